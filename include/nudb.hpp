@@ -8,12 +8,21 @@
 #ifndef NUDB_HPP
 #define NUDB_HPP
 
+#include <nudb/advise.hpp>
 #include <nudb/api.hpp>
+#include <nudb/bulk_load.hpp>
 #include <nudb/create.hpp>
 #include <nudb/common.hpp>
+#include <nudb/compact.hpp>
 #include <nudb/file.hpp>
+#include <nudb/memory_budget.hpp>
+#include <nudb/mmap_file.hpp>
+#include <nudb/observer.hpp>
 #include <nudb/recover.hpp>
+#include <nudb/sharded_store.hpp>
 #include <nudb/store.hpp>
+#include <nudb/striped_file.hpp>
+#include <nudb/uring_file.hpp>
 #include <nudb/verify.hpp>
 #include <nudb/visit.hpp>
 
@@ -0,0 +1,378 @@
+//
+// Copyright (c) 2015-2016 Vinnie Falco (vinnie dot falco at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef NUDB_ADVISE_HPP
+#define NUDB_ADVISE_HPP
+
+#include <nudb/verify.hpp>
+#include <nudb/detail/bucket.hpp>
+#include <nudb/detail/format.hpp>
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <random>
+#include <stdexcept>
+#include <vector>
+
+namespace nudb {
+
+/** The expected use of a database, for advise. */
+struct tuning_workload
+{
+    // Keys the database will hold
+    std::size_t key_count = 0;
+
+    // Size of a key in bytes
+    std::size_t key_size = 0;
+
+    // Sizes of a sample of values. Each simulated value
+    // takes the size of one of them, chosen at random.
+    std::vector<std::size_t> value_sizes;
+
+    // Fraction of fetches which look up absent keys
+    float miss_fraction = 0;
+
+    // Largest read which costs the device one I/O. Reading
+    // a bucket of a larger block size costs several.
+    std::size_t io_size = 4096;
+
+    // Cost of the files growing by as many bytes as the
+    // values hold, in I/Os per fetch.
+    float size_weight = 0.1f;
+
+    // Block sizes and load factors to try. When empty,
+    // the powers of two from 512 to 32768 and the load
+    // factors from 0.5 to 0.95 in steps of 0.05 are used.
+    std::vector<std::size_t> block_sizes;
+    std::vector<float> load_factors;
+
+    // Most keys inserted by each simulation. A larger
+    // database is modeled by a smaller one at the same
+    // point in its growth.
+    std::size_t sample_keys = 256 * 1024;
+
+    // Seed of the simulated hashes and value sizes
+    std::uint64_t seed = 1;
+};
+
+/** Predicted behavior of a database, from advise. */
+struct tuning_advice
+{
+    std::size_t block_size = 0;
+    float load_factor = 0;
+
+    float avg_fetch = 0;        // key file and spill reads per fetch
+    float avg_miss = 0;         // the same for an absent key
+    float actual_load = 0;      // actual bucket fill fraction
+    std::size_t key_file_size = 0;
+    std::size_t dat_file_size = 0;
+    float overhead = 0;         // as in verify_info
+
+    // Device I/Os per fetch, excluding the value, plus
+    // the weighted overhead. Lower is better.
+    float cost = 0;
+};
+
+namespace detail {
+
+template <class = void>
+class tuning_sim
+{
+private:
+    struct sim_bucket
+    {
+        std::vector<std::uint64_t> keys;
+        std::vector<std::size_t> spills;    // key counts, oldest first
+    };
+
+    std::size_t const capacity_;
+    std::size_t const spill_size_;      // bytes per spill record
+    std::vector<sim_bucket> b_;
+    std::size_t modulus_ = 1;
+    std::vector<std::vector<std::uint64_t>> chains_;
+
+public:
+    std::size_t spill_bytes = 0;        // spill records written
+
+    tuning_sim (std::size_t block_size)
+        : capacity_ (bucket_capacity(block_size))
+        , spill_size_ (field<uint48_t>::size +
+            field<std::uint16_t>::size +
+                bucket_size(capacity_))
+        , b_ (1)
+    {
+        chains_.emplace_back();
+    }
+
+    std::size_t
+    buckets() const
+    {
+        return b_.size();
+    }
+
+    std::size_t
+    modulus() const
+    {
+        return modulus_;
+    }
+
+    std::vector<std::uint64_t> const&
+    keys (std::size_t n) const
+    {
+        return b_[n].keys;
+    }
+
+    std::vector<std::size_t> const&
+    spills (std::size_t n) const
+    {
+        return b_[n].spills;
+    }
+
+    // As a commit inserts into a bucket
+    void
+    insert (std::uint64_t h)
+    {
+        insert (bucket_index(h, b_.size(), modulus_), h);
+    }
+
+    // As store::split, but keeping the keys of spilled
+    // records in chains_ in place of the data file.
+    void
+    split();
+
+private:
+    void
+    insert (std::size_t n, std::uint64_t h);
+};
+
+template <class _>
+void
+tuning_sim<_>::insert (std::size_t n, std::uint64_t h)
+{
+    auto& b = b_[n];
+    if (b.keys.size() >= capacity_)
+    {
+        // maybe_spill
+        b.spills.push_back(b.keys.size());
+        chains_[n].insert(chains_[n].end(),
+            b.keys.begin(), b.keys.end());
+        spill_bytes += spill_size_;
+        b.keys.clear();
+    }
+    b.keys.push_back(h);
+}
+
+template <class _>
+void
+tuning_sim<_>::split()
+{
+    if (b_.size() == modulus_)
+        modulus_ *= 2;
+    auto const n1 = b_.size() - (modulus_ / 2);
+    auto const n2 = b_.size();
+    b_.emplace_back();
+    chains_.emplace_back();
+    auto& k1 = b_[n1].keys;
+    auto const it = std::stable_partition(
+        k1.begin(), k1.end(),
+        [&](std::uint64_t h)
+        {
+            return bucket_index(h, b_.size(), modulus_) == n1;
+        });
+    b_[n2].keys.assign(it, k1.end());
+    k1.erase(it, k1.end());
+    // The spill records are read newest first
+    std::vector<std::uint64_t> chain;
+    chain.swap(chains_[n1]);
+    auto spills = std::move(b_[n1].spills);
+    b_[n1].spills.clear();
+    auto end = chain.size();
+    for (auto s = spills.rbegin(); s != spills.rend(); ++s)
+    {
+        for (auto i = end - *s; i < end; ++i)
+            insert(bucket_index(chain[i], b_.size(),
+                modulus_), chain[i]);
+        end -= *s;
+    }
+}
+
+// Scales a database of target buckets down to one of no
+// more than limit buckets at the same fraction of its
+// modulus, where the pattern of spills repeats.
+template <class = void>
+std::size_t
+sample_buckets (std::size_t target, std::size_t limit)
+{
+    if (target <= limit)
+        return target;
+    auto const modulus = ceil_pow2(target);
+    auto f = double(target) / modulus;
+    auto m = std::max<std::size_t>(1, ceil_pow2(limit));
+    while (m > 1 && f * m > limit)
+        m /= 2;
+    return std::max<std::size_t>(1,
+        static_cast<std::size_t>(f * m));
+}
+
+template <class = void>
+tuning_advice
+simulate (tuning_workload const& w,
+    std::size_t block_size, float load_factor)
+{
+    tuning_advice a;
+    a.block_size = block_size;
+    a.load_factor = load_factor;
+    auto const capacity = bucket_capacity(block_size);
+    // As in create and store::open
+    std::size_t const lf = std::min<std::size_t>(
+        static_cast<std::size_t>(65536.0 * load_factor), 65535);
+    std::size_t const thresh =
+        std::max<std::size_t>(65536UL, lf * capacity);
+    auto const per_split = double(thresh) / 65536;
+    auto const target = std::max<std::size_t>(1,
+        static_cast<std::size_t>(w.key_count / per_split));
+    auto const limit = std::max<std::size_t>(1,
+        static_cast<std::size_t>(w.sample_keys / per_split));
+    auto const sample = sample_buckets(target, limit);
+    std::size_t const keys = sample == target ? w.key_count :
+        static_cast<std::size_t>(sample * per_split);
+    std::mt19937_64 gen (w.seed);
+    std::uniform_int_distribution<std::size_t> pick (
+        0, w.value_sizes.size() - 1);
+    tuning_sim<> sim (block_size);
+    std::size_t frac = thresh / 2;
+    std::uint64_t value_bytes = 0;
+    std::uint64_t record_bytes = 0;
+    for (std::size_t i = 0; i < keys; ++i)
+    {
+        if ((frac += 65536) >= thresh)
+        {
+            frac -= thresh;
+            sim.split();
+        }
+        sim.insert(make_hash<hash_t>(gen()));
+        auto const size = w.value_sizes[pick(gen)];
+        value_bytes += size;
+        record_bytes += value_size(size, w.key_size);
+    }
+    // Reads per fetch and per miss, as verify counts them
+    std::uint64_t fetches = 0;
+    double misses = 0;
+    auto const buckets = sim.buckets();
+    auto const modulus = sim.modulus();
+    for (std::size_t n = 0; n < buckets; ++n)
+    {
+        auto const& spills = sim.spills(n);
+        std::size_t depth = 0;
+        fetches += sim.keys(n).size() * ++depth;
+        for (auto s = spills.rbegin(); s != spills.rend(); ++s)
+            fetches += *s * ++depth;
+        // Unsplit buckets hold twice the hash range
+        auto const range = (n >= buckets - modulus / 2 &&
+            n < modulus / 2) ? 2 : 1;
+        misses += double(range) * depth / modulus;
+    }
+    auto const scale = double(w.key_count) / std::max<
+        std::size_t>(1, keys);
+    a.avg_fetch = keys > 0 ? float(fetches) / keys : 1;
+    a.avg_miss = float(misses);
+    a.actual_load = float(keys) / (capacity * buckets);
+    a.key_file_size = static_cast<std::size_t>(
+        (buckets * scale + 1) * block_size);
+    a.dat_file_size = dat_file_header::size +
+        static_cast<std::size_t>(
+            (record_bytes + sim.spill_bytes) * scale);
+    auto const payload = (value_bytes + keys *
+        (w.key_size + field<uint48_t>::size)) * scale;
+    a.overhead = payload > 0 ? float((a.key_file_size +
+        a.dat_file_size) / payload - 1) : 0;
+    auto const ios = (block_size + w.io_size - 1) / w.io_size;
+    a.cost = float(ios) * (
+        (1 - w.miss_fraction) * a.avg_fetch +
+            w.miss_fraction * a.avg_miss) +
+                w.size_weight * a.overhead;
+    return a;
+}
+
+} // detail
+
+/** Describe a workload with the measurements of verify.
+
+    The key count, key size and mean value size of an
+    existing database are taken from info, for advise to
+    predict a database holding the same kind of data.
+*/
+inline
+tuning_workload
+make_workload (verify_info const& info)
+{
+    tuning_workload w;
+    w.key_count = info.key_count;
+    w.key_size = info.key_size;
+    if (info.value_count > 0)
+        w.value_sizes.push_back(std::max<std::size_t>(1,
+            info.value_bytes / info.value_count));
+    return w;
+}
+
+/** Recommend a block size and load factor for create.
+
+    Each pair of block size and load factor is tried by
+    simulating the growth of the key file as store does,
+    splitting buckets as the load factor is reached and
+    spilling full buckets to the data file, with random
+    hashes. The predicted reads per fetch, which verify
+    reports as avg_fetch, and the sizes of the files are
+    combined into a cost, as set by the workload.
+
+    @return One prediction per pair tried, lowest cost
+    first, so the recommendation is the front.
+
+    Throws:
+        std::domain_error if the workload is incomplete
+*/
+template <class = void>
+std::vector<tuning_advice>
+advise (tuning_workload const& w)
+{
+    using namespace detail;
+    if (w.key_size < 1)
+        throw std::domain_error("nudb: invalid key size");
+    if (w.value_sizes.empty())
+        throw std::domain_error("nudb: no value sizes");
+    if (w.io_size < 1)
+        throw std::domain_error("nudb: invalid io size");
+    auto block_sizes = w.block_sizes;
+    if (block_sizes.empty())
+        for (std::size_t n = 512; n <= 32768; n *= 2)
+            block_sizes.push_back(n);
+    auto load_factors = w.load_factors;
+    if (load_factors.empty())
+        for (int i = 10; i < 20; ++i)
+            load_factors.push_back(i * 0.05f);
+    std::vector<tuning_advice> result;
+    for (auto const block_size : block_sizes)
+    {
+        if (block_size > field<std::uint16_t>::max ||
+                bucket_capacity(block_size) < 1)
+            continue;
+        for (auto const load_factor : load_factors)
+            if (load_factor > 0.f && load_factor < 1.f)
+                result.push_back(simulate(
+                    w, block_size, load_factor));
+    }
+    std::stable_sort(result.begin(), result.end(),
+        [](tuning_advice const& a, tuning_advice const& b)
+        {
+            return a.cost < b.cost;
+        });
+    return result;
+}
+
+} // nudb
+
+#endif
@@ -24,14 +24,18 @@ template <
     class Hasher,
     class Codec = identity,
     class File = native_file,
-    std::size_t BufferSize = 16 * 1024 * 1024
+    std::size_t BufferSize = 16 * 1024 * 1024,
+    std::size_t KeySize = 0,
+    class Observer = null_observer
 >
 struct api
 {
     using hash_type = Hasher;
     using codec_type = Codec;
     using file_type = File;
-    using store = nudb::store<Hasher, Codec, File>;
+    using observer_type = Observer;
+    using store = nudb::store<
+        Hasher, Codec, File, KeySize, Observer>;
 
     static std::size_t const buffer_size = BufferSize;
 
@@ -89,6 +93,18 @@ struct api
         return nudb::visit<Codec>(
             path, BufferSize, f);
     }
+
+    template <class Function>
+    static
+    bool
+    visit_parallel(
+        path_type const& path,
+        std::size_t threads,
+        Function&& f)
+    {
+        return nudb::visit_parallel<Codec>(
+            path, BufferSize, threads, f);
+    }
 };
 
 } // nudb
@@ -0,0 +1,756 @@
+//
+// Copyright (c) 2015-2016 Vinnie Falco (vinnie dot falco at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef NUDB_BULK_LOAD_HPP
+#define NUDB_BULK_LOAD_HPP
+
+#include <nudb/common.hpp>
+#include <nudb/create.hpp>
+#include <nudb/file.hpp>
+#include <nudb/detail/bucket.hpp>
+#include <nudb/detail/buffer.hpp>
+#include <nudb/detail/bulkio.hpp>
+#include <nudb/detail/format.hpp>
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <queue>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+namespace nudb {
+
+namespace detail {
+
+/*  Builds a key file from the entries of a data file.
+
+    Entries are collected in memory up to the buffer size,
+    sorted by bucket index then hash, and written to a run
+    file. When every entry is known the runs are merged, so
+    that each bucket is filled in order and written to the
+    key file exactly once. A bucket which fills up spills to
+    the end of the data file, as in a commit.
+
+    Memory use is about the buffer size, plus the bucket
+    and the write buffers.
+*/
+template <class File>
+class key_builder
+{
+private:
+    enum
+    {
+        // Size of the key and data file write buffers
+        write_size = 16 * 1024 * 1024
+    };
+
+    struct entry
+    {
+        std::size_t n;          // bucket index
+        std::size_t h;          // hash
+        std::size_t offset;     // data record
+        std::size_t size;       // value size
+
+        bool
+        operator< (entry const& other) const
+        {
+            if (n != other.n)
+                return n < other.n;
+            if (h != other.h)
+                return h < other.h;
+            return offset < other.offset;
+        }
+
+        bool
+        operator> (entry const& other) const
+        {
+            return other < *this;
+        }
+    };
+
+    // Run Record
+    static std::size_t constexpr entry_size =
+        field<std::uint64_t>::size +    // Bucket
+        field<uint48_t>::size +         // Hash
+        field<uint48_t>::size +         // Offset
+        field<uint48_t>::size;          // Size
+
+    key_file_header const& kh_;
+    File& df_;
+    File& rf_;
+    std::size_t buffer_size_;
+    std::vector<entry> v_;
+    std::vector<std::size_t> runs_;     // end of each run
+    std::size_t count_ = 0;
+
+public:
+    key_builder (key_builder const&) = delete;
+    key_builder& operator= (key_builder const&) = delete;
+
+    /** Create the builder.
+
+        @param kh The header of the key file to build.
+        @param df The data file, opened for append.
+        @param rf An empty file used for the sorted runs.
+        @param buffer_size Bytes of entries kept in memory.
+    */
+    key_builder (key_file_header const& kh, File& df,
+        File& rf, std::size_t buffer_size);
+
+    // Returns the number of entries added
+    std::size_t
+    size() const
+    {
+        return count_;
+    }
+
+    // Add the data record at offset
+    void
+    insert (std::size_t h,
+        std::size_t offset, std::size_t size);
+
+    // Write every bucket to kf, after the header, and
+    // append spill records to the data file at df_size.
+    // Progress is called with the entries merged so far.
+    template <class Progress>
+    void
+    finish (File& kf, std::size_t df_size,
+        Progress&& progress);
+
+private:
+    void
+    flush();
+};
+
+template <class File>
+std::size_t constexpr key_builder<File>::entry_size;
+
+template <class File>
+key_builder<File>::key_builder (
+        key_file_header const& kh, File& df,
+            File& rf, std::size_t buffer_size)
+    : kh_ (kh)
+    , df_ (df)
+    , rf_ (rf)
+    , buffer_size_ (std::max<std::size_t>(
+        buffer_size, 64 * entry_size))
+{
+    v_.reserve(buffer_size_ / sizeof(entry));
+}
+
+template <class File>
+void
+key_builder<File>::insert (std::size_t h,
+    std::size_t offset, std::size_t size)
+{
+    if (v_.size() == v_.capacity())
+        flush();
+    v_.push_back({bucket_index(h, kh_.buckets,
+        kh_.modulus), h, offset, size});
+    ++count_;
+}
+
+template <class File>
+void
+key_builder<File>::flush()
+{
+    std::sort(v_.begin(), v_.end());
+    auto const offset =
+        runs_.empty() ? 0 : runs_.back();
+    bulk_writer<File> w (rf_, offset,
+        std::min<std::size_t>(buffer_size_, write_size));
+    for (auto const& e : v_)
+    {
+        // Run Record
+        auto os = w.prepare(entry_size);
+        write<std::uint64_t>(os, e.n);  // Bucket
+        write<uint48_t>(os, e.h);       // Hash
+        write<uint48_t>(os, e.offset);  // Offset
+        write<uint48_t>(os, e.size);    // Size
+    }
+    w.flush();
+    runs_.push_back(w.offset());
+    v_.clear();
+}
+
+template <class File>
+template <class Progress>
+void
+key_builder<File>::finish (File& kf,
+    std::size_t df_size, Progress&& progress)
+{
+    // A single run is merged from memory
+    if (runs_.empty())
+        std::sort(v_.begin(), v_.end());
+    else if (! v_.empty())
+        flush();
+    // Run readers share the buffer
+    std::vector<std::unique_ptr<bulk_reader<File>>> readers;
+    for (std::size_t i = 0; i < runs_.size(); ++i)
+        readers.emplace_back(new bulk_reader<File>(rf_,
+            i == 0 ? 0 : runs_[i - 1], runs_[i],
+                std::max<std::size_t>(64 * entry_size,
+                    buffer_size_ / runs_.size())));
+    using head = std::pair<entry, std::size_t>;
+    std::priority_queue<head, std::vector<head>,
+        std::greater<head>> q;
+    auto const next =
+        [&](std::size_t i)
+        {
+            auto& r = *readers[i];
+            if (r.eof())
+                return;
+            // Run Record
+            head e;
+            e.second = i;
+            auto is = r.prepare(entry_size);
+            read<std::uint64_t>(is, e.first.n); // Bucket
+            read<uint48_t>(is, e.first.h);      // Hash
+            read<uint48_t>(is, e.first.offset); // Offset
+            read<uint48_t>(is, e.first.size);   // Size
+            q.push(e);
+        };
+    for (std::size_t i = 0; i < readers.size(); ++i)
+        next(i);
+    buffer buf (kh_.block_size + 2 * kh_.key_size);
+    auto const k0 = buf.get() + kh_.block_size;
+    auto const k1 = k0 + kh_.key_size;
+    bucket b (kh_.block_size, buf.get(), empty);
+    bulk_writer<File> kw (kf, kh_.block_size, write_size);
+    bulk_writer<File> dw (df_, df_size, write_size);
+    std::size_t n = 0;                  // bucket being filled
+    std::size_t h = 0;                  // hash of the last entry
+    std::vector<std::size_t> same;      // offsets with equal hash
+    std::size_t merged = 0;
+    auto const add =
+        [&](entry const& e)
+        {
+            if (e.n >= kh_.buckets || e.n < n)
+                throw std::logic_error(
+                    "nudb: bad bucket order");
+            // Write the buckets before this one
+            for (; n < e.n; ++n)
+            {
+                b.pad();
+                auto os = kw.prepare(kh_.block_size);
+                std::memcpy(os.data(kh_.block_size),
+                    b.block(), kh_.block_size);
+                b.clear();
+                same.clear();
+            }
+            if (e.h != h)
+                same.clear();
+            // Keys with equal hashes are compared
+            if (! same.empty())
+            {
+                df_.read(e.offset +
+                    field<uint48_t>::size,  // Size
+                        k0, kh_.key_size);  // Key
+                for (auto const offset : same)
+                {
+                    df_.read(offset +
+                        field<uint48_t>::size,
+                            k1, kh_.key_size);
+                    if (std::memcmp(k0, k1,
+                            kh_.key_size) == 0)
+                        throw store_corrupt_error(
+                            "duplicate key");
+                }
+            }
+            maybe_spill(b, dw);
+            b.insert(e.offset, e.size, e.h);
+            same.push_back(e.offset);
+            h = e.h;
+            if ((++merged % 65536) == 0)
+                progress(merged, count_);
+        };
+    if (runs_.empty())
+    {
+        for (auto const& e : v_)
+            add(e);
+    }
+    else
+    {
+        while (! q.empty())
+        {
+            auto const e = q.top();
+            q.pop();
+            add(e.first);
+            next(e.second);
+        }
+    }
+    // Write the remaining buckets
+    for (; n < kh_.buckets; ++n)
+    {
+        b.pad();
+        auto os = kw.prepare(kh_.block_size);
+        std::memcpy(os.data(kh_.block_size),
+            b.block(), kh_.block_size);
+        b.clear();
+    }
+    kw.flush();
+    dw.flush();
+    progress(count_, count_);
+}
+
+// Returns the header of a key file for the data file
+template <class Hasher>
+key_file_header
+make_key_file_header (dat_file_header const& dh,
+    std::uint64_t salt, std::size_t block_size,
+        float load_factor, std::size_t item_count)
+{
+    if (block_size > field<std::uint16_t>::max)
+        throw std::domain_error(
+            "nudb: block size too large");
+    if (load_factor <= 0.f)
+        throw std::domain_error(
+            "nudb: load factor too small");
+    if (load_factor >= 1.f)
+        throw std::domain_error(
+            "nudb: load factor too large");
+    key_file_header kh;
+    kh.version = currentVersion;
+    kh.uid = dh.uid;
+    kh.appnum = dh.appnum;
+    kh.key_size = dh.key_size;
+    kh.salt = salt;
+    kh.pepper = pepper<Hasher>(salt);
+    kh.block_size = block_size;
+    kh.load_factor = std::min<std::size_t>(
+        static_cast<std::size_t>(
+            65536.0 * load_factor), 65535);
+    kh.inline_size = 0;
+    kh.inline_bytes = 0;
+    kh.capacity = bucket_capacity(block_size);
+    if (kh.capacity < 1)
+        throw std::domain_error(
+            "nudb: block size too small");
+    kh.bucket_size = bucket_size(kh.capacity);
+    // Sized for item_count keys. The buckets beyond
+    // what the loaded keys need are a split credit.
+    kh.buckets = std::max<std::size_t>(1,
+        static_cast<std::size_t>(std::ceil(
+            static_cast<double>(item_count) /
+                (kh.capacity * load_factor))));
+    kh.modulus = ceil_pow2(kh.buckets);
+    return kh;
+}
+
+// Returns the buckets in kh beyond the number which a
+// store grows to while inserting count keys. The store
+// uses these up before it splits a bucket.
+inline
+std::uint64_t
+split_credit (key_file_header const& kh, std::size_t count)
+{
+    auto const thresh = std::max<std::size_t>(65536UL,
+        kh.load_factor * kh.capacity);
+    auto const need = std::max<std::uint64_t>(1,
+        (static_cast<std::uint64_t>(count) * 65536 +
+            thresh - 1) / thresh);
+    return kh.buckets > need ? kh.buckets - need : 0;
+}
+
+// Builds the key file for the data file in df. Add is
+// called with the builder to enter every data record,
+// and returns the size of the data file afterwards.
+template <class File, class Add, class Progress>
+void
+build_key_file (key_file_header const& kh,
+    File& df, File& kf, File& rf, std::size_t buffer_size,
+        Add&& add, Progress&& progress)
+{
+    key_builder<File> kb (kh, df, rf, buffer_size);
+    auto const df_size = add(kb);
+    auto hdr = kh;
+    hdr.split_credit = split_credit(hdr, kb.size());
+    write(kf, hdr);
+    kb.finish(kf, df_size, progress);
+    df.sync();
+    kf.sync();
+}
+
+} // detail
+
+/** Build the key file for an existing data file.
+
+    Each data record in the data file is entered into a
+    key file sized for `item_count` keys. The buckets beyond
+    what the loaded keys need are recorded as a split credit,
+    which the store uses up before splitting a bucket, so
+    that it grows to about `item_count` keys without a split. The entries
+    are sorted in runs of `buffer_size` bytes, and the runs
+    are merged so that every bucket is written once, in
+    order. Spill records in the data file, such as those
+    left by a previous key file, are skipped. New spill
+    records are appended to the data file.
+
+    The salt may be chosen freely, since the data file does
+    not record it. A temporary file named by appending
+    ".sort" to the key path holds the runs.
+
+    Progress is called as
+        `(void)()(std::uint64_t amount, std::uint64_t total)`
+
+    If an exception is thrown the key file and the
+    temporary file are erased and the data file is
+    truncated to its original size. The build is not
+    protected against a crash.
+
+    Preconditions:
+        The key file must not exist.
+        The keys in the data file are distinct.
+
+    Throws:
+        store_corrupt_error if a key appears twice
+
+    @param args Arguments passed to File constructors
+    @return `false` if the key or temporary file
+        could not be created.
+*/
+template <
+    class Hasher,
+    class File,
+    class Progress,
+    class... Args
+>
+bool
+build_key_file (
+    path_type const& dat_path,
+    path_type const& key_path,
+    std::uint64_t salt,
+    std::size_t block_size,
+    float load_factor,
+    std::size_t item_count,
+    std::size_t buffer_size,
+    Progress&& progress,
+    Args&&... args)
+{
+    using namespace detail;
+    File df(args...);
+    if (! df.open(file_mode::append, dat_path))
+        return false;
+    dat_file_header dh;
+    read(df, dh);
+    verify(dh);
+    auto const kh = make_key_file_header<Hasher>(
+        dh, salt, block_size, load_factor, item_count);
+    auto const rp = key_path + ".sort";
+    File kf(args...);
+    if (! kf.create(file_mode::append, key_path))
+        return false;
+    File rf(args...);
+    File::erase(rp);
+    if (! rf.create(file_mode::append, rp))
+    {
+        kf.close();
+        File::erase(key_path);
+        return false;
+    }
+    auto const df_size = df.actual_size();
+    try
+    {
+        detail::build_key_file(kh, df, kf, rf, buffer_size,
+            [&](key_builder<File>& kb)
+            {
+                // Iterate Data File
+                bulk_reader<File> r (df,
+                    dat_file_header::size, df_size,
+                        std::min<std::size_t>(buffer_size,
+                            16 * 1024 * 1024));
+                while (! r.eof())
+                {
+                    auto const offset = r.offset();
+                    progress(offset, 2 * df_size);
+                    // Data Record or Spill Record
+                    std::size_t size;
+                    auto is = r.prepare(
+                        field<uint48_t>::size); // Size
+                    read<uint48_t>(is, size);
+                    if (size > 0)
+                    {
+                        // Data Record
+                        is = r.prepare(
+                            dh.key_size +       // Key
+                            size);              // Data
+                        auto const h = hash<Hasher>(
+                            is.data(dh.key_size),
+                                dh.key_size, salt);
+                        kb.insert(h, offset, size);
+                    }
+                    else
+                    {
+                        // Spill Record
+                        is = r.prepare(
+                            field<std::uint16_t>::size);
+                        read<std::uint16_t>(is, size);
+                        r.prepare(size); // skip bucket
+                    }
+                }
+                return df_size;
+            },
+            [&](std::size_t amount, std::size_t total)
+            {
+                progress(df_size + amount * df_size /
+                    std::max<std::size_t>(1, total),
+                        2 * df_size);
+            });
+    }
+    catch (...)
+    {
+        kf.close();
+        rf.close();
+        File::erase(key_path);
+        File::erase(rp);
+        df.trunc(df_size);
+        throw;
+    }
+    rf.close();
+    File::erase(rp);
+    return true;
+}
+
+/** Build a key file with a new block size or load factor.
+
+    The salt of the existing key file is kept, and a new key
+    file for the data file is written as with build_key_file,
+    with buckets streamed in index order using bounded memory.
+    The existing key file remains valid for the data file, so
+    the caller may replace it with the new one afterwards.
+
+    If `item_count` is zero, the data records are counted
+    first, which takes one more pass over the data file, and
+    the new key file is sized for those keys alone.
+
+    Progress is called as
+        `(void)()(std::uint64_t amount, std::uint64_t total)`
+
+    Preconditions:
+        The database is not open, and has been recovered.
+        The new key file must not exist.
+
+    @param args Arguments passed to File constructors
+    @return `false` if the new key file could not be created.
+*/
+template <
+    class Hasher,
+    class File,
+    class Progress,
+    class... Args
+>
+bool
+rekey (
+    path_type const& dat_path,
+    path_type const& key_path,
+    path_type const& new_key_path,
+    std::size_t block_size,
+    float load_factor,
+    std::size_t item_count,
+    std::size_t buffer_size,
+    Progress&& progress,
+    Args&&... args)
+{
+    using namespace detail;
+    std::uint64_t salt;
+    {
+        File df(args...);
+        File kf(args...);
+        if (! df.open(file_mode::scan, dat_path))
+            throw store_corrupt_error(
+                "no data file");
+        if (! kf.open(file_mode::read, key_path))
+            throw store_corrupt_error(
+                "no key file");
+        dat_file_header dh;
+        key_file_header kh;
+        read(df, dh);
+        read(kf, kh);
+        verify(dh);
+        verify<Hasher>(dh, kh);
+        salt = kh.salt;
+        if (item_count == 0)
+        {
+            // Iterate Data File
+            bulk_reader<File> r (df,
+                dat_file_header::size, df.actual_size(),
+                    std::min<std::size_t>(buffer_size,
+                        16 * 1024 * 1024));
+            while (! r.eof())
+            {
+                // Data Record or Spill Record
+                std::size_t size;
+                auto is = r.prepare(
+                    field<uint48_t>::size); // Size
+                read<uint48_t>(is, size);
+                if (size > 0)
+                {
+                    // Data Record
+                    r.prepare(dh.key_size + size);
+                    ++item_count;
+                }
+                else
+                {
+                    // Spill Record
+                    is = r.prepare(
+                        field<std::uint16_t>::size);
+                    read<std::uint16_t>(is, size);
+                    r.prepare(size); // skip bucket
+                }
+            }
+        }
+    }
+    return build_key_file<Hasher, File>(dat_path,
+        new_key_path, salt, block_size, load_factor,
+            item_count, buffer_size, progress, args...);
+}
+
+/** Create a database from a sequence of key/value pairs.
+
+    The data file is written sequentially, then the key file
+    is built as with build_key_file, so that the database
+    grows to about `item_count` keys without splitting a
+    bucket.
+    Function is called once as
+        `(void)()(Insert& insert)`
+
+    and adds each pair by calling
+        `insert(void const* key, void const* data, std::size_t size)`
+
+    If an exception is thrown, including by Function, every
+    file is erased.
+
+    Preconditions:
+        The files must not exist.
+        The keys are distinct.
+
+    @param args Arguments passed to File constructors
+    @return `false` if any file could not be created.
+*/
+template <
+    class Hasher,
+    class Codec,
+    class File,
+    class Function,
+    class Progress,
+    class... Args
+>
+bool
+bulk_load (
+    path_type const& dat_path,
+    path_type const& key_path,
+    std::uint64_t appnum,
+    std::uint64_t salt,
+    std::size_t key_size,
+    std::size_t block_size,
+    float load_factor,
+    std::size_t item_count,
+    std::size_t buffer_size,
+    Function&& f,
+    Progress&& progress,
+    Args&&... args)
+{
+    using namespace detail;
+    if (key_size < 1)
+        throw std::domain_error(
+            "invalid key size");
+    dat_file_header dh;
+    dh.version = currentVersion;
+    dh.uid = make_uid();
+    dh.appnum = appnum;
+    dh.key_size = key_size;
+    auto const kh = make_key_file_header<Hasher>(
+        dh, salt, block_size, load_factor, item_count);
+    auto const rp = key_path + ".sort";
+    File df(args...);
+    File kf(args...);
+    File rf(args...);
+    if (! df.create(file_mode::append, dat_path))
+        return false;
+    if (! kf.create(file_mode::append, key_path))
+    {
+        df.close();
+        File::erase(dat_path);
+        return false;
+    }
+    File::erase(rp);
+    if (! rf.create(file_mode::append, rp))
+    {
+        df.close();
+        kf.close();
+        File::erase(dat_path);
+        File::erase(key_path);
+        return false;
+    }
+    try
+    {
+        write(df, dh);
+        Codec codec;
+        bulk_writer<File> w (df, dat_file_header::size,
+            std::min<std::size_t>(buffer_size,
+                16 * 1024 * 1024));
+        std::size_t count = 0;
+        detail::build_key_file(kh, df, kf, rf, buffer_size,
+            [&](key_builder<File>& kb)
+            {
+                buffer buf;
+                f([&](void const* key,
+                    void const* data, std::size_t size)
+                {
+                    auto const result =
+                        codec.compress(data, size, buf);
+                    if (result.second < 1 ||
+                            result.second > field<uint48_t>::max)
+                        throw std::logic_error(
+                            "nudb: bad value size");
+                    // Data Record
+                    auto const offset = w.offset();
+                    auto os = w.prepare(value_size(
+                        result.second, key_size));
+                    write<uint48_t>(os,
+                        result.second);         // Size
+                    write(os, key, key_size);   // Key
+                    write(os, result.first,
+                        result.second);         // Data
+                    kb.insert(hash<Hasher>(key,
+                        key_size, salt), offset,
+                            result.second);
+                    if ((++count % 65536) == 0)
+                        progress(count, 2 * std::max(
+                            count, item_count));
+                });
+                w.flush();
+                return w.offset();
+            },
+            [&](std::size_t amount, std::size_t total)
+            {
+                progress(total + amount, 2 * total);
+            });
+    }
+    catch (...)
+    {
+        df.close();
+        kf.close();
+        rf.close();
+        File::erase(dat_path);
+        File::erase(key_path);
+        File::erase(rp);
+        throw;
+    }
+    rf.close();
+    File::erase(rp);
+    return true;
+}
+
+} // nudb
+
+#endif
@@ -8,6 +8,7 @@
 #ifndef NUDB_COMMON_HPP
 #define NUDB_COMMON_HPP
 
+#include <cstddef>
 #include <stdexcept>
 #include <string>
 
@@ -23,8 +24,25 @@ enum class file_mode
     write         // read random, write random
 };
 
+/** How far a sync goes to make written data durable. */
+enum class durability
+{
+    full,         // data and metadata, fsync
+    data,         // data and the file size, fdatasync
+    range,        // dirty pages written back, sync_file_range
+    none          // left to the operating system
+};
+
 using path_type = std::string;
 
+/** A single transfer in a batch of file reads or writes. */
+struct file_request
+{
+    std::size_t offset;     // Offset in the file
+    void* data;             // Buffer to read into or write from
+    std::size_t bytes;      // Number of bytes to transfer
+};
+
 // All exceptions thrown by nudb are derived
 // from std::runtime_error except for fail_error
 
@@ -0,0 +1,244 @@
+//
+// Copyright (c) 2015-2016 Vinnie Falco (vinnie dot falco at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef NUDB_COMPACT_HPP
+#define NUDB_COMPACT_HPP
+
+#include <nudb/bulk_load.hpp>
+#include <nudb/common.hpp>
+#include <nudb/create.hpp>
+#include <nudb/file.hpp>
+#include <nudb/detail/bucket.hpp>
+#include <nudb/detail/buffer.hpp>
+#include <nudb/detail/bulkio.hpp>
+#include <nudb/detail/format.hpp>
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+
+namespace nudb {
+
+/** Write a copy of a database without unused spill records.
+
+    Each split leaves the spill records of the old bucket in
+    the data file, where they are no longer referenced. This
+    copies the data records of the database to a new data
+    file, then builds a new key file for it with the same
+    salt, block size, load factor and number of buckets, so
+    that only the spill records of the current buckets are
+    written. Since values are never removed, every data
+    record is live. Values are copied as they are stored,
+    without decompressing them.
+
+    If `bucket_order` is `true`, the data records are read
+    through the key file and written grouped by bucket, so
+    that values whose keys hash to the same bucket are next
+    to each other. Otherwise they keep their order, and the
+    old data file is read sequentially.
+
+    The database must not be open. The new files form a
+    database with a new uid; the caller replaces the old
+    files with them once this returns. A temporary file
+    named by appending ".sort" to the new key path holds
+    sorted runs while the key file is built.
+
+    Progress is called as
+        `(void)()(std::uint64_t amount, std::uint64_t total)`
+
+    If an exception is thrown the new files are erased.
+    Key files with inline values are not supported.
+
+    Preconditions:
+        The new files must not exist.
+
+    Throws:
+        store_corrupt_error if the database is damaged
+
+    @param args Arguments passed to File constructors
+    @return `false` if a new file could not be created.
+*/
+template <
+    class Hasher,
+    class File,
+    class Progress,
+    class... Args
+>
+bool
+compact (
+    path_type const& dat_path,
+    path_type const& key_path,
+    path_type const& new_dat_path,
+    path_type const& new_key_path,
+    std::size_t buffer_size,
+    bool bucket_order,
+    Progress&& progress,
+    Args&&... args)
+{
+    using namespace detail;
+    File df(args...);
+    File kf(args...);
+    if (! df.open(bucket_order ?
+            file_mode::read : file_mode::scan, dat_path))
+        throw store_corrupt_error(
+            "no data file");
+    if (! kf.open(file_mode::read, key_path))
+        throw store_corrupt_error(
+            "no key file");
+    dat_file_header dh;
+    key_file_header kh;
+    read(df, dh);
+    read(kf, kh);
+    verify(dh);
+    verify<Hasher>(dh, kh);
+    if (kh.inline_bytes > 0)
+        throw std::domain_error(
+            "nudb: inline key files are not supported");
+    // Same buckets, so each key keeps its index
+    auto ndh = dh;
+    ndh.uid = make_uid();
+    auto nkh = kh;
+    nkh.uid = ndh.uid;
+    auto const rp = new_key_path + ".sort";
+    File ndf(args...);
+    File nkf(args...);
+    File rf(args...);
+    if (! ndf.create(file_mode::append, new_dat_path))
+        return false;
+    if (! nkf.create(file_mode::append, new_key_path))
+    {
+        ndf.close();
+        File::erase(new_dat_path);
+        return false;
+    }
+    File::erase(rp);
+    if (! rf.create(file_mode::append, rp))
+    {
+        ndf.close();
+        nkf.close();
+        File::erase(new_dat_path);
+        File::erase(new_key_path);
+        return false;
+    }
+    auto const df_size = df.actual_size();
+    auto const work = 2 * df_size;
+    auto const write_size = std::min<std::size_t>(
+        buffer_size, 16 * 1024 * 1024);
+    try
+    {
+        write(ndf, ndh);
+        bulk_writer<File> w (ndf,
+            dat_file_header::size, write_size);
+        detail::build_key_file(nkh, ndf, nkf, rf, buffer_size,
+            [&](key_builder<File>& kb)
+            {
+                if (bucket_order)
+                {
+                    // Iterate Key File
+                    buffer buf (kh.block_size);
+                    bucket b (kh.block_size, buf.get());
+                    for (std::size_t n = 0; n < kh.buckets; ++n)
+                    {
+                        progress(n * df_size / kh.buckets, work);
+                        b.read(kf, (n + 1) * kh.block_size);
+                        for (;;)
+                        {
+                            for (std::size_t i = 0; i < b.size(); ++i)
+                            {
+                                auto const e = b[i];
+                                // Data Record
+                                auto const len = value_size(
+                                    e.size, kh.key_size);
+                                auto const offset = w.offset();
+                                auto os = w.prepare(len);
+                                df.read(e.offset, os.data(len), len);
+                                kb.insert(e.hash, offset, e.size);
+                            }
+                            if (! b.spill())
+                                break;
+                            b.read(df, b.spill());
+                        }
+                    }
+                }
+                else
+                {
+                    // Iterate Data File
+                    bulk_reader<File> r (df,
+                        dat_file_header::size, df_size,
+                            write_size);
+                    while (! r.eof())
+                    {
+                        progress(r.offset(), work);
+                        // Data Record or Spill Record
+                        std::size_t size;
+                        auto is = r.prepare(
+                            field<uint48_t>::size); // Size
+                        read<uint48_t>(is, size);
+                        if (size > 0)
+                        {
+                            // Data Record
+                            is = r.prepare(
+                                kh.key_size +       // Key
+                                size);              // Data
+                            auto const key = is.data(kh.key_size);
+                            auto const offset = w.offset();
+                            auto os = w.prepare(
+                                value_size(size, kh.key_size));
+                            write<uint48_t>(os, size);      // Size
+                            write(os, key, kh.key_size);    // Key
+                            write(os, is.data(size), size); // Data
+                            kb.insert(hash<Hasher>(key,
+                                kh.key_size, kh.salt), offset, size);
+                        }
+                        else
+                        {
+                            // Spill Record
+                            is = r.prepare(
+                                field<std::uint16_t>::size);
+                            read<std::uint16_t>(is, size);
+                            r.prepare(size); // skip bucket
+                        }
+                    }
+                }
+                w.flush();
+                return w.offset();
+            },
+            [&](std::size_t amount, std::size_t total)
+            {
+                progress(df_size + amount * df_size /
+                    std::max<std::size_t>(1, total), work);
+            });
+    }
+    catch (file_short_read_error const&)
+    {
+        ndf.close();
+        nkf.close();
+        rf.close();
+        File::erase(new_dat_path);
+        File::erase(new_key_path);
+        File::erase(rp);
+        throw store_corrupt_error(
+            "nudb: data short read");
+    }
+    catch (...)
+    {
+        ndf.close();
+        nkf.close();
+        rf.close();
+        File::erase(new_dat_path);
+        File::erase(new_key_path);
+        File::erase(rp);
+        throw;
+    }
+    rf.close();
+    File::erase(rp);
+    return true;
+}
+
+} // nudb
+
+#endif
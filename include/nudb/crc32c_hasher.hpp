@@ -0,0 +1,383 @@
+//
+// Copyright (c) 2015-2016 Vinnie Falco (vinnie dot falco at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef NUDB_CRC32C_HASHER_HPP
+#define NUDB_CRC32C_HASHER_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+
+#ifndef NUDB_CRC32C_X86
+# if (defined(__x86_64__) || defined(__i386__)) && \
+        (defined(__GNUC__) || defined(__clang__))
+#  define NUDB_CRC32C_X86 1
+# else
+#  define NUDB_CRC32C_X86 0
+# endif
+#endif
+
+#ifndef NUDB_CRC32C_ARM
+# if defined(__ARM_FEATURE_CRC32)
+#  define NUDB_CRC32C_ARM 1
+# else
+#  define NUDB_CRC32C_ARM 0
+# endif
+#endif
+
+#if NUDB_CRC32C_X86
+# include <nmmintrin.h>
+#endif
+#if NUDB_CRC32C_ARM
+# include <arm_acle.h>
+#endif
+
+namespace nudb {
+
+namespace detail {
+
+// Two CRC32C lanes over the same 64-bit words. The second
+// lane sees each word multiplied by an odd constant, so that
+// the lanes do not cancel out as CRCs with different seeds
+// of the same input would.
+//
+struct crc32c_lanes
+{
+    static std::uint64_t constexpr k =
+        0x9e3779b97f4a7c15ULL;
+
+    std::uint32_t a;
+    std::uint32_t b;
+};
+
+// Little endian regardless of the host, so that hashes
+// stored in a key file do not depend on the machine.
+inline
+std::uint64_t
+crc32c_load (std::uint8_t const* p, std::size_t n)
+{
+    std::uint64_t v = 0;
+    for (std::size_t i = 0; i < n; ++i)
+        v |= static_cast<std::uint64_t>(p[i]) << (8 * i);
+    return v;
+}
+
+inline
+std::uint64_t
+crc32c_load (std::uint8_t const* p)
+{
+    return crc32c_load(p, 8);
+}
+
+template <class = void>
+struct crc32c_table_t
+{
+    std::uint32_t t[256];
+
+    crc32c_table_t()
+    {
+        for (std::uint32_t i = 0; i < 256; ++i)
+        {
+            auto c = i;
+            for (int j = 0; j < 8; ++j)
+                c = (c >> 1) ^ ((c & 1) ? 0x82f63b78 : 0);
+            t[i] = c;
+        }
+    }
+
+    static
+    crc32c_table_t const&
+    get()
+    {
+        static crc32c_table_t const table;
+        return table;
+    }
+};
+
+// Portable CRC32C of one word, a byte at a time
+inline
+std::uint32_t
+crc32c_word_sw (std::uint32_t c, std::uint64_t v)
+{
+    auto const& t = crc32c_table_t<>::get().t;
+    for (int i = 0; i < 8; ++i)
+    {
+        c = t[(c ^ v) & 0xff] ^ (c >> 8);
+        v >>= 8;
+    }
+    return c;
+}
+
+// Feeds n bytes at p to both lanes, using word(c, v)
+// for each 64-bit word. A final partial word is padded
+// with zeroes; the length is mixed in by the caller.
+//
+template <class Word>
+inline
+void
+crc32c_update (crc32c_lanes& s, std::uint8_t const* p,
+    std::size_t n, Word const& word)
+{
+    auto const k = crc32c_lanes::k;
+    auto a = s.a;
+    auto b = s.b;
+    switch(n)
+    {
+    // Common fixed key sizes
+    case 32:
+    {
+        auto const v0 = crc32c_load(p);
+        auto const v1 = crc32c_load(p + 8);
+        auto const v2 = crc32c_load(p + 16);
+        auto const v3 = crc32c_load(p + 24);
+        a = word(word(word(word(a, v0), v1), v2), v3);
+        b = word(word(word(word(b, v0 * k),
+            v1 * k), v2 * k), v3 * k);
+        break;
+    }
+    case 16:
+    {
+        auto const v0 = crc32c_load(p);
+        auto const v1 = crc32c_load(p + 8);
+        a = word(word(a, v0), v1);
+        b = word(word(b, v0 * k), v1 * k);
+        break;
+    }
+    default:
+        for (; n >= 8; n -= 8, p += 8)
+        {
+            auto const v = crc32c_load(p);
+            a = word(a, v);
+            b = word(b, v * k);
+        }
+        if (n > 0)
+        {
+            auto const v = crc32c_load(p, n);
+            a = word(a, v);
+            b = word(b, v * k);
+        }
+        break;
+    }
+    s.a = a;
+    s.b = b;
+}
+
+inline
+void
+crc32c_update_sw (crc32c_lanes& s,
+    std::uint8_t const* p, std::size_t n)
+{
+    crc32c_update(s, p, n,
+        [](std::uint32_t c, std::uint64_t v)
+        {
+            return crc32c_word_sw(c, v);
+        });
+}
+
+#if NUDB_CRC32C_X86
+
+// The loop is repeated here rather than shared with
+// crc32c_update, since the instructions can only be
+// inlined into a function compiled for SSE 4.2.
+//
+__attribute__((target("sse4.2")))
+inline
+std::uint32_t
+crc32c_word_hw (std::uint32_t c, std::uint64_t v)
+{
+# if defined(__x86_64__)
+    return static_cast<std::uint32_t>(
+        _mm_crc32_u64(c, v));
+# else
+    c = _mm_crc32_u32(c,
+        static_cast<std::uint32_t>(v));
+    return _mm_crc32_u32(c,
+        static_cast<std::uint32_t>(v >> 32));
+# endif
+}
+
+__attribute__((target("sse4.2")))
+inline
+void
+crc32c_update_hw (crc32c_lanes& s,
+    std::uint8_t const* p, std::size_t n)
+{
+    auto const k = crc32c_lanes::k;
+    auto a = s.a;
+    auto b = s.b;
+    if (n == 32)
+    {
+        auto const v0 = crc32c_load(p);
+        auto const v1 = crc32c_load(p + 8);
+        auto const v2 = crc32c_load(p + 16);
+        auto const v3 = crc32c_load(p + 24);
+        a = crc32c_word_hw(crc32c_word_hw(crc32c_word_hw(
+            crc32c_word_hw(a, v0), v1), v2), v3);
+        b = crc32c_word_hw(crc32c_word_hw(crc32c_word_hw(
+            crc32c_word_hw(b, v0 * k), v1 * k), v2 * k), v3 * k);
+    }
+    else if (n == 16)
+    {
+        auto const v0 = crc32c_load(p);
+        auto const v1 = crc32c_load(p + 8);
+        a = crc32c_word_hw(crc32c_word_hw(a, v0), v1);
+        b = crc32c_word_hw(crc32c_word_hw(b, v0 * k), v1 * k);
+    }
+    else
+    {
+        for (; n >= 8; n -= 8, p += 8)
+        {
+            auto const v = crc32c_load(p);
+            a = crc32c_word_hw(a, v);
+            b = crc32c_word_hw(b, v * k);
+        }
+        if (n > 0)
+        {
+            auto const v = crc32c_load(p, n);
+            a = crc32c_word_hw(a, v);
+            b = crc32c_word_hw(b, v * k);
+        }
+    }
+    s.a = a;
+    s.b = b;
+}
+
+inline
+bool
+crc32c_has_hw()
+{
+    static bool const result =
+        __builtin_cpu_supports("sse4.2");
+    return result;
+}
+
+#elif NUDB_CRC32C_ARM
+
+inline
+void
+crc32c_update_hw (crc32c_lanes& s,
+    std::uint8_t const* p, std::size_t n)
+{
+    crc32c_update(s, p, n,
+        [](std::uint32_t c, std::uint64_t v)
+        {
+            return __crc32cd(c, v);
+        });
+}
+
+inline
+bool
+crc32c_has_hw()
+{
+    return true;
+}
+
+#else
+
+inline
+void
+crc32c_update_hw (crc32c_lanes& s,
+    std::uint8_t const* p, std::size_t n)
+{
+    crc32c_update_sw(s, p, n);
+}
+
+inline
+bool
+crc32c_has_hw()
+{
+    return false;
+}
+
+#endif
+
+} // detail
+
+/** Hasher built on the CRC32C instruction.
+
+    This produces 64 bits from two CRC32C lanes, finished
+    with a multiplicative mix, using the SSE 4.2 or ARMv8
+    CRC instructions when the processor has them, and a
+    table otherwise. Both give the same results, so a key
+    file may move between machines. Keys of 16 and 32
+    bytes take an unrolled path.
+
+    It is meant for keys which are already well spread,
+    such as digests, where it is much faster than a
+    general purpose hash. Each call to the function
+    operator mixes in its bytes separately.
+*/
+class crc32c_hasher
+{
+private:
+    detail::crc32c_lanes s_;
+    std::uint64_t seed_;
+    std::uint64_t size_ = 0;
+
+    static
+    std::uint64_t
+    mix (std::uint64_t h)
+    {
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33;
+        h *= 0xc4ceb9fe1a85ec53ULL;
+        h ^= h >> 33;
+        return h;
+    }
+
+public:
+    using result_type = std::uint64_t;
+
+    crc32c_hasher() noexcept
+        : crc32c_hasher(1u)
+    {
+    }
+
+    template<class Seed,
+        std::enable_if_t<
+            std::is_unsigned<Seed>::value>* = nullptr>
+    explicit
+    crc32c_hasher(Seed seed) noexcept
+        : seed_ (static_cast<std::uint64_t>(seed))
+    {
+        s_.a = static_cast<std::uint32_t>(seed_);
+        s_.b = static_cast<std::uint32_t>(seed_ >> 32);
+    }
+
+    template<class Seed,
+        std::enable_if_t<
+            std::is_unsigned<Seed>::value>* = nullptr>
+    crc32c_hasher(Seed seed, Seed) noexcept
+        : crc32c_hasher(seed)
+    {
+    }
+
+    void
+    operator()(void const* key, std::size_t len) noexcept
+    {
+        auto const p = reinterpret_cast<
+            std::uint8_t const*>(key);
+        if (detail::crc32c_has_hw())
+            detail::crc32c_update_hw(s_, p, len);
+        else
+            detail::crc32c_update_sw(s_, p, len);
+        size_ += len;
+    }
+
+    explicit
+    operator std::uint64_t() noexcept
+    {
+        auto const h =
+            (static_cast<std::uint64_t>(s_.a) << 32) | s_.b;
+        return mix(h ^ mix(seed_ + size_));
+    }
+};
+
+} // nudb
+
+#endif
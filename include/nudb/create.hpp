@@ -13,12 +13,41 @@
 #include <nudb/detail/format.hpp>
 #include <algorithm>
 #include <cstring>
+#include <fstream>
 #include <random>
 #include <stdexcept>
+#include <string>
+#include <type_traits>
 #include <utility>
 
+#if NUDB_POSIX_FILE
+# include <sys/statvfs.h>
+# if defined(__linux__)
+#  include <sys/sysmacros.h>
+# endif
+#endif
+
+#if NUDB_WIN32_FILE
+# include <winioctl.h>
+#endif
+
 namespace nudb {
 
+/** Optional settings for a new database. */
+struct create_options
+{
+    /** Largest value stored in the key file, or 0.
+
+        When not zero, each bucket entry reserves room for
+        the key followed by a value of up to this many
+        bytes. Such values are stored in the data file as
+        usual, but fetches read them from the bucket and
+        avoid a data file read. The bucket capacity shrinks
+        accordingly.
+    */
+    std::size_t inline_size = 0;
+};
+
 namespace detail {
 
 template <class = void>
@@ -31,6 +60,19 @@ make_uid()
     return dist(gen);
 }
 
+template <class... Args>
+struct is_create_options
+    : std::false_type
+{
+};
+
+template <class Arg, class... Args>
+struct is_create_options<Arg, Args...>
+    : std::is_same<typename std::decay<Arg>::type,
+        create_options>
+{
+};
+
 }
 
 /** Generate a random salt. */
@@ -44,12 +86,165 @@ make_salt()
     return dist(gen);
 }
 
-/** Returns the best guess at the volume's block size. */
+namespace detail {
+
+// Largest power of two which fits the block size field
+static std::size_t constexpr max_block_size = 32768;
+
+// Returns the directory holding path, which need not exist
+inline
+path_type
+parent_path (path_type const& path)
+{
+    auto const pos = path.find_last_of("/\\");
+    if (pos == path_type::npos)
+        return ".";
+    return path.substr(0, pos > 0 ? pos : 1);
+}
+
+#if NUDB_POSIX_FILE
+
+#if defined(__linux__)
+// Returns the number in a sysfs file, or 0
 inline
 std::size_t
-block_size (path_type const& /*path*/)
+read_sysfs (std::string const& path)
+{
+    std::ifstream is (path);
+    std::size_t n = 0;
+    if (is >> n)
+        return n;
+    return 0;
+}
+#endif
+
+// Returns the largest of the filesystem block size and,
+// on Linux, the physical sector and optimal I/O sizes
+// of the device holding dir, or 0 if none are known.
+//
+// The device sizes are those which the BLKPBSZGET and
+// BLKIOOPT ioctls return, read from sysfs instead so
+// that the device need not be opened.
+template <class = void>
+std::size_t
+device_block_size (path_type const& dir)
+{
+    std::size_t result = 0;
+    struct statvfs sv;
+    if (::statvfs(dir.c_str(), &sv) == 0)
+        result = sv.f_frsize > 0 ? sv.f_frsize : sv.f_bsize;
+#if defined(__linux__)
+    struct stat st;
+    if (::stat(dir.c_str(), &st) != 0)
+        return result;
+    auto const dev = "/sys/dev/block/" +
+        std::to_string(major(st.st_dev)) + ":" +
+            std::to_string(minor(st.st_dev));
+    // A partition has no queue of its own
+    for (auto const& queue : {
+            dev + "/queue/", dev + "/../queue/"})
+    {
+        auto const physical =
+            read_sysfs(queue + "physical_block_size");
+        if (physical == 0)
+            continue;
+        result = std::max(result, physical);
+        // A RAID stripe larger than any block is left
+        // alone: a power of two block inside one chunk
+        // never crosses into the next.
+        auto const optimal =
+            read_sysfs(queue + "optimal_io_size");
+        if (optimal <= max_block_size)
+            result = std::max(result, optimal);
+        break;
+    }
+#endif
+    return result;
+}
+
+#elif NUDB_WIN32_FILE
+
+// Returns the larger of the cluster size and the physical
+// sector size of the volume holding dir, or 0 if neither
+// is known.
+template <class = void>
+std::size_t
+device_block_size (path_type const& dir)
+{
+    std::size_t result = 0;
+    char volume[MAX_PATH];
+    if (! ::GetVolumePathNameA(dir.c_str(), volume, MAX_PATH))
+        return result;
+    DWORD sectors;
+    DWORD bytes;
+    DWORD free_clusters;
+    DWORD clusters;
+    if (::GetDiskFreeSpaceA(volume, &sectors, &bytes,
+            &free_clusters, &clusters))
+        result = std::size_t(sectors) * bytes;
+    // Only volumes with a drive letter can be opened
+    path_type const v (volume);
+    if (v.size() < 2 || v[1] != ':')
+        return result;
+    auto const h = ::CreateFileA(
+        ("\\\\.\\" + v.substr(0, 2)).c_str(), 0,
+            FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr,
+                OPEN_EXISTING, 0, nullptr);
+    if (h == INVALID_HANDLE_VALUE)
+        return result;
+    STORAGE_PROPERTY_QUERY q {};
+    q.PropertyId = StorageAccessAlignmentProperty;
+    q.QueryType = PropertyStandardQuery;
+    STORAGE_ACCESS_ALIGNMENT_DESCRIPTOR d {};
+    DWORD n;
+    if (::DeviceIoControl(h, IOCTL_STORAGE_QUERY_PROPERTY,
+            &q, sizeof(q), &d, sizeof(d), &n, nullptr) &&
+                n >= sizeof(d))
+        result = std::max<std::size_t>(
+            result, d.BytesPerPhysicalSector);
+    ::CloseHandle(h);
+    return result;
+}
+
+#else
+
+template <class = void>
+std::size_t
+device_block_size (path_type const&)
 {
-    return 4096;
+    return 0;
+}
+
+#endif
+
+} // detail
+
+/** Returns the best guess at the volume's block size.
+
+    This is the largest of the filesystem block size, the
+    physical sector size and the optimal I/O size of the
+    device holding path, as far as the system reports
+    them, rounded up to a power of two no larger than
+    32768. If none is known, 4096 is returned.
+
+    Buckets are at multiples of the block size in the key
+    file, so with this block size every bucket read is
+    aligned to the device, a whole number of its sectors,
+    as reads with O_DIRECT require.
+
+    @param path A file on the volume, which need not exist.
+*/
+template <class = void>
+std::size_t
+block_size (path_type const& path)
+{
+    using namespace detail;
+    auto const n = device_block_size(parent_path(path));
+    if (n == 0)
+        return 4096;
+    return static_cast<std::size_t>(std::min<
+        unsigned long long>(max_block_size,
+            ceil_pow2(std::max<std::size_t>(n, 512))));
 }
 
 /** Create a new database.
@@ -57,6 +252,7 @@ block_size (path_type const& /*path*/)
         The files must not exist
     Throws:
 
+    @param options Optional settings for the database.
     @param args Arguments passed to File constructors
     @return `false` if any file could not be created.
 */
@@ -76,6 +272,7 @@ create (
     std::size_t key_size,
     std::size_t block_size,
     float load_factor,
+    create_options const& options,
     Args&&... args)
 {
     using namespace detail;
@@ -91,8 +288,13 @@ create (
     if (load_factor >= 1.f)
         throw std::domain_error(
             "nudb: load factor too large");
+    if (options.inline_size > field<std::uint16_t>::max)
+        throw std::domain_error(
+            "nudb: inline size too large");
+    auto const ib = inline_bytes(
+        key_size, options.inline_size);
     auto const capacity =
-        bucket_capacity(block_size);
+        bucket_capacity(block_size, ib);
     if (capacity < 1)
         throw std::domain_error(
             "nudb: block size too small");
@@ -121,13 +323,15 @@ success:
     dh.key_size = key_size;
 
     key_file_header kh;
-    kh.version = currentVersion;
+    kh.version = options.inline_size > 0 ?
+        inlineVersion : currentVersion;
     kh.uid = dh.uid;
     kh.appnum = appnum;
     kh.key_size = key_size;
     kh.salt = salt;
     kh.pepper = pepper<Hasher>(salt);
     kh.block_size = block_size;
+    kh.inline_size = options.inline_size;
     // VFALCO Should it be 65536?
     //        How do we set the min?
     kh.load_factor = std::min<std::size_t>(
@@ -137,7 +341,7 @@ success:
     write (kf, kh);
     buffer buf(block_size);
     std::memset(buf.get(), 0, block_size);
-    bucket b (block_size, buf.get(), empty);
+    bucket b (block_size, buf.get(), empty, ib);
     b.write (kf, block_size);
     // VFALCO Leave log file empty?
     df.sync();
@@ -146,6 +350,40 @@ success:
     return true;
 }
 
+/** Create a new database with default options.
+    Preconditions:
+        The files must not exist
+    Throws:
+
+    @param args Arguments passed to File constructors
+    @return `false` if any file could not be created.
+*/
+template <
+    class Hasher,
+    class Codec,
+    class File,
+    class... Args
+>
+typename std::enable_if<
+    ! detail::is_create_options<Args...>::value,
+        bool>::type
+create (
+    path_type const& dat_path,
+    path_type const& key_path,
+    path_type const& log_path,
+    std::uint64_t appnum,
+    std::uint64_t salt,
+    std::size_t key_size,
+    std::size_t block_size,
+    float load_factor,
+    Args&&... args)
+{
+    return create<Hasher, Codec, File>(dat_path,
+        key_path, log_path, appnum, salt, key_size,
+            block_size, load_factor, create_options{},
+                std::forward<Args>(args)...);
+}
+
 } // nudb
 
 #endif
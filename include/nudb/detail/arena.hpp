@@ -9,9 +9,15 @@
 #define NUDB_DETAIL_ARENA_HPP
 
 #include <algorithm>
+#include <cassert>
 #include <cstddef>
 #include <cstdint>
 #include <memory>
+#include <stdexcept>
+
+#if defined(__linux__)
+# include <sys/mman.h>
+#endif
 
 namespace nudb {
 namespace detail {
@@ -24,14 +30,32 @@ namespace detail {
 
     When the arena is cleared, allocated memory is placed
     on a free list for re-use, avoiding future system calls.
+    Shrinking keeps free blocks up to a high water mark, so
+    that the next burst of allocations does not fault in
+    fresh pages.
+
+    With huge pages, blocks are rounded up to whole 2MB
+    pages and mapped with MAP_HUGETLB, using 1GB pages
+    when the size allows. If the system has no huge pages
+    reserved, transparent huge pages are requested with
+    madvise instead. Elsewhere blocks come from new.
 */
 template <class = void>
 class arena_t
 {
 private:
+    enum : std::size_t
+    {
+        huge_page = 2 * 1024 * 1024,
+        giant_page = 1024 * 1024 * 1024
+    };
+
     class element;
 
     std::size_t alloc_size_;
+    std::size_t high_water_;
+    bool huge_pages_;
+    std::size_t size_ = 0;      // bytes of all blocks
     element* used_ = nullptr;
     element* free_ = nullptr;
 
@@ -41,8 +65,12 @@ public:
 
     ~arena_t();
 
+    // high_water is the number of bytes of free
+    // blocks which shrink_to_fit keeps.
     explicit
-    arena_t (std::size_t alloc_size);
+    arena_t (std::size_t alloc_size,
+        std::size_t high_water = 0,
+            bool huge_pages = false);
 
     arena_t& operator= (arena_t&& other);
 
@@ -50,10 +78,17 @@ public:
     void
     clear();
 
-    // deletes free blocks
+    // Deletes free blocks above the high water mark
     void
     shrink_to_fit();
 
+    // Returns the bytes of used and free blocks
+    std::size_t
+    size() const
+    {
+        return size_;
+    }
+
     std::uint8_t*
     alloc (std::size_t n);
 
@@ -65,6 +100,13 @@ public:
 private:
     void
     dealloc (element*& list);
+
+    std::uint8_t*
+    obtain (std::size_t& size, bool& mapped);
+
+    static
+    void
+    release (void* p, std::size_t size, bool mapped);
 };
 
 //------------------------------------------------------------------------------
@@ -73,17 +115,33 @@ template <class _>
 class arena_t<_>::element
 {
 private:
+    std::size_t const size_;
     std::size_t const capacity_;
     std::size_t used_ = 0;
+    bool const mapped_;
 
 public:
     element* next = nullptr;
 
-    explicit
-    element (std::size_t alloc_size)
-        : capacity_ (
+    element (std::size_t alloc_size, bool mapped)
+        : size_ (alloc_size)
+        , capacity_ (
             alloc_size - sizeof(*this))
+        , mapped_ (mapped)
+    {
+    }
+
+    // Bytes obtained from the system
+    std::size_t
+    size() const
     {
+        return size_;
+    }
+
+    bool
+    mapped() const
+    {
+        return mapped_;
     }
 
     void
@@ -124,8 +182,11 @@ arena_t<_>::element::alloc (std::size_t n)
 //------------------------------------------------------------------------------
 
 template <class _>
-arena_t<_>::arena_t (std::size_t alloc_size)
+arena_t<_>::arena_t (std::size_t alloc_size,
+        std::size_t high_water, bool huge_pages)
     : alloc_size_ (alloc_size)
+    , high_water_ (high_water)
+    , huge_pages_ (huge_pages)
 {
     if (alloc_size <= sizeof(element))
         throw std::domain_error(
@@ -146,8 +207,12 @@ arena_t<_>::operator= (arena_t&& other)
     dealloc (used_);
     dealloc (free_);
     alloc_size_ = other.alloc_size_;
+    high_water_ = other.high_water_;
+    huge_pages_ = other.huge_pages_;
+    size_ = other.size_;
     used_ = other.used_;
     free_ = other.free_;
+    other.size_ = 0;
     other.used_ = nullptr;
     other.free_ = nullptr;
     return *this;
@@ -171,7 +236,14 @@ template <class _>
 void
 arena_t<_>::shrink_to_fit()
 {
-    dealloc (free_);
+    std::size_t kept = 0;
+    auto list = &free_;
+    while (*list && kept + (*list)->size() <= high_water_)
+    {
+        kept += (*list)->size();
+        list = &(*list)->next;
+    }
+    dealloc (*list);
 }
 
 template <class _>
@@ -191,11 +263,13 @@ arena_t<_>::alloc (std::size_t n)
         used_ = e;
         return used_->alloc(n);
     }
-    std::size_t const size = std::max(
+    std::size_t size = std::max(
         alloc_size_, sizeof(element) + n);
+    bool mapped;
     element* const e = reinterpret_cast<element*>(
-        new std::uint8_t[size]);
-    ::new(e) element(size);
+        obtain(size, mapped));
+    ::new(e) element(size, mapped);
+    size_ += size;
     e->next = used_;
     used_ = e;
     return used_->alloc(n);
@@ -207,6 +281,9 @@ swap (arena_t<_>& lhs, arena_t<_>& rhs)
 {
     using std::swap;
     swap(lhs.alloc_size_, rhs.alloc_size_);
+    swap(lhs.high_water_, rhs.high_water_);
+    swap(lhs.huge_pages_, rhs.huge_pages_);
+    swap(lhs.size_, rhs.size_);
     swap(lhs.used_, rhs.used_);
     swap(lhs.free_, rhs.free_);
 }
@@ -219,9 +296,85 @@ arena_t<_>::dealloc (element*& list)
     {
         auto const e = list;
         list = list->next;
+        auto const size = e->size();
+        auto const mapped = e->mapped();
+        size_ -= size;
         e->~element();
-        delete[] reinterpret_cast<std::uint8_t*>(e);
+        release(e, size, mapped);
+    }
+}
+
+// Returns a block of at least size bytes, setting
+// size to the bytes obtained.
+template <class _>
+std::uint8_t*
+arena_t<_>::obtain (std::size_t& size, bool& mapped)
+{
+    mapped = false;
+#if defined(__linux__)
+    if (huge_pages_)
+    {
+        size = (size + huge_page - 1) / huge_page * huge_page;
+        int const prot = PROT_READ | PROT_WRITE;
+        int const flags = MAP_PRIVATE | MAP_ANONYMOUS;
+        void* p = MAP_FAILED;
+#if defined(MAP_HUGETLB)
+# if defined(MAP_HUGE_1GB)
+        if (size % giant_page == 0)
+            p = ::mmap(nullptr, size, prot,
+                flags | MAP_HUGETLB | MAP_HUGE_1GB, -1, 0);
+# endif
+        if (p == MAP_FAILED)
+            p = ::mmap(nullptr, size, prot,
+                flags | MAP_HUGETLB, -1, 0);
+#endif
+        if (p == MAP_FAILED)
+        {
+            // Map an extra page, to trim
+            // the block to a page boundary.
+            auto const q = ::mmap(nullptr,
+                size + huge_page, prot, flags, -1, 0);
+            if (q != MAP_FAILED)
+            {
+                auto const a =
+                    reinterpret_cast<std::uintptr_t>(q);
+                auto const b = (a + huge_page - 1) &
+                    ~std::uintptr_t(huge_page - 1);
+                if (b > a)
+                    ::munmap(q, b - a);
+                ::munmap(reinterpret_cast<void*>(b + size),
+                    a + huge_page - b);
+                p = reinterpret_cast<void*>(b);
+#if defined(MADV_HUGEPAGE)
+                ::madvise(p, size, MADV_HUGEPAGE);
+#endif
+            }
+        }
+        if (p != MAP_FAILED)
+        {
+            mapped = true;
+            return static_cast<std::uint8_t*>(p);
+        }
+    }
+#endif
+    return new std::uint8_t[size];
+}
+
+template <class _>
+void
+arena_t<_>::release (void* p, std::size_t size, bool mapped)
+{
+#if defined(__linux__)
+    if (mapped)
+    {
+        ::munmap(p, size);
+        return;
     }
+#else
+    (void)size;
+    (void)mapped;
+#endif
+    delete[] static_cast<std::uint8_t*>(p);
 }
 
 using arena = arena_t<>;
@@ -0,0 +1,186 @@
+//
+// Copyright (c) 2015-2016 Vinnie Falco (vinnie dot falco at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef NUDB_DETAIL_BLOOM_FILTER_HPP
+#define NUDB_DETAIL_BLOOM_FILTER_HPP
+
+#include <nudb/detail/format.hpp>
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+namespace nudb {
+namespace detail {
+
+/*  Membership filter over key hashes.
+
+    This is a blocked Bloom filter: the bits for a key all
+    fall in one 64 byte block, so a query touches a single
+    cache line. Keys are identified by the hash stored in
+    the bucket entries, so the filter can be built from the
+    key file without reading keys from the data file.
+
+    Bits are set and tested with atomic operations, so that
+    readers may query the filter while a commit adds keys.
+    A filter with no bits reports every key as present.
+    The filter cannot grow; a larger one is built in its
+    place and moved in when the keys outgrow it.
+*/
+template <class = void>
+class bloom_filter_t
+{
+private:
+    enum
+    {
+        // 512 bits per block
+        block_words = 8
+    };
+
+    using word = std::atomic<std::uint64_t>;
+
+    std::unique_ptr<word[]> words_;
+    std::size_t blocks_ = 0;    // power of two
+    unsigned probes_ = 0;
+    std::size_t keys_ = 0;
+    std::size_t bits_per_key_ = 0;
+
+public:
+    bloom_filter_t() = default;
+    bloom_filter_t (bloom_filter_t const&) = delete;
+    bloom_filter_t& operator= (bloom_filter_t const&) = delete;
+    bloom_filter_t (bloom_filter_t&&) = default;
+    bloom_filter_t& operator= (bloom_filter_t&&) = default;
+
+    /** Create a filter.
+
+        @param keys Expected number of keys.
+
+        @param bits_per_key Bits of memory per expected key,
+        or 0 for a filter that holds nothing.
+    */
+    bloom_filter_t (std::size_t keys,
+        std::size_t bits_per_key);
+
+    // `true` if the filter holds bits
+    bool
+    enabled() const
+    {
+        return blocks_ > 0;
+    }
+
+    // Returns the number of keys the filter was sized for
+    std::size_t
+    keys() const
+    {
+        return keys_;
+    }
+
+    // Returns the bits of memory per expected key
+    std::size_t
+    bits_per_key() const
+    {
+        return bits_per_key_;
+    }
+
+    // Returns the memory used, in bytes
+    std::size_t
+    size() const
+    {
+        return blocks_ * block_words * sizeof(std::uint64_t);
+    }
+
+    // Add a key hash
+    void
+    insert (std::size_t h);
+
+    // Returns `false` if the key hash was never inserted
+    bool
+    may_contain (std::size_t h) const;
+
+private:
+    static
+    std::uint64_t
+    mix (std::uint64_t x)
+    {
+        // splitmix64 finalizer
+        x ^= x >> 30;
+        x *= 0xbf58476d1ce4e5b9ULL;
+        x ^= x >> 27;
+        x *= 0x94d049bb133111ebULL;
+        x ^= x >> 31;
+        return x;
+    }
+};
+
+template <class _>
+bloom_filter_t<_>::bloom_filter_t (
+    std::size_t keys, std::size_t bits_per_key)
+    : keys_ (keys)
+    , bits_per_key_ (bits_per_key)
+{
+    if (bits_per_key == 0)
+        return;
+    auto const bits = std::max<std::size_t>(1,
+        keys) * bits_per_key;
+    blocks_ = ceil_pow2(std::max<std::size_t>(1,
+        bits / (block_words * 64)));
+    // Optimal count is ln(2) * bits per key
+    probes_ = static_cast<unsigned>(std::min(16.,
+        std::max(1., std::round(0.69 * bits_per_key))));
+    words_.reset(new word[blocks_ * block_words]);
+    for (std::size_t i = 0; i < blocks_ * block_words; ++i)
+        words_[i].store(0, std::memory_order_relaxed);
+}
+
+template <class _>
+void
+bloom_filter_t<_>::insert (std::size_t h)
+{
+    if (! enabled())
+        return;
+    auto x = mix(h);
+    auto const block = words_.get() +
+        (x & (blocks_ - 1)) * block_words;
+    for (unsigned i = 0; i < probes_; ++i)
+    {
+        x = mix(x + i);
+        auto const bit = x & 511;
+        block[bit >> 6].fetch_or(std::uint64_t(1) <<
+            (bit & 63), std::memory_order_relaxed);
+    }
+}
+
+template <class _>
+bool
+bloom_filter_t<_>::may_contain (std::size_t h) const
+{
+    if (! enabled())
+        return true;
+    auto x = mix(h);
+    auto const block = words_.get() +
+        (x & (blocks_ - 1)) * block_words;
+    for (unsigned i = 0; i < probes_; ++i)
+    {
+        x = mix(x + i);
+        auto const bit = x & 511;
+        if (! (block[bit >> 6].load(
+                std::memory_order_relaxed) &
+                    (std::uint64_t(1) << (bit & 63))))
+            return false;
+    }
+    return true;
+}
+
+using bloom_filter = bloom_filter_t<>;
+
+} // detail
+} // nudb
+
+#endif
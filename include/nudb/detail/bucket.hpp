@@ -15,6 +15,7 @@
 #include <cstddef>
 #include <cstdint>
 #include <cstring>
+#include <type_traits>
 
 namespace nudb {
 namespace detail {
@@ -46,6 +47,7 @@ class bucket_t
 {
 private:
     std::size_t block_size_;    // Size of a key file block
+    std::size_t inline_bytes_;  // Size of each entry's inline field
     std::size_t size_;          // Current key count
     std::size_t spill_;         // Offset of next spill record or 0
     std::uint8_t* p_;           // Pointer to the bucket blob
@@ -61,9 +63,11 @@ public:
     bucket_t (bucket_t const&) = default;
     bucket_t& operator= (bucket_t const&) = default;
 
-    bucket_t (std::size_t block_size, void* p);
+    bucket_t (std::size_t block_size, void* p,
+        std::size_t inline_bytes = 0);
 
-    bucket_t (std::size_t block_size, void* p, empty_t);
+    bucket_t (std::size_t block_size, void* p, empty_t,
+        std::size_t inline_bytes = 0);
 
     std::size_t
     block_size() const
@@ -71,10 +75,18 @@ public:
         return block_size_;
     }
 
+    // Returns the size of each entry's inline field
+    std::size_t
+    inline_bytes() const
+    {
+        return inline_bytes_;
+    }
+
     std::size_t
     compact_size() const
     {
-        return detail::bucket_size(size_);
+        return detail::bucket_size(
+            size_, inline_bytes_);
     }
 
     bool
@@ -86,8 +98,8 @@ public:
     bool
     full() const
     {
-        return size_ >=
-            detail::bucket_capacity(block_size_);
+        return size_ >= detail::bucket_capacity(
+            block_size_, inline_bytes_);
     }
 
     std::size_t
@@ -132,7 +144,16 @@ public:
     std::size_t
     lower_bound (std::size_t h) const;
 
-    void
+    // Returns the inline field of an entry
+    // without bounds checking.
+    //
+    std::uint8_t*
+    inline_data (std::size_t i) const;
+
+    // Insert an entry with a zeroed inline field.
+    // Returns the index of the new entry.
+    //
+    std::size_t
     insert (std::size_t offset,
         std::size_t size, std::size_t h);
 
@@ -167,6 +188,18 @@ public:
     void
     write (File& f, std::size_t offset) const;
 
+    // Zero the bytes past the entries, up to
+    // the block size.
+    //
+    void
+    pad();
+
+    // Returns the full block_size() bytes of the bucket,
+    // ready to be written once pad() has been called.
+    //
+    void const*
+    block() const;
+
 private:
     // Update size and spill in the blob
     void
@@ -176,9 +209,10 @@ private:
 //------------------------------------------------------------------------------
 
 template <class _>
-bucket_t<_>::bucket_t (
-        std::size_t block_size, void* p)
+bucket_t<_>::bucket_t (std::size_t block_size,
+        void* p, std::size_t inline_bytes)
     : block_size_ (block_size)
+    , inline_bytes_ (inline_bytes)
     , p_ (reinterpret_cast<std::uint8_t*>(p))
 {
     // Bucket Record
@@ -188,9 +222,10 @@ bucket_t<_>::bucket_t (
 }
 
 template <class _>
-bucket_t<_>::bucket_t (
-        std::size_t block_size, void* p, empty_t)
+bucket_t<_>::bucket_t (std::size_t block_size,
+        void* p, empty_t, std::size_t inline_bytes)
     : block_size_ (block_size)
+    , inline_bytes_ (inline_bytes)
     , size_ (0)
     , spill_ (0)
     , p_ (reinterpret_cast<std::uint8_t*>(p))
@@ -225,19 +260,22 @@ bucket_t<_>::at (std::size_t i) const ->
     std::size_t const w =
         field<uint48_t>::size +         // Offset
         field<uint48_t>::size +         // Size
-        field<hash_t>::size;            // Prefix
+        field<hash_t>::size +           // Prefix
+        inline_bytes_;                  // Inline
     // Bucket Record
-    detail::istream is(p_ +
+    auto const p = p_ +
         field<std::uint16_t>::size +    // Count
         field<uint48_t>::size +         // Spill
-        i * w, w);
+        i * w;
     // Bucket Entry
-    detail::read<uint48_t>(
-        is, result.offset);             // Offset
-    detail::read<uint48_t>(
-        is, result.size);               // Size
-    detail::read<hash_t>(
-        is, result.hash);               // Hash
+    // Every field is preceded by at least
+    // two bytes, so they are read wide.
+    result.offset = readp_wide48(p);    // Offset
+    result.size = readp_wide48(p +
+        field<uint48_t>::size);         // Size
+    result.hash = readp_wide48(p +
+        field<uint48_t>::size +
+        field<uint48_t>::size);         // Hash
     return result;
 }
 
@@ -246,11 +284,16 @@ std::size_t
 bucket_t<_>::lower_bound (
     std::size_t h) const
 {
+    static_assert(std::is_same<hash_t, uint48_t>::value,
+        "hash_t must be uint48_t");
+    if (size_ == 0)
+        return 0;
     // Bucket Entry
     auto const w =
         field<uint48_t>::size +         // Offset
         field<uint48_t>::size +         // Size
-        field<hash_t>::size;            // Hash
+        field<hash_t>::size +           // Hash
+        inline_bytes_;                  // Inline
     // Bucket Record
     auto const p = p_ +
         field<std::uint16_t>::size +    // Count
@@ -258,30 +301,42 @@ bucket_t<_>::lower_bound (
         // Bucket Entry
         field<uint48_t>::size +         // Offset
         field<uint48_t>::size;          // Size
-    std::size_t step;
+    // Branchless, so the probes of a search can be
+    // overlapped instead of waiting on mispredictions.
+    // Each hash is preceded by its Size field, which
+    // makes the wide read safe.
     std::size_t first = 0;
     std::size_t count = size_;
-    while (count > 0)
+    while (count > 1)
     {
-        step = count / 2;
-        auto const i = first + step;
-        std::size_t h1;
-        readp<hash_t>(p + i * w, h1);
-        if (h1 < h)
-        {
-            first = i + 1;
-            count -= step + 1;
-        }
-        else
-        {
-            count = step;
-        }
+        auto const step = count / 2;
+        if (readp_wide48(p + (first + step) * w) < h)
+            first += step;
+        count -= step;
     }
+    if (readp_wide48(p + first * w) < h)
+        ++first;
     return first;
 }
 
 template <class _>
-void
+std::uint8_t*
+bucket_t<_>::inline_data (std::size_t i) const
+{
+    // Bucket Entry
+    std::size_t const w =
+        field<uint48_t>::size +         // Offset
+        field<uint48_t>::size +         // Size
+        field<hash_t>::size;            // Hash
+    // Bucket Record
+    return p_ +
+        field<std::uint16_t>::size +    // Count
+        field<uint48_t>::size +         // Spill
+        i * (w + inline_bytes_) + w;
+}
+
+template <class _>
+std::size_t
 bucket_t<_>::insert (std::size_t offset,
     std::size_t size, std::size_t h)
 {
@@ -295,7 +350,8 @@ bucket_t<_>::insert (std::size_t offset,
     std::size_t const w =
         field<uint48_t>::size +     // Offset
         field<uint48_t>::size +     // Size
-        field<hash_t>::size;        // Hash
+        field<hash_t>::size +       // Hash
+        inline_bytes_;              // Inline
     std::memmove (
         p + (i + 1)  * w,
         p +  i       * w,
@@ -310,6 +366,9 @@ bucket_t<_>::insert (std::size_t offset,
         os, size);                  // Size
     detail::write<hash_t>(
         os, h);                     // Prefix
+    std::memset(os.data(inline_bytes_),
+        0, inline_bytes_);          // Inline
+    return i;
 }
 
 template <class _>
@@ -324,7 +383,8 @@ bucket_t<_>::erase (std::size_t i)
     auto const w =
         field<uint48_t>::size +     // Offset
         field<uint48_t>::size +     // Size
-        field<hash_t>::size;        // Hash
+        field<hash_t>::size +       // Hash
+        inline_bytes_;              // Inline
     --size_;
     if (i < size_)
         std::memmove(
@@ -341,9 +401,10 @@ void
 bucket_t<_>::read (File& f, std::size_t offset)
 {
     auto const cap = bucket_capacity (
-        block_size_);
+        block_size_, inline_bytes_);
     // Excludes padding to block size
-    f.read (offset, p_, bucket_size(cap));
+    f.read (offset, p_, bucket_size(
+        cap, inline_bytes_));
     istream is(p_, block_size_);
     detail::read<
         std::uint16_t>(is, size_);     // Count
@@ -372,7 +433,8 @@ bucket_t<_>::read (bulk_reader<File>& r)
     auto const w = size_ * (
         field<uint48_t>::size +     // Offset
         field<uint48_t>::size +     // Size
-        field<hash_t>::size);       // Hash
+        field<hash_t>::size +       // Hash
+        inline_bytes_);             // Inline
     is = r.prepare (w);
     std::memcpy(p_ +
         field<
@@ -407,6 +469,22 @@ bucket_t<_>::write (File& f, std::size_t offset) const
     f.write (offset, p_, block_size_);
 }
 
+template <class _>
+void
+bucket_t<_>::pad()
+{
+    auto const size = compact_size();
+    std::memset (p_ + size, 0,
+        block_size_ - size);
+}
+
+template <class _>
+void const*
+bucket_t<_>::block() const
+{
+    return p_;
+}
+
 template <class _>
 void
 bucket_t<_>::update()
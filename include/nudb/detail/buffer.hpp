@@ -20,6 +20,7 @@ class buffer
 {
 private:
     std::size_t size_ = 0;
+    std::size_t capacity_ = 0;
     std::unique_ptr<std::uint8_t[]> buf_;
 
 public:
@@ -31,22 +32,27 @@ public:
     explicit
     buffer (std::size_t n)
         : size_ (n)
+        , capacity_ (n)
         , buf_ (new std::uint8_t[n])
     {
     }
 
     buffer (buffer&& other)
         : size_ (other.size_)
+        , capacity_ (other.capacity_)
         , buf_ (std::move(other.buf_))
     {
         other.size_ = 0;
+        other.capacity_ = 0;
     }
 
     buffer& operator= (buffer&& other)
     {
         size_ = other.size_;
+        capacity_ = other.capacity_;
         buf_ = std::move(other.buf_);
         other.size_ = 0;
+        other.capacity_ = 0;
         return *this;
     }
 
@@ -62,11 +68,16 @@ public:
         return buf_.get();
     }
 
+    // The storage is kept when shrinking, so that a
+    // reused buffer stops allocating once it has grown.
     void
     reserve (std::size_t n)
     {
-        if (size_ < n)
+        if (capacity_ < n)
+        {
             buf_.reset (new std::uint8_t[n]);
+            capacity_ = n;
+        }
         size_ = n;
     }
 
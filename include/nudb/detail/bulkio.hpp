@@ -9,6 +9,7 @@
 #define NUDB_DETAIL_BULKIO_HPP
 
 #include <nudb/detail/buffer.hpp>
+#include <nudb/detail/io_worker.hpp>
 #include <nudb/detail/stream.hpp>
 #include <algorithm>
 #include <cstddef>
@@ -100,27 +101,43 @@ bulk_reader<File>::prepare (std::size_t needed)
 
 // Buffers file writes
 // Caller must call flush manually at the end
+//
+// When constructed with an io_worker, a full buffer is
+// handed to the worker to write while the caller fills
+// a second buffer. flush still returns only after all
+// of the data is in the file. Only the writes of this
+// writer are waited for, and only their errors thrown.
+//
 template <class File>
 class bulk_writer
 {
 private:
     File& f_;
     buffer buf_;
+    buffer back_;           // buffer being written
+    io_worker* worker_ = nullptr;
+    io_worker::job job_;    // write of back
     std::size_t offset_;    // current position
     std::size_t used_;      // bytes written to buf
+    std::size_t pending_;   // bytes written from back
 
 public:
     bulk_writer (File& f, std::size_t offset,
         std::size_t buffer_size);
 
+    bulk_writer (File& f, std::size_t offset,
+        std::size_t buffer_size, io_worker& worker);
+
+    ~bulk_writer();
+
     ostream
     prepare (std::size_t needed);
 
-    // Returns the number of bytes buffered
+    // Returns the number of bytes not yet in the file
     std::size_t
     size()
     {
-        return used_;
+        return used_ + pending_;
     }
 
     // Return current offset in file. This
@@ -135,6 +152,10 @@ public:
     // since it can throw, so callers must do it manually.
     void
     flush();
+
+private:
+    void
+    post();
 };
 
 template <class File>
@@ -143,9 +164,39 @@ bulk_writer<File>::bulk_writer (File& f,
     : f_ (f)
     , offset_ (offset)
     , used_ (0)
+    , pending_ (0)
+{
+    buf_.reserve (buffer_size);
+}
 
+template <class File>
+bulk_writer<File>::bulk_writer (File& f,
+        std::size_t offset, std::size_t buffer_size,
+            io_worker& worker)
+    : f_ (f)
+    , worker_ (&worker)
+    , offset_ (offset)
+    , used_ (0)
+    , pending_ (0)
 {
     buf_.reserve (buffer_size);
+    back_.reserve (buffer_size);
+}
+
+template <class File>
+bulk_writer<File>::~bulk_writer()
+{
+    // The worker may still be using back_
+    if (pending_)
+    {
+        try
+        {
+            worker_->wait(job_);
+        }
+        catch(...)
+        {
+        }
+    }
 }
 
 template <class File>
@@ -153,7 +204,12 @@ ostream
 bulk_writer<File>::prepare (std::size_t needed)
 {
     if (used_ + needed > buf_.size())
-        flush();
+    {
+        if (worker_)
+            post();
+        else
+            flush();
+    }
     if (needed > buf_.size())
         buf_.reserve (needed);
     ostream os (buf_.get() + used_, needed);
@@ -165,6 +221,16 @@ template <class File>
 void
 bulk_writer<File>::flush()
 {
+    if (worker_)
+    {
+        post();
+        if (pending_)
+        {
+            pending_ = 0;
+            worker_->wait(job_);
+        }
+        return;
+    }
     if (used_)
     {
         auto const offset = offset_;
@@ -175,6 +241,36 @@ bulk_writer<File>::flush()
     }
 }
 
+template <class File>
+void
+bulk_writer<File>::post()
+{
+    // Wait for the previous buffer to be written
+    if (pending_)
+    {
+        pending_ = 0;
+        worker_->wait(job_);
+    }
+    if (! used_)
+        return;
+    using std::swap;
+    swap(buf_, back_);
+    if (buf_.size() < back_.size())
+        buf_.reserve (back_.size());
+    auto const offset = offset_;
+    auto const used = used_;
+    auto const data = back_.get();
+    auto& f = f_;
+    offset_ += used_;
+    used_ = 0;
+    pending_ = used;
+    worker_->post(
+        [&f, offset, data, used]
+        {
+            f.write (offset, data, used);
+        }, job_);
+}
+
 } // detail
 } // nudb
 
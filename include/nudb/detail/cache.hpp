@@ -10,18 +10,29 @@
 
 #include <nudb/detail/arena.hpp>
 #include <nudb/detail/bucket.hpp>
-#include <boost/iterator/transform_iterator.hpp>
 #include <algorithm>
+#include <cstddef>
 #include <cstdint>
+#include <iterator>
+#include <limits>
+#include <memory>
 #include <utility>
 #include <vector>
-#include <unordered_map>
 
 namespace nudb {
 namespace detail {
 
 // Associative container storing
 // bucket blobs keyed by bucket index.
+//
+// Bucket indexes are dense, so they are looked up
+// directly in a table of fixed size pages, allocated
+// as buckets are added. Iteration visits the buckets
+// in increasing order of bucket index, skipping
+// empty pages. Pages are kept when the cache is
+// cleared, and only the slots in use are reset, so
+// a cache reused by each commit stops allocating;
+// shrink_to_fit frees the empty pages.
 template <class = void>
 class cache_t
 {
@@ -29,84 +40,80 @@ public:
     using value_type = std::pair<
         std::size_t, bucket>;
 
+    class iterator;
+
 private:
     enum
     {
         // The arena's alloc size will be this
         // multiple of the block size.
-        factor = 64
-    };
-
-    using map_type = std::unordered_map <
-        std::size_t, void*>;
-
-    struct transform
-    {
-        using argument_type =
-            typename map_type::value_type;
-        using result_type = value_type;
-
-        cache_t* cache_;
-
-        transform()
-            : cache_ (nullptr)
-        {
-        }
-
-        explicit
-        transform (cache_t& cache)
-            : cache_ (&cache)
-        {
-        }
+        factor = 64,
 
-        value_type
-        operator() (argument_type const& e) const
-        {
-            return std::make_pair(e.first,
-                bucket (cache_->block_size_,
-                    e.second));
-        }
+        // Each page holds 2^page_bits buckets
+        page_bits = 8,
+        page_size = 1 << page_bits
     };
 
+    using page_type = std::unique_ptr<void*[]>;
+
     std::size_t key_size_;
     std::size_t block_size_;
+    std::size_t inline_bytes_;
+    std::size_t page_count_ = 0;        // allocated pages
     arena arena_;
-    map_type map_;
+    std::vector<page_type> pages_;
+    std::vector<std::uint16_t> counts_; // used slots per page
+    std::vector<std::size_t> used_;     // buckets held
 
 public:
-    using iterator = boost::transform_iterator<
-        transform, typename map_type::iterator,
-            value_type, value_type>;
-
     cache_t (cache_t const&) = delete;
     cache_t& operator= (cache_t const&) = delete;
 
     cache_t();
 
+    // See arena_t for high_water and huge_pages
     explicit
     cache_t (std::size_t key_size,
-        std::size_t block_size);
+        std::size_t block_size,
+            std::size_t inline_bytes = 0,
+                std::size_t high_water = 0,
+                    bool huge_pages = false);
 
     cache_t& operator= (cache_t&& other);
 
     iterator
     begin()
     {
-        return iterator(map_.begin(),
-            transform(*this));
+        return iterator(*this, next(0));
     }
 
     iterator
     end()
     {
-        return iterator(map_.end(),
-            transform(*this));
+        return iterator(*this, npos());
+    }
+
+    std::size_t
+    size() const
+    {
+        return used_.size();
     }
 
     bool
     empty() const
     {
-        return map_.empty();
+        return used_.empty();
+    }
+
+    // Returns about the bytes of memory held
+    std::size_t
+    memory() const
+    {
+        return arena_.size() +
+            pages_.capacity() * sizeof(page_type) +
+            counts_.capacity() * sizeof(std::uint16_t) +
+            page_count_ * page_size * sizeof(void*) +
+            used_.capacity() * sizeof(std::size_t);
     }
 
     void
@@ -132,6 +139,115 @@ public:
     friend
     void
     swap (cache_t<U>& lhs, cache_t<U>& rhs);
+
+private:
+    static
+    std::size_t
+    npos()
+    {
+        return std::numeric_limits<std::size_t>::max();
+    }
+
+    // Returns the blob of bucket n, or nullptr
+    void*
+    get (std::size_t n) const
+    {
+        auto const i = n >> page_bits;
+        if (i >= pages_.size() || ! pages_[i])
+            return nullptr;
+        return pages_[i][n & (page_size - 1)];
+    }
+
+    // Returns the slot for bucket n, adding pages
+    void*&
+    slot (std::size_t n);
+
+    // Makes p the blob of bucket n, whose slot s was empty
+    void
+    fill (std::size_t n, void*& s, void* p);
+
+    // Returns the first bucket at or after n, or npos
+    std::size_t
+    next (std::size_t n) const;
+};
+
+template <class _>
+class cache_t<_>::iterator
+{
+private:
+    friend class cache_t;
+
+    struct pointer_type
+    {
+        value_type v;
+
+        value_type const*
+        operator->() const
+        {
+            return &v;
+        }
+    };
+
+    cache_t* cache_ = nullptr;
+    std::size_t n_ = 0;
+
+    iterator (cache_t& cache, std::size_t n)
+        : cache_ (&cache)
+        , n_ (n)
+    {
+    }
+
+public:
+    using iterator_category = std::forward_iterator_tag;
+    using value_type = typename cache_t::value_type;
+    using difference_type = std::ptrdiff_t;
+    using pointer = pointer_type;
+    using reference = value_type;
+
+    iterator() = default;
+    iterator (iterator const&) = default;
+    iterator& operator= (iterator const&) = default;
+
+    bool
+    operator== (iterator const& other) const
+    {
+        return n_ == other.n_;
+    }
+
+    bool
+    operator!= (iterator const& other) const
+    {
+        return n_ != other.n_;
+    }
+
+    reference
+    operator*() const
+    {
+        return std::make_pair(n_, bucket(
+            cache_->block_size_, cache_->get(n_),
+                cache_->inline_bytes_));
+    }
+
+    pointer
+    operator->() const
+    {
+        return pointer{**this};
+    }
+
+    iterator&
+    operator++()
+    {
+        n_ = cache_->next(n_ + 1);
+        return *this;
+    }
+
+    iterator
+    operator++(int)
+    {
+        auto const prev = *this;
+        ++(*this);
+        return prev;
+    }
 };
 
 // Constructs a cache that will never have inserts
@@ -139,16 +255,19 @@ template <class _>
 cache_t<_>::cache_t()
     : key_size_ (0)
     , block_size_ (0)
-    , arena_ (32) // arbitrary small number
+    , inline_bytes_ (0)
+    , arena_ (64) // arbitrary small number
 {
 }
 
 template <class _>
 cache_t<_>::cache_t (std::size_t key_size,
-    std::size_t block_size)
+    std::size_t block_size, std::size_t inline_bytes,
+        std::size_t high_water, bool huge_pages)
     : key_size_ (key_size)
     , block_size_ (block_size)
-    , arena_ (block_size * factor)
+    , inline_bytes_ (inline_bytes)
+    , arena_ (block_size * factor, high_water, huge_pages)
 {
 }
 
@@ -157,7 +276,14 @@ cache_t<_>&
 cache_t<_>::operator=(cache_t&& other)
 {
     arena_ = std::move(other.arena_);
-    map_ = std::move(other.map_);
+    pages_ = std::move(other.pages_);
+    counts_ = std::move(other.counts_);
+    used_ = std::move(other.used_);
+    page_count_ = other.page_count_;
+    other.pages_.clear();
+    other.counts_.clear();
+    other.used_.clear();
+    other.page_count_ = 0;
     return *this;
 }
 
@@ -166,7 +292,13 @@ void
 cache_t<_>::clear()
 {
     arena_.clear();
-    map_.clear();
+    for (auto const n : used_)
+    {
+        auto const i = n >> page_bits;
+        pages_[i][n & (page_size - 1)] = nullptr;
+        counts_[i] = 0;
+    }
+    used_.clear();
 }
 
 template <class _>
@@ -174,6 +306,20 @@ void
 cache_t<_>::shrink_to_fit()
 {
     arena_.shrink_to_fit();
+    for (std::size_t i = 0; i < pages_.size(); ++i)
+        if (pages_[i] && counts_[i] == 0)
+        {
+            pages_[i].reset();
+            --page_count_;
+        }
+    auto n = pages_.size();
+    while (n > 0 && ! pages_[n - 1])
+        --n;
+    pages_.resize(n);
+    counts_.resize(n);
+    pages_.shrink_to_fit();
+    counts_.shrink_to_fit();
+    used_.shrink_to_fit();
 }
 
 template <class _>
@@ -181,12 +327,9 @@ auto
 cache_t<_>::find (std::size_t n) ->
     iterator
 {
-    auto const iter = map_.find(n);
-    if (iter == map_.end())
-        return iterator (map_.end(),
-            transform(*this));
-    return iterator (iter,
-        transform(*this));
+    if (! get(n))
+        return end();
+    return iterator(*this, n);
 }
 
 template <class _>
@@ -194,9 +337,13 @@ bucket
 cache_t<_>::create (std::size_t n)
 {
     auto const p = arena_.alloc (block_size_);
-    map_.emplace (n, p);
+    auto& s = slot(n);
+    if (s)
+        s = p;
+    else
+        fill(n, s, p);
     return bucket (block_size_,
-        p, detail::empty);
+        p, detail::empty, inline_bytes_);
 }
 
 template <class _>
@@ -205,13 +352,64 @@ cache_t<_>::insert (std::size_t n,
     bucket const& b) ->
         iterator
 {
+    auto& s = slot(n);
+    if (s)
+        return iterator(*this, n);
     void* const p = arena_.alloc(
         b.block_size());
     ostream os(p, b.block_size());
     b.write(os);
-    auto const result = map_.emplace(n, p);
-    return iterator(result.first,
-        transform(*this));
+    fill(n, s, p);
+    return iterator(*this, n);
+}
+
+template <class _>
+void*&
+cache_t<_>::slot (std::size_t n)
+{
+    auto const i = n >> page_bits;
+    if (i >= pages_.size())
+    {
+        pages_.resize(i + 1);
+        counts_.resize(i + 1);
+    }
+    auto& page = pages_[i];
+    if (! page)
+    {
+        page.reset(new void*[page_size]);
+        std::fill(page.get(),
+            page.get() + page_size, nullptr);
+        ++page_count_;
+    }
+    return page[n & (page_size - 1)];
+}
+
+template <class _>
+void
+cache_t<_>::fill (std::size_t n, void*& s, void* p)
+{
+    s = p;
+    ++counts_[n >> page_bits];
+    used_.push_back(n);
+}
+
+template <class _>
+std::size_t
+cache_t<_>::next (std::size_t n) const
+{
+    for (auto i = n >> page_bits;
+        i < pages_.size(); ++i)
+    {
+        auto const& page = pages_[i];
+        if (counts_[i] == 0)
+            continue;
+        auto j = (i == (n >> page_bits)) ?
+            (n & (page_size - 1)) : 0;
+        for (; j < page_size; ++j)
+            if (page[j])
+                return (i << page_bits) + j;
+    }
+    return npos();
 }
 
 template <class U>
@@ -221,8 +419,12 @@ swap (cache_t<U>& lhs, cache_t<U>& rhs)
     using std::swap;
     swap(lhs.key_size_, rhs.key_size_);
     swap(lhs.block_size_, rhs.block_size_);
+    swap(lhs.inline_bytes_, rhs.inline_bytes_);
+    swap(lhs.page_count_, rhs.page_count_);
     swap(lhs.arena_, rhs.arena_);
-    swap(lhs.map_, rhs.map_);
+    swap(lhs.pages_, rhs.pages_);
+    swap(lhs.counts_, rhs.counts_);
+    swap(lhs.used_, rhs.used_);
 }
 
 using cache = cache_t<>;
@@ -0,0 +1,243 @@
+//
+// Copyright (c) 2015-2016 Vinnie Falco (vinnie dot falco at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef NUDB_DETAIL_EPOCH_HPP
+#define NUDB_DETAIL_EPOCH_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <thread>
+
+namespace nudb {
+namespace detail {
+
+//  Reader/writer lock with reader epochs
+//
+//  Readers never write a cache line which another thread
+//  writes. Each thread is handed one of a power of two
+//  number of slots, in turn, so threads only share a slot
+//  when there are more of them than slots. A reader counts
+//  itself in its slot, then checks that no writer is active.
+//  A writer marks itself active, then waits for every slot
+//  to empty. Reads cost one uncontended atomic add, while a
+//  write costs a scan of the slots.
+//
+//  Readers also count themselves in an epoch, which meets
+//  the GenerationLockable requirements of genlock: start
+//  begins a new epoch, and finish waits until no reader of
+//  an earlier one remains. Their counts are kept in the
+//  slots too, by the parity of the epoch.
+//
+//  Locks must be released by the thread which took them.
+//  Readers must take the epoch while holding the shared
+//  lock, and start must be called holding the unique lock,
+//  so that no reader can see the old epoch after start.
+//
+template <class = void>
+class epoch_t
+{
+private:
+    enum
+    {
+        // Bytes per slot, the size of a cache line
+        line_size = 64,
+
+        // Limits on the number of slots
+        min_slots = 8,
+        max_slots = 256
+    };
+
+    struct slot
+    {
+        std::atomic<std::size_t> readers;   // holding the lock
+        std::atomic<std::size_t> epochs[2]; // by epoch parity
+        std::uint8_t pad[line_size -
+            3 * sizeof(std::atomic<std::size_t>)];
+    };
+
+    static_assert(sizeof(slot) == line_size, "");
+
+    std::unique_ptr<std::uint8_t[]> buf_;
+    slot* slots_;
+    std::size_t mask_;
+    std::atomic<bool> writer_ {false};
+    std::atomic<std::size_t> epoch_ {0};
+    std::mutex m_;                          // held by the writer
+
+public:
+    epoch_t (epoch_t const&) = delete;
+    epoch_t& operator= (epoch_t const&) = delete;
+
+    epoch_t();
+
+    // Shared lock
+
+    void
+    lock_shared();
+
+    void
+    unlock_shared()
+    {
+        this_slot().readers.fetch_sub(
+            1, std::memory_order_release);
+    }
+
+    // Unique lock
+
+    void
+    lock();
+
+    void
+    unlock()
+    {
+        writer_.store(false);
+        m_.unlock();
+    }
+
+    // Epochs
+
+    std::size_t
+    lock_gen()
+    {
+        auto const e = epoch_.load(
+            std::memory_order_acquire);
+        this_slot().epochs[e & 1].fetch_add(
+            1, std::memory_order_relaxed);
+        return e;
+    }
+
+    void
+    unlock_gen (std::size_t e)
+    {
+        this_slot().epochs[e & 1].fetch_sub(
+            1, std::memory_order_release);
+    }
+
+    void
+    start()
+    {
+        epoch_.fetch_add(1, std::memory_order_release);
+    }
+
+    void
+    finish();
+
+private:
+    slot&
+    this_slot()
+    {
+        static std::atomic<std::size_t> next {0};
+        static thread_local std::size_t const i =
+            next.fetch_add(1, std::memory_order_relaxed);
+        return slots_[i & mask_];
+    }
+
+    // Waits for pred to return `true`, yielding at first
+    // and then sleeping, for readers doing I/O.
+    template <class Predicate>
+    static
+    void
+    wait (Predicate&& pred)
+    {
+        for (std::size_t i = 0; ! pred(); ++i)
+        {
+            if (i < 64)
+                std::this_thread::yield();
+            else
+                std::this_thread::sleep_for(
+                    std::chrono::microseconds(50));
+        }
+    }
+};
+
+template <class _>
+epoch_t<_>::epoch_t()
+{
+    std::size_t n = min_slots;
+    while (n < max_slots &&
+            n < std::thread::hardware_concurrency())
+        n *= 2;
+    mask_ = n - 1;
+    // Slots start on a cache line boundary
+    buf_.reset(new std::uint8_t[(n + 1) * line_size]);
+    auto const p = reinterpret_cast<std::uintptr_t>(
+        buf_.get());
+    slots_ = reinterpret_cast<slot*>(
+        (p + line_size - 1) & ~std::uintptr_t(line_size - 1));
+    for (std::size_t i = 0; i < n; ++i)
+    {
+        auto const s = new (&slots_[i]) slot;
+        s->readers.store(0, std::memory_order_relaxed);
+        s->epochs[0].store(0, std::memory_order_relaxed);
+        s->epochs[1].store(0, std::memory_order_relaxed);
+    }
+}
+
+template <class _>
+void
+epoch_t<_>::lock_shared()
+{
+    auto& s = this_slot();
+    // Pairs with the store and scan in lock, so either
+    // the writer sees this reader or this reader sees
+    // the writer.
+    s.readers.fetch_add(1);
+    if (! writer_.load())
+        return;
+    s.readers.fetch_sub(1, std::memory_order_relaxed);
+    // A writer is only active while it holds m_, so
+    // waiting for m_ also keeps the next writer out
+    // until this reader is counted.
+    std::lock_guard<std::mutex> l (m_);
+    s.readers.fetch_add(1, std::memory_order_relaxed);
+}
+
+template <class _>
+void
+epoch_t<_>::lock()
+{
+    m_.lock();
+    writer_.store(true);
+    for (std::size_t i = 0; i <= mask_; ++i)
+    {
+        auto& s = slots_[i];
+        wait([&s]
+            {
+                return s.readers.load() == 0;
+            });
+    }
+}
+
+template <class _>
+void
+epoch_t<_>::finish()
+{
+    auto const e = (epoch_.load(
+        std::memory_order_relaxed) - 1) & 1;
+    for (std::size_t i = 0; i <= mask_; ++i)
+    {
+        auto& s = slots_[i];
+        wait([&s, e]
+            {
+                return s.epochs[e].load(
+                    std::memory_order_acquire) == 0;
+            });
+    }
+}
+
+using epoch = epoch_t<>;
+
+} // detail
+} // nudb
+
+#endif
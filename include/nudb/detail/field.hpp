@@ -11,6 +11,7 @@
 #include <nudb/detail/stream.hpp>
 #include <cstddef>
 #include <cstdint>
+#include <cstring>
 #include <stdexcept>
 #include <type_traits>
 
@@ -160,6 +161,32 @@ readp (void const* v, U& u)
     u = t;
 }
 
+// Read a uint48_t field with a single unaligned load.
+// The two bytes before the field are also loaded, so
+// they must be readable.
+//
+inline
+std::uint64_t
+readp_wide48 (void const* v)
+{
+#if defined(_MSC_VER) || (defined(__BYTE_ORDER__) && \
+    __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+    std::uint64_t t;
+    std::memcpy(&t, reinterpret_cast<
+        std::uint8_t const*>(v) - 2, sizeof(t));
+# ifdef _MSC_VER
+    t = _byteswap_uint64(t);
+# else
+    t = __builtin_bswap64(t);
+# endif
+    return t & 0xffffffffffffULL;
+#else
+    std::uint64_t t;
+    readp<uint48_t>(v, t);
+    return t;
+#endif
+}
+
 // read field from istream
 
 template <class T, class U>
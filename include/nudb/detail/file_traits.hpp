@@ -0,0 +1,311 @@
+//
+// Copyright (c) 2015-2016 Vinnie Falco (vinnie dot falco at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef NUDB_DETAIL_FILE_TRAITS_HPP
+#define NUDB_DETAIL_FILE_TRAITS_HPP
+
+#include <nudb/common.hpp>
+#include <cstddef>
+#include <type_traits>
+#include <utility>
+
+namespace nudb {
+namespace detail {
+
+// Optional extensions to the File concept are detected
+// here, so that store can use them when they are present
+// and fall back to the plain File interface otherwise.
+
+template <class...>
+struct make_void
+{
+    using type = void;
+};
+
+template <class... Ts>
+using void_t = typename make_void<Ts...>::type;
+
+// `true` if File provides direct access to its bytes:
+//
+//      void const* data (std::size_t offset, std::size_t bytes);
+//
+// which returns a pointer to the bytes at offset that stays
+// valid until the file is closed, or nullptr if the range is
+// not available.
+//
+template <class File, class = void>
+struct is_mapped_file : std::false_type
+{
+};
+
+template <class File>
+struct is_mapped_file<File, void_t<decltype(
+    std::declval<void const*&>() = std::declval<File&>().data(
+        std::declval<std::size_t>(), std::declval<std::size_t>()))>>
+    : std::true_type
+{
+};
+
+template <class File>
+void const*
+file_data (File& f, std::size_t offset,
+    std::size_t bytes, std::true_type)
+{
+    return f.data(offset, bytes);
+}
+
+template <class File>
+void const*
+file_data (File&, std::size_t,
+    std::size_t, std::false_type)
+{
+    return nullptr;
+}
+
+// Returns a pointer to the bytes at offset,
+// or nullptr if File does not provide one.
+//
+template <class File>
+void const*
+file_data (File& f, std::size_t offset, std::size_t bytes)
+{
+    return file_data(f, offset, bytes,
+        is_mapped_file<File>{});
+}
+
+//------------------------------------------------------------------------------
+
+// `true` if File can issue several transfers at once:
+//
+//      void read_batch (file_request const* r, std::size_t n);
+//      void write_batch (file_request const* r, std::size_t n);
+//
+// Each request is completed in full or an exception is thrown.
+//
+template <class File, class = void>
+struct is_batch_file : std::false_type
+{
+};
+
+template <class File>
+struct is_batch_file<File, void_t<
+    decltype(std::declval<File&>().read_batch(
+        std::declval<file_request const*>(),
+            std::declval<std::size_t>())),
+    decltype(std::declval<File&>().write_batch(
+        std::declval<file_request const*>(),
+            std::declval<std::size_t>()))>>
+    : std::true_type
+{
+};
+
+template <class File>
+void
+read_batch (File& f, file_request const* r,
+    std::size_t n, std::true_type)
+{
+    f.read_batch(r, n);
+}
+
+template <class File>
+void
+read_batch (File& f, file_request const* r,
+    std::size_t n, std::false_type)
+{
+    for (std::size_t i = 0; i < n; ++i)
+        f.read(r[i].offset, r[i].data, r[i].bytes);
+}
+
+template <class File>
+void
+write_batch (File& f, file_request const* r,
+    std::size_t n, std::true_type)
+{
+    f.write_batch(r, n);
+}
+
+template <class File>
+void
+write_batch (File& f, file_request const* r,
+    std::size_t n, std::false_type)
+{
+    for (std::size_t i = 0; i < n; ++i)
+        f.write(r[i].offset, r[i].data, r[i].bytes);
+}
+
+// Perform a batch of reads, one at a time
+// if File does not support batches.
+//
+template <class File>
+void
+read_batch (File& f,
+    file_request const* r, std::size_t n)
+{
+    read_batch(f, r, n, is_batch_file<File>{});
+}
+
+// Perform a batch of writes, one at a time
+// if File does not support batches.
+//
+template <class File>
+void
+write_batch (File& f,
+    file_request const* r, std::size_t n)
+{
+    write_batch(f, r, n, is_batch_file<File>{});
+}
+
+//------------------------------------------------------------------------------
+
+// `true` if File can control which of its pages stay in memory:
+//
+//      void prefetch (std::size_t offset, std::size_t bytes);
+//      bool lock (std::size_t offset, std::size_t bytes);
+//
+// prefetch is a hint that the range will be read soon. lock
+// keeps the range in memory until the file is closed, and
+// returns `false` if the system does not allow it.
+//
+template <class File, class = void>
+struct is_lockable_file : std::false_type
+{
+};
+
+template <class File>
+struct is_lockable_file<File, void_t<
+    decltype(std::declval<File&>().prefetch(
+        std::declval<std::size_t>(),
+            std::declval<std::size_t>())),
+    decltype(std::declval<bool&>() =
+        std::declval<File&>().lock(
+            std::declval<std::size_t>(),
+                std::declval<std::size_t>()))>>
+    : std::true_type
+{
+};
+
+template <class File>
+void
+file_prefetch (File& f, std::size_t offset,
+    std::size_t bytes, std::true_type)
+{
+    f.prefetch(offset, bytes);
+}
+
+template <class File>
+void
+file_prefetch (File&, std::size_t,
+    std::size_t, std::false_type)
+{
+}
+
+template <class File>
+bool
+file_lock (File& f, std::size_t offset,
+    std::size_t bytes, std::true_type)
+{
+    return f.lock(offset, bytes);
+}
+
+template <class File>
+bool
+file_lock (File&, std::size_t,
+    std::size_t, std::false_type)
+{
+    return false;
+}
+
+// Hint that a range will be read soon,
+// if File supports it.
+//
+template <class File>
+void
+file_prefetch (File& f,
+    std::size_t offset, std::size_t bytes)
+{
+    file_prefetch(f, offset, bytes,
+        is_lockable_file<File>{});
+}
+
+// Keep a range in memory. Returns `false` if File
+// does not support it or the system refuses.
+//
+template <class File>
+bool
+file_lock (File& f,
+    std::size_t offset, std::size_t bytes)
+{
+    return file_lock(f, offset, bytes,
+        is_lockable_file<File>{});
+}
+
+//------------------------------------------------------------------------------
+
+// `true` if File can sync to a chosen level:
+//
+//      void sync (durability level);
+//
+template <class File, class = void>
+struct is_durability_file : std::false_type
+{
+};
+
+template <class File>
+struct is_durability_file<File, void_t<decltype(
+    std::declval<File&>().sync(std::declval<durability>()))>>
+    : std::true_type
+{
+};
+
+template <class File>
+void
+file_sync (File& f, durability level, std::true_type)
+{
+    f.sync(level);
+}
+
+template <class File>
+void
+file_sync (File& f, durability level, std::false_type)
+{
+    if (level != durability::none)
+        f.sync();
+}
+
+// Sync to the given level. Files without levels
+// do a full sync unless the level is none.
+//
+template <class File>
+void
+file_sync (File& f, durability level)
+{
+    file_sync(f, level, is_durability_file<File>{});
+}
+
+//------------------------------------------------------------------------------
+
+// `true` if File can copy its bytes to a descriptor:
+//
+//      void copy_to (int fd, std::size_t offset, std::size_t bytes);
+//
+template <class File, class = void>
+struct is_copyable_file : std::false_type
+{
+};
+
+template <class File>
+struct is_copyable_file<File, void_t<decltype(
+    std::declval<File&>().copy_to(std::declval<int>(),
+        std::declval<std::size_t>(), std::declval<std::size_t>()))>>
+    : std::true_type
+{
+};
+
+} // detail
+} // nudb
+
+#endif
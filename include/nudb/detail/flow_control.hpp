@@ -0,0 +1,186 @@
+//
+// Copyright (c) 2015-2016 Vinnie Falco (vinnie dot falco at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef NUDB_DETAIL_FLOW_CONTROL_HPP
+#define NUDB_DETAIL_FLOW_CONTROL_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <thread>
+
+namespace nudb {
+namespace detail {
+
+/*  Throttles inserts so that commits take a target time.
+
+    Each commit reports how many pool bytes it wrote and
+    how long it took, giving a smoothed commit rate. The
+    budget is the pool size which commits in the target
+    time at that rate.
+
+    While the pool is under budget inserts are not delayed.
+    Above it, each insert is charged a delay proportional
+    to its size, ramping up so that at twice the budget
+    inserts arrive no faster than commits drain them.
+
+    The delays form one schedule shared by all inserting
+    threads: each insert moves the earliest time of the
+    next one on by its own delay, then sleeps until that
+    time if it is at least `min_sleep` ahead, so single
+    inserts stay cheap. However many threads insert, they
+    are paced at the rate of one.
+
+    The hard limit, when not zero, still blocks inserts
+    until a commit finishes.
+*/
+template <class = void>
+class flow_control_t
+{
+private:
+    using clock_type = std::chrono::steady_clock;
+
+    // Smallest sleep, in nanoseconds
+    static std::int64_t constexpr min_sleep = 1000000;
+
+    std::size_t limit_;
+    std::chrono::nanoseconds target_;
+    float smoothing_;
+    std::atomic<std::uint64_t> rate_;   // bytes per second
+    std::atomic<std::int64_t> next_;    // nanoseconds, clock_type
+
+public:
+    flow_control_t (flow_control_t const&) = delete;
+    flow_control_t& operator= (flow_control_t const&) = delete;
+
+    /** Create the controller.
+
+        @param limit Pool size at which inserts block,
+        or 0 for no limit.
+
+        @param target Commit duration to aim for, or
+        zero to disable throttling.
+
+        @param smoothing Weight of the newest commit
+        in the measured rate, between 0 and 1.
+    */
+    flow_control_t (std::size_t limit,
+        std::chrono::nanoseconds target, float smoothing)
+        : limit_ (limit)
+        , target_ (target)
+        , smoothing_ (std::min(1.f, std::max(0.f, smoothing)))
+        , rate_ (0)
+        , next_ (0)
+    {
+    }
+
+    // Pool size at which inserts block
+    std::size_t
+    limit() const
+    {
+        return limit_;
+    }
+
+    // Smoothed commit rate in bytes per second,
+    // or 0 before the first commit.
+    std::uint64_t
+    rate() const
+    {
+        return rate_.load();
+    }
+
+    // Pool size which commits in the target
+    // time, or 0 if not yet known.
+    std::size_t
+    budget() const;
+
+    // Record a commit of `bytes` taking `elapsed`
+    void
+    on_commit (std::size_t bytes,
+        clock_type::duration elapsed);
+
+    // Charge an insert of `bytes` made with the pool
+    // at `pool` bytes, sleeping until its turn.
+    // Must be called without holding any locks.
+    void
+    throttle (std::size_t bytes, std::size_t pool);
+};
+
+template <class _>
+std::int64_t constexpr flow_control_t<_>::min_sleep;
+
+template <class _>
+std::size_t
+flow_control_t<_>::budget() const
+{
+    using namespace std::chrono;
+    auto const rate = rate_.load();
+    if (rate == 0 || target_.count() <= 0)
+        return 0;
+    auto const b = static_cast<double>(rate) *
+        duration_cast<duration<double>>(target_).count();
+    if (limit_ > 0 && b >= limit_)
+        return limit_ / 2;
+    return std::max<std::size_t>(1,
+        static_cast<std::size_t>(b));
+}
+
+template <class _>
+void
+flow_control_t<_>::on_commit (std::size_t bytes,
+    clock_type::duration elapsed)
+{
+    using namespace std::chrono;
+    auto const seconds = duration_cast<
+        duration<double>>(elapsed).count();
+    if (bytes == 0 || seconds <= 0)
+        return;
+    auto const sample = bytes / seconds;
+    auto const rate = rate_.load();
+    rate_.store(static_cast<std::uint64_t>(rate == 0 ?
+        sample : smoothing_ * sample +
+            (1 - smoothing_) * rate));
+}
+
+template <class _>
+void
+flow_control_t<_>::throttle (
+    std::size_t bytes, std::size_t pool)
+{
+    auto const budget = this->budget();
+    auto const rate = rate_.load();
+    if (budget == 0 || rate == 0 || pool <= budget)
+        return;
+    auto const ramp = std::min(1.0,
+        static_cast<double>(pool - budget) / budget);
+    auto const ns = static_cast<std::int64_t>(
+        ramp * 1e9 * bytes / rate);
+    auto const now = std::chrono::duration_cast<
+        std::chrono::nanoseconds>(clock_type::now(
+            ).time_since_epoch()).count();
+    // A schedule fallen behind restarts from now,
+    // so idle time is not saved up as a burst.
+    auto next = next_.load();
+    std::int64_t until;
+    do
+    {
+        until = std::max(next, now) + ns;
+    }
+    while (! next_.compare_exchange_weak(next, until));
+    if (until - now >= min_sleep)
+        std::this_thread::sleep_for(
+            std::chrono::nanoseconds(until - now));
+}
+
+using flow_control = flow_control_t<>;
+
+} // detail
+} // nudb
+
+#endif
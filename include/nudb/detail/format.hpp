@@ -27,6 +27,14 @@ namespace detail {
 
 static std::size_t constexpr currentVersion = 2;
 
+// Version of key files whose bucket entries
+// carry small values inline.
+static std::size_t constexpr inlineVersion = 3;
+
+// Version of log files whose header holds the split
+// credit of the key file before the commit.
+static std::size_t constexpr creditVersion = 3;
+
 struct dat_file_header
 {
     static std::size_t constexpr size =
@@ -58,8 +66,10 @@ struct key_file_header
         8 +     // Pepper
         2 +     // BlockSize
         2 +     // LoadFactor
+        2 +     // InlineSize
+        8 +     // SplitCredit
 
-        56;     // (Reserved)
+        46;     // (Reserved)
 
     char type[8];
     std::size_t version;
@@ -71,8 +81,14 @@ struct key_file_header
     std::uint64_t pepper;
     std::size_t block_size;
     std::size_t load_factor;
+    std::size_t inline_size = 0;
+
+    // Buckets split before the keys needed them, which
+    // the next inserts use up in place of splitting.
+    std::uint64_t split_credit = 0;
 
     // Computed values
+    std::size_t inline_bytes;   // extra bytes per bucket entry
     std::size_t capacity;
     std::size_t bucket_size;
     std::size_t buckets;
@@ -93,7 +109,11 @@ struct log_file_header
         2 +     // BlockSize
 
         8 +     // KeyFileSize
-        8;      // DataFileSize
+        8 +     // DataFileSize
+        8;      // SplitCredit, since creditVersion
+
+    // Size of the header of earlier versions
+    static std::size_t constexpr base_size = size - 8;
 
     char type[8];
     std::size_t version;
@@ -105,12 +125,27 @@ struct log_file_header
     std::size_t block_size;
     std::size_t key_file_size;
     std::size_t dat_file_size;
+    std::uint64_t split_credit = 0;
+
+    // Returns the offset of the first log record
+    std::size_t
+    header_size() const
+    {
+        return version >= creditVersion ? size : base_size;
+    }
 };
 
 // Type used to store hashes in buckets.
 // This can be smaller than the output
 // of the hash function.
 //
+// The 48 bits stored are enough to act as a key
+// fingerprint: a bucket holding n entries matches an
+// absent key's hash with probability about n / 2^48,
+// so a data file read for a matching hash almost always
+// finds the key. The Hasher must produce at least 64
+// bits, or fewer than 48 of these bits carry hash.
+//
 using hash_t = uint48_t;
 
 static_assert(field<hash_t>::size <=
@@ -137,6 +172,8 @@ std::size_t
 hash (void const* key,
     std::size_t key_size, std::size_t salt)
 {
+    static_assert(sizeof(typename Hasher::result_type) >=
+        sizeof(std::uint64_t), "Hasher must produce 64 bits");
     Hasher h (salt);
     h (key, key_size);
     return make_hash<hash_t>(static_cast<
@@ -154,12 +191,26 @@ pepper (std::size_t salt)
     return static_cast<std::size_t>(h);
 }
 
+// Returns the size of the inline field of each bucket
+// entry, which holds the key followed by the value when
+// the value is no larger than inline_size.
+//
+inline
+std::size_t
+inline_bytes (std::size_t key_size,
+    std::size_t inline_size)
+{
+    return inline_size > 0 ?
+        key_size + inline_size : 0;
+}
+
 // Returns the actual size of a bucket.
 // This can be smaller than the block size.
 //
 template <class = void>
 std::size_t
-bucket_size (std::size_t capacity)
+bucket_size (std::size_t capacity,
+    std::size_t inline_bytes = 0)
 {
     // Bucket Record
     return
@@ -168,14 +219,16 @@ bucket_size (std::size_t capacity)
         capacity * (
             field<uint48_t>::size +     // Offset
             field<uint48_t>::size +     // Size
-            field<hash_t>::size);       // Hash
+            field<hash_t>::size +       // Hash
+            inline_bytes);              // Inline
 }
 
 // Returns the number of entries that fit in a bucket
 //
 template <class = void>
 std::size_t
-bucket_capacity (std::size_t block_size)
+bucket_capacity (std::size_t block_size,
+    std::size_t inline_bytes = 0)
 {
     // Bucket Record
     auto const size =
@@ -184,7 +237,8 @@ bucket_capacity (std::size_t block_size)
     auto const entry_size =
         field<uint48_t>::size +         // Offset
         field<uint48_t>::size +         // Size
-        field<hash_t>::size;            // Hash
+        field<hash_t>::size +           // Hash
+        inline_bytes;                   // Inline
     if (block_size < key_file_header::size ||
         block_size < size)
         return 0;
@@ -312,14 +366,20 @@ read (istream& is, std::size_t file_size,
     read<std::uint64_t>(is, kh.pepper);
     read<std::uint16_t>(is, kh.block_size);
     read<std::uint16_t>(is, kh.load_factor);
-    std::array <std::uint8_t, 56> reserved;
+    read<std::uint16_t>(is, kh.inline_size);
+    read<std::uint64_t>(is, kh.split_credit);
+    std::array <std::uint8_t, 46> reserved;
     read (is,
         reserved.data(), reserved.size());
 
     // VFALCO These need to be checked to handle
     //        when the file size is too small
-    kh.capacity = bucket_capacity(kh.block_size);
-    kh.bucket_size = bucket_size(kh.capacity);
+    kh.inline_bytes = inline_bytes(
+        kh.key_size, kh.inline_size);
+    kh.capacity = bucket_capacity(
+        kh.block_size, kh.inline_bytes);
+    kh.bucket_size = bucket_size(
+        kh.capacity, kh.inline_bytes);
     if (file_size > kh.block_size)
     {
         // VFALCO This should be handled elsewhere.
@@ -373,7 +433,9 @@ write (ostream& os, key_file_header const& kh)
     write<std::uint64_t>(os, kh.pepper);
     write<std::uint16_t>(os, kh.block_size);
     write<std::uint16_t>(os, kh.load_factor);
-    std::array <std::uint8_t, 56> reserved;
+    write<std::uint16_t>(os, kh.inline_size);
+    write<std::uint64_t>(os, kh.split_credit);
+    std::array <std::uint8_t, 46> reserved;
     reserved.fill (0);
     write (os,
         reserved.data(), reserved.size());
@@ -410,6 +472,10 @@ read (istream& is, log_file_header& lh)
     read<std::uint16_t>(is, lh.block_size);
     read<std::uint64_t>(is, lh.key_file_size);
     read<std::uint64_t>(is, lh.dat_file_size);
+    if (lh.version >= creditVersion)
+        read<std::uint64_t>(is, lh.split_credit);
+    else
+        lh.split_credit = 0;
 }
 
 // Read log file header from file
@@ -420,7 +486,16 @@ read (File& f, log_file_header& lh)
     std::array <std::uint8_t,
         log_file_header::size> buf;
     // Can throw file_short_read_error to callers
-    f.read (0, buf.data(), buf.size());
+    f.read (0, buf.data(), log_file_header::base_size);
+    // The version follows the type
+    std::size_t version;
+    istream vs (buf.data() + 8, field<std::uint16_t>::size);
+    read<std::uint16_t>(vs, version);
+    if (version >= creditVersion)
+        f.read (log_file_header::base_size,
+            buf.data() + log_file_header::base_size,
+                log_file_header::size -
+                    log_file_header::base_size);
     istream is(buf);
     read (is, lh);
 }
@@ -440,6 +515,8 @@ write (ostream& os, log_file_header const& lh)
     write<std::uint16_t>(os, lh.block_size);
     write<std::uint64_t>(os, lh.key_file_size);
     write<std::uint64_t>(os, lh.dat_file_size);
+    if (lh.version >= creditVersion)
+        write<std::uint64_t>(os, lh.split_credit);
 }
 
 // Write log file header to file
@@ -451,7 +528,7 @@ write (File& f, log_file_header const& lh)
         log_file_header::size> buf;
     ostream os (buf);
     write (os, lh);
-    f.write (0, buf.data(), buf.size());
+    f.write (0, buf.data(), lh.header_size());
 }
 
 template <class = void>
@@ -478,9 +555,18 @@ verify (key_file_header const& kh)
     if (type != "nudb.key")
         throw store_corrupt_error (
             "bad type in key file");
-    if (kh.version != currentVersion)
+    if (kh.version == inlineVersion)
+    {
+        if (kh.inline_size < 1)
+            throw store_corrupt_error (
+                "bad inline size in key file");
+    }
+    else if (kh.version != currentVersion ||
+        kh.inline_size != 0)
+    {
         throw store_corrupt_error (
             "bad version in key file");
+    }
     if (kh.key_size < 1)
         throw store_corrupt_error (
             "bad key size in key file");
@@ -506,7 +592,8 @@ verify (log_file_header const& lh)
     if (type != "nudb.log")
         throw store_corrupt_error (
             "bad type in log file");
-    if (lh.version != currentVersion)
+    if (lh.version != currentVersion &&
+            lh.version != creditVersion)
         throw store_corrupt_error (
             "bad version in log file");
     if (lh.pepper != pepper<Hasher>(lh.salt))
@@ -163,6 +163,7 @@ template <class G>
 genlock<G>::genlock (genlock&& other)
     : owned_ (other.owned_)
     , g_ (other.g_)
+    , gen_ (other.gen_)
 {
     other.owned_ = false;
     other.g_ = nullptr;
@@ -176,6 +177,7 @@ genlock<G>::operator= (genlock&& other)
         unlock();
     owned_ = other.owned_;
     g_ = other.g_;
+    gen_ = other.gen_;
     other.owned_ = false;
     other.g_ = nullptr;
     return *this;
@@ -251,6 +253,7 @@ swap (genlock<G>& lhs, genlock<G>& rhs) noexcept
     using namespace std;
     swap (lhs.owned_, rhs.owned_);
     swap (lhs.g_, rhs.g_);
+    swap (lhs.gen_, rhs.gen_);
 }
 
 } // detail
@@ -0,0 +1,219 @@
+//
+// Copyright (c) 2015-2016 Vinnie Falco (vinnie dot falco at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef NUDB_DETAIL_IO_WORKER_HPP
+#define NUDB_DETAIL_IO_WORKER_HPP
+
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <utility>
+
+namespace nudb {
+namespace detail {
+
+/*  Thread which performs file operations in order.
+
+    The commit thread posts writes and syncs here so that
+    the disk stays busy while it continues with work that
+    does not depend on them. An exception thrown by a task
+    is delivered by the next call to wait(), and tasks
+    posted after the failure are discarded.
+
+    A task posted with a job is tracked by that job alone:
+    wait(job) returns once it has run, throwing what it
+    threw, and it runs even after another task failed.
+*/
+template <class = void>
+class io_worker_t
+{
+public:
+    // Completion of a task posted with post(f, j)
+    struct job
+    {
+        bool done = true;
+        std::exception_ptr ep;
+    };
+
+private:
+    struct task
+    {
+        std::function<void(void)> f;
+        job* j;
+    };
+
+    std::mutex m_;
+    std::condition_variable cond_;
+    std::condition_variable idle_;
+    std::deque<task> q_;
+    std::exception_ptr ep_;
+    bool busy_ = false;
+    bool stop_ = false;
+    std::thread thread_;
+
+public:
+    io_worker_t (io_worker_t const&) = delete;
+    io_worker_t& operator= (io_worker_t const&) = delete;
+
+    io_worker_t();
+
+    ~io_worker_t();
+
+    // Queue a task for the worker
+    void
+    post (std::function<void(void)> f);
+
+    // Queue a task whose completion is tracked by j,
+    // which must not have a task pending already.
+    void
+    post (std::function<void(void)> f, job& j);
+
+    // Block until every posted task has finished.
+    // Throws the first exception thrown by a task
+    // posted without a job.
+    void
+    wait();
+
+    // Block until the task of j has finished.
+    // Throws the exception it threw, if any.
+    void
+    wait (job& j);
+
+private:
+    void
+    run();
+};
+
+template <class _>
+io_worker_t<_>::io_worker_t()
+    : thread_ (&io_worker_t::run, this)
+{
+}
+
+template <class _>
+io_worker_t<_>::~io_worker_t()
+{
+    {
+        std::lock_guard<std::mutex> l (m_);
+        stop_ = true;
+    }
+    cond_.notify_all();
+    thread_.join();
+}
+
+template <class _>
+void
+io_worker_t<_>::post (std::function<void(void)> f)
+{
+    {
+        std::lock_guard<std::mutex> l (m_);
+        q_.push_back({std::move(f), nullptr});
+    }
+    cond_.notify_all();
+}
+
+template <class _>
+void
+io_worker_t<_>::post (std::function<void(void)> f, job& j)
+{
+    {
+        std::lock_guard<std::mutex> l (m_);
+        j.done = false;
+        j.ep = nullptr;
+        q_.push_back({std::move(f), &j});
+    }
+    cond_.notify_all();
+}
+
+template <class _>
+void
+io_worker_t<_>::wait()
+{
+    std::unique_lock<std::mutex> l (m_);
+    idle_.wait(l,
+        [this]
+        {
+            return q_.empty() && ! busy_;
+        });
+    if (ep_)
+    {
+        auto ep = ep_;
+        ep_ = nullptr;
+        std::rethrow_exception(ep);
+    }
+}
+
+template <class _>
+void
+io_worker_t<_>::wait (job& j)
+{
+    std::unique_lock<std::mutex> l (m_);
+    idle_.wait(l,
+        [&j]
+        {
+            return j.done;
+        });
+    if (j.ep)
+    {
+        auto ep = j.ep;
+        j.ep = nullptr;
+        std::rethrow_exception(ep);
+    }
+}
+
+template <class _>
+void
+io_worker_t<_>::run()
+{
+    std::unique_lock<std::mutex> l (m_);
+    for(;;)
+    {
+        cond_.wait(l,
+            [this]
+            {
+                return stop_ || ! q_.empty();
+            });
+        if (q_.empty())
+            break;
+        auto t = std::move(q_.front());
+        q_.pop_front();
+        if (t.j || ! ep_)
+        {
+            busy_ = true;
+            l.unlock();
+            std::exception_ptr ep;
+            try
+            {
+                t.f();
+            }
+            catch(...)
+            {
+                ep = std::current_exception();
+            }
+            l.lock();
+            if (ep && t.j)
+                t.j->ep = ep;
+            else if (ep)
+                ep_ = ep;
+            busy_ = false;
+        }
+        if (t.j)
+            t.j->done = true;
+        if (t.j || q_.empty())
+            idle_.notify_all();
+    }
+}
+
+using io_worker = io_worker_t<>;
+
+} // detail
+} // nudb
+
+#endif
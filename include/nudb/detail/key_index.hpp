@@ -0,0 +1,142 @@
+//
+// Copyright (c) 2015-2016 Vinnie Falco (vinnie dot falco at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef NUDB_DETAIL_KEY_INDEX_HPP
+#define NUDB_DETAIL_KEY_INDEX_HPP
+
+#include <nudb/common.hpp>
+#include <nudb/detail/arena.hpp>
+#include <nudb/detail/bulkio.hpp>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+namespace nudb {
+namespace detail {
+
+/*  Copy of every bucket of the key file in memory.
+
+    The buckets are kept in one array, in key file order,
+    so a bucket is found at a fixed offset. The array is
+    allocated from an arena with huge pages, and grows by
+    doubling. An outgrown array is kept until the index is
+    destroyed, so a reader which loaded the old address
+    can still use it: buckets are only changed by commits,
+    which update the index once the readers of the old
+    view have drained, into whichever array is current.
+
+    Only the commit thread calls update.
+*/
+template <class = void>
+class key_index_t
+{
+private:
+    std::size_t const block_size_;
+    std::size_t capacity_ = 0;      // buckets in the array
+    arena a_;
+    std::atomic<std::uint8_t*> p_ {nullptr};
+
+public:
+    key_index_t (key_index_t const&) = delete;
+    key_index_t& operator= (key_index_t const&) = delete;
+
+    // Construct an index of buckets of block_size bytes,
+    // or a disabled one if block_size is 0.
+    explicit
+    key_index_t (std::size_t block_size)
+        : block_size_ (block_size)
+        , a_ (2 * 1024 * 1024, 0, true)
+    {
+    }
+
+    bool
+    enabled() const
+    {
+        return block_size_ > 0;
+    }
+
+    // Returns the bytes obtained for the arrays
+    std::size_t
+    memory() const
+    {
+        return a_.size();
+    }
+
+    // Read the first buckets of the key file
+    template <class File>
+    void
+    load (File& kf, std::size_t buckets,
+        std::size_t read_size);
+
+    // Returns the block of bucket n
+    std::uint8_t*
+    at (std::size_t n) const
+    {
+        return p_.load(std::memory_order_acquire) +
+            n * block_size_;
+    }
+
+    // Replace the block of bucket n, growing the array
+    void
+    update (std::size_t n, void const* block)
+    {
+        if (n >= capacity_)
+            grow(n + 1);
+        std::memcpy(at(n), block, block_size_);
+    }
+
+private:
+    void
+    grow (std::size_t buckets);
+};
+
+template <class _>
+template <class File>
+void
+key_index_t<_>::load (File& kf,
+    std::size_t buckets, std::size_t read_size)
+{
+    grow(buckets);
+    bulk_reader<File> r (kf, block_size_,
+        (buckets + 1) * block_size_, read_size);
+    try
+    {
+        for (std::size_t n = 0; n < buckets; ++n)
+        {
+            auto is = r.prepare(block_size_);
+            std::memcpy(at(n),
+                is.data(block_size_), block_size_);
+        }
+    }
+    catch (file_short_read_error const&)
+    {
+        throw store_corrupt_error(
+            "nudb: key short read");
+    }
+}
+
+template <class _>
+void
+key_index_t<_>::grow (std::size_t buckets)
+{
+    auto capacity = capacity_ > 0 ? capacity_ : 1;
+    while (capacity < buckets)
+        capacity *= 2;
+    auto const p = a_.alloc(capacity * block_size_);
+    if (capacity_ > 0)
+        std::memcpy(p, at(0), capacity_ * block_size_);
+    capacity_ = capacity;
+    p_.store(p, std::memory_order_release);
+}
+
+using key_index = key_index_t<>;
+
+} // detail
+} // nudb
+
+#endif
@@ -11,69 +11,94 @@
 #include <nudb/detail/arena.hpp>
 #include <nudb/detail/bucket.hpp>
 #include <nudb/detail/format.hpp>
+#include <algorithm>
+#include <cassert>
+#include <cstddef>
 #include <cstdint>
 #include <cstring>
 #include <memory>
-#include <map>
 #include <utility>
+#include <vector>
 
 namespace nudb {
 namespace detail {
 
-// Buffers key/value pairs in a map, associating
+// Buffers key/value pairs in a hash table, associating
 // them with a modifiable data file offset.
-template <class = void>
+//
+// Keys and values are copied into the arena. Elements are
+// kept in insertion order and indexed by an open addressing
+// table with linear probing on the hash of the key, so that
+// a lookup usually costs a single key comparison.
+//
+// A nonzero KeySize is the size of every key, so that
+// keys are compared and copied with code for that size.
+//
+template <std::size_t KeySize = 0>
 class pool_t
 {
 public:
     struct value_type;
-    class compare;
+
+    struct element
+    {
+        value_type first;
+        std::size_t second;     // data file offset
+    };
 
 private:
-    using map_type = std::map<
-        value_type, std::size_t, compare>;
+    enum
+    {
+        // Initial number of table slots
+        min_capacity = 16
+    };
 
     arena arena_;
     std::size_t key_size_;
     std::size_t data_size_ = 0;
-    map_type map_;
+    std::vector<element> v_;
+    // Each slot holds an index into v_ plus one, or zero
+    std::vector<std::size_t> table_;
 
 public:
     using iterator =
-        typename map_type::iterator;
+        typename std::vector<element>::iterator;
 
     pool_t (pool_t const&) = delete;
     pool_t& operator= (pool_t const&) = delete;
 
+    // See arena_t for high_water and huge_pages
     explicit
     pool_t (std::size_t key_size,
-        std::size_t alloc_size);
+        std::size_t alloc_size,
+            std::size_t high_water = 0,
+                bool huge_pages = false);
 
     pool_t& operator= (pool_t&& other);
 
     iterator
     begin()
     {
-        return map_.begin();
+        return v_.begin();
     }
 
     iterator
     end()
     {
-        return map_.end();
+        return v_.end();
     }
 
     bool
     empty()
     {
-        return map_.size() == 0;
+        return v_.size() == 0;
     }
 
     // Returns the number of elements in the pool
     std::size_t
     size() const
     {
-        return map_.size();
+        return v_.size();
     }
 
     // Returns the sum of data sizes in the pool
@@ -83,14 +108,25 @@ public:
         return data_size_;
     }
 
+    // Returns the bytes of memory held
+    std::size_t
+    memory() const
+    {
+        return arena_.size() +
+            v_.capacity() * sizeof(element) +
+            table_.capacity() * sizeof(std::size_t);
+    }
+
     void
     clear();
 
     void
     shrink_to_fit();
 
+    // Find a value
+    // @param h The hash of the key
     iterator
-    find (void const* key);
+    find (std::size_t h, void const* key);
 
     // Insert a value
     // @param h The hash of the key
@@ -98,14 +134,24 @@ public:
     insert (std::size_t h, void const* key,
         void const* buffer, std::size_t size);
 
-    template <class U>
+    template <std::size_t N>
     friend
     void
-    swap (pool_t<U>& lhs, pool_t<U>& rhs);
+    swap (pool_t<N>& lhs, pool_t<N>& rhs);
+
+private:
+    std::size_t
+    key_size() const
+    {
+        return KeySize != 0 ? KeySize : key_size_;
+    }
+
+    void
+    rehash (std::size_t capacity);
 };
 
-template <class _>
-struct pool_t<_>::value_type
+template <std::size_t KeySize>
+struct pool_t<KeySize>::value_type
 {
     std::size_t hash;
     std::size_t size;
@@ -125,112 +171,127 @@ struct pool_t<_>::value_type
     }
 };
 
-template <class _>
-class pool_t<_>::compare
-{
-private:
-    std::size_t key_size_;
-
-public:
-    using result_type = bool;
-    using first_argument_type = value_type;
-    using second_argument_type = value_type;
-
-    compare (compare const&) = default;
-    compare& operator= (compare const&) = default;
-
-    compare (std::size_t key_size)
-        : key_size_ (key_size)
-    {
-    }
-
-    bool
-    operator()(value_type const& lhs,
-        value_type const& rhs) const
-    {
-        return std::memcmp(
-            lhs.key, rhs.key, key_size_) < 0;
-    }
-};
-
 //------------------------------------------------------------------------------
 
-template <class _>
-pool_t<_>::pool_t (std::size_t key_size,
-        std::size_t alloc_size)
-    : arena_ (alloc_size)
+template <std::size_t KeySize>
+pool_t<KeySize>::pool_t (std::size_t key_size,
+        std::size_t alloc_size, std::size_t high_water,
+            bool huge_pages)
+    : arena_ (alloc_size, high_water, huge_pages)
     , key_size_ (key_size)
-    , map_ (compare(key_size))
 {
+    assert(KeySize == 0 || key_size == KeySize);
 }
 
-template <class _>
-pool_t<_>&
-pool_t<_>::operator= (pool_t&& other)
+template <std::size_t KeySize>
+pool_t<KeySize>&
+pool_t<KeySize>::operator= (pool_t&& other)
 {
     arena_ = std::move(other.arena_);
     key_size_ = other.key_size_;
     data_size_ = other.data_size_;
-    map_ = std::move(other.map_);
+    v_ = std::move(other.v_);
+    table_ = std::move(other.table_);
+    other.data_size_ = 0;
+    other.v_.clear();
+    other.table_.clear();
     return *this;
 }
 
-template <class _>
+template <std::size_t KeySize>
 void
-pool_t<_>::clear()
+pool_t<KeySize>::clear()
 {
     arena_.clear();
     data_size_ = 0;
-    map_.clear();
+    v_.clear();
+    std::fill(table_.begin(), table_.end(), 0);
 }
 
-template <class _>
+template <std::size_t KeySize>
 void
-pool_t<_>::shrink_to_fit()
+pool_t<KeySize>::shrink_to_fit()
 {
     arena_.shrink_to_fit();
+    if (v_.empty())
+    {
+        v_.shrink_to_fit();
+        table_.clear();
+        table_.shrink_to_fit();
+    }
 }
 
-template <class _>
+template <std::size_t KeySize>
 auto
-pool_t<_>::find (void const* key) ->
+pool_t<KeySize>::find (std::size_t h, void const* key) ->
     iterator
 {
-    // VFALCO need is_transparent here
-    value_type tmp (0, 0, key, nullptr);
-    auto const iter = map_.find(tmp);
-    return iter;
+    if (table_.empty())
+        return v_.end();
+    auto const mask = table_.size() - 1;
+    for (auto i = h & mask;; i = (i + 1) & mask)
+    {
+        auto const j = table_[i];
+        if (j == 0)
+            return v_.end();
+        auto const& e = v_[j - 1].first;
+        if (e.hash == h && std::memcmp(
+                e.key, key, key_size()) == 0)
+            return v_.begin() + (j - 1);
+    }
 }
 
-template <class _>
+template <std::size_t KeySize>
 void
-pool_t<_>::insert (std::size_t h,
+pool_t<KeySize>::insert (std::size_t h,
     void const* key, void const* data,
         std::size_t size)
 {
-    auto const k = arena_.alloc(key_size_);
+    // Must not already exist!
+    assert(find(h, key) == v_.end());
+    // Keep the load factor at or below one half
+    if (2 * (v_.size() + 1) > table_.size())
+        rehash(std::max<std::size_t>(
+            min_capacity, 2 * table_.size()));
+    auto const k = arena_.alloc(key_size());
     auto const d = arena_.alloc(size);
-    std::memcpy(k, key, key_size_);
+    std::memcpy(k, key, key_size());
     std::memcpy(d, data, size);
-    auto const result = map_.emplace(
-        std::piecewise_construct,
-            std::make_tuple(h, size, k, d),
-                std::make_tuple(0));
-    (void)result.second;
-    // Must not already exist!
-    assert(result.second);
+    v_.push_back({value_type(h, size, k, d), 0});
+    auto const mask = table_.size() - 1;
+    auto i = h & mask;
+    while (table_[i] != 0)
+        i = (i + 1) & mask;
+    table_[i] = v_.size();
     data_size_ += size;
 }
 
-template <class _>
+template <std::size_t KeySize>
+void
+pool_t<KeySize>::rehash (std::size_t capacity)
+{
+    // Hashes are stored, so keys are not compared
+    table_.assign(capacity, 0);
+    auto const mask = capacity - 1;
+    for (std::size_t j = 0; j < v_.size(); ++j)
+    {
+        auto i = v_[j].first.hash & mask;
+        while (table_[i] != 0)
+            i = (i + 1) & mask;
+        table_[i] = j + 1;
+    }
+}
+
+template <std::size_t KeySize>
 void
-swap (pool_t<_>& lhs, pool_t<_>& rhs)
+swap (pool_t<KeySize>& lhs, pool_t<KeySize>& rhs)
 {
     using std::swap;
     swap(lhs.arena_, rhs.arena_);
     swap(lhs.key_size_, rhs.key_size_);
     swap(lhs.data_size_, rhs.data_size_);
-    swap(lhs.map_, rhs.map_);
+    swap(lhs.v_, rhs.v_);
+    swap(lhs.table_, rhs.table_);
 }
 
 using pool = pool_t<>;
@@ -0,0 +1,234 @@
+//
+// Copyright (c) 2015-2016 Vinnie Falco (vinnie dot falco at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef NUDB_DETAIL_READ_CACHE_HPP
+#define NUDB_DETAIL_READ_CACHE_HPP
+
+#include <nudb/detail/arena.hpp>
+#include <nudb/detail/bucket.hpp>
+#include <nudb/detail/stream.hpp>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace nudb {
+namespace detail {
+
+/*  Size-bounded cache of key file buckets.
+
+    Buckets are stored in fixed size slots allocated from
+    an arena. When the cache is full, a slot is reclaimed
+    using the CLOCK algorithm: each slot has a reference bit
+    which is set on a hit, and the hand sweeps the slots
+    clearing reference bits until it finds one not set.
+
+    Buckets are copied in and out, so callers must provide
+    their own synchronization. Only capacity may be read
+    while another thread changes the cache.
+*/
+template <class = void>
+class read_cache_t
+{
+private:
+    enum
+    {
+        // The arena's alloc size will be this
+        // multiple of the block size.
+        factor = 64
+    };
+
+    struct slot
+    {
+        std::size_t n;
+        std::uint8_t* p;
+        bool ref;
+    };
+
+    std::size_t block_size_;
+    std::size_t inline_bytes_;
+    std::atomic<std::size_t> capacity_;
+    std::size_t hand_ = 0;
+    arena arena_;
+    std::vector<slot> slots_;
+    std::unordered_map<std::size_t, std::size_t> map_;
+
+public:
+    read_cache_t (read_cache_t const&) = delete;
+    read_cache_t& operator= (read_cache_t const&) = delete;
+
+    // Construct a cache holding up to `bytes` of buckets
+    read_cache_t (std::size_t block_size,
+        std::size_t bytes, std::size_t inline_bytes = 0);
+
+    // Returns the maximum number of buckets
+    std::size_t
+    capacity() const
+    {
+        return capacity_.load(std::memory_order_relaxed);
+    }
+
+    // Change the size to `bytes` of buckets. When the
+    // cache shrinks, the buckets kept are moved to new
+    // memory so that the old memory can be released.
+    void
+    resize (std::size_t bytes);
+
+    // Returns the number of buckets held
+    std::size_t
+    size() const
+    {
+        return map_.size();
+    }
+
+    void
+    clear();
+
+    // Copy bucket n to the block pointed to by p.
+    // Returns `false` if the bucket is not cached.
+    bool
+    find (std::size_t n, void* p);
+
+    // Insert a copy of a bucket, replacing
+    // any previous copy.
+    void
+    insert (std::size_t n, bucket const& b);
+
+    // Replace the copy of a bucket,
+    // if the bucket is cached.
+    void
+    update (std::size_t n, bucket const& b);
+};
+
+template <class _>
+read_cache_t<_>::read_cache_t (
+        std::size_t block_size, std::size_t bytes,
+            std::size_t inline_bytes)
+    : block_size_ (block_size)
+    , inline_bytes_ (inline_bytes)
+    , capacity_ (bytes / block_size)
+    , arena_ (block_size * factor)
+{
+}
+
+template <class _>
+void
+read_cache_t<_>::resize (std::size_t bytes)
+{
+    auto const capacity = bytes / block_size_;
+    capacity_.store(capacity, std::memory_order_relaxed);
+    if (slots_.size() <= capacity)
+        return;
+    // Keep the slots which the hand reaches last
+    arena a (block_size_ * factor);
+    std::vector<slot> slots;
+    slots.reserve(capacity);
+    map_.clear();
+    for (std::size_t i = 0; i < capacity; ++i)
+    {
+        auto const& e = slots_[
+            (hand_ + slots_.size() - capacity + i) %
+                slots_.size()];
+        auto const p = a.alloc(block_size_);
+        std::memcpy(p, e.p, block_size_);
+        map_.emplace(e.n, slots.size());
+        slots.push_back({e.n, p, e.ref});
+    }
+    hand_ = 0;
+    slots_ = std::move(slots);
+    swap(arena_, a);
+}
+
+template <class _>
+void
+read_cache_t<_>::clear()
+{
+    hand_ = 0;
+    slots_.clear();
+    map_.clear();
+    arena_.clear();
+}
+
+template <class _>
+bool
+read_cache_t<_>::find (std::size_t n, void* p)
+{
+    auto const iter = map_.find(n);
+    if (iter == map_.end())
+        return false;
+    auto& e = slots_[iter->second];
+    e.ref = true;
+    ostream os(p, block_size_);
+    bucket(block_size_, e.p, inline_bytes_).write(os);
+    return true;
+}
+
+template <class _>
+void
+read_cache_t<_>::insert (
+    std::size_t n, bucket const& b)
+{
+    auto const capacity = capacity_.load(
+        std::memory_order_relaxed);
+    if (capacity == 0)
+        return;
+    auto iter = map_.find(n);
+    if (iter == map_.end())
+    {
+        std::size_t i;
+        if (slots_.size() < capacity)
+        {
+            i = slots_.size();
+            slots_.push_back({n,
+                arena_.alloc(block_size_), false});
+        }
+        else
+        {
+            // Reclaim a slot
+            for(;;)
+            {
+                auto& e = slots_[hand_];
+                if (! e.ref)
+                    break;
+                e.ref = false;
+                if (++hand_ == slots_.size())
+                    hand_ = 0;
+            }
+            i = hand_;
+            if (++hand_ == slots_.size())
+                hand_ = 0;
+            map_.erase(slots_[i].n);
+            slots_[i].n = n;
+            slots_[i].ref = false;
+        }
+        iter = map_.emplace(n, i).first;
+    }
+    ostream os(slots_[iter->second].p, block_size_);
+    b.write(os);
+}
+
+template <class _>
+void
+read_cache_t<_>::update (
+    std::size_t n, bucket const& b)
+{
+    auto const iter = map_.find(n);
+    if (iter == map_.end())
+        return;
+    ostream os(slots_[iter->second].p, block_size_);
+    b.write(os);
+}
+
+using read_cache = read_cache_t<>;
+
+} // detail
+} // nudb
+
+#endif
@@ -0,0 +1,98 @@
+//
+// Copyright (c) 2015-2016 Vinnie Falco (vinnie dot falco at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef NUDB_DETAIL_STATS_HPP
+#define NUDB_DETAIL_STATS_HPP
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+namespace nudb {
+namespace detail {
+
+// A count which any thread may add to.
+//
+// Updates are relaxed, so they cost a single locked add
+// and order nothing. Counters are padded to the size of a
+// cache line, so that threads bumping different counters
+// do not contend. Padding is used rather than alignas,
+// since the store state is allocated with operator new.
+//
+class stat_counter
+{
+private:
+    std::atomic<std::uint64_t> v_ {0};
+    char pad_[64 - sizeof(std::atomic<std::uint64_t>)];
+
+public:
+    void
+    add (std::uint64_t n = 1)
+    {
+        v_.fetch_add(n, std::memory_order_relaxed);
+    }
+
+    // Raise the count to n if it is lower
+    void
+    raise (std::uint64_t n)
+    {
+        auto v = v_.load(std::memory_order_relaxed);
+        while (v < n && ! v_.compare_exchange_weak(
+            v, n, std::memory_order_relaxed))
+        {
+        }
+    }
+
+    std::uint64_t
+    load() const
+    {
+        return v_.load(std::memory_order_relaxed);
+    }
+};
+
+// Counts lookups by the number of spill records they
+// followed, the last slot holding the longer chains.
+//
+template <std::size_t N>
+class stat_histogram
+{
+private:
+    std::array<stat_counter, N> v_;
+
+public:
+    void
+    add (std::size_t depth)
+    {
+        v_[std::min(depth, N - 1)].add();
+    }
+
+    std::array<std::uint64_t, N>
+    load() const
+    {
+        std::array<std::uint64_t, N> result;
+        for (std::size_t i = 0; i < N; ++i)
+            result[i] = v_[i].load();
+        return result;
+    }
+};
+
+// Returns a duration as a count of nanoseconds
+template <class Duration>
+std::uint64_t
+stat_nanoseconds (Duration d)
+{
+    return static_cast<std::uint64_t>(std::chrono::duration_cast<
+        std::chrono::nanoseconds>(d).count());
+}
+
+} // detail
+} // nudb
+
+#endif
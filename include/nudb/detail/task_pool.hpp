@@ -0,0 +1,140 @@
+//
+// Copyright (c) 2015-2016 Vinnie Falco (vinnie dot falco at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef NUDB_DETAIL_TASK_POOL_HPP
+#define NUDB_DETAIL_TASK_POOL_HPP
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace nudb {
+namespace detail {
+
+/*  A bounded set of threads running queued tasks.
+
+    Threads are started as tasks are posted, up to the
+    limit, so a pool which is never used costs nothing.
+    Posting never blocks. Tasks must not throw.
+*/
+template <class = void>
+class task_pool_t
+{
+private:
+    std::size_t const limit_;
+    std::mutex m_;
+    std::condition_variable cond_;
+    std::condition_variable idle_;
+    std::deque<std::function<void(void)>> q_;
+    std::size_t idle_threads_ = 0;
+    std::size_t busy_ = 0;
+    bool stop_ = false;
+    std::vector<std::thread> threads_;
+
+public:
+    task_pool_t (task_pool_t const&) = delete;
+    task_pool_t& operator= (task_pool_t const&) = delete;
+
+    // Construct a pool of up to limit threads, at least one
+    explicit
+    task_pool_t (std::size_t limit)
+        : limit_ (limit > 0 ? limit : 1)
+    {
+    }
+
+    ~task_pool_t();
+
+    // Queue a task
+    void
+    post (std::function<void(void)> f);
+
+    // Block until every posted task has finished
+    void
+    wait();
+
+private:
+    void
+    run();
+};
+
+template <class _>
+task_pool_t<_>::~task_pool_t()
+{
+    {
+        std::lock_guard<std::mutex> l (m_);
+        stop_ = true;
+    }
+    cond_.notify_all();
+    for (auto& t : threads_)
+        t.join();
+}
+
+template <class _>
+void
+task_pool_t<_>::post (std::function<void(void)> f)
+{
+    {
+        std::lock_guard<std::mutex> l (m_);
+        q_.emplace_back(std::move(f));
+        if (idle_threads_ < q_.size() &&
+                threads_.size() < limit_)
+            threads_.emplace_back(&task_pool_t::run, this);
+    }
+    cond_.notify_one();
+}
+
+template <class _>
+void
+task_pool_t<_>::wait()
+{
+    std::unique_lock<std::mutex> l (m_);
+    idle_.wait(l,
+        [this]
+        {
+            return q_.empty() && busy_ == 0;
+        });
+}
+
+template <class _>
+void
+task_pool_t<_>::run()
+{
+    std::unique_lock<std::mutex> l (m_);
+    for(;;)
+    {
+        ++idle_threads_;
+        cond_.wait(l,
+            [this]
+            {
+                return stop_ || ! q_.empty();
+            });
+        --idle_threads_;
+        if (q_.empty())
+            break;
+        auto f = std::move(q_.front());
+        q_.pop_front();
+        ++busy_;
+        l.unlock();
+        f();
+        l.lock();
+        --busy_;
+        if (q_.empty() && busy_ == 0)
+            idle_.notify_all();
+    }
+}
+
+using task_pool = task_pool_t<>;
+
+} // detail
+} // nudb
+
+#endif
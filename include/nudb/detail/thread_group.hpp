@@ -0,0 +1,135 @@
+//
+// Copyright (c) 2015-2016 Vinnie Falco (vinnie dot falco at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef NUDB_DETAIL_THREAD_GROUP_HPP
+#define NUDB_DETAIL_THREAD_GROUP_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace nudb {
+namespace detail {
+
+/*  Threads working on parts of one job.
+
+    The first exception thrown by a function run through
+    the group is kept, and the group is stopped so that
+    the other threads can give up early. join rethrows
+    the exception once every thread has finished.
+*/
+template <class = void>
+class thread_group_t
+{
+private:
+    std::mutex m_;
+    std::exception_ptr ep_;
+    std::atomic<bool> stop_;
+    std::vector<std::thread> threads_;
+
+public:
+    thread_group_t (thread_group_t const&) = delete;
+    thread_group_t& operator= (thread_group_t const&) = delete;
+
+    thread_group_t()
+        : stop_ (false)
+    {
+    }
+
+    ~thread_group_t()
+    {
+        stop();
+        for (auto& t : threads_)
+            if (t.joinable())
+                t.join();
+    }
+
+    // Returns the number of threads to use for a request
+    // of n, where zero means one per hardware thread.
+    static
+    std::size_t
+    size (std::size_t n)
+    {
+        if (n > 0)
+            return n;
+        return std::max<std::size_t>(1,
+            std::thread::hardware_concurrency());
+    }
+
+    // Returns `true` if the work should end
+    bool
+    stopped() const
+    {
+        return stop_.load();
+    }
+
+    // End the work without an error
+    void
+    stop()
+    {
+        stop_.store(true);
+    }
+
+    // Call f on a new thread
+    template <class Function>
+    void
+    spawn (Function f)
+    {
+        threads_.emplace_back(
+            [this, f]
+            {
+                run(f);
+            });
+    }
+
+    // Call f on this thread, keeping its exception
+    template <class Function>
+    void
+    run (Function&& f)
+    {
+        try
+        {
+            f();
+        }
+        catch (...)
+        {
+            {
+                std::lock_guard<std::mutex> lock (m_);
+                if (! ep_)
+                    ep_ = std::current_exception();
+            }
+            stop();
+        }
+    }
+
+    // Wait for every thread, then throw the first exception
+    void
+    join();
+};
+
+template <class _>
+void
+thread_group_t<_>::join()
+{
+    for (auto& t : threads_)
+        t.join();
+    threads_.clear();
+    if (ep_)
+        std::rethrow_exception(ep_);
+}
+
+using thread_group = thread_group_t<>;
+
+} // detail
+} // nudb
+
+#endif
@@ -0,0 +1,361 @@
+//
+// Copyright (c) 2015-2016 Vinnie Falco (vinnie dot falco at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef NUDB_DETAIL_VALUE_CACHE_HPP
+#define NUDB_DETAIL_VALUE_CACHE_HPP
+
+#include <nudb/detail/buffer.hpp>
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+namespace nudb {
+namespace detail {
+
+/*  Size-bounded cache of decompressed values.
+
+    Values are admitted with W-TinyLFU: a new value enters
+    a small LRU window, and when it leaves the window it
+    replaces the least recently used value of the main
+    cache only if it was looked up more often. Lookup
+    frequencies are estimated with a count-min sketch of
+    4-bit counters, which are halved periodically so that
+    old popularity fades. The main cache is a segmented
+    LRU, where values found a second time are protected
+    from eviction by values found only once.
+
+    Entries are found by hash and checked against the key.
+    Since values are never changed or erased from a store,
+    entries never go stale.
+
+    The cache is split into shards by hash, each with its
+    own lock and an even part of the budget.
+*/
+template <class = void>
+class value_cache_t
+{
+private:
+    enum
+    {
+        shard_count = 16,
+
+        // Bytes charged per entry besides its key and value
+        overhead = 96,
+
+        // Percent of a shard's budget for the window,
+        // and of the main cache for protected entries
+        window_percent = 1,
+        protected_percent = 80
+    };
+
+    enum class segment : std::uint8_t
+    {
+        window,
+        probation,
+        protect
+    };
+
+    struct entry
+    {
+        std::size_t h;
+        std::size_t size;       // bytes of value
+        std::size_t cost;       // bytes charged
+        segment seg;
+        std::unique_ptr<std::uint8_t[]> data; // key, value
+    };
+
+    using list_type = std::list<entry>;
+    using iterator = typename list_type::iterator;
+
+    // Count-min sketch of lookup frequencies
+    class sketch
+    {
+    private:
+        static std::size_t constexpr rows = 4;
+        static std::uint8_t constexpr max_count = 15;
+
+        std::vector<std::uint8_t> v_;
+        std::size_t mask_ = 0;
+        std::size_t added_ = 0;
+
+    public:
+        void
+        resize (std::size_t entries);
+
+        void
+        add (std::size_t h);
+
+        std::uint8_t
+        frequency (std::size_t h) const;
+
+    private:
+        std::size_t
+        index (std::size_t h, std::size_t row) const;
+    };
+
+    struct shard
+    {
+        std::mutex m;
+        list_type window;
+        list_type probation;
+        list_type protect;
+        std::size_t window_bytes = 0;
+        std::size_t main_bytes = 0;
+        std::size_t protect_bytes = 0;
+        std::unordered_map<std::size_t, iterator> map;
+        sketch freq;
+    };
+
+    std::size_t key_size_;
+    std::size_t limit_ = 0;         // bytes per shard
+    std::size_t window_limit_ = 0;
+    std::size_t main_limit_ = 0;
+    std::size_t protect_limit_ = 0;
+    std::unique_ptr<shard[]> shards_;
+
+public:
+    value_cache_t (value_cache_t const&) = delete;
+    value_cache_t& operator= (value_cache_t const&) = delete;
+
+    // Construct a cache holding up to `bytes` of
+    // values and keys, or none if bytes is 0.
+    value_cache_t (std::size_t key_size, std::size_t bytes);
+
+    bool
+    enabled() const
+    {
+        return limit_ > 0;
+    }
+
+    // Copy the value of key to value, setting size.
+    // Returns `false` if it is not cached. Every lookup
+    // counts towards the frequency of the key.
+    bool
+    find (std::size_t h, void const* key,
+        buffer& value, std::size_t& size);
+
+    // Offer a value, which is admitted or not
+    void
+    insert (std::size_t h, void const* key,
+        void const* data, std::size_t size);
+
+private:
+    shard&
+    shard_of (std::size_t h)
+    {
+        return shards_[(h ^ (h >> 32)) % shard_count];
+    }
+
+    void
+    admit (shard& s, iterator it);
+
+    void
+    erase (shard& s, list_type& list, iterator it);
+};
+
+//------------------------------------------------------------------------------
+
+template <class _>
+void
+value_cache_t<_>::sketch::resize (std::size_t entries)
+{
+    std::size_t n = 64;
+    while (n < entries)
+        n *= 2;
+    v_.assign(n * rows, 0);
+    mask_ = n - 1;
+    added_ = 0;
+}
+
+template <class _>
+void
+value_cache_t<_>::sketch::add (std::size_t h)
+{
+    for (std::size_t r = 0; r < rows; ++r)
+    {
+        auto& c = v_[index(h, r)];
+        if (c < max_count)
+            ++c;
+    }
+    // Age the counts after ten lookups per counter
+    if (++added_ < 10 * (mask_ + 1))
+        return;
+    for (auto& c : v_)
+        c >>= 1;
+    added_ /= 2;
+}
+
+template <class _>
+std::uint8_t
+value_cache_t<_>::sketch::frequency (std::size_t h) const
+{
+    std::uint8_t result = max_count;
+    for (std::size_t r = 0; r < rows; ++r)
+        result = std::min(result, v_[index(h, r)]);
+    return result;
+}
+
+template <class _>
+std::size_t
+value_cache_t<_>::sketch::index (
+    std::size_t h, std::size_t row) const
+{
+    static std::uint64_t constexpr seeds[rows] = {
+        0x9e3779b97f4a7c15ULL, 0xc2b2ae3d27d4eb4fULL,
+        0x165667b19e3779f9ULL, 0xd6e8feb86659fd93ULL };
+    auto x = static_cast<std::uint64_t>(h) * seeds[row];
+    x ^= x >> 29;
+    return row * (mask_ + 1) +
+        static_cast<std::size_t>(x & mask_);
+}
+
+//------------------------------------------------------------------------------
+
+template <class _>
+value_cache_t<_>::value_cache_t (
+        std::size_t key_size, std::size_t bytes)
+    : key_size_ (key_size)
+{
+    if (bytes == 0)
+        return;
+    limit_ = std::max<std::size_t>(1, bytes / shard_count);
+    window_limit_ = limit_ * window_percent / 100;
+    main_limit_ = limit_ - window_limit_;
+    protect_limit_ = main_limit_ * protected_percent / 100;
+    shards_.reset(new shard[shard_count]);
+    // Track about ten times the entries which fit
+    for (std::size_t i = 0; i < shard_count; ++i)
+        shards_[i].freq.resize(10 * limit_ /
+            (overhead + key_size + 64));
+}
+
+template <class _>
+bool
+value_cache_t<_>::find (std::size_t h, void const* key,
+    buffer& value, std::size_t& size)
+{
+    auto& s = shard_of(h);
+    std::lock_guard<std::mutex> lock (s.m);
+    s.freq.add(h);
+    auto const iter = s.map.find(h);
+    if (iter == s.map.end())
+        return false;
+    auto const it = iter->second;
+    if (std::memcmp(it->data.get(), key, key_size_) != 0)
+        return false;
+    switch (it->seg)
+    {
+    case segment::window:
+        s.window.splice(s.window.begin(), s.window, it);
+        break;
+
+    case segment::probation:
+        // Found again, so it is protected
+        it->seg = segment::protect;
+        s.protect.splice(s.protect.begin(), s.probation, it);
+        s.protect_bytes += it->cost;
+        while (s.protect_bytes > protect_limit_)
+        {
+            auto const last = std::prev(s.protect.end());
+            last->seg = segment::probation;
+            s.protect_bytes -= last->cost;
+            s.probation.splice(s.probation.begin(),
+                s.protect, last);
+        }
+        break;
+
+    case segment::protect:
+        s.protect.splice(s.protect.begin(), s.protect, it);
+        break;
+    }
+    value.reserve(it->size);
+    if (it->size > 0)
+        std::memcpy(value.get(),
+            it->data.get() + key_size_, it->size);
+    size = it->size;
+    return true;
+}
+
+template <class _>
+void
+value_cache_t<_>::insert (std::size_t h, void const* key,
+    void const* data, std::size_t size)
+{
+    auto const cost = overhead + key_size_ + size;
+    if (cost > main_limit_)
+        return;
+    std::unique_ptr<std::uint8_t[]> p (
+        new std::uint8_t[key_size_ + size]);
+    std::memcpy(p.get(), key, key_size_);
+    if (size > 0)
+        std::memcpy(p.get() + key_size_, data, size);
+    auto& s = shard_of(h);
+    std::lock_guard<std::mutex> lock (s.m);
+    // Another key with the same hash stays out
+    if (s.map.find(h) != s.map.end())
+        return;
+    s.window.push_front(entry{h, size, cost,
+        segment::window, std::move(p)});
+    s.map.emplace(h, s.window.begin());
+    s.window_bytes += cost;
+    while (s.window_bytes > window_limit_)
+    {
+        auto const last = std::prev(s.window.end());
+        s.window_bytes -= last->cost;
+        admit(s, last);
+    }
+}
+
+// Moves an entry leaving the window into the main
+// cache, if it is used more than the entries it evicts.
+template <class _>
+void
+value_cache_t<_>::admit (shard& s, iterator it)
+{
+    auto const f = s.freq.frequency(it->h);
+    while (s.main_bytes + it->cost > main_limit_)
+    {
+        auto& list = s.probation.empty() ?
+            s.protect : s.probation;
+        auto const victim = std::prev(list.end());
+        if (f <= s.freq.frequency(victim->h))
+        {
+            s.map.erase(it->h);
+            s.window.erase(it);
+            return;
+        }
+        if (victim->seg == segment::protect)
+            s.protect_bytes -= victim->cost;
+        erase(s, list, victim);
+    }
+    it->seg = segment::probation;
+    s.main_bytes += it->cost;
+    s.probation.splice(s.probation.begin(), s.window, it);
+}
+
+template <class _>
+void
+value_cache_t<_>::erase (shard& s,
+    list_type& list, iterator it)
+{
+    s.main_bytes -= it->cost;
+    s.map.erase(it->h);
+    list.erase(it);
+}
+
+using value_cache = value_cache_t<>;
+
+} // detail
+} // nudb
+
+#endif
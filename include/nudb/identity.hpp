@@ -18,7 +18,7 @@ class identity
 public:
     template <class... Args>
     explicit
-    identity(Args&&... args)
+    identity(Args&&...)
     {
     }
 
@@ -0,0 +1,127 @@
+//
+// Copyright (c) 2015-2016 Vinnie Falco (vinnie dot falco at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef NUDB_LZ4_CODEC_HPP
+#define NUDB_LZ4_CODEC_HPP
+
+#include <nudb/common.hpp>
+#include <nudb/detail/varint.hpp>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <utility>
+
+#ifndef NUDB_LZ4_CODEC
+# if defined(__has_include)
+#  if __has_include(<lz4.h>)
+#   define NUDB_LZ4_CODEC 1
+#  else
+#   define NUDB_LZ4_CODEC 0
+#  endif
+# else
+#  define NUDB_LZ4_CODEC 0
+# endif
+#endif
+
+#if NUDB_LZ4_CODEC
+# include <lz4.h>
+#endif
+
+namespace nudb {
+
+#if NUDB_LZ4_CODEC
+
+/** Codec which compresses values with LZ4.
+
+    Each value is stored as a varint holding its size,
+    followed by an LZ4 block. Compression state is kept
+    per thread and reused, so that compressing a value
+    does not allocate once the buffers have grown.
+
+    Linking requires the lz4 library.
+*/
+class lz4_codec
+{
+public:
+    template <class... Args>
+    explicit
+    lz4_codec(Args&&...)
+    {
+    }
+
+    char const*
+    name() const
+    {
+        return "lz4";
+    }
+
+    template <class BufferFactory>
+    std::pair<void const*, std::size_t>
+    compress (void const* in,
+        std::size_t in_size, BufferFactory&& bf) const
+    {
+        using namespace detail;
+        if (in_size > LZ4_MAX_INPUT_SIZE)
+            throw codec_error(
+                "nudb: lz4 value too large");
+        auto const n = size_varint(in_size);
+        auto const bound = LZ4_compressBound(
+            static_cast<int>(in_size));
+        auto const out = reinterpret_cast<
+            std::uint8_t*>(bf(n + bound));
+        write_varint(out, in_size);
+        auto const used = LZ4_compress_fast_extState(
+            state(), reinterpret_cast<char const*>(in),
+                reinterpret_cast<char*>(out + n),
+                    static_cast<int>(in_size), bound, 1);
+        if (used <= 0)
+            throw codec_error(
+                "nudb: lz4 compress");
+        return std::make_pair(out, n + used);
+    }
+
+    template <class BufferFactory>
+    std::pair<void const*, std::size_t>
+    decompress (void const* in,
+        std::size_t in_size, BufferFactory&& bf) const
+    {
+        using namespace detail;
+        std::size_t size;
+        auto const n = read_varint(in, in_size, size);
+        if (n == 0 || size > LZ4_MAX_INPUT_SIZE)
+            throw codec_error(
+                "nudb: lz4 bad size");
+        auto const out = bf(size);
+        auto const used = LZ4_decompress_safe(
+            reinterpret_cast<char const*>(in) + n,
+                reinterpret_cast<char*>(out),
+                    static_cast<int>(in_size - n),
+                        static_cast<int>(size));
+        if (used < 0 || static_cast<
+                std::size_t>(used) != size)
+            throw codec_error(
+                "nudb: lz4 decompress");
+        return std::make_pair(out, size);
+    }
+
+private:
+    // Returns the compression state of this thread
+    static
+    void*
+    state()
+    {
+        static thread_local std::unique_ptr<
+            char[]> p (new char[LZ4_sizeofState()]);
+        return p.get();
+    }
+};
+
+#endif
+
+} // nudb
+
+#endif
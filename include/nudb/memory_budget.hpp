@@ -0,0 +1,331 @@
+//
+// Copyright (c) 2015-2016 Vinnie Falco (vinnie dot falco at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef NUDB_MEMORY_BUDGET_HPP
+#define NUDB_MEMORY_BUDGET_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <vector>
+
+namespace nudb {
+
+/** A memory budget shared by the stores of a process.
+
+    Stores opened with a budget report the bytes held by
+    the arenas of their insert pools and commit caches.
+    When the total reaches the limit, the store holding
+    the most is asked to commit early and to release its
+    free arena blocks.
+
+    The read cache budget is divided between the stores
+    every second or so. Each store is granted a quarter of
+    an even share, and the rest is divided in proportion
+    to the cache hits each store had since the last time.
+
+    A budget must outlive the stores opened with it. Its
+    members may be called from any thread.
+*/
+template <class = void>
+class memory_budget_t
+{
+public:
+    class member;
+
+private:
+    using clock_type = std::chrono::steady_clock;
+
+    std::size_t const limit_;
+    std::size_t const cache_limit_;
+    std::atomic<std::size_t> used_ {0};
+    std::atomic<std::size_t> flushing_ {0};
+    std::mutex m_;
+    std::vector<member*> members_;
+    clock_type::time_point last_;
+
+public:
+    memory_budget_t (memory_budget_t const&) = delete;
+    memory_budget_t& operator= (memory_budget_t const&) = delete;
+
+    /** Create a budget.
+
+        @param limit The bytes all pools and commit caches
+        may hold before early commits start, or 0 for no
+        limit.
+
+        @param cache_limit The bytes of read cache to divide
+        between the stores.
+    */
+    memory_budget_t (std::size_t limit,
+            std::size_t cache_limit)
+        : limit_ (limit)
+        , cache_limit_ (cache_limit)
+        , last_ (clock_type::now())
+    {
+    }
+
+    /** Returns the limit on pools and commit caches. */
+    std::size_t
+    limit() const
+    {
+        return limit_;
+    }
+
+    /** Returns the read cache budget. */
+    std::size_t
+    cache_limit() const
+    {
+        return cache_limit_;
+    }
+
+    /** Returns the bytes reported by all stores. */
+    std::size_t
+    used() const
+    {
+        return used_.load(std::memory_order_relaxed);
+    }
+
+    /** Divide the read cache budget again.
+
+        Stores call this periodically. It does nothing if
+        the budget was divided less than a second ago.
+    */
+    void
+    rebalance();
+
+private:
+    void
+    divide();
+
+    void
+    reclaim();
+};
+
+/** A store's account with a memory budget. */
+template <class _>
+class memory_budget_t<_>::member
+{
+private:
+    friend class memory_budget_t;
+
+    memory_budget_t* b_ = nullptr;
+    std::function<void()> wake_;
+    std::atomic<std::size_t> used_ {0};
+    std::atomic<std::size_t> cache_ {0};
+    std::atomic<std::uint64_t> hits_ {0};
+    std::atomic<bool> flush_ {false};
+    std::uint64_t seen_ = 0;    // hits at the last division
+
+public:
+    member() = default;
+    member (member const&) = delete;
+    member& operator= (member const&) = delete;
+
+    ~member()
+    {
+        leave();
+    }
+
+    /** Returns `true` if the member belongs to a budget. */
+    bool
+    joined() const
+    {
+        return b_ != nullptr;
+    }
+
+    /** Join a budget.
+
+        wake is called, from any thread, when the budget
+        asks for an early commit. The read cache shares of
+        all members are divided again.
+    */
+    void
+    join (memory_budget_t& b, std::function<void()> wake);
+
+    /** Leave the budget, returning the reported bytes. */
+    void
+    leave();
+
+    /** Report the bytes now held. */
+    void
+    charge (std::size_t bytes);
+
+    /** Report the total number of read cache hits. */
+    void
+    hits (std::uint64_t n)
+    {
+        hits_.store(n, std::memory_order_relaxed);
+    }
+
+    /** Divide the read cache budget again, if it is due. */
+    void
+    rebalance()
+    {
+        if (b_)
+            b_->rebalance();
+    }
+
+    /** Returns the bytes of read cache granted. */
+    std::size_t
+    cache_size() const
+    {
+        return cache_.load(std::memory_order_relaxed);
+    }
+
+    /** Returns `true` if an early commit was asked for. */
+    bool
+    flush_requested() const
+    {
+        return flush_.load(std::memory_order_relaxed);
+    }
+
+    /** Acknowledge a request for an early commit.
+
+        @return `true` if one was outstanding.
+    */
+    bool
+    flushed();
+};
+
+//------------------------------------------------------------------------------
+
+template <class _>
+void
+memory_budget_t<_>::rebalance()
+{
+    std::unique_lock<std::mutex> lock (m_, std::try_to_lock);
+    if (! lock.owns_lock())
+        return;
+    auto const now = clock_type::now();
+    if (now - last_ < std::chrono::seconds(1))
+        return;
+    last_ = now;
+    divide();
+}
+
+// Requires m_ held
+template <class _>
+void
+memory_budget_t<_>::divide()
+{
+    if (members_.empty())
+        return;
+    auto const n = members_.size();
+    auto const floor = cache_limit_ / (4 * n);
+    auto const rest = cache_limit_ - floor * n;
+    std::uint64_t total = 0;
+    std::vector<std::uint64_t> recent;
+    recent.reserve(n);
+    for (auto const m : members_)
+    {
+        auto const h = m->hits_.load(std::memory_order_relaxed);
+        recent.push_back(h >= m->seen_ ? h - m->seen_ : 0);
+        m->seen_ = h;
+        total += recent.back();
+    }
+    for (std::size_t i = 0; i < n; ++i)
+    {
+        auto const share = total == 0 ? rest / n :
+            static_cast<std::size_t>(static_cast<double>(rest) *
+                recent[i] / total);
+        members_[i]->cache_.store(floor + share,
+            std::memory_order_relaxed);
+    }
+}
+
+// Asks the member holding the most to commit
+template <class _>
+void
+memory_budget_t<_>::reclaim()
+{
+    // One early commit at a time
+    if (flushing_.load() > 0)
+        return;
+    std::unique_lock<std::mutex> lock (m_, std::try_to_lock);
+    if (! lock.owns_lock())
+        return;
+    member* largest = nullptr;
+    for (auto const m : members_)
+        if (! m->flush_.load() && (! largest ||
+                m->used_.load(std::memory_order_relaxed) >
+                    largest->used_.load(std::memory_order_relaxed)))
+            largest = m;
+    if (! largest || largest->flush_.exchange(true))
+        return;
+    ++flushing_;
+    largest->wake_();
+}
+
+//------------------------------------------------------------------------------
+
+template <class _>
+void
+memory_budget_t<_>::member::join (
+    memory_budget_t& b, std::function<void()> wake)
+{
+    leave();
+    std::lock_guard<std::mutex> lock (b.m_);
+    b_ = &b;
+    wake_ = std::move(wake);
+    seen_ = hits_.load();
+    b.members_.push_back(this);
+    b.divide();
+}
+
+template <class _>
+void
+memory_budget_t<_>::member::leave()
+{
+    if (! b_)
+        return;
+    charge(0);
+    flushed();
+    {
+        std::lock_guard<std::mutex> lock (b_->m_);
+        auto& v = b_->members_;
+        v.erase(std::remove(v.begin(), v.end(), this), v.end());
+        b_->divide();
+    }
+    b_ = nullptr;
+    wake_ = nullptr;
+    cache_.store(0);
+}
+
+template <class _>
+void
+memory_budget_t<_>::member::charge (std::size_t bytes)
+{
+    if (! b_)
+        return;
+    auto const old = used_.exchange(bytes);
+    // Wraps around when bytes < old, as intended
+    auto const total = b_->used_.fetch_add(
+        bytes - old) + (bytes - old);
+    if (b_->limit_ > 0 && total >= b_->limit_)
+        b_->reclaim();
+}
+
+template <class _>
+bool
+memory_budget_t<_>::member::flushed()
+{
+    if (! flush_.exchange(false))
+        return false;
+    --b_->flushing_;
+    return true;
+}
+
+using memory_budget = memory_budget_t<>;
+
+} // nudb
+
+#endif
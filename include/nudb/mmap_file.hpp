@@ -0,0 +1,313 @@
+//
+// Copyright (c) 2015-2016 Vinnie Falco (vinnie dot falco at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef NUDB_MMAP_FILE_HPP
+#define NUDB_MMAP_FILE_HPP
+
+#include <nudb/common.hpp>
+#include <nudb/posix_file.hpp>
+#include <nudb/detail/format.hpp>
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+#if NUDB_POSIX_FILE
+# include <sys/mman.h>
+#endif
+
+namespace nudb {
+
+#if NUDB_POSIX_FILE
+
+namespace detail {
+
+/*  File which reads through a read-only memory mapping.
+
+    Writes go through posix_file. The mapping is created
+    on the first read, so files which are only written,
+    such as the log file of an open store, are never mapped.
+
+    The mapping reserves more address space than the file
+    occupies. As the file grows, bytes up to the reserved
+    size become visible without remapping. When the file
+    outgrows the reservation a larger mapping is created;
+    earlier mappings stay valid until the file is closed,
+    so pointers handed out by data() remain usable while
+    other threads extend the file.
+*/
+template <class = void>
+class mmap_file
+{
+private:
+    enum
+    {
+        // Smallest address space reservation
+        min_map_size = 64 * 1024 * 1024
+    };
+
+    struct mapping
+    {
+        std::uint8_t const* base;
+        std::size_t capacity;
+    };
+
+    posix_file<> f_;
+    std::unique_ptr<std::mutex> m_;
+    std::vector<std::unique_ptr<mapping>> maps_;
+    std::atomic<mapping const*> map_;
+    std::atomic<std::size_t> size_;     // bytes visible in map_
+
+public:
+    mmap_file();
+    mmap_file (mmap_file const&) = delete;
+    mmap_file& operator= (mmap_file const&) = delete;
+
+    ~mmap_file();
+
+    mmap_file (mmap_file&& other);
+
+    mmap_file&
+    operator= (mmap_file&& other);
+
+    bool
+    is_open() const
+    {
+        return f_.is_open();
+    }
+
+    void
+    close();
+
+    bool
+    create (file_mode mode, path_type const& path)
+    {
+        return f_.create(mode, path);
+    }
+
+    bool
+    open (file_mode mode, path_type const& path)
+    {
+        return f_.open(mode, path);
+    }
+
+    static
+    bool
+    erase (path_type const& path)
+    {
+        return posix_file<>::erase(path);
+    }
+
+    std::size_t
+    actual_size() const
+    {
+        return f_.actual_size();
+    }
+
+    // Returns a pointer to the bytes at offset, or nullptr
+    // if the range extends past the end of the file.
+    void const*
+    data (std::size_t offset, std::size_t bytes);
+
+    void
+    read (std::size_t offset,
+        void* buffer, std::size_t bytes);
+
+    void
+    write (std::size_t offset,
+        void const* buffer, std::size_t bytes)
+    {
+        f_.write(offset, buffer, bytes);
+    }
+
+    void
+    sync()
+    {
+        f_.sync();
+    }
+
+    void
+    sync (durability level)
+    {
+        f_.sync(level);
+    }
+
+    void
+    trunc (std::size_t length);
+
+    void
+    prefetch (std::size_t offset, std::size_t bytes)
+    {
+        f_.prefetch(offset, bytes);
+    }
+
+    bool
+    lock (std::size_t offset, std::size_t bytes)
+    {
+        return f_.lock(offset, bytes);
+    }
+
+    void
+    copy_to (int fd, std::size_t offset, std::size_t bytes)
+    {
+        f_.copy_to(fd, offset, bytes);
+    }
+
+private:
+    void const*
+    remap (std::size_t offset, std::size_t bytes);
+
+    void
+    unmap();
+};
+
+template <class _>
+mmap_file<_>::mmap_file()
+    : m_ (new std::mutex)
+    , map_ (nullptr)
+    , size_ (0)
+{
+}
+
+template <class _>
+mmap_file<_>::~mmap_file()
+{
+    unmap();
+}
+
+template <class _>
+mmap_file<_>::mmap_file (mmap_file&& other)
+    : f_ (std::move(other.f_))
+    , m_ (std::move(other.m_))
+    , maps_ (std::move(other.maps_))
+    , map_ (other.map_.load())
+    , size_ (other.size_.load())
+{
+    other.m_.reset(new std::mutex);
+    other.maps_.clear();
+    other.map_.store(nullptr);
+    other.size_.store(0);
+}
+
+template <class _>
+mmap_file<_>&
+mmap_file<_>::operator= (mmap_file&& other)
+{
+    if (&other == this)
+        return *this;
+    close();
+    f_ = std::move(other.f_);
+    maps_ = std::move(other.maps_);
+    map_.store(other.map_.load());
+    size_.store(other.size_.load());
+    other.maps_.clear();
+    other.map_.store(nullptr);
+    other.size_.store(0);
+    return *this;
+}
+
+template <class _>
+void
+mmap_file<_>::close()
+{
+    unmap();
+    f_.close();
+}
+
+template <class _>
+void const*
+mmap_file<_>::data (
+    std::size_t offset, std::size_t bytes)
+{
+    auto const size =
+        size_.load(std::memory_order_acquire);
+    if (offset + bytes <= size)
+        return map_.load(std::memory_order_acquire
+            )->base + offset;
+    return remap(offset, bytes);
+}
+
+template <class _>
+void
+mmap_file<_>::read (std::size_t offset,
+    void* buffer, std::size_t bytes)
+{
+    if (auto const p = data(offset, bytes))
+        std::memcpy(buffer, p, bytes);
+    else
+        // Throws file_short_read_error
+        f_.read(offset, buffer, bytes);
+}
+
+template <class _>
+void
+mmap_file<_>::trunc (std::size_t length)
+{
+    {
+        std::lock_guard<std::mutex> l (*m_);
+        if (size_.load() > length)
+            size_.store(length);
+    }
+    f_.trunc(length);
+}
+
+template <class _>
+void const*
+mmap_file<_>::remap (
+    std::size_t offset, std::size_t bytes)
+{
+    std::lock_guard<std::mutex> l (*m_);
+    auto const file_size = f_.actual_size();
+    if (offset + bytes > file_size)
+        return nullptr;
+    auto map = map_.load();
+    if (! map || file_size > map->capacity)
+    {
+        std::size_t const capacity = std::max<std::size_t>(
+            min_map_size, 2 * ceil_pow2(file_size));
+        auto const p = ::mmap(nullptr, capacity,
+            PROT_READ, MAP_SHARED, f_.native_handle(), 0);
+        if (p == MAP_FAILED)
+            throw file_posix_error("mmap");
+        std::unique_ptr<mapping> m (new mapping{
+            reinterpret_cast<std::uint8_t const*>(p),
+                capacity});
+        map = m.get();
+        maps_.emplace_back(std::move(m));
+        // Publish the mapping before the larger size
+        map_.store(map, std::memory_order_release);
+    }
+    size_.store(file_size, std::memory_order_release);
+    return map->base + offset;
+}
+
+template <class _>
+void
+mmap_file<_>::unmap()
+{
+    map_.store(nullptr);
+    size_.store(0);
+    for (auto const& m : maps_)
+        ::munmap(const_cast<std::uint8_t*>(
+            m->base), m->capacity);
+    maps_.clear();
+}
+
+} // detail
+
+using mmap_file = detail::mmap_file<>;
+
+#endif
+
+} // nudb
+
+#endif
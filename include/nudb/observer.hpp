@@ -0,0 +1,358 @@
+//
+// Copyright (c) 2015-2016 Vinnie Falco (vinnie dot falco at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef NUDB_OBSERVER_HPP
+#define NUDB_OBSERVER_HPP
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+namespace nudb {
+
+/** The phases of work reported to an observer.
+
+    A commit goes through the commit phases in order, except
+    that data_sync runs on the I/O worker alongside log_write,
+    reader_drain and key_write.
+*/
+enum class phase
+{
+    // Commit
+    log_header,         // write and sync the log file header
+    data_append,        // copy the pool to data records
+    split_insert,       // insert into buckets and split them
+    log_write,          // finish and sync the log file
+    reader_drain,       // wait for fetches of the old buckets
+    key_write,          // write the new buckets
+    data_sync,          // sync the data file
+    final_sync,         // sync the key file and clear the log
+
+    // Recovery
+    recover_read,       // read logged buckets
+    recover_rollback,   // write logged buckets to the key file
+    recover_sync,       // truncate and sync the files
+
+    // Reads made by fetch and insert
+    key_read,           // buckets from the key file
+    data_read           // records and spills from the data file
+};
+
+/** The number of values of phase. */
+static std::size_t constexpr phase_count =
+    static_cast<std::size_t>(phase::data_read) + 1;
+
+/** Returns the name of a phase. */
+inline
+char const*
+to_string (phase p)
+{
+    switch (p)
+    {
+    case phase::log_header:         return "log_header";
+    case phase::data_append:        return "data_append";
+    case phase::split_insert:       return "split_insert";
+    case phase::log_write:          return "log_write";
+    case phase::reader_drain:       return "reader_drain";
+    case phase::key_write:          return "key_write";
+    case phase::data_sync:          return "data_sync";
+    case phase::final_sync:         return "final_sync";
+    case phase::recover_read:       return "recover_read";
+    case phase::recover_rollback:   return "recover_rollback";
+    case phase::recover_sync:       return "recover_sync";
+    case phase::key_read:           return "key_read";
+    case phase::data_read:          return "data_read";
+    }
+    return "unknown";
+}
+
+/** An observer which ignores every event.
+
+    A store using it measures nothing, so the calls
+    compile away entirely.
+
+    An Observer is default constructible and has:
+
+    @code
+    // Called when a phase starts
+    void begin (phase p);
+
+    // Called when a phase ends, with its duration
+    void end (phase p, std::chrono::nanoseconds elapsed);
+    @endcode
+
+    Both may be called from any thread, and must not throw.
+    The end of a phase is reported on the thread which
+    reported its beginning.
+*/
+struct null_observer
+{
+    void
+    begin (phase)
+    {
+    }
+
+    void
+    end (phase, std::chrono::nanoseconds)
+    {
+    }
+};
+
+/** A histogram of durations.
+
+    Durations are counted in buckets whose widths grow with
+    their value, as in an HDR histogram: each power of two
+    is split into `sub_buckets` equal parts, so a bucket is
+    never wider than 1/8 of the values it holds. Recording
+    is a few relaxed atomic adds, and may be done from any
+    thread.
+*/
+class latency_histogram
+{
+public:
+    enum
+    {
+        // Buckets per power of two
+        sub_buckets = 8,
+
+        // Powers of two counted, up to about three days
+        magnitudes = 48,
+
+        bucket_count = sub_buckets * (magnitudes - 2)
+    };
+
+private:
+    static int constexpr sub_bits = 3;
+
+    std::array<std::atomic<std::uint64_t>, bucket_count> v_;
+    std::atomic<std::uint64_t> count_;
+    std::atomic<std::uint64_t> sum_;
+    std::atomic<std::uint64_t> max_;
+
+public:
+    latency_histogram()
+    {
+        clear();
+    }
+
+    latency_histogram (latency_histogram const&) = delete;
+    latency_histogram& operator= (latency_histogram const&) = delete;
+
+    /** Add a duration. */
+    void
+    record (std::chrono::nanoseconds d)
+    {
+        auto const n = d.count() > 0 ?
+            static_cast<std::uint64_t>(d.count()) : 0;
+        v_[index(n)].fetch_add(1, std::memory_order_relaxed);
+        count_.fetch_add(1, std::memory_order_relaxed);
+        sum_.fetch_add(n, std::memory_order_relaxed);
+        auto m = max_.load(std::memory_order_relaxed);
+        while (m < n && ! max_.compare_exchange_weak(
+            m, n, std::memory_order_relaxed))
+        {
+        }
+    }
+
+    /** Add the durations of another histogram. */
+    void
+    merge (latency_histogram const& other)
+    {
+        for (std::size_t i = 0; i < bucket_count; ++i)
+            v_[i].fetch_add(other.v_[i].load(
+                std::memory_order_relaxed),
+                    std::memory_order_relaxed);
+        count_.fetch_add(other.count(), std::memory_order_relaxed);
+        sum_.fetch_add(other.total().count(),
+            std::memory_order_relaxed);
+        auto const n = static_cast<std::uint64_t>(
+            other.max().count());
+        auto m = max_.load(std::memory_order_relaxed);
+        while (m < n && ! max_.compare_exchange_weak(
+            m, n, std::memory_order_relaxed))
+        {
+        }
+    }
+
+    /** Remove all durations. */
+    void
+    clear()
+    {
+        for (auto& e : v_)
+            e.store(0, std::memory_order_relaxed);
+        count_.store(0, std::memory_order_relaxed);
+        sum_.store(0, std::memory_order_relaxed);
+        max_.store(0, std::memory_order_relaxed);
+    }
+
+    /** Returns the number of durations. */
+    std::uint64_t
+    count() const
+    {
+        return count_.load(std::memory_order_relaxed);
+    }
+
+    /** Returns the sum of the durations. */
+    std::chrono::nanoseconds
+    total() const
+    {
+        return std::chrono::nanoseconds(
+            sum_.load(std::memory_order_relaxed));
+    }
+
+    /** Returns the longest duration. */
+    std::chrono::nanoseconds
+    max() const
+    {
+        return std::chrono::nanoseconds(
+            max_.load(std::memory_order_relaxed));
+    }
+
+    /** Returns a duration which `fraction` of the durations
+        do not exceed, rounded up to the end of its bucket.
+
+        @param fraction A value from 0 to 1, such as 0.99
+    */
+    std::chrono::nanoseconds
+    percentile (double fraction) const
+    {
+        auto const n = count();
+        if (n == 0)
+            return std::chrono::nanoseconds(0);
+        auto const rank = static_cast<std::uint64_t>(
+            fraction * static_cast<double>(n - 1)) + 1;
+        std::uint64_t seen = 0;
+        for (std::size_t i = 0; i < bucket_count; ++i)
+        {
+            seen += v_[i].load(std::memory_order_relaxed);
+            if (seen >= rank)
+                return std::chrono::nanoseconds(
+                    std::min(highest(i), max().count()));
+        }
+        return max();
+    }
+
+private:
+    static
+    std::size_t
+    index (std::uint64_t n)
+    {
+        if (n < sub_buckets)
+            return static_cast<std::size_t>(n);
+        int e = 0;
+        for (auto x = n; x >>= 1;)
+            ++e;
+        auto const i = sub_buckets * (e - sub_bits + 1) +
+            ((n >> (e - sub_bits)) & (sub_buckets - 1));
+        return std::min<std::size_t>(i, bucket_count - 1);
+    }
+
+    // Returns the largest value counted in bucket i
+    static
+    std::chrono::nanoseconds::rep
+    highest (std::size_t i)
+    {
+        if (i < sub_buckets)
+            return static_cast<std::chrono::nanoseconds::rep>(i);
+        auto const e = i / sub_buckets + sub_bits - 1;
+        auto const sub = i % sub_buckets;
+        auto const width = std::uint64_t{1} << (e - sub_bits);
+        return static_cast<std::chrono::nanoseconds::rep>(
+            (sub_buckets + sub) * width + width - 1);
+    }
+};
+
+/** An observer which keeps a latency histogram per phase. */
+class latency_observer
+{
+private:
+    std::array<latency_histogram, phase_count> h_;
+
+public:
+    void
+    begin (phase)
+    {
+    }
+
+    void
+    end (phase p, std::chrono::nanoseconds elapsed)
+    {
+        h_[static_cast<std::size_t>(p)].record(elapsed);
+    }
+
+    /** Returns the histogram of a phase. */
+    latency_histogram const&
+    operator[] (phase p) const
+    {
+        return h_[static_cast<std::size_t>(p)];
+    }
+
+    /** Remove all durations. */
+    void
+    clear()
+    {
+        for (auto& h : h_)
+            h.clear();
+    }
+};
+
+namespace detail {
+
+// Reports a phase to an observer from construction
+// until destruction.
+//
+template <class Observer>
+class observe
+{
+private:
+    using clock_type = std::chrono::steady_clock;
+
+    Observer& o_;
+    phase p_;
+    clock_type::time_point start_;
+
+public:
+    observe (observe const&) = delete;
+    observe& operator= (observe const&) = delete;
+
+    observe (Observer& o, phase p)
+        : o_ (o)
+        , p_ (p)
+    {
+        o_.begin(p_);
+        start_ = clock_type::now();
+    }
+
+    ~observe()
+    {
+        o_.end(p_, std::chrono::duration_cast<
+            std::chrono::nanoseconds>(
+                clock_type::now() - start_));
+    }
+};
+
+// Nothing is measured for the null observer
+template <>
+class observe<null_observer>
+{
+public:
+    observe (observe const&) = delete;
+    observe& operator= (observe const&) = delete;
+
+    observe (null_observer&, phase)
+    {
+    }
+};
+
+} // detail
+
+} // nudb
+
+#endif
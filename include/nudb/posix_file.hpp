@@ -9,6 +9,7 @@
 #define NUDB_DETAIL_POSIX_FILE_HPP
 
 #include <nudb/common.hpp>
+#include <algorithm>
 #include <cassert>
 #include <cerrno>
 #include <cstring>
@@ -29,6 +30,10 @@
 # include <sys/uio.hpp>
 # include <sys/stat.hpp>
 # include <unistd.hpp>
+# include <sys/mman.h>
+# if defined(__linux__)
+#  include <sys/sendfile.h>
+# endif
 #endif
 
 namespace nudb {
@@ -72,6 +77,8 @@ class posix_file
 {
 private:
     int fd_ = -1;
+    void* lock_ = nullptr;          // locked mapping
+    std::size_t lock_size_ = 0;
 
 public:
     posix_file() = default;
@@ -91,6 +98,13 @@ public:
         return fd_ != -1;
     }
 
+    // Returns the file descriptor
+    int
+    native_handle() const
+    {
+        return fd_;
+    }
+
     void
     close();
 
@@ -115,16 +129,52 @@ public:
     write (std::size_t offset,
         void const* buffer, std::size_t bytes);
 
+    // Perform a batch of transfers. Requests which are
+    // adjacent in the file, in the order given, are
+    // merged into one vectored system call.
+    void
+    read_batch (file_request const* r, std::size_t n);
+
+    void
+    write_batch (file_request const* r, std::size_t n);
+
     void
     sync();
 
+    // Sync to the given level, see durability
+    void
+    sync (durability level);
+
     void
     trunc (std::size_t length);
 
+    // Hint that the bytes will be read soon
+    void
+    prefetch (std::size_t offset, std::size_t bytes);
+
+    // Keep the bytes in memory until the file is closed,
+    // replacing any earlier lock. Returns `false` if the
+    // system does not allow that much locked memory.
+    bool
+    lock (std::size_t offset, std::size_t bytes);
+
+    // Copy bytes from offset to the file or socket fd, at
+    // its current position. On Linux the bytes do not pass
+    // through user space.
+    void
+    copy_to (int fd, std::size_t offset, std::size_t bytes);
+
 private:
     static
     std::pair<int, int>
     flags (file_mode mode);
+
+    void
+    unlock();
+
+    void
+    transfer (bool write,
+        file_request const* r, std::size_t n);
 };
 
 template <class _>
@@ -136,8 +186,12 @@ posix_file<_>::~posix_file()
 template <class _>
 posix_file<_>::posix_file (posix_file &&other)
     : fd_ (other.fd_)
+    , lock_ (other.lock_)
+    , lock_size_ (other.lock_size_)
 {
     other.fd_ = -1;
+    other.lock_ = nullptr;
+    other.lock_size_ = 0;
 }
 
 template <class _>
@@ -148,7 +202,11 @@ posix_file<_>::operator= (posix_file&& other)
         return *this;
     close();
     fd_ = other.fd_;
+    lock_ = other.lock_;
+    lock_size_ = other.lock_size_;
     other.fd_ = -1;
+    other.lock_ = nullptr;
+    other.lock_size_ = 0;
     return *this;
 }
 
@@ -156,6 +214,7 @@ template <class _>
 void
 posix_file<_>::close()
 {
+    unlock();
     if (fd_ != -1)
     {
         if (::close(fd_) != 0)
@@ -289,6 +348,79 @@ posix_file<_>::write (std::size_t offset,
     }
 }
 
+template <class _>
+void
+posix_file<_>::read_batch (
+    file_request const* r, std::size_t n)
+{
+    transfer(false, r, n);
+}
+
+template <class _>
+void
+posix_file<_>::write_batch (
+    file_request const* r, std::size_t n)
+{
+    transfer(true, r, n);
+}
+
+template <class _>
+void
+posix_file<_>::transfer (bool write,
+    file_request const* r, std::size_t n)
+{
+    enum
+    {
+        // Buffers per system call, within
+        // IOV_MAX of the supported systems
+        max_iov = 64
+    };
+    iovec iov[max_iov];
+    while (n > 0)
+    {
+        // Gather a run of adjacent requests
+        std::size_t count = 0;
+        std::size_t bytes = 0;
+        do
+        {
+            iov[count].iov_base = r[count].data;
+            iov[count].iov_len = r[count].bytes;
+            bytes += r[count].bytes;
+            ++count;
+        }
+        while (count < n && count < max_iov &&
+            r[count].offset == r[0].offset + bytes);
+        auto const used = write ?
+            ::pwritev(fd_, iov, static_cast<int>(count),
+                static_cast<off_t>(r[0].offset)) :
+            ::preadv(fd_, iov, static_cast<int>(count),
+                static_cast<off_t>(r[0].offset));
+        if (used == -1)
+            throw file_posix_error(
+                write ? "pwritev" : "preadv");
+        // Finish a short transfer one request at
+        // a time, which throws at the end of file.
+        auto left = static_cast<std::size_t>(used);
+        for (std::size_t i = 0; i < count; ++i)
+        {
+            auto const done = std::min(left, r[i].bytes);
+            left -= done;
+            if (done == r[i].bytes)
+                continue;
+            auto const p =
+                reinterpret_cast<char*>(r[i].data) + done;
+            if (write)
+                this->write(r[i].offset + done,
+                    p, r[i].bytes - done);
+            else
+                read(r[i].offset + done,
+                    p, r[i].bytes - done);
+        }
+        r += count;
+        n -= count;
+    }
+}
+
 template <class _>
 void
 posix_file<_>::sync()
@@ -298,6 +430,110 @@ posix_file<_>::sync()
             "fsync");
 }
 
+template <class _>
+void
+posix_file<_>::sync (durability level)
+{
+    switch(level)
+    {
+    case durability::full:
+        sync();
+        break;
+
+    case durability::data:
+#if defined(__APPLE__)
+        sync();
+#else
+        if (::fdatasync(fd_) != 0)
+            throw file_posix_error(
+                "fdatasync");
+#endif
+        break;
+
+    case durability::range:
+#if defined(__linux__)
+        if (::sync_file_range(fd_, 0, 0,
+                SYNC_FILE_RANGE_WAIT_BEFORE |
+                SYNC_FILE_RANGE_WRITE |
+                SYNC_FILE_RANGE_WAIT_AFTER) != 0)
+            throw file_posix_error(
+                "sync_file_range");
+#else
+        sync(durability::data);
+#endif
+        break;
+
+    case durability::none:
+        break;
+    }
+}
+
+template <class _>
+void
+posix_file<_>::copy_to (int fd,
+    std::size_t offset, std::size_t bytes)
+{
+#if defined(__linux__)
+    // copy_file_range only copies between files, and
+    // sendfile takes any output not opened for append.
+    // Other outputs are written from a buffer.
+    for (bool range = true; bytes > 0;)
+    {
+        ssize_t n;
+        if (range)
+        {
+            loff_t in = offset;
+            n = ::copy_file_range(
+                fd_, &in, fd, nullptr, bytes, 0);
+        }
+        else
+        {
+            off_t in = offset;
+            n = ::sendfile(fd, fd_, &in, bytes);
+        }
+        if (n == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno != EXDEV && errno != EINVAL &&
+                errno != EBADF && errno != ENOSYS &&
+                errno != EOPNOTSUPP)
+                throw file_posix_error(range ?
+                    "copy_file_range" : "sendfile");
+            if (! range)
+                break;
+            range = false;
+            continue;
+        }
+        if (n == 0)
+            throw file_short_read_error();
+        offset += n;
+        bytes -= n;
+    }
+#endif
+    char buf[65536];
+    while(bytes > 0)
+    {
+        auto const amount = std::min(bytes, sizeof(buf));
+        read(offset, buf, amount);
+        for (std::size_t used = 0; used < amount;)
+        {
+            auto const n = ::write(
+                fd, buf + used, amount - used);
+            if (n == -1)
+            {
+                if (errno == EINTR)
+                    continue;
+                throw file_posix_error(
+                    "write");
+            }
+            used += n;
+        }
+        offset += amount;
+        bytes -= amount;
+    }
+}
+
 template <class _>
 void
 posix_file<_>::trunc (std::size_t length)
@@ -307,6 +543,63 @@ posix_file<_>::trunc (std::size_t length)
             "ftruncate");
 }
 
+template <class _>
+void
+posix_file<_>::prefetch (
+    std::size_t offset, std::size_t bytes)
+{
+#ifndef __APPLE__
+    if (::posix_fadvise(fd_, offset, bytes,
+            POSIX_FADV_WILLNEED) != 0)
+        throw file_posix_error(
+            "fadvise");
+#endif
+}
+
+template <class _>
+bool
+posix_file<_>::lock (
+    std::size_t offset, std::size_t bytes)
+{
+    unlock();
+    if (bytes == 0)
+        return true;
+    // Mappings start on a page boundary
+    auto const page = static_cast<
+        std::size_t>(::sysconf(_SC_PAGESIZE));
+    auto const first = offset - offset % page;
+    auto const size = offset + bytes - first;
+    auto const p = ::mmap(nullptr, size,
+        PROT_READ, MAP_SHARED, fd_, first);
+    if (p == MAP_FAILED)
+        throw file_posix_error(
+            "mmap");
+    if (::mlock(p, size) != 0)
+    {
+        int const ec = errno;
+        ::munmap(p, size);
+        if (ec == ENOMEM || ec == EPERM || ec == EAGAIN)
+            return false;
+        throw file_posix_error(
+            "mlock", ec);
+    }
+    lock_ = p;
+    lock_size_ = size;
+    return true;
+}
+
+template <class _>
+void
+posix_file<_>::unlock()
+{
+    if (lock_)
+    {
+        ::munmap(lock_, lock_size_);
+        lock_ = nullptr;
+        lock_size_ = 0;
+    }
+}
+
 template <class _>
 std::pair<int, int>
 posix_file<_>::flags (file_mode mode)
@@ -10,33 +10,78 @@
 
 #include <nudb/common.hpp>
 #include <nudb/file.hpp>
+#include <nudb/observer.hpp>
 #include <nudb/detail/bucket.hpp>
+#include <nudb/detail/buffer.hpp>
 #include <nudb/detail/bulkio.hpp>
+#include <nudb/detail/file_traits.hpp>
 #include <nudb/detail/format.hpp>
 #include <algorithm>
 #include <cstddef>
+#include <cstdint>
+#include <cstring>
 #include <string>
+#include <utility>
+#include <vector>
 
 namespace nudb {
 
-/** Perform recovery on a database.
-    This implements the recovery algorithm by rolling back
-    any partially committed data.
-*/
+namespace detail {
+
+// Writes logged bucket images back to the key file in
+// ascending order, with consecutive buckets coalesced
+// into a single request. When a bucket was logged more
+// than once, the image logged last is written.
+//
+template <class File>
+void
+rollback (File& kf, std::size_t block_size,
+    std::vector<std::pair<std::size_t,
+        std::uint8_t const*>>& images, buffer& buf)
+{
+    std::stable_sort(images.begin(), images.end(),
+        [](std::pair<std::size_t, std::uint8_t const*> const& lhs,
+            std::pair<std::size_t, std::uint8_t const*> const& rhs)
+        {
+            return lhs.first < rhs.first;
+        });
+    std::vector<file_request> requests;
+    auto p = buf.get();
+    for (std::size_t i = 0; i < images.size(); ++i)
+    {
+        if (i + 1 < images.size() &&
+                images[i + 1].first == images[i].first)
+            continue;
+        auto const offset =
+            (images[i].first + 1) * block_size;
+        std::memcpy(p, images[i].second, block_size);
+        if (! requests.empty() && offset ==
+                requests.back().offset + requests.back().bytes)
+            requests.back().bytes += block_size;
+        else
+            requests.push_back({offset, p, block_size});
+        p += block_size;
+    }
+    write_batch(kf, requests.data(), requests.size());
+    images.clear();
+}
+
+// Performs recovery, reporting its phases to observer
+//
 template <
     class Hasher,
-    class Codec,
-    class File = native_file,
+    class File,
+    class Observer,
     class... Args>
 bool
 recover (
+    Observer& observer,
     path_type const& dat_path,
     path_type const& key_path,
     path_type const& log_path,
     std::size_t read_size,
     Args&&... args)
 {
-    using namespace detail;
     File df(args...);
     File lf(args...);
     File kf(args...);
@@ -44,8 +89,16 @@ recover (
         return false;
     if (! kf.open (file_mode::write, key_path))
         return false;
-    if (! lf.open (file_mode::append, log_path))
+    // The log is only read front to back until it is cleared
+    if (! lf.open (file_mode::scan, log_path))
         return true;
+    auto const lf_size = lf.actual_size();
+    if (lf_size == 0)
+    {
+        lf.close();
+        File::erase (log_path);
+        return true;
+    }
     dat_file_header dh;
     key_file_header kh;
     log_file_header lh;
@@ -71,58 +124,81 @@ recover (
             "short data file header");
     }
     verify<Hasher>(dh, kh);
-    auto const lf_size = lf.actual_size();
-    if (lf_size == 0)
-    {
-        lf.close();
-        File::erase (log_path);
-        return true;
-    }
     try
     {
         read (lf, lh);
         verify<Hasher>(kh, lh);
         auto const df_size = df.actual_size();
-        buffer buf(kh.block_size);
-        bucket b (kh.block_size, buf.get());
-        bulk_reader<File> r(lf, log_file_header::size,
+        auto const batch = std::max<std::size_t>(
+            1, read_size / kh.block_size);
+        buffer buf(batch * kh.block_size);
+        buffer wb(batch * kh.block_size);
+        std::vector<std::pair<std::size_t,
+            std::uint8_t const*>> images;
+        images.reserve(batch);
+        bulk_reader<File> r(lf, lh.header_size(),
             lf_size, read_size);
-        while(! r.eof())
+        bool done = false;
+        while(! done && ! r.eof())
         {
-            std::size_t n;
-            try
-            {
-                // Log Record
-                auto is = r.prepare(field<
-                    std::uint64_t>::size);
-                read<std::uint64_t>(is, n); // Index
-                b.read(r);                  // Bucket
-            }
-            catch (store_corrupt_error const&)
-            {
-                throw store_corrupt_error(
-                    "corrupt log record");
-            }
-            catch (file_short_read_error const&)
             {
-                // This means that the log file never
-                // got fully synced. In which case, there
-                // were no changes made to the key file.
-                // So we can recover by just truncating.
-                break;
+                observe<Observer> o (observer,
+                    phase::recover_read);
+                while(images.size() < batch && ! r.eof())
+                {
+                    std::size_t n;
+                    auto const p = buf.get() +
+                        images.size() * kh.block_size;
+                    bucket b (kh.block_size, p, kh.inline_bytes);
+                    try
+                    {
+                        // Log Record
+                        auto is = r.prepare(field<
+                            std::uint64_t>::size);
+                        read<std::uint64_t>(is, n); // Index
+                        b.read(r);                  // Bucket
+                    }
+                    catch (store_corrupt_error const&)
+                    {
+                        throw store_corrupt_error(
+                            "corrupt log record");
+                    }
+                    catch (file_short_read_error const&)
+                    {
+                        // This means that the log file never
+                        // got fully synced. In which case, there
+                        // were no changes made to the key file.
+                        // So we can recover by just truncating.
+                        done = true;
+                        break;
+                    }
+                    if (b.spill() &&
+                            b.spill() + kh.bucket_size > df_size)
+                        throw store_corrupt_error(
+                            "bad spill in log record");
+                    // VFALCO is this the right condition?
+                    if (n > kh.buckets)
+                        throw store_corrupt_error(
+                            "bad index in log record");
+                    // Log records are compact
+                    b.pad();
+                    images.emplace_back(n, p);
+                }
             }
-            if (b.spill() &&
-                    b.spill() + kh.bucket_size > df_size)
-                throw store_corrupt_error(
-                    "bad spill in log record");
-            // VFALCO is this the right condition?
-            if (n > kh.buckets)
-                throw store_corrupt_error(
-                    "bad index in log record");
-            b.write (kf, (n + 1) * kh.block_size);
+            observe<Observer> o (observer,
+                phase::recover_rollback);
+            rollback(kf, kh.block_size, images, wb);
         }
+        observe<Observer> o (observer, phase::recover_sync);
         kf.trunc(lh.key_file_size);
         df.trunc(lh.dat_file_size);
+        // The commit may have written its split credit
+        if (lh.version >= creditVersion &&
+            kh.split_credit != lh.split_credit)
+        {
+            kh.split_credit = lh.split_credit;
+            write(kf, kh);
+        }
         kf.sync();
         df.sync();
     }
@@ -130,14 +206,50 @@ recover (
     {
         // key and data files should be consistent here
     }
-
-    lf.trunc(0);
-    lf.sync();
+    lf.close();
+    if (! lf.open (file_mode::append, log_path))
+        throw store_error("nudb: log file removed during recovery");
+    {
+        observe<Observer> o (observer, phase::recover_sync);
+        lf.trunc(0);
+        lf.sync();
+    }
     lf.close();
     File::erase (log_path);
     return true;
 }
 
+} // detail
+
+/** Perform recovery on a database.
+    This implements the recovery algorithm by rolling back
+    any partially committed data.
+
+    After a clean close there is no log file, or an empty
+    one, and this returns without reading the database.
+    Otherwise the buckets in the log are gathered in
+    batches of up to `read_size` bytes, and each batch is
+    written to the key file in bucket order.
+*/
+template <
+    class Hasher,
+    class Codec,
+    class File = native_file,
+    class... Args>
+bool
+recover (
+    path_type const& dat_path,
+    path_type const& key_path,
+    path_type const& log_path,
+    std::size_t read_size,
+    Args&&... args)
+{
+    null_observer observer;
+    return detail::recover<Hasher, File>(observer,
+        dat_path, key_path, log_path, read_size,
+            args...);
+}
+
 } // nudb
 
 #endif
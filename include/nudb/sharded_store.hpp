@@ -0,0 +1,463 @@
+//
+// Copyright (c) 2015-2016 Vinnie Falco (vinnie dot falco at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef NUDB_SHARDED_STORE_HPP
+#define NUDB_SHARDED_STORE_HPP
+
+#include <nudb/common.hpp>
+#include <nudb/create.hpp>
+#include <nudb/recover.hpp>
+#include <nudb/store.hpp>
+#include <nudb/detail/format.hpp>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace nudb {
+
+/** A database partitioned by key into independent stores.
+
+    Each of the N shards is a complete store with its own
+    data, key and log files and its own commit thread, so
+    inserts into different shards do not contend. Keys are
+    routed by a hash which is independent of the hash used
+    to choose buckets within a shard.
+
+    The files of shard i are named by appending "." and i
+    to each path. Every shard is created with the same
+    appnum, salt and key size, and open checks that they
+    still agree. The number of shards is part of the
+    database and must not change once it is created; open
+    fails if there is a shard beyond the last one.
+
+    Each shard commits on its own, so after a crash the
+    shards recover independently: a key inserted before
+    the crash is either present or absent in its shard,
+    but inserts into different shards are not ordered.
+*/
+template <class Hasher, class Codec, class File, std::size_t N>
+class sharded_store
+{
+    static_assert(N > 0, "sharded_store needs a shard");
+
+public:
+    using hash_type = Hasher;
+    using codec_type = Codec;
+    using file_type = File;
+    using store_type = store<Hasher, Codec, File>;
+
+private:
+    std::array<store_type, N> shards_;
+    std::uint64_t seed_ = 0;
+    std::size_t key_size_ = 0;
+
+public:
+    sharded_store() = default;
+    sharded_store (sharded_store const&) = delete;
+    sharded_store& operator= (sharded_store const&) = delete;
+
+    /** Returns the path of a shard's file. */
+    static
+    path_type
+    shard_path (path_type const& path, std::size_t i)
+    {
+        return path + "." + std::to_string(i);
+    }
+
+    /** Returns the number of shards. */
+    static
+    std::size_t constexpr
+    shards()
+    {
+        return N;
+    }
+
+    /** Create the files of every shard.
+
+        The arguments are the same as for nudb::create,
+        and apply to each shard. If a shard cannot be
+        created, the files of earlier shards are erased.
+
+        @return `false` if any file could not be created.
+    */
+    template <class... Args>
+    static
+    bool
+    create (
+        path_type const& dat_path,
+        path_type const& key_path,
+        path_type const& log_path,
+        std::uint64_t appnum,
+        std::uint64_t salt,
+        std::size_t key_size,
+        std::size_t block_size,
+        float load_factor,
+        Args&&... args);
+
+    /** Recover every shard.
+
+        This is done by open, and is only needed
+        to repair the files without opening them.
+
+        @return `false` if any shard could not be recovered.
+    */
+    template <class... Args>
+    static
+    bool
+    recover (
+        path_type const& dat_path,
+        path_type const& key_path,
+        path_type const& log_path,
+        std::size_t read_size,
+        Args&&... args);
+
+    /** Returns `true` if the database is open. */
+    bool
+    is_open() const
+    {
+        return shards_[0].is_open();
+    }
+
+    /** Returns the shard at index i. */
+    store_type&
+    shard (std::size_t i)
+    {
+        return shards_[i];
+    }
+
+    /** Returns the index of the shard holding key. */
+    std::size_t
+    shard_index (void const* key) const
+    {
+        return detail::hash<Hasher>(
+            key, key_size_, seed_) % N;
+    }
+
+    std::uint64_t
+    appnum() const
+    {
+        return shards_[0].appnum();
+    }
+
+    /** Open every shard.
+
+        Each shard is recovered if needed. If any shard
+        fails to open, the shards already open are closed.
+
+        Throws:
+            store_corrupt_error if the shards disagree
+            store_error if the database has more shards
+
+        @return `true` if every shard could be opened.
+    */
+    template <class... Args>
+    bool
+    open (
+        path_type const& dat_path,
+        path_type const& key_path,
+        path_type const& log_path,
+        store_options const& options,
+        Args&&... args);
+
+    /** Close every shard.
+
+        Every shard is closed even if closing one throws,
+        after which the first exception is rethrown.
+    */
+    void
+    close();
+
+    /** Fetch a value. See store::fetch. */
+    template <class Handler>
+    bool
+    fetch (void const* key, Handler&& handler)
+    {
+        return shards_[shard_index(key)].fetch(
+            key, std::forward<Handler>(handler));
+    }
+
+    /** Fetch a value using a context. See store::fetch. */
+    template <class Handler>
+    bool
+    fetch (void const* key, fetch_context& ctx,
+        Handler&& handler)
+    {
+        return shards_[shard_index(key)].fetch(
+            key, ctx, std::forward<Handler>(handler));
+    }
+
+    /** Fetch a batch of values. See store::fetch_batch.
+
+        Keys are grouped by shard, and each group is
+        fetched as one batch from its shard.
+    */
+    template <class Handler>
+    std::size_t
+    fetch_batch (void const* const* keys,
+        std::size_t count, Handler&& handler);
+
+    /** Insert a value. See store::insert. */
+    bool
+    insert (void const* key, void const* data,
+        std::size_t bytes)
+    {
+        return shards_[shard_index(key)].insert(
+            key, data, bytes);
+    }
+
+    /** Insert a batch of values. See store::insert_batch.
+
+        Items are grouped by shard, and each group is
+        inserted as one batch into its shard.
+    */
+    std::vector<bool>
+    insert_batch (insert_item const* items,
+        std::size_t count);
+
+    /** Fetch a value without blocking. See store::async_fetch. */
+    template <class Handler>
+    void
+    async_fetch (void const* key, Handler&& handler)
+    {
+        shards_[shard_index(key)].async_fetch(
+            key, std::forward<Handler>(handler));
+    }
+
+    /** Insert a value without blocking. See store::async_insert. */
+    template <class Handler>
+    void
+    async_insert (void const* key, void const* data,
+        std::size_t bytes, Handler&& handler)
+    {
+        shards_[shard_index(key)].async_insert(
+            key, data, bytes, std::forward<Handler>(handler));
+    }
+
+private:
+    // Returns the indexes of the keys in each shard
+    template <class Key>
+    std::array<std::vector<std::size_t>, N>
+    partition (Key const& key, std::size_t count) const;
+};
+
+//------------------------------------------------------------------------------
+
+template <class Hasher, class Codec, class File, std::size_t N>
+template <class... Args>
+bool
+sharded_store<Hasher, Codec, File, N>::create (
+    path_type const& dat_path,
+    path_type const& key_path,
+    path_type const& log_path,
+    std::uint64_t appnum,
+    std::uint64_t salt,
+    std::size_t key_size,
+    std::size_t block_size,
+    float load_factor,
+    Args&&... args)
+{
+    for (std::size_t i = 0; i < N; ++i)
+    {
+        if (nudb::create<Hasher, Codec, File>(
+                shard_path(dat_path, i),
+                shard_path(key_path, i),
+                shard_path(log_path, i),
+                appnum, salt, key_size, block_size,
+                    load_factor, args...))
+            continue;
+        while (i-- > 0)
+        {
+            File::erase(shard_path(dat_path, i));
+            File::erase(shard_path(key_path, i));
+            File::erase(shard_path(log_path, i));
+        }
+        return false;
+    }
+    return true;
+}
+
+template <class Hasher, class Codec, class File, std::size_t N>
+template <class... Args>
+bool
+sharded_store<Hasher, Codec, File, N>::recover (
+    path_type const& dat_path,
+    path_type const& key_path,
+    path_type const& log_path,
+    std::size_t read_size,
+    Args&&... args)
+{
+    bool result = true;
+    for (std::size_t i = 0; i < N; ++i)
+        if (! nudb::recover<Hasher, Codec, File>(
+                shard_path(dat_path, i),
+                shard_path(key_path, i),
+                shard_path(log_path, i),
+                    read_size, args...))
+            result = false;
+    return result;
+}
+
+template <class Hasher, class Codec, class File, std::size_t N>
+template <class... Args>
+bool
+sharded_store<Hasher, Codec, File, N>::open (
+    path_type const& dat_path,
+    path_type const& key_path,
+    path_type const& log_path,
+    store_options const& options,
+    Args&&... args)
+{
+    if (is_open())
+        throw std::logic_error("nudb: already open");
+    {
+        // A database of more shards has a shard N
+        File f(args...);
+        if (f.open(file_mode::read, shard_path(dat_path, N)))
+            throw store_error("nudb: shard count mismatch");
+    }
+    std::size_t i = 0;
+    try
+    {
+        for (; i < N; ++i)
+        {
+            if (! shards_[i].open(
+                    shard_path(dat_path, i),
+                    shard_path(key_path, i),
+                    shard_path(log_path, i),
+                        options, args...))
+                break;
+            if (shards_[i].appnum() != shards_[0].appnum() ||
+                    shards_[i].salt() != shards_[0].salt() ||
+                    shards_[i].key_size() !=
+                        shards_[0].key_size())
+                throw store_corrupt_error(
+                    "shard mismatch");
+        }
+    }
+    catch (...)
+    {
+        // Shard i may be open if it was the mismatch
+        if (i < N)
+            ++i;
+        while (i-- > 0)
+            shards_[i].close();
+        throw;
+    }
+    if (i < N)
+    {
+        while (i-- > 0)
+            shards_[i].close();
+        return false;
+    }
+    key_size_ = shards_[0].key_size();
+    seed_ = detail::pepper<Hasher>(shards_[0].salt());
+    return true;
+}
+
+template <class Hasher, class Codec, class File, std::size_t N>
+void
+sharded_store<Hasher, Codec, File, N>::close()
+{
+    std::exception_ptr ep;
+    for (auto& s : shards_)
+    {
+        try
+        {
+            s.close();
+        }
+        catch (...)
+        {
+            if (! ep)
+                ep = std::current_exception();
+        }
+    }
+    if (ep)
+        std::rethrow_exception(ep);
+}
+
+template <class Hasher, class Codec, class File, std::size_t N>
+template <class Key>
+auto
+sharded_store<Hasher, Codec, File, N>::partition (
+    Key const& key, std::size_t count) const ->
+        std::array<std::vector<std::size_t>, N>
+{
+    std::array<std::vector<std::size_t>, N> result;
+    for (std::size_t i = 0; i < count; ++i)
+        result[shard_index(key(i))].push_back(i);
+    return result;
+}
+
+template <class Hasher, class Codec, class File, std::size_t N>
+template <class Handler>
+std::size_t
+sharded_store<Hasher, Codec, File, N>::fetch_batch (
+    void const* const* keys, std::size_t count,
+        Handler&& handler)
+{
+    auto const parts = partition(
+        [keys](std::size_t i)
+        {
+            return keys[i];
+        }, count);
+    std::size_t found = 0;
+    std::vector<void const*> sub;
+    for (std::size_t s = 0; s < N; ++s)
+    {
+        auto const& part = parts[s];
+        if (part.empty())
+            continue;
+        sub.clear();
+        for (auto const i : part)
+            sub.push_back(keys[i]);
+        found += shards_[s].fetch_batch(
+            sub.data(), sub.size(),
+            [&](std::size_t j,
+                void const* data, std::size_t size)
+            {
+                handler(part[j], data, size);
+            });
+    }
+    return found;
+}
+
+template <class Hasher, class Codec, class File, std::size_t N>
+std::vector<bool>
+sharded_store<Hasher, Codec, File, N>::insert_batch (
+    insert_item const* items, std::size_t count)
+{
+    auto const parts = partition(
+        [items](std::size_t i)
+        {
+            return items[i].key;
+        }, count);
+    std::vector<bool> result(count, false);
+    std::vector<insert_item> sub;
+    for (std::size_t s = 0; s < N; ++s)
+    {
+        auto const& part = parts[s];
+        if (part.empty())
+            continue;
+        sub.clear();
+        for (auto const i : part)
+            sub.push_back(items[i]);
+        auto const inserted = shards_[s].insert_batch(
+            sub.data(), sub.size());
+        for (std::size_t j = 0; j < part.size(); ++j)
+            result[part[j]] = inserted[j];
+    }
+    return result;
+}
+
+} // nudb
+
+#endif
@@ -9,16 +9,25 @@
 #define NUDB_STORE_HPP
 
 #include <nudb/common.hpp>
+#include <nudb/memory_budget.hpp>
+#include <nudb/observer.hpp>
 #include <nudb/recover.hpp>
+#include <nudb/detail/bloom_filter.hpp>
 #include <nudb/detail/bucket.hpp>
 #include <nudb/detail/buffer.hpp>
 #include <nudb/detail/bulkio.hpp>
 #include <nudb/detail/cache.hpp>
+#include <nudb/detail/epoch.hpp>
+#include <nudb/detail/file_traits.hpp>
+#include <nudb/detail/flow_control.hpp>
 #include <nudb/detail/format.hpp>
 #include <nudb/detail/gentex.hpp>
+#include <nudb/detail/key_index.hpp>
 #include <nudb/detail/pool.hpp>
-#include <boost/thread/lock_types.hpp>
-#include <boost/thread/shared_mutex.hpp>
+#include <nudb/detail/read_cache.hpp>
+#include <nudb/detail/stats.hpp>
+#include <nudb/detail/task_pool.hpp>
+#include <nudb/detail/value_cache.hpp>
 #include <algorithm>
 #include <array>
 #include <atomic>
@@ -31,14 +40,19 @@
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <deque>
 #include <exception>
+#include <functional>
 #include <limits>
 #include <memory>
 #include <mutex>
+#include <shared_mutex>
 #include <stdexcept>
 #include <string>
 #include <thread>
+#include <type_traits>
 #include <utility>
+#include <vector>
 
 namespace nudb {
 
@@ -56,18 +70,321 @@ namespace nudb {
 
 */
 
+/** Options used when opening a store. */
+struct store_options
+{
+    // Size of the blocks allocated by the pool arenas
+    std::size_t arena_alloc_size = 16 * 1024 * 1024;
+
+    // Bytes of free blocks which each pool and commit cache
+    // arena keeps when the store is idle, so that the next
+    // burst of inserts reuses them instead of allocating.
+    std::size_t arena_high_water = 0;
+
+    // Back the pool and commit cache arenas with huge pages
+    // where the system provides them, rounding blocks up to
+    // whole pages. Only Linux is supported.
+    bool arena_huge_pages = false;
+
+    // Bytes of key file buckets kept in memory across
+    // commits to serve fetches, or 0 to disable.
+    std::size_t cache_size = 0;
+
+    // Bytes of decompressed values kept in memory to serve
+    // repeated fetches, or 0 to disable. Values read from
+    // the data file are offered to the cache, which admits
+    // those fetched more often than the ones they replace.
+    std::size_t value_cache_size = 0;
+
+    // Read the whole key file into memory at open, in one
+    // array backed by huge pages where the system allows,
+    // and serve every bucket from it. Commits update the
+    // array as they write the key file.
+    bool index_in_memory = false;
+
+    // Buckets which the commit thread splits ahead of the
+    // load factor while the store is idle, or 0 to split
+    // only during commits. The early splits are made in
+    // small transactions of their own, and are used up by
+    // the growth of later commits, which then mostly just
+    // insert. The store runs at a lower load factor by up
+    // to this many buckets.
+    std::size_t split_ahead = 0;
+
+    // Threads which run async_fetch and async_insert,
+    // started on first use.
+    std::size_t async_threads = 4;
+
+    // Pool size at which inserts block until a
+    // commit finishes, or 0 for no limit.
+    std::size_t commit_limit = 1024 * 1024 * 1024;
+
+    // Number of full pools which may wait for a commit
+    // behind the one being committed. When the pool
+    // reaches commit_limit and there is room, it is
+    // sealed and inserts go on into a new pool instead
+    // of blocking. Each waiting pool holds up to
+    // commit_limit bytes of values in memory.
+    std::size_t commit_queue = 0;
+
+    // Commit duration which insert throttling aims for,
+    // or zero to only block at the commit limit. Setting
+    // it changes how insert behaves: once the pool grows
+    // past what commits in this time at the measured
+    // rate, inserts sleep to slow down to that rate.
+    std::chrono::milliseconds commit_target =
+        std::chrono::milliseconds(0);
+
+    // Weight of the newest commit in the measured
+    // commit rate, between 0 and 1.
+    float commit_smoothing = 0.25f;
+
+    // Bits per key of an in-memory filter, built when the
+    // store is opened, which lets lookups of absent keys
+    // skip the key file, or 0 to disable. The filter is
+    // sized for twice the keys present, and rebuilt from
+    // the key file by a commit which outgrows it.
+    std::size_t filter_bits = 0;
+
+    // Warm-up of the key file, done by a background thread
+    // started by open so that the first fetches do not wait
+    // on cold reads. See store::warmup.
+
+    // Hint that the key file will be read, then read it
+    // ahead so that its pages are in the system cache.
+    bool prefetch_key_file = false;
+
+    // Lock the pages of the key file in memory, if the
+    // File supports it and the system allows it.
+    bool lock_key_file = false;
+
+    // Fill the read cache with buckets from the key file,
+    // up to cache_size.
+    bool warm_cache = false;
+
+    // How commits sync the files. Anything less than full
+    // relies on the file system keeping the file sizes. At
+    // range, only the data file and the log header are
+    // synced with sync_file_range; the log before buckets
+    // are written, and the key file before the log is
+    // emptied, are synced at data, which also flushes the
+    // data file if it is on the same device. With none a
+    // power failure can lose commits or leave the database
+    // in need of a rebuild. Recovery from a process crash
+    // works at every level.
+    durability sync_level = durability::full;
+
+    // Path of a file passed to the Codec constructor, such
+    // as a compression dictionary, or empty for none. Only
+    // a Codec which declares the nested type dictionary_file
+    // takes one; for others, open throws if this is set.
+    path_type codec_dictionary;
+
+    // Open the data and key files for reading only. No log
+    // file is made and no commit thread is started, and
+    // fetches take no locks other than that of the read
+    // cache, so any number of processes may open the same
+    // store this way at once. Inserts throw. Opening fails
+    // if the log file holds a commit awaiting recovery, and
+    // the store must not be opened for writing meanwhile.
+    bool read_only = false;
+
+    // A budget shared with other stores, or null. The
+    // store reports the memory of its pools and commit
+    // caches to it, and commits early when asked. Its read
+    // cache takes the share the budget grants in place of
+    // cache_size, and keeps the share of the time it was
+    // opened if it is read only. The budget must outlive
+    // the store.
+    memory_budget* budget = nullptr;
+};
+
+namespace detail {
+
+// Determines if a Codec is made from a dictionary file
+template <class Codec, class = void>
+struct has_dictionary_file : std::false_type
+{
+};
+
+template <class Codec>
+struct has_dictionary_file<Codec, typename std::conditional<
+        true, void, typename Codec::dictionary_file>::type>
+    : std::true_type
+{
+};
+
+template <class Codec>
+Codec
+make_codec (path_type const& path, std::true_type)
+{
+    if (path.empty())
+        return Codec{};
+    return Codec{path};
+}
+
+template <class Codec>
+Codec
+make_codec (path_type const& path, std::false_type)
+{
+    if (! path.empty())
+        throw std::logic_error(
+            "nudb: codec takes no dictionary");
+    return Codec{};
+}
+
+// Returns a Codec made from path, when it takes one
+//
+template <class Codec>
+Codec
+make_codec (path_type const& path)
+{
+    return make_codec<Codec>(path,
+        has_dictionary_file<Codec>{});
+}
+
+} // detail
+
+/** Progress of the key file warm-up begun by store::open. */
+struct warmup_progress
+{
+    std::uint64_t amount = 0;   // bytes of buckets warmed
+    std::uint64_t total = 0;    // bytes of buckets at open
+    bool done = true;           // `true` once the warm-up ended
+    bool locked = false;        // `true` if the pages are locked
+};
+
+/** A snapshot of the counters of an open store.
+
+    Counts start at zero when the store is opened. Each is
+    read separately, so a snapshot taken while other threads
+    use the store need not add up exactly.
+*/
+struct store_stats
+{
+    enum
+    {
+        // Number of slots in spill_depth
+        spill_depths = 8
+    };
+
+    // Fetches, by where the key was found or ruled out.
+    // Keys of fetch_batch are counted one by one.
+    std::uint64_t fetch_p1 = 0;     // in the pool
+    std::uint64_t fetch_queue = 0;  // in a pool awaiting commit
+    std::uint64_t fetch_p0 = 0;     // in the pool being committed
+    std::uint64_t fetch_c1 = 0;     // bucket changed by the commit
+    std::uint64_t fetch_filter = 0; // ruled out by the filter
+    std::uint64_t fetch_value = 0;  // in the value cache
+    std::uint64_t fetch_disk = 0;   // bucket from the read cache
+                                    // or the key file
+
+    std::uint64_t cache_hits = 0;   // buckets from the read cache
+                                    // or the in-memory index
+    std::uint64_t key_reads = 0;    // buckets from the key file
+    std::uint64_t data_reads = 0;   // records and spills read from
+                                    // the data file
+
+    // Lookups in buckets by the number of spill records
+    // followed, the last slot counting longer chains.
+    std::array<std::uint64_t, spill_depths> spill_depth{};
+
+    // Buckets read from the read cache or key file to
+    // check that an inserted key is not a duplicate.
+    std::uint64_t insert_reads = 0;
+
+    // Buckets split ahead of the load factor while idle,
+    // and the transactions which split them.
+    std::uint64_t early_splits = 0;
+    std::uint64_t split_commits = 0;
+
+    // Bytes each commit stage wrote, summed over commits
+    std::uint64_t commits = 0;
+    std::uint64_t log_bytes = 0;    // rollback records
+    std::uint64_t data_bytes = 0;   // data records and spills
+    std::uint64_t key_bytes = 0;    // buckets
+
+    std::chrono::nanoseconds commit_time{0};    // total
+    std::chrono::nanoseconds commit_max{0};     // longest
+
+    // Time commits waited for fetches using the buckets
+    // from before the commit, to leave their epoch.
+    std::uint64_t gentex_waits = 0;
+    std::chrono::nanoseconds gentex_time{0};
+
+    // Inserts which blocked at the commit limit
+    std::uint64_t limit_waits = 0;
+    std::chrono::nanoseconds limit_time{0};
+
+    // Bytes of values currently held in memory
+    std::size_t p1_size = 0;        // the pool
+    std::size_t queue_size = 0;     // pools awaiting commit
+    std::size_t p0_size = 0;        // the pool being committed
+};
+
+template <class Hasher, class Codec, class File,
+    std::size_t KeySize = 0, class Observer = null_observer>
+class store;
+
+/** Reusable buffers for lookups in a store.
+
+    A context passed to store::fetch holds the buffers
+    a lookup needs, so that repeated fetches through the
+    same context stop allocating once the buffers have
+    grown to fit. A context may be shared by stores of
+    any type, but not by two fetches at the same time.
+
+    Calls without a context use one belonging to the
+    calling thread.
+*/
+class fetch_context
+{
+private:
+    template <class, class, class, std::size_t, class>
+    friend class store;
+
+    detail::buffer bucket_;     // bucket from key file
+    detail::buffer record_;     // data record
+    detail::buffer value_;      // codec output
+    detail::buffer spill_;      // spill bucket
+    bool busy_ = false;
+
+public:
+    fetch_context() = default;
+    fetch_context (fetch_context const&) = delete;
+    fetch_context& operator= (fetch_context const&) = delete;
+};
+
+/** A key/value pair passed to store::insert_batch. */
+struct insert_item
+{
+    void const* key;
+    void const* data;
+    std::size_t size;
+};
+
 /** A simple key/value database
     @tparam Hasher The hash function to use on key
     @tparam Codec The codec to apply to value data
     @tparam File The type of File object to use.
+    @tparam KeySize The size of every key, or zero to use
+    the size in the key file. A nonzero size must match the
+    key file, and lets keys be compared, hashed and copied
+    with code for that size.
+    @tparam Observer Told of the phases of commits, recovery
+    and file reads, see null_observer.
 */
-template <class Hasher, class Codec, class File>
+template <class Hasher, class Codec, class File,
+    std::size_t KeySize, class Observer>
 class store
 {
 public:
     using hash_type = Hasher;
     using codec_type = Codec;
     using file_type = File;
+    using observer_type = Observer;
+
+    static std::size_t constexpr fixed_key_size = KeySize;
 
 private:
     // requires 64-bit integers or better
@@ -79,17 +396,83 @@ private:
         bulk_write_size     = 16 * 1024 * 1024,
 
         // Size of bulk reads during recover
-        recover_read_size   = 16 * 1024 * 1024
+        recover_read_size   = 16 * 1024 * 1024,
+
+        // Largest single data file read in fetch_batch
+        batch_read_size     = 1024 * 1024,
+
+        // Gap between data records read through
+        // in a single merged read in fetch_batch
+        batch_read_gap      = 4096,
+
+        // Number of insert locks, a power of two
+        insert_stripes      = 64,
+
+        // Size of data file reads in tail
+        tail_read_size      = 1024 * 1024,
+
+        // Commit boundaries kept for tail
+        tail_boundaries     = 65536,
+
+        // Most buckets split ahead by one transaction
+        split_batch         = 256,
+
+        // Most queued async fetches looked up together
+        async_batch         = 64
     };
 
     using clock_type =
         std::chrono::steady_clock;
 
     using shared_lock_type =
-        boost::shared_lock<boost::shared_mutex>;
+        std::shared_lock<detail::epoch>;
 
     using unique_lock_type =
-        boost::unique_lock<boost::shared_mutex>;
+        std::unique_lock<detail::epoch>;
+
+    using commit_handler =
+        std::function<void(std::exception_ptr)>;
+
+    using fetch_handler = std::function<void(
+        std::exception_ptr, void const*, std::size_t)>;
+
+    struct async_fetch_op
+    {
+        std::vector<std::uint8_t> key;
+        fetch_handler handler;
+    };
+
+    using pool_type = detail::pool_t<KeySize>;
+
+    // Updated as the store runs, see stats()
+    struct counters
+    {
+        detail::stat_counter fetch_p1;
+        detail::stat_counter fetch_queue;
+        detail::stat_counter fetch_p0;
+        detail::stat_counter fetch_c1;
+        detail::stat_counter fetch_filter;
+        detail::stat_counter fetch_value;
+        detail::stat_counter fetch_disk;
+        detail::stat_counter cache_hits;
+        detail::stat_counter key_reads;
+        detail::stat_counter data_reads;
+        detail::stat_histogram<
+            store_stats::spill_depths> spill_depth;
+        detail::stat_counter insert_reads;
+        detail::stat_counter early_splits;
+        detail::stat_counter split_commits;
+        detail::stat_counter commits;
+        detail::stat_counter log_bytes;
+        detail::stat_counter data_bytes;
+        detail::stat_counter key_bytes;
+        detail::stat_counter commit_time;   // nanoseconds
+        detail::stat_counter commit_max;    // nanoseconds
+        detail::stat_counter gentex_waits;
+        detail::stat_counter gentex_time;   // nanoseconds
+        detail::stat_counter limit_waits;
+        detail::stat_counter limit_time;    // nanoseconds
+    };
 
     struct state
     {
@@ -99,16 +482,48 @@ private:
         path_type dp;
         path_type kp;
         path_type lp;
-        detail::pool p0;
-        detail::pool p1;
+        pool_type p0;
+        pool_type p1;
+        std::deque<pool_type> pq;    // sealed, oldest first
         detail::cache c0;
         detail::cache c1;
+        detail::read_cache rc;
+        detail::value_cache vc;
+        detail::key_index ki;       // index_in_memory
+        detail::io_worker io;       // performs commit I/O
+        detail::io_worker lio;      // writes the log file
+        detail::flow_control fc;    // throttles insert
+        detail::bloom_filter bf;    // keys in the key file
+        durability const dl;        // commit sync level
+        std::vector<commit_handler> h0; // commit of p0
+        std::vector<commit_handler> h1; // commit of p1
+        std::deque<std::vector<
+            commit_handler>> hq;        // commits of pq
+        std::mutex am;                  // protects aq
+        std::deque<async_fetch_op> aq;  // async fetches
+        detail::task_pool tp;           // runs async calls
+        std::size_t const alloc_size;   // arena_alloc_size
+        std::size_t const high_water;   // arena_high_water
+        bool const huge_pages;          // arena_huge_pages
+        std::size_t const queue_size;   // commit_queue
+        std::size_t const split_ahead;  // split_ahead
         Codec const codec;
         detail::key_file_header const kh;
+        counters sc;
 
         // pool commit high water mark
         std::size_t pool_thresh = 1;
 
+        // Memory of p0, c0 and c1, set by the commit
+        std::size_t commit_memory = 0;
+
+        // Data file size at open, then at the end of each
+        // commit, oldest first. Guarded by store::tm_.
+        std::deque<std::uint64_t> boundaries;
+
+        // Destroyed first, leaving the budget
+        memory_budget::member bm;
+
         state (state const&) = delete;
         state& operator= (state const&) = delete;
 
@@ -116,10 +531,11 @@ private:
             path_type const& dp_, path_type const& kp_,
                 path_type const& lp_,
                     detail::key_file_header const& kh_,
-                        std::size_t arena_alloc_size);
+                        store_options const& options);
     };
 
     bool open_ = false;
+    bool read_only_ = false;
 
     // VFALCO Unfortunately boost::optional doesn't support
     //        move construction so we use unique_ptr instead.
@@ -129,23 +545,40 @@ private:
     std::size_t thresh_;            // split threshold
     std::size_t buckets_;           // number of buckets
     std::size_t modulus_;           // hash modulus
-
-    std::mutex u_;                  // serializes insert()
-    detail::gentex g_;
-    boost::shared_mutex m_;
+    std::size_t ahead_ = 0;         // buckets split early
+    std::size_t credit_ = 0;        // ahead_ in the key file
+
+    // Inserts of keys with the same hash stripe are
+    // serialized, from the duplicate check until the
+    // key is in the pool. Other inserts run their
+    // checks concurrently.
+    std::array<std::mutex, insert_stripes> u_;
+    std::mutex cm_;                 // protects s_->rc
+    std::mutex tm_;                 // protects s_->boundaries
+    // Guards the pools and c1. Readers also hold an epoch
+    // of it while reading the key file, see commit.
+    detail::epoch m_;
     std::thread thread_;
     std::condition_variable_any cond_;
 
-    // These allow insert to block, preventing the pool
-    // from exceeding a limit. Currently the limit is
-    // baked in, and can only be reached during sustained
-    // insertions, such as while importing.
-    std::size_t commit_limit_ = 1UL * 1024 * 1024 * 1024;
+    // This allows insert to block, preventing the pool
+    // from exceeding s_->fc.limit(). The limit can only
+    // be reached during sustained insertions, such as
+    // while importing.
     std::condition_variable_any cond_limit_;
 
     std::atomic<bool> epb_;         // `true` when ep_ set
     std::exception_ptr ep_;
 
+    std::thread warm_thread_;       // warms the key file
+    std::atomic<bool> warm_stop_ {false};
+    std::atomic<bool> warm_done_ {true};
+    std::atomic<bool> warm_locked_ {false};
+    std::atomic<std::size_t> warm_amount_ {0};
+    std::size_t warm_total_ = 0;
+
+    Observer obs_;
+
 public:
     store() = default;
     store (store const&) = delete;
@@ -174,6 +607,16 @@ public:
         return open_;
     }
 
+    /** Returns `true` if the database is open read-only.
+
+        See store_options::read_only.
+    */
+    bool
+    read_only() const
+    {
+        return read_only_;
+    }
+
     path_type const&
     dat_path() const
     {
@@ -198,6 +641,51 @@ public:
         return s_->kh.appnum;
     }
 
+    std::size_t
+    key_size() const
+    {
+        return KeySize != 0 ? KeySize : s_->kh.key_size;
+    }
+
+    std::uint64_t
+    salt() const
+    {
+        return s_->kh.salt;
+    }
+
+    /** Returns the progress of the key file warm-up.
+
+        The warm-up is started by open when any of the
+        warm-up settings in store_options is set. It only
+        affects performance: if it fails, it ends early.
+    */
+    warmup_progress
+    warmup() const
+    {
+        warmup_progress result;
+        result.amount = warm_amount_.load();
+        result.total = warm_total_;
+        result.done = warm_done_.load();
+        result.locked = warm_locked_.load();
+        return result;
+    }
+
+    /** Returns the observer of the store. */
+    Observer&
+    observer()
+    {
+        return obs_;
+    }
+
+    /** Returns a snapshot of the counters of the store.
+
+        Counting is always on, and cheap enough for the
+        hot paths. This may be called from any thread
+        while the store is open.
+    */
+    store_stats
+    stats();
+
     /** Close the database.
 
         All data is committed before closing.
@@ -222,6 +710,21 @@ public:
         std::size_t arena_alloc_size,
         Args&&... args);
 
+    /** Open a database.
+
+        @param options The settings to use for the open store
+        @param args Arguments passed to File constructors
+        @return `true` if each file could be opened
+    */
+    template <class... Args>
+    bool
+    open (
+        path_type const& dat_path,
+        path_type const& key_path,
+        path_type const& log_path,
+        store_options const& options,
+        Args&&... args);
+
     /** Fetch a value.
 
         If key is found, Handler will be called as:
@@ -230,23 +733,253 @@ public:
         where data and size represent the value. If the
         key is not found, the handler is not called.
 
+        The value is only valid until the handler returns.
+        With a codec which does not transform the data,
+        such as `identity`, the handler sees the value in
+        place without a copy: in the memory pool for keys
+        not yet committed, in the bucket for inline
+        values, or in the mapping of a mapped data file.
+        Otherwise the record is read into a buffer once.
+
         @return `true` if a matching key was found.
     */
     template <class Handler>
     bool
     fetch (void const* key, Handler&& handler);
 
+    /** Fetch a value using the buffers in a context.
+
+        This is the same as fetch without a context,
+        except that scratch memory comes from ctx. The
+        handler may not use ctx in a fetch of its own.
+
+        Throws:
+            std::logic_error if ctx is in use
+    */
+    template <class Handler>
+    bool
+    fetch (void const* key, fetch_context& ctx,
+        Handler&& handler);
+
+    /** Fetch a batch of values.
+
+        For each key that is found, Handler will be called as:
+            `(void)()(std::size_t i, void const* data, std::size_t size)`
+
+        where i is the index of the key in the batch, and data
+        and size represent the value. Keys which are not found
+        are not reported. The order of calls is unspecified.
+
+        Each distinct bucket is read from the key file once,
+        and reads of data records are sorted by offset and
+        merged when they are close together in the file.
+        As with fetch, values are seen in place when they
+        are in the pool, inline, or in a mapped data file.
+
+        @param keys An array of count pointers to keys.
+        @return The number of keys found.
+    */
+    template <class Handler>
+    std::size_t
+    fetch_batch (void const* const* keys,
+        std::size_t count, Handler&& handler);
+
     /** Insert a value.
 
         Returns:
             `true` if the key was inserted,
             `false` if the key already existed
+
+        Throws:
+            std::logic_error if the store is read-only
     */
     bool
     insert (void const* key, void const* data,
         std::size_t bytes);
 
+    /** Insert a batch of values.
+
+        The batch is inserted while holding the insert locks
+        of its keys once. Duplicate checks are grouped by bucket so each
+        distinct bucket is read at most once.
+
+        If the same key appears more than once in the batch,
+        only the first occurrence is inserted.
+
+        @param items An array of count key/value pairs.
+        @return A vector with one element per item, set to
+            `true` if the key was inserted, or `false` if the
+            key already existed.
+    */
+    std::vector<bool>
+    insert_batch (insert_item const* items,
+        std::size_t count);
+
+    /** Insert a value, with notification of its commit.
+
+        This is the same as insert without a handler, except
+        that when the key is inserted, Handler will be called
+        as:
+            `(void)()(std::exception_ptr ep)`
+
+        once the commit which writes the value has synced the
+        data and key files, or ended with an error, which ep
+        then holds. If the key already existed, the handler
+        is not called.
+
+        Handlers are called from the commit thread, in the
+        order of their inserts, after a commit of many
+        inserts, so that callers can acknowledge them as a
+        group. A handler should not block, throw, or call
+        into the store.
+    */
+    template <class Handler>
+    bool
+    insert (void const* key, void const* data,
+        std::size_t bytes, Handler&& handler);
+
+    /** Insert a batch of values, with notification of their commit.
+
+        This is the same as insert_batch without a handler,
+        except that if any key is inserted, Handler is called
+        once all of the inserted values are committed, as
+        described for insert with a handler.
+    */
+    template <class Handler>
+    std::vector<bool>
+    insert_batch (insert_item const* items,
+        std::size_t count, Handler&& handler);
+
+    /** Fetch a value without blocking the caller.
+
+        The key is copied and looked up by one of the
+        threads set by store_options::async_threads.
+        Handler will be called there as:
+            `(void)()(std::exception_ptr ep,
+                void const* data, std::size_t size)`
+
+        where data and size represent the value, or are
+        `nullptr` and 0 if the key is not found, or if the
+        lookup failed, when ep holds the error. The value
+        is only valid until the handler returns.
+
+        Fetches waiting for a thread are looked up together
+        through fetch_batch, so that a File which provides
+        read_batch, such as uring_file, submits their reads
+        at once.
+
+        A handler should not block or throw. To resume on
+        an executor, such as that of a coroutine, it can
+        copy the value and post the continuation there.
+    */
+    template <class Handler>
+    void
+    async_fetch (void const* key, Handler&& handler);
+
+    /** Insert a value without blocking the caller.
+
+        The key and value are copied and inserted by one of
+        the threads set by store_options::async_threads,
+        which is the one to block if the pool is at the
+        commit limit. Handler will be called as:
+            `(void)()(std::exception_ptr ep, bool inserted)`
+
+        once the commit which writes the value has synced,
+        from the commit thread, or at once if the key already
+        existed or the insert failed, when ep holds the error.
+
+        Throws:
+            std::logic_error if the store is read-only
+    */
+    template <class Handler>
+    void
+    async_insert (void const* key, void const* data,
+        std::size_t bytes, Handler&& handler);
+
+    /** Stream the records appended to the data file.
+
+        Records from offset `from` up to the end of the last
+        commit are read from the open data file, while
+        inserts and commits go on. For each data record,
+        RecordFunction is called as:
+            `bool(std::uint64_t offset, void const* key,
+                std::size_t key_size, void const* data,
+                    std::size_t size)`
+
+        with the decompressed value. Spill records are
+        skipped. Between records, at the end of each commit
+        made since the store was opened, CommitFunction is
+        called as:
+            `bool(std::uint64_t offset)`
+
+        with the data file offset of the end of the commit.
+        Only the ends of the latest 65536 commits are kept.
+        If either function returns `false`, the stream ends.
+
+        Records up to the end of a commit are only certain
+        to survive a crash once the commit ended, so a
+        replica which applies records up to the last end
+        reported holds whole commits.
+
+        @param from The offset of a record, as returned by an
+        earlier call, or reported to CommitFunction. Zero is
+        the first record.
+
+        @return The offset following the last record or
+        commit end reported, from which to stream again.
+
+        Throws:
+            std::logic_error if from is past the last commit
+    */
+    template <class RecordFunction, class CommitFunction>
+    std::uint64_t
+    tail (std::uint64_t from, RecordFunction&& record,
+        CommitFunction&& commit);
+
+    /** Copy the bytes appended to the data file.
+
+        The data file from offset `from` up to the end of the
+        last commit is copied as it is to fd, which may be a
+        file or a socket, at its current position. On Linux
+        this uses copy_file_range or sendfile, so the bytes
+        do not pass through user space. The records can be
+        appended to the data file of a replica, whose key
+        file is then rebuilt or brought up to date.
+
+        File must provide:
+            `void copy_to(int fd, std::size_t offset,
+                std::size_t bytes)`
+
+        @param from As for tail.
+
+        @return The end of the last commit, which is the
+        offset copied up to.
+
+        Throws:
+            std::logic_error if from is past the last commit
+    */
+    std::uint64_t
+    tail_copy (std::uint64_t from, int fd);
+
 private:
+    // A key in fetch_batch
+    struct batch_key
+    {
+        std::size_t i;      // index in the batch
+        std::size_t h;      // hash
+        std::size_t n;      // bucket index
+        std::size_t slot;   // bucket slot in the batch buffer
+        bool found;
+    };
+
+    // A possible match for a key in fetch_batch
+    struct batch_read
+    {
+        std::size_t offset; // offset of the key in the data file
+        std::size_t size;   // value size
+        batch_key* k;
+    };
+
     void
     rethrow()
     {
@@ -254,19 +987,147 @@ private:
             std::rethrow_exception(ep_);
     }
 
+    // Returns the key and value stored in entry i of b,
+    // or nullptr if the value is only in the data file.
+    //
+    std::uint8_t const*
+    inline_record (detail::bucket const& b,
+        std::size_t i, std::size_t size) const
+    {
+        if (b.inline_bytes() == 0 ||
+                size > s_->kh.inline_size)
+            return nullptr;
+        return b.inline_data(i);
+    }
+
+    // Copy the inline record of entry i in b to the
+    // entry at j in b2, after an insert made it.
+    //
+    static
+    void
+    move_inline (detail::bucket const& b, std::size_t i,
+        detail::bucket& b2, std::size_t j)
+    {
+        std::memcpy(b2.inline_data(j),
+            b.inline_data(i), b.inline_bytes());
+    }
+
+    bool
+    insert (void const* key, void const* data,
+        std::size_t size, fetch_context& ctx,
+            commit_handler* handler);
+
+    std::vector<bool>
+    insert_batch (insert_item const* items,
+        std::size_t count, commit_handler* handler);
+
+    // Calls each handler with ep, then clears them
+    static
+    void
+    complete (std::vector<commit_handler>& handlers,
+        std::exception_ptr ep);
+
+    // Returns the element for a key in a pool which
+    // is not yet committed, or nullptr. m_ must be held.
+    // A fetch counts where the key was found.
+    typename pool_type::element*
+    find_pooled (std::size_t h, void const* key,
+        bool fetching = false);
+
+    // Called with m_ held after an insert reaches the
+    // commit limit. Seals the pool, or waits for room.
+    void
+    limit_pool (unique_lock_type& m);
+
+    // Returns the insert lock for a key hash
+    std::mutex&
+    insert_lock (std::size_t h)
+    {
+        return u_[h & (insert_stripes - 1)];
+    }
+
+    // Marks a context as in use for its lifetime
+    class context_guard
+    {
+        fetch_context& ctx_;
+
+    public:
+        explicit
+        context_guard (fetch_context& ctx)
+            : ctx_ (ctx)
+        {
+            if (ctx_.busy_)
+                throw std::logic_error(
+                    "nudb: fetch context in use");
+            ctx_.busy_ = true;
+        }
+
+        ~context_guard()
+        {
+            ctx_.busy_ = false;
+        }
+    };
+
+    // Calls f with this thread's context, or with a
+    // temporary one if a handler on this thread is
+    // still using it.
+    //
+    template <class Function>
+    static
+    auto
+    with_context (Function&& f)
+    {
+        static thread_local fetch_context ctx;
+        if (! ctx.busy_)
+            return f(ctx);
+        fetch_context tmp;
+        return f(tmp);
+    }
+
+    // Fetch key from the value cache
+    //
+    template <class Handler>
+    bool
+    fetch_cached (std::size_t h, void const* key,
+        fetch_context& ctx, Handler&& handler);
+
     // Fetch key in loaded bucket b or its spills.
     //
     template <class Handler>
     bool
     fetch (std::size_t h, void const* key,
-        detail::bucket b, Handler&& handler);
+        detail::bucket b, fetch_context& ctx,
+            Handler&& handler);
+
+    // Look up keys in bk which are not in the pool
+    //
+    template <class Function>
+    void
+    fetch_batch (void const* const* keys,
+        std::vector<batch_key>& bk, shared_lock_type& m,
+            bool values, Function&& f);
 
     // Returns `true` if the key exists
     // lock is unlocked after the first bucket processed
     //
     bool
     exists (std::size_t h, void const* key,
-        shared_lock_type* lock, detail::bucket b);
+        shared_lock_type* lock, detail::bucket b,
+            fetch_context& ctx);
+
+    // Read bucket n from the read cache or the key file.
+    // buf must point to at least block_size bytes.
+    //
+    detail::bucket
+    read_bucket (std::size_t n, void* buf);
+
+    // Read the bucket at offset in f. If f is mapped the
+    // bucket refers to the mapping and must not be modified.
+    // Otherwise it is read into buf, which must point to at
+    // least block_size bytes.
+    //
+    detail::bucket
+    read_bucket (File& f, std::size_t offset, void* buf);
 
     void
     split (detail::bucket& b1, detail::bucket& b2,
@@ -276,10 +1137,36 @@ private:
 
     detail::bucket
     load (std::size_t n, detail::cache& c1,
-        detail::cache& c0, void* buf);
+        detail::cache& c0, void* buf,
+            detail::bulk_writer<File>& lw);
+
+    void
+    fill_filter (state& s, detail::bloom_filter& bf,
+        std::size_t buckets);
+
+    void
+    grow_filter (std::size_t buckets);
 
     void
-    commit();
+    warm (bool prefetch, bool lock, bool fill);
+
+    std::vector<std::uint64_t>
+    tail_range (std::uint64_t& from);
+
+    void
+    async_drain();
+
+    bool
+    commit_due (std::size_t pool) const;
+
+    void
+    charge();
+
+    void
+    share_budget();
+
+    void
+    commit (std::size_t splits = 0);
 
     void
     run();
@@ -287,31 +1174,54 @@ private:
 
 //------------------------------------------------------------------------------
 
-template <class Hasher, class Codec, class File>
-store<Hasher, Codec, File>::state::state (
+template <class Hasher, class Codec, class File,
+    std::size_t KeySize, class Observer>
+store<Hasher, Codec, File, KeySize, Observer>::state::state (
     File&& df_, File&& kf_, File&& lf_,
         path_type const& dp_, path_type const& kp_,
             path_type const& lp_,
                 detail::key_file_header const& kh_,
-                    std::size_t arena_alloc_size)
+                    store_options const& options)
     : df (std::move(df_))
     , kf (std::move(kf_))
     , lf (std::move(lf_))
     , dp (dp_)
     , kp (kp_)
     , lp (lp_)
-    , p0 (kh_.key_size, arena_alloc_size)
-    , p1 (kh_.key_size, arena_alloc_size)
-    , c0 (kh_.key_size, kh_.block_size)
-    , c1 (kh_.key_size, kh_.block_size)
+    , p0 (kh_.key_size, options.arena_alloc_size,
+        options.arena_high_water, options.arena_huge_pages)
+    , p1 (kh_.key_size, options.arena_alloc_size,
+        options.arena_high_water, options.arena_huge_pages)
+    , c0 (kh_.key_size, kh_.block_size, kh_.inline_bytes,
+        options.arena_high_water, options.arena_huge_pages)
+    , c1 (kh_.key_size, kh_.block_size, kh_.inline_bytes,
+        options.arena_high_water, options.arena_huge_pages)
+    , rc (kh_.block_size, options.cache_size,
+        kh_.inline_bytes)
+    , vc (kh_.key_size, options.value_cache_size)
+    , ki (options.index_in_memory ? kh_.block_size : 0)
+    , fc (options.commit_limit, options.commit_target,
+        options.commit_smoothing)
+    , bf (2 * kh_.buckets * kh_.capacity *
+        kh_.load_factor / 65536, options.filter_bits)
+    , dl (options.sync_level)
+    , tp (options.async_threads)
+    , alloc_size (options.arena_alloc_size)
+    , high_water (options.arena_high_water)
+    , huge_pages (options.arena_huge_pages)
+    , queue_size (options.commit_queue)
+    , split_ahead (options.split_ahead)
+    , codec (detail::make_codec<Codec>(
+        options.codec_dictionary))
     , kh (kh_)
 {
 }
 
 //------------------------------------------------------------------------------
 
-template <class Hasher, class Codec, class File>
-store<Hasher, Codec, File>::~store()
+template <class Hasher, class Codec, class File,
+    std::size_t KeySize, class Observer>
+store<Hasher, Codec, File, KeySize, Observer>::~store()
 {
     try
     {
@@ -324,71 +1234,201 @@ store<Hasher, Codec, File>::~store()
     }
 }
 
-template <class Hasher, class Codec, class File>
+template <class Hasher, class Codec, class File,
+    std::size_t KeySize, class Observer>
 template <class... Args>
 bool
-store<Hasher, Codec, File>::open (
+store<Hasher, Codec, File, KeySize, Observer>::open (
     path_type const& dat_path,
     path_type const& key_path,
     path_type const& log_path,
     std::size_t arena_alloc_size,
     Args&&... args)
+{
+    store_options options;
+    options.arena_alloc_size = arena_alloc_size;
+    return open(dat_path, key_path, log_path,
+        options, std::forward<Args>(args)...);
+}
+
+template <class Hasher, class Codec, class File,
+    std::size_t KeySize, class Observer>
+template <class... Args>
+bool
+store<Hasher, Codec, File, KeySize, Observer>::open (
+    path_type const& dat_path,
+    path_type const& key_path,
+    path_type const& log_path,
+    store_options const& options,
+    Args&&... args)
 {
     using namespace detail;
     if (is_open())
         throw std::logic_error("nudb: already open");
     epb_.store(false);
-    recover<Hasher, Codec, File>(
-        dat_path, key_path, log_path,
-            recover_read_size,
-                args...);
     File df(args...);
     File kf(args...);
     File lf(args...);
-    if (! df.open (file_mode::append, dat_path))
-        return false;
-    if (! kf.open (file_mode::write, key_path))
-        return false;
-    if (! lf.create (file_mode::append, log_path))
-        return false;
-    dat_file_header dh;
-    key_file_header kh;
-    read (df, dh);
-    read (kf, kh);
-    verify (dh);
-    verify<Hasher> (kh);
-    verify<Hasher> (dh, kh);
-    auto s = std::make_unique<state>(
-        std::move(df), std::move(kf), std::move(lf),
+    if (options.read_only)
+    {
+        // Recovery would write, so it is left to a writer
+        if (lf.open (file_mode::read, log_path))
+        {
+            if (lf.actual_size() != 0)
+                throw store_error(
+                    "nudb: recovery needed");
+            lf.close();
+        }
+        if (! df.open (file_mode::read, dat_path))
+            return false;
+        if (! kf.open (file_mode::read, key_path))
+            return false;
+    }
+    else
+    {
+        detail::recover<Hasher, File>(obs_,
+            dat_path, key_path, log_path,
+                recover_read_size,
+                    args...);
+        if (! df.open (file_mode::append, dat_path))
+            return false;
+        if (! kf.open (file_mode::write, key_path))
+            return false;
+        if (! lf.create (file_mode::append, log_path))
+            return false;
+    }
+    dat_file_header dh;
+    key_file_header kh;
+    read (df, dh);
+    read (kf, kh);
+    verify (dh);
+    verify<Hasher> (kh);
+    verify<Hasher> (dh, kh);
+    if (KeySize != 0 && kh.key_size != KeySize)
+        throw store_error("nudb: key size mismatch");
+    auto s = std::make_unique<state>(
+        std::move(df), std::move(kf), std::move(lf),
             dat_path, key_path, log_path, kh,
-                arena_alloc_size);
+                options);
     thresh_ = std::max<std::size_t>(65536UL,
         kh.load_factor * kh.capacity);
     frac_ = thresh_ / 2;
+    // Early splits are kept in the key file, so
+    // that they are used up rather than repeated
+    ahead_ = static_cast<std::size_t>(kh.split_credit);
+    credit_ = ahead_;
     buckets_ = kh.buckets;
     modulus_ = ceil_pow2(kh.buckets);
     // VFALCO TODO This could be better
     if (buckets_ < 1)
         throw store_corrupt_error (
             "bad key file length");
+    if (s->bf.enabled())
+        fill_filter(*s, s->bf, kh.buckets);
+    if (s->ki.enabled())
+        s->ki.load(s->kf, kh.buckets, recover_read_size);
+    s->boundaries.push_back(s->df.actual_size());
+    if (options.budget)
+    {
+        s->bm.join(*options.budget,
+            [this]()
+            {
+                cond_.notify_all();
+            });
+        s->rc.resize(s->bm.cache_size());
+    }
     s_ = std::move(s);
     open_ = true;
-    thread_ = std::thread(
-        &store::run, this);
+    read_only_ = options.read_only;
+    if (! read_only_)
+        thread_ = std::thread(
+            &store::run, this);
+    warm_stop_.store(false);
+    warm_locked_.store(false);
+    warm_amount_.store(0);
+    warm_total_ = buckets_ * kh.block_size;
+    if (options.prefetch_key_file ||
+        options.lock_key_file || options.warm_cache)
+    {
+        warm_done_.store(false);
+        warm_thread_ = std::thread(&store::warm, this,
+            options.prefetch_key_file,
+                options.lock_key_file, options.warm_cache);
+    }
+    else
+    {
+        warm_done_.store(true);
+    }
     return true;
 }
 
-template <class Hasher, class Codec, class File>
+template <class Hasher, class Codec, class File,
+    std::size_t KeySize, class Observer>
+store_stats
+store<Hasher, Codec, File, KeySize, Observer>::stats()
+{
+    using std::chrono::nanoseconds;
+    auto const& c = s_->sc;
+    store_stats result;
+    result.fetch_p1 = c.fetch_p1.load();
+    result.fetch_queue = c.fetch_queue.load();
+    result.fetch_p0 = c.fetch_p0.load();
+    result.fetch_c1 = c.fetch_c1.load();
+    result.fetch_filter = c.fetch_filter.load();
+    result.fetch_value = c.fetch_value.load();
+    result.fetch_disk = c.fetch_disk.load();
+    result.cache_hits = c.cache_hits.load();
+    result.key_reads = c.key_reads.load();
+    result.data_reads = c.data_reads.load();
+    result.spill_depth = c.spill_depth.load();
+    result.insert_reads = c.insert_reads.load();
+    result.early_splits = c.early_splits.load();
+    result.split_commits = c.split_commits.load();
+    result.commits = c.commits.load();
+    result.log_bytes = c.log_bytes.load();
+    result.data_bytes = c.data_bytes.load();
+    result.key_bytes = c.key_bytes.load();
+    result.commit_time = nanoseconds(c.commit_time.load());
+    result.commit_max = nanoseconds(c.commit_max.load());
+    result.gentex_waits = c.gentex_waits.load();
+    result.gentex_time = nanoseconds(c.gentex_time.load());
+    result.limit_waits = c.limit_waits.load();
+    result.limit_time = nanoseconds(c.limit_time.load());
+    shared_lock_type m (m_);
+    result.p1_size = s_->p1.data_size();
+    for (auto const& p : s_->pq)
+        result.queue_size += p.data_size();
+    result.p0_size = s_->p0.data_size();
+    return result;
+}
+
+template <class Hasher, class Codec, class File,
+    std::size_t KeySize, class Observer>
 void
-store<Hasher, Codec, File>::close()
+store<Hasher, Codec, File, KeySize, Observer>::close()
 {
     if (open_)
     {
+        // Async calls still use the store
+        s_->tp.wait();
         // Set this first otherwise a
         // throw can cause another close().
         open_ = false;
+        warm_stop_.store(true);
+        if (warm_thread_.joinable())
+            warm_thread_.join();
+        if (read_only_)
+        {
+            s_.reset();
+            return;
+        }
         cond_.notify_all();
         thread_.join();
+        // After a failed commit
+        complete(s_->h0, ep_);
+        for (auto& h : s_->hq)
+            complete(h, ep_);
+        complete(s_->h1, ep_);
         rethrow();
         s_->lf.close();
         File::erase(s_->lp);
@@ -396,135 +1436,983 @@ store<Hasher, Codec, File>::close()
     }
 }
 
-template <class Hasher, class Codec, class File>
+template <class Hasher, class Codec, class File,
+    std::size_t KeySize, class Observer>
 template <class Handler>
 bool
-store<Hasher, Codec, File>::fetch (
+store<Hasher, Codec, File, KeySize, Observer>::fetch (
     void const* key, Handler&& handler)
+{
+    return with_context(
+        [&](fetch_context& ctx)
+        {
+            return fetch(key, ctx, handler);
+        });
+}
+
+template <class Hasher, class Codec, class File,
+    std::size_t KeySize, class Observer>
+template <class Handler>
+bool
+store<Hasher, Codec, File, KeySize, Observer>::fetch (void const* key,
+    fetch_context& ctx, Handler&& handler)
 {
     using namespace detail;
     rethrow();
+    context_guard cg (ctx);
     auto const h = hash<Hasher>(
-        key, s_->kh.key_size, s_->kh.salt);
-    shared_lock_type m (m_);
+        key, key_size(), s_->kh.salt);
+    // Read-only, the pools are empty and buckets never
+    // change, so the key file is read without locking.
+    if (read_only_)
     {
-        auto iter = s_->p1.find(key);
-        if (iter == s_->p1.end())
+        if (! s_->bf.may_contain(h))
         {
-            iter = s_->p0.find(key);
-            if (iter == s_->p0.end())
-                goto next;
+            s_->sc.fetch_filter.add();
+            return false;
         }
-        buffer buf;
+        if (fetch_cached(h, key, ctx, handler))
+            return true;
+        s_->sc.fetch_disk.add();
+        ctx.bucket_.reserve(s_->kh.block_size);
+        return fetch(h, key, read_bucket(bucket_index(
+            h, buckets_, modulus_), ctx.bucket_.get()),
+                ctx, handler);
+    }
+    shared_lock_type m (m_);
+    {
+        auto const iter = find_pooled(h, key, true);
+        if (! iter)
+            goto next;
         auto const result =
             s_->codec.decompress(
                 iter->first.data,
-                    iter->first.size, buf);
+                    iter->first.size, ctx.value_);
         handler(result.first, result.second);
         return true;
     }
 next:
+    if (! s_->bf.may_contain(h))
+    {
+        s_->sc.fetch_filter.add();
+        return false;
+    }
+    if (fetch_cached(h, key, ctx, handler))
+        return true;
     auto const n = bucket_index(
         h, buckets_, modulus_);
     auto const iter = s_->c1.find(n);
     if (iter != s_->c1.end())
+    {
+        s_->sc.fetch_c1.add();
         return fetch(h, key,
-            iter->second, handler);
+            iter->second, ctx, handler);
+    }
+    s_->sc.fetch_disk.add();
     // VFALCO Audit for concurrency
-    genlock <gentex> g (g_);
+    genlock <epoch> g (m_);
     m.unlock();
-    buffer buf (s_->kh.block_size);
-    // VFALCO Constructs with garbage here
-    bucket b (s_->kh.block_size,
-        buf.get());
-    b.read (s_->kf,
-        (n + 1) * b.block_size());
-    return fetch(h, key, b, handler);
+    ctx.bucket_.reserve(s_->kh.block_size);
+    return fetch(h, key, read_bucket(n,
+        ctx.bucket_.get()), ctx, handler);
 }
 
-template <class Hasher, class Codec, class File>
+template <class Hasher, class Codec, class File,
+    std::size_t KeySize, class Observer>
+template <class Handler>
+std::size_t
+store<Hasher, Codec, File, KeySize, Observer>::fetch_batch (
+    void const* const* keys, std::size_t count,
+        Handler&& handler)
+{
+    using namespace detail;
+    rethrow();
+    auto const key_size = this->key_size();
+    std::size_t found = 0;
+    std::vector<batch_key> bk;
+    bk.reserve(count);
+    for (std::size_t i = 0; i < count; ++i)
+        bk.push_back({i, hash<Hasher>(
+            keys[i], key_size, s_->kh.salt),
+                0, 0, false});
+    buffer buf;
+    shared_lock_type m (m_, std::defer_lock);
+    if (! read_only_)
+        m.lock();
+    // Keys in the pool are reported right away
+    {
+        auto out = bk.begin();
+        for (auto const& k : bk)
+        {
+            auto const iter = read_only_ ? nullptr :
+                find_pooled(k.h, keys[k.i], true);
+            if (! iter)
+            {
+                if (! s_->bf.may_contain(k.h))
+                {
+                    s_->sc.fetch_filter.add();
+                    continue;
+                }
+                *out = k;
+                out->n = bucket_index(
+                    k.h, buckets_, modulus_);
+                ++out;
+                continue;
+            }
+            auto const result =
+                s_->codec.decompress(
+                    iter->first.data,
+                        iter->first.size, buf);
+            handler(k.i, result.first, result.second);
+            ++found;
+        }
+        bk.erase(out, bk.end());
+    }
+    if (bk.empty())
+        return found;
+    fetch_batch(keys, bk, m, true,
+        [&](batch_key const& k,
+            std::uint8_t const* p, std::size_t size)
+        {
+            auto const result =
+                s_->codec.decompress(
+                    p + key_size, size, buf);
+            handler(k.i, result.first, result.second);
+            ++found;
+        });
+    return found;
+}
+
+template <class Hasher, class Codec, class File,
+    std::size_t KeySize, class Observer>
 bool
-store<Hasher, Codec, File>::insert (
+store<Hasher, Codec, File, KeySize, Observer>::insert (
     void const* key, void const* data,
         std::size_t size)
+{
+    return with_context(
+        [&](fetch_context& ctx)
+        {
+            return insert(key, data, size, ctx, nullptr);
+        });
+}
+
+template <class Hasher, class Codec, class File,
+    std::size_t KeySize, class Observer>
+template <class Handler>
+bool
+store<Hasher, Codec, File, KeySize, Observer>::insert (
+    void const* key, void const* data,
+        std::size_t size, Handler&& handler)
+{
+    commit_handler h (std::forward<Handler>(handler));
+    return with_context(
+        [&](fetch_context& ctx)
+        {
+            return insert(key, data, size, ctx, &h);
+        });
+}
+
+template <class Hasher, class Codec, class File,
+    std::size_t KeySize, class Observer>
+std::vector<bool>
+store<Hasher, Codec, File, KeySize, Observer>::insert_batch (
+    insert_item const* items, std::size_t count)
+{
+    commit_handler* none = nullptr;
+    return insert_batch(items, count, none);
+}
+
+template <class Hasher, class Codec, class File,
+    std::size_t KeySize, class Observer>
+template <class Handler>
+std::vector<bool>
+store<Hasher, Codec, File, KeySize, Observer>::insert_batch (
+    insert_item const* items, std::size_t count,
+        Handler&& handler)
+{
+    commit_handler h (std::forward<Handler>(handler));
+    return insert_batch(items, count, &h);
+}
+
+template <class Hasher, class Codec, class File,
+    std::size_t KeySize, class Observer>
+template <class Handler>
+void
+store<Hasher, Codec, File, KeySize, Observer>::async_fetch (
+    void const* key, Handler&& handler)
+{
+    auto const p = reinterpret_cast<std::uint8_t const*>(key);
+    {
+        std::lock_guard<std::mutex> l (s_->am);
+        s_->aq.push_back({std::vector<std::uint8_t>(
+            p, p + key_size()), fetch_handler(
+                std::forward<Handler>(handler))});
+    }
+    // A drain may find the fetch already taken
+    s_->tp.post(
+        [this]
+        {
+            async_drain();
+        });
+}
+
+template <class Hasher, class Codec, class File,
+    std::size_t KeySize, class Observer>
+template <class Handler>
+void
+store<Hasher, Codec, File, KeySize, Observer>::async_insert (
+    void const* key, void const* data,
+        std::size_t size, Handler&& handler)
+{
+    if (read_only_)
+        throw std::logic_error("nudb: read only");
+    auto const k = reinterpret_cast<std::uint8_t const*>(key);
+    auto const d = reinterpret_cast<std::uint8_t const*>(data);
+    std::function<void(std::exception_ptr, bool)> h (
+        std::forward<Handler>(handler));
+    s_->tp.post(
+        [this, h, size,
+            k = std::vector<std::uint8_t>(k, k + key_size()),
+            d = std::vector<std::uint8_t>(d, d + size)]
+        {
+            bool inserted;
+            try
+            {
+                inserted = insert(k.data(), d.data(), size,
+                    [h](std::exception_ptr ep)
+                    {
+                        h(ep, true);
+                    });
+            }
+            catch(...)
+            {
+                h(std::current_exception(), false);
+                return;
+            }
+            if (! inserted)
+                h(nullptr, false);
+        });
+}
+
+template <class Hasher, class Codec, class File,
+    std::size_t KeySize, class Observer>
+bool
+store<Hasher, Codec, File, KeySize, Observer>::insert (
+    void const* key, void const* data,
+        std::size_t size, fetch_context& ctx,
+            commit_handler* handler)
 {
     using namespace detail;
     rethrow();
-    buffer buf;
+    if (read_only_)
+        throw std::logic_error("nudb: read only");
+    context_guard cg (ctx);
     // Data Record
     if (size > field<uint48_t>::max)
         throw std::logic_error(
             "nudb: size too large");
     auto const h = hash<Hasher>(
-        key, s_->kh.key_size, s_->kh.salt);
-    std::lock_guard<std::mutex> u (u_);
+        key, key_size(), s_->kh.salt);
+    std::unique_lock<std::mutex> u (insert_lock(h));
     {
         shared_lock_type m (m_);
-        if (s_->p1.find(key) != s_->p1.end())
-            return false;
-        if (s_->p0.find(key) != s_->p0.end())
+        if (find_pooled(h, key))
             return false;
         auto const n = bucket_index(
             h, buckets_, modulus_);
         auto const iter = s_->c1.find(n);
-        if (iter != s_->c1.end())
+        if (! s_->bf.may_contain(h))
+        {
+            // The filter rules out the key file
+        }
+        else if (iter != s_->c1.end())
+        {
+            if (exists(h, key, &m,
+                    iter->second, ctx))
+                return false;
+            // m is now unlocked
+        }
+        else
+        {
+            // VFALCO Audit for concurrency
+            genlock <epoch> g (m_);
+            m.unlock();
+            s_->sc.insert_reads.add();
+            ctx.bucket_.reserve(s_->kh.block_size);
+            if (exists(h, key, nullptr, read_bucket(
+                    n, ctx.bucket_.get()), ctx))
+                return false;
+        }
+    }
+    auto const result =
+        s_->codec.compress(data, size, ctx.value_);
+    // Perform insert
+    unique_lock_type m (m_);
+    s_->p1.insert (h, key,
+        result.first, result.second);
+    if (handler)
+        s_->h1.emplace_back(std::move(*handler));
+    // The key is visible to other inserts now
+    u.unlock();
+    // Did we go over the commit limit?
+    if (s_->fc.limit() > 0 &&
+        s_->p1.data_size() >= s_->fc.limit())
+        limit_pool(m);
+    charge();
+    auto const pool = s_->p1.data_size();
+    bool const notify = commit_due(pool);
+    m.unlock();
+    if (notify)
+        cond_.notify_all();
+    s_->fc.throttle(result.second, pool);
+    return true;
+}
+
+template <class Hasher, class Codec, class File,
+    std::size_t KeySize, class Observer>
+std::vector<bool>
+store<Hasher, Codec, File, KeySize, Observer>::insert_batch (
+    insert_item const* items, std::size_t count,
+        commit_handler* handler)
+{
+    using namespace detail;
+    rethrow();
+    if (read_only_)
+        throw std::logic_error("nudb: read only");
+    std::vector<bool> inserted(count, false);
+    if (count == 0)
+        return inserted;
+    auto const key_size = this->key_size();
+    std::vector<void const*> keys;
+    std::vector<batch_key> bk;
+    std::vector<batch_key> absent;
+    keys.reserve(count);
+    bk.reserve(count);
+    for (std::size_t i = 0; i < count; ++i)
+    {
+        // Data Record
+        if (items[i].size > field<uint48_t>::max)
+            throw std::logic_error(
+                "nudb: size too large");
+        keys.push_back(items[i].key);
+        bk.push_back({i, hash<Hasher>(
+            items[i].key, key_size, s_->kh.salt),
+                0, 0, false});
+    }
+    // Take the insert locks of the batch in order
+    std::vector<std::size_t> stripes;
+    for (auto const& k : bk)
+        stripes.push_back(k.h & (insert_stripes - 1));
+    std::sort(stripes.begin(), stripes.end());
+    stripes.erase(std::unique(stripes.begin(),
+        stripes.end()), stripes.end());
+    for (auto const i : stripes)
+        u_[i].lock();
+    struct unlock_stripes
+    {
+        store& s;
+        std::vector<std::size_t>& stripes;
+
+        void
+        operator()()
+        {
+            for (auto const i : stripes)
+                s.u_[i].unlock();
+            stripes.clear();
+        }
+
+        ~unlock_stripes()
+        {
+            (*this)();
+        }
+    } unlock{*this, stripes};
+    {
+        shared_lock_type m (m_);
+        auto out = bk.begin();
+        for (auto const& k : bk)
+        {
+            if (find_pooled(k.h, keys[k.i]))
+                continue;
+            // The filter rules out the key file
+            if (! s_->bf.may_contain(k.h))
+            {
+                absent.push_back(k);
+                continue;
+            }
+            *out = k;
+            out->n = bucket_index(
+                k.h, buckets_, modulus_);
+            ++out;
+        }
+        bk.erase(out, bk.end());
+        if (bk.empty() && absent.empty())
+            return inserted;
+        if (! bk.empty())
+            fetch_batch(keys.data(), bk, m, false,
+                [](batch_key const&,
+                    std::uint8_t const*, std::size_t)
+                {
+                });
+        // m is now unlocked
+    }
+    auto out = bk.begin();
+    for (auto const& k : bk)
+        if (! k.found)
+            *out++ = k;
+    bk.erase(out, bk.end());
+    bk.insert(bk.end(), absent.begin(), absent.end());
+    // Survivors are inserted in their original order
+    std::sort(bk.begin(), bk.end(),
+        [](batch_key const& lhs, batch_key const& rhs)
+        {
+            return lhs.i < rhs.i;
+        });
+    std::vector<buffer> bufs(bk.size());
+    std::vector<std::pair<void const*, std::size_t>> data;
+    data.reserve(bk.size());
+    for (std::size_t j = 0; j < bk.size(); ++j)
+    {
+        auto const& e = items[bk[j].i];
+        data.push_back(s_->codec.compress(
+            e.data, e.size, bufs[j]));
+    }
+    // Perform insert
+    unique_lock_type m (m_);
+    for (std::size_t j = 0; j < bk.size(); ++j)
+    {
+        auto const& k = bk[j];
+        // Duplicate within the batch
+        if (s_->p1.find(k.h, keys[k.i]) != s_->p1.end())
+            continue;
+        s_->p1.insert (k.h, keys[k.i],
+            data[j].first, data[j].second);
+        inserted[k.i] = true;
+        if (handler)
+        {
+            s_->h1.emplace_back(std::move(*handler));
+            handler = nullptr;
+        }
+    }
+    // The keys are visible to other inserts now
+    unlock();
+    // Did we go over the commit limit?
+    if (s_->fc.limit() > 0 &&
+        s_->p1.data_size() >= s_->fc.limit())
+        limit_pool(m);
+    charge();
+    auto const pool = s_->p1.data_size();
+    bool const notify = commit_due(pool);
+    m.unlock();
+    if (notify)
+        cond_.notify_all();
+    std::size_t bytes = 0;
+    for (auto const& e : data)
+        bytes += e.second;
+    s_->fc.throttle(bytes, pool);
+    return inserted;
+}
+
+template <class Hasher, class Codec, class File,
+    std::size_t KeySize, class Observer>
+template <class RecordFunction, class CommitFunction>
+std::uint64_t
+store<Hasher, Codec, File, KeySize, Observer>::tail (
+    std::uint64_t from, RecordFunction&& record,
+        CommitFunction&& commit)
+{
+    using namespace detail;
+    rethrow();
+    auto const ends = tail_range(from);
+    if (ends.empty())
+        return from;
+    auto const key_size = this->key_size();
+    bulk_reader<File> r (s_->df, from,
+        ends.back(), tail_read_size);
+    buffer buf;
+    auto next = ends.begin();
+    auto offset = from;
+    try
+    {
+        while (! r.eof())
+        {
+            // Commits end between records
+            for (; *next <= offset; ++next)
+                if (! commit(*next))
+                    return offset;
+            // Data Record or Spill Record
+            std::size_t size;
+            auto is = r.prepare(
+                field<uint48_t>::size); // Size
+            read<uint48_t>(is, size);
+            if (size > 0)
+            {
+                // Data Record
+                is = r.prepare(
+                    key_size +              // Key
+                    size);                  // Data
+                std::uint8_t const* const key =
+                    is.data(key_size);
+                auto const result = s_->codec.decompress(
+                    is.data(size), size, buf);
+                auto const at = offset;
+                offset = r.offset();
+                if (! record(at, key, key_size,
+                        result.first, result.second))
+                    return offset;
+            }
+            else
+            {
+                // Spill Record
+                is = r.prepare(
+                    field<std::uint16_t>::size);
+                read<std::uint16_t>(is, size);  // Size
+                r.prepare(size); // skip bucket
+                offset = r.offset();
+            }
+        }
+    }
+    catch (file_short_read_error const&)
+    {
+        throw store_corrupt_error(
+            "nudb: data short read");
+    }
+    for (; next != ends.end(); ++next)
+        if (! commit(*next))
+            break;
+    return offset;
+}
+
+template <class Hasher, class Codec, class File,
+    std::size_t KeySize, class Observer>
+std::uint64_t
+store<Hasher, Codec, File, KeySize, Observer>::tail_copy (
+    std::uint64_t from, int fd)
+{
+    static_assert(detail::is_copyable_file<File>::value,
+        "File does not provide copy_to");
+    rethrow();
+    auto const ends = tail_range(from);
+    if (ends.empty())
+        return from;
+    s_->df.copy_to(fd, from, ends.back() - from);
+    return ends.back();
+}
+
+template <class Hasher, class Codec, class File,
+    std::size_t KeySize, class Observer>
+template <class Handler>
+bool
+store<Hasher, Codec, File, KeySize, Observer>::fetch_cached (
+    std::size_t h, void const* key, fetch_context& ctx,
+        Handler&& handler)
+{
+    if (! s_->vc.enabled())
+        return false;
+    std::size_t size;
+    if (! s_->vc.find(h, key, ctx.value_, size))
+        return false;
+    s_->sc.fetch_value.add();
+    handler(ctx.value_.get(), size);
+    return true;
+}
+
+template <class Hasher, class Codec, class File,
+    std::size_t KeySize, class Observer>
+template <class Handler>
+bool
+store<Hasher, Codec, File, KeySize, Observer>::fetch (
+    std::size_t h, void const* key,
+        detail::bucket b, fetch_context& ctx,
+            Handler&& handler)
+{
+    using namespace detail;
+    // The value is decompressed into its own buffer, so
+    // neither the record nor the spill bucket can be
+    // overwritten before the codec reads it.
+    for(std::size_t depth = 0;; ++depth)
+    {
+        for (auto i = b.lower_bound(h);
+            i < b.size(); ++i)
+        {
+            auto const item = b[i];
+            if (item.hash != h)
+                break;
+            // Data Record
+            auto const len =
+                key_size() +            // Key
+                item.size;              // Value
+            auto p = inline_record(b, i, item.size);
+            if (! p)
+                p = reinterpret_cast<std::uint8_t const*>(
+                    file_data(s_->df, item.offset +
+                        field<uint48_t>::size, len));
+            if (! p)
+            {
+                observe<Observer> o (obs_, phase::data_read);
+                ctx.record_.reserve(len);
+                s_->df.read(item.offset +
+                    field<uint48_t>::size,  // Size
+                        ctx.record_.get(), len);
+                s_->sc.data_reads.add();
+                p = ctx.record_.get();
+            }
+            if (std::memcmp(p, key,
+                key_size()) == 0)
+            {
+                s_->sc.spill_depth.add(depth);
+                auto const result =
+                    s_->codec.decompress(
+                        p + key_size(),
+                            item.size, ctx.value_);
+                if (s_->vc.enabled())
+                    s_->vc.insert(h, key,
+                        result.first, result.second);
+                handler(result.first, result.second);
+                return true;
+            }
+        }
+        auto const spill = b.spill();
+        if (! spill)
+        {
+            s_->sc.spill_depth.add(depth);
+            break;
+        }
+        observe<Observer> o (obs_, phase::data_read);
+        ctx.spill_.reserve(s_->kh.block_size);
+        b = read_bucket(s_->df, spill, ctx.spill_.get());
+        s_->sc.data_reads.add();
+    }
+    return false;
+}
+
+//  Look up keys in their buckets and spill records.
+//
+//  Preconditions:
+//      m is locked, unless the store is read-only
+//      Keys in bk are not in the pool, and have
+//          their bucket index computed.
+//
+//  Effects:
+//      m is unlocked.
+//      For each key found, f is called with the key
+//          and a pointer to the key in the data record,
+//          followed by the value if `values` is true.
+//
+template <class Hasher, class Codec, class File,
+    std::size_t KeySize, class Observer>
+template <class Function>
+void
+store<Hasher, Codec, File, KeySize, Observer>::fetch_batch (
+    void const* const* keys, std::vector<batch_key>& bk,
+        shared_lock_type& m, bool values, Function&& f)
+{
+    using namespace detail;
+    auto const key_size = this->key_size();
+    auto const block_size = s_->kh.block_size;
+    // Group keys by bucket, one slot per distinct bucket
+    std::sort(bk.begin(), bk.end(),
+        [](batch_key const& lhs, batch_key const& rhs)
+        {
+            return lhs.n < rhs.n;
+        });
+    std::vector<std::size_t> slots;
+    for (auto& k : bk)
+    {
+        if (slots.empty() || slots.back() != k.n)
+            slots.push_back(k.n);
+        k.slot = slots.size() - 1;
+    }
+    buffer buckets (slots.size() * block_size);
+    // Buckets in the cache are copied, the rest
+    // are read from the key file with consecutive
+    // bucket indexes coalesced into a single read.
+    std::vector<bool> cached(slots.size(), false);
+    for (std::size_t j = 0; j < slots.size(); ++j)
+    {
+        auto const iter = s_->c1.find(slots[j]);
+        if (iter == s_->c1.end())
+            continue;
+        ostream os(buckets.get() +
+            j * block_size, block_size);
+        iter->second.write(os);
+        cached[j] = true;
+    }
+    if (values)
+    {
+        std::size_t n = 0;
+        for (auto const& k : bk)
+            if (cached[k.slot])
+                ++n;
+        s_->sc.fetch_c1.add(n);
+        s_->sc.fetch_disk.add(bk.size() - n);
+    }
+    // VFALCO Audit for concurrency
+    genlock <epoch> g (m_, std::defer_lock);
+    if (! read_only_)
+    {
+        g.lock();
+        m.unlock();
+    }
+    if (! values)
+        s_->sc.insert_reads.add(std::count(
+            cached.begin(), cached.end(), false));
+    if (s_->ki.enabled())
+    {
+        for (std::size_t j = 0; j < slots.size(); ++j)
+        {
+            if (cached[j])
+                continue;
+            std::memcpy(buckets.get() + j * block_size,
+                s_->ki.at(slots[j]), block_size);
+            cached[j] = true;
+            s_->sc.cache_hits.add();
+        }
+    }
+    if (s_->rc.capacity() > 0)
+    {
+        std::lock_guard<std::mutex> l (cm_);
+        for (std::size_t j = 0; j < slots.size(); ++j)
+        {
+            if (cached[j] || ! s_->rc.find(slots[j],
+                    buckets.get() + j * block_size))
+                continue;
+            cached[j] = true;
+            s_->sc.cache_hits.add();
+        }
+    }
+    s_->sc.key_reads.add(std::count(
+        cached.begin(), cached.end(), false));
+    std::vector<file_request> requests;
+    for (std::size_t j = 0; j < slots.size();)
+    {
+        if (cached[j])
+        {
+            ++j;
+            continue;
+        }
+        auto j1 = j + 1;
+        while (j1 < slots.size() && ! cached[j1] &&
+                slots[j1] == slots[j1 - 1] + 1 &&
+                    (j1 - j + 1) * block_size <=
+                        batch_read_size)
+            ++j1;
+        requests.push_back({(slots[j] + 1) * block_size,
+            buckets.get() + j * block_size,
+                (j1 - j) * block_size});
+        j = j1;
+    }
+    if (! requests.empty())
+    {
+        observe<Observer> o (obs_, phase::key_read);
+        read_batch(s_->kf, requests.data(), requests.size());
+    }
+    for (std::size_t j = 0; j < slots.size(); ++j)
+    {
+        if (cached[j])
+            continue;
+        bucket b (block_size, buckets.get() +
+            j * block_size, s_->kh.inline_bytes);
+        if (b.size() > s_->kh.capacity)
+            throw store_corrupt_error(
+                "bad bucket size");
+    }
+    if (s_->rc.capacity() > 0 && ! requests.empty())
+    {
+        std::lock_guard<std::mutex> l (cm_);
+        for (std::size_t j = 0; j < slots.size(); ++j)
+            if (! cached[j])
+                s_->rc.insert(slots[j], bucket(block_size,
+                    buckets.get() + j * block_size,
+                        s_->kh.inline_bytes));
+    }
+    // Resolve keys against each bucket, then
+    // against each level of spill records in turn.
+    buffer buf;
+    std::vector<batch_read> reads;
+    std::vector<std::size_t> ends;
+    std::vector<batch_key*> pending;
+    for (auto& k : bk)
+        pending.push_back(&k);
+    for (std::size_t depth = 0; ! pending.empty(); ++depth)
+    {
+        reads.clear();
+        for (auto const k : pending)
+        {
+            bucket b (block_size, buckets.get() +
+                k->slot * block_size, s_->kh.inline_bytes);
+            for (auto i = b.lower_bound(k->h);
+                i < b.size(); ++i)
+            {
+                auto const item = b[i];
+                if (item.hash != k->h)
+                    break;
+                // Inline records need no read
+                auto const p = inline_record(b, i, item.size);
+                if (p)
+                {
+                    if (std::memcmp(p, keys[k->i],
+                            key_size) != 0)
+                        continue;
+                    k->found = true;
+                    f(*k, p, item.size);
+                    break;
+                }
+                reads.push_back({item.offset +
+                    field<uint48_t>::size,  // Size
+                        item.size, k});
+            }
+        }
+        // Records in a mapped data file are used in place
+        if (is_mapped_file<File>::value)
+        {
+            auto out = reads.begin();
+            for (auto const& e : reads)
+            {
+                if (e.k->found)
+                    continue;
+                // Data Record
+                auto const p = reinterpret_cast<
+                    std::uint8_t const*>(file_data(s_->df,
+                        e.offset, key_size +
+                            (values ? e.size : 0)));
+                if (! p)
+                {
+                    *out++ = e;
+                    continue;
+                }
+                if (std::memcmp(p, keys[e.k->i],
+                        key_size) != 0)
+                    continue;
+                e.k->found = true;
+                f(*e.k, p, e.size);
+            }
+            reads.erase(out, reads.end());
+        }
+        std::sort(reads.begin(), reads.end(),
+            [](batch_read const& lhs, batch_read const& rhs)
+            {
+                return lhs.offset < rhs.offset;
+            });
+        s_->sc.data_reads.add(reads.size());
+        // Merge reads of nearby records, then
+        // read all of the spans at once.
+        requests.clear();
+        ends.clear();
+        std::size_t total = 0;
+        for (std::size_t r = 0; r < reads.size();)
+        {
+            auto const first = reads[r].offset;
+            auto last = first + key_size +
+                (values ? reads[r].size : 0);
+            auto r1 = r + 1;
+            while (r1 < reads.size())
+            {
+                auto const end = reads[r1].offset +
+                    key_size + (values ? reads[r1].size : 0);
+                if (reads[r1].offset > last + batch_read_gap ||
+                        std::max(last, end) - first >
+                            batch_read_size)
+                    break;
+                last = std::max(last, end);
+                ++r1;
+            }
+            requests.push_back({first, nullptr, last - first});
+            ends.push_back(r1);
+            total += last - first;
+            r = r1;
+        }
+        buf.reserve(total);
+        total = 0;
+        for (auto& q : requests)
+        {
+            q.data = buf.get() + total;
+            total += q.bytes;
+        }
+        if (! requests.empty())
+        {
+            observe<Observer> o (obs_, phase::data_read);
+            read_batch(s_->df, requests.data(), requests.size());
+        }
+        for (std::size_t q = 0, r = 0; q < requests.size(); ++q)
         {
-            if (exists(h, key, &m,
-                    iter->second))
-                return false;
-            // m is now unlocked
+            auto const first = requests[q].offset;
+            auto const data = reinterpret_cast<
+                std::uint8_t const*>(requests[q].data);
+            for (; r < ends[q]; ++r)
+            {
+                auto const& e = reads[r];
+                if (e.k->found)
+                    continue;
+                // Data Record
+                auto const p = data + (e.offset - first);
+                if (std::memcmp(p, keys[e.k->i],
+                        key_size) != 0)
+                    continue;
+                e.k->found = true;
+                f(*e.k, p, e.size);
+            }
         }
-        else
+        // Unresolved keys move on to the spill record
+        // of their bucket, which is read once per slot.
+        requests.clear();
+        auto out = pending.begin();
+        std::size_t slot = slots.size();
+        for (auto const k : pending)
         {
-            // VFALCO Audit for concurrency
-            genlock <gentex> g (g_);
-            m.unlock();
-            buf.reserve(s_->kh.block_size);
-            bucket b (s_->kh.block_size,
-                buf.get());
-            b.read (s_->kf,
-                (n + 1) * s_->kh.block_size);
-            if (exists(h, key, nullptr, b))
-                return false;
+            if (k->found)
+            {
+                s_->sc.spill_depth.add(depth);
+                continue;
+            }
+            auto const p = buckets.get() +
+                k->slot * block_size;
+            if (k->slot != slot)
+            {
+                bucket b (block_size, p, s_->kh.inline_bytes);
+                if (! b.spill())
+                {
+                    s_->sc.spill_depth.add(depth);
+                    continue;
+                }
+                slot = k->slot;
+                // Excludes padding to block size
+                requests.push_back({b.spill(),
+                    p, s_->kh.bucket_size});
+            }
+            *out++ = k;
+        }
+        pending.erase(out, pending.end());
+        if (! requests.empty())
+        {
+            observe<Observer> o (obs_, phase::data_read);
+            read_batch(s_->df, requests.data(), requests.size());
+        }
+        s_->sc.data_reads.add(requests.size());
+        for (auto const& q : requests)
+        {
+            bucket b (block_size, q.data, s_->kh.inline_bytes);
+            if (b.size() > s_->kh.capacity)
+                throw store_corrupt_error(
+                    "bad bucket size");
         }
     }
-    auto const result =
-        s_->codec.compress(data, size, buf);
-    // Perform insert
-    unique_lock_type m (m_);
-    s_->p1.insert (h, key,
-        result.first, result.second);
-    // Did we go over the commit limit?
-    if (commit_limit_ > 0 &&
-        s_->p1.data_size() >= commit_limit_)
-    {
-        // Yes, start a new commit
-        cond_.notify_all();
-        // Wait for pool to shrink
-        cond_limit_.wait(m,
-            [this]() { return
-                s_->p1.data_size() <
-                    commit_limit_; });
-    }
-    bool const notify =
-        s_->p1.data_size() >= s_->pool_thresh;
-    m.unlock();
-    if (notify)
-        cond_.notify_all();
-    return true;
 }
 
-template <class Hasher, class Codec, class File>
-template <class Handler>
+template <class Hasher, class Codec, class File,
+    std::size_t KeySize, class Observer>
 bool
-store<Hasher, Codec, File>::fetch (
+store<Hasher, Codec, File, KeySize, Observer>::exists (
     std::size_t h, void const* key,
-        detail::bucket b, Handler&& handler)
+        shared_lock_type* lock, detail::bucket b,
+            fetch_context& ctx)
 {
     using namespace detail;
-    buffer buf0;
-    buffer buf1;
-    for(;;)
+    ctx.record_.reserve(key_size());
+    ctx.spill_.reserve(s_->kh.block_size);
+    void* pk = ctx.record_.get();
+    void* pb = ctx.spill_.get();
+    for(std::size_t depth = 0;; ++depth)
     {
         for (auto i = b.lower_bound(h);
             i < b.size(); ++i)
@@ -533,71 +2421,122 @@ store<Hasher, Codec, File>::fetch (
             if (item.hash != h)
                 break;
             // Data Record
-            auto const len =
-                s_->kh.key_size +       // Key
-                item.size;              // Value
-            buf0.reserve(len);
-            s_->df.read(item.offset +
-                field<uint48_t>::size,  // Size
-                    buf0.get(), len);
-            if (std::memcmp(buf0.get(), key,
-                s_->kh.key_size) == 0)
+            void const* p = inline_record(b, i, item.size);
+            if (! p)
+                p = file_data(s_->df, item.offset +
+                    field<uint48_t>::size, key_size());
+            if (! p)
             {
-                auto const result =
-                    s_->codec.decompress(
-                        buf0.get() + s_->kh.key_size,
-                            item.size, buf1);
-                handler(result.first, result.second);
+                observe<Observer> o (obs_, phase::data_read);
+                s_->df.read(item.offset +
+                    field<uint48_t>::size,      // Size
+                    pk, key_size());            // Key
+                s_->sc.data_reads.add();
+                p = pk;
+            }
+            if (std::memcmp(p, key,
+                    key_size()) == 0)
+            {
+                s_->sc.spill_depth.add(depth);
                 return true;
             }
         }
-        auto const spill = b.spill();
+        auto spill = b.spill();
+        if (lock && lock->owns_lock())
+            lock->unlock();
         if (! spill)
+        {
+            s_->sc.spill_depth.add(depth);
             break;
-        buf1.reserve(s_->kh.block_size);
-        b = bucket(s_->kh.block_size,
-            buf1.get());
-        b.read(s_->df, spill);
+        }
+        observe<Observer> o (obs_, phase::data_read);
+        b = read_bucket(s_->df, spill, pb);
+        s_->sc.data_reads.add();
     }
     return false;
 }
 
-template <class Hasher, class Codec, class File>
-bool
-store<Hasher, Codec, File>::exists (
-    std::size_t h, void const* key,
-        shared_lock_type* lock, detail::bucket b)
+//  Effects:
+//
+//      Returns bucket n from the read cache if present,
+//      otherwise reads the bucket from the key file and
+//      inserts it into the read cache.
+//
+//  Preconditions:
+//      The caller holds a genlock on m_, so that a bucket
+//      read from the key file cannot go stale in the read
+//      cache before the commit updates it.
+//
+template <class Hasher, class Codec, class File,
+    std::size_t KeySize, class Observer>
+detail::bucket
+store<Hasher, Codec, File, KeySize, Observer>::read_bucket (
+    std::size_t n, void* buf)
 {
     using namespace detail;
-    buffer buf(s_->kh.key_size +
-        s_->kh.block_size);
-    void* pk = buf.get();
-    void* pb = buf.get() + s_->kh.key_size;
-    for(;;)
+    if (s_->ki.enabled())
     {
-        for (auto i = b.lower_bound(h);
-            i < b.size(); ++i)
+        s_->sc.cache_hits.add();
+        bucket b (s_->kh.block_size, s_->ki.at(n),
+            s_->kh.inline_bytes);
+        if (b.size() > s_->kh.capacity)
+            throw store_corrupt_error(
+                "bad bucket size");
+        return b;
+    }
+    // A mapped key file is its own cache
+    if (is_mapped_file<File>::value)
+    {
+        s_->sc.key_reads.add();
+        return read_bucket(s_->kf,
+            (n + 1) * s_->kh.block_size, buf);
+    }
+    if (s_->rc.capacity() > 0)
+    {
+        std::lock_guard<std::mutex> l (cm_);
+        if (s_->rc.find(n, buf))
         {
-            auto const item = b[i];
-            if (item.hash != h)
-                break;
-            // Data Record
-            s_->df.read(item.offset +
-                field<uint48_t>::size,      // Size
-                pk, s_->kh.key_size);       // Key
-            if (std::memcmp(pk, key,
-                    s_->kh.key_size) == 0)
-                return true;
+            s_->sc.cache_hits.add();
+            return bucket (s_->kh.block_size,
+                buf, s_->kh.inline_bytes);
         }
-        auto spill = b.spill();
-        if (lock && lock->owns_lock())
-            lock->unlock();
-        if (! spill)
-            break;
-        b = bucket(s_->kh.block_size, pb);
-        b.read(s_->df, spill);
     }
-    return false;
+    bucket b (s_->kh.block_size, buf, s_->kh.inline_bytes);
+    {
+        observe<Observer> o (obs_, phase::key_read);
+        b.read (s_->kf, (n + 1) * s_->kh.block_size);
+    }
+    s_->sc.key_reads.add();
+    if (s_->rc.capacity() > 0)
+    {
+        std::lock_guard<std::mutex> l (cm_);
+        s_->rc.insert(n, b);
+    }
+    return b;
+}
+
+template <class Hasher, class Codec, class File,
+    std::size_t KeySize, class Observer>
+detail::bucket
+store<Hasher, Codec, File, KeySize, Observer>::read_bucket (
+    File& f, std::size_t offset, void* buf)
+{
+    using namespace detail;
+    auto const p = file_data(
+        f, offset, s_->kh.bucket_size);
+    if (! p)
+    {
+        bucket b (s_->kh.block_size,
+            buf, s_->kh.inline_bytes);
+        b.read (f, offset);
+        return b;
+    }
+    bucket b (s_->kh.block_size, const_cast<void*>(p),
+        s_->kh.inline_bytes);
+    if (b.size() > s_->kh.capacity)
+        throw store_corrupt_error(
+            "bad bucket size");
+    return b;
 }
 
 //  Split the bucket in b1 to b2
@@ -605,9 +2544,10 @@ store<Hasher, Codec, File>::exists (
 //  tmp is used as a temporary buffer
 //  splits are written but not the new buckets
 //
-template <class Hasher, class Codec, class File>
+template <class Hasher, class Codec, class File,
+    std::size_t KeySize, class Observer>
 void
-store<Hasher, Codec, File>::split (detail::bucket& b1,
+store<Hasher, Codec, File, KeySize, Observer>::split (detail::bucket& b1,
     detail::bucket& b2, detail::bucket& tmp,
         std::size_t n1, std::size_t n2,
             std::size_t buckets, std::size_t modulus,
@@ -626,7 +2566,9 @@ store<Hasher, Codec, File>::split (detail::bucket& b1,
         assert(n==n1 || n==n2);
         if (n == n2)
         {
-            b2.insert (e.offset, e.size, e.hash);
+            auto const j = b2.insert (
+                e.offset, e.size, e.hash);
+            move_inline(b1, i, b2, j);
             b1.erase (i);
         }
         else
@@ -643,7 +2585,7 @@ store<Hasher, Codec, File>::split (detail::bucket& b1,
             // If any part of the spill record is
             // in the write buffer then flush first
             // VFALCO Needs audit
-            if (spill + bucket_size(s_->kh.capacity) >
+            if (spill + s_->kh.bucket_size >
                     w.offset() - w.size())
                 w.flush();
             tmp.read (s_->df, spill);
@@ -656,14 +2598,14 @@ store<Hasher, Codec, File>::split (detail::bucket& b1,
                 if (n == n2)
                 {
                     maybe_spill(b2, w);
-                    b2.insert(
-                        e.offset, e.size, e.hash);
+                    move_inline(tmp, i, b2, b2.insert(
+                        e.offset, e.size, e.hash));
                 }
                 else
                 {
                     maybe_spill(b1, w);
-                    b1.insert(
-                        e.offset, e.size, e.hash);
+                    move_inline(tmp, i, b1, b1.insert(
+                        e.offset, e.size, e.hash));
                 }
             }
             spill = tmp.spill();
@@ -683,8 +2625,9 @@ store<Hasher, Codec, File>::split (detail::bucket& b1,
 //      Else, If the bucket is found in c2, inserts the
 //          bucket into c1 and returns the bucket from c1.
 //      Else, reads the bucket from the key file, inserts
-//          the bucket into c0 and c1, and returns
-//          the bucket from c1.
+//          the bucket into c0 and c1, writes the bucket
+//          to the log file through lw, and returns the
+//          bucket from c1.
 //
 //  Preconditions:
 //      buf points to a buffer of at least block_size() bytes
@@ -692,11 +2635,13 @@ store<Hasher, Codec, File>::split (detail::bucket& b1,
 //  Postconditions:
 //      c1, and c0, and the memory pointed to by buf may be modified
 //
-template <class Hasher, class Codec, class File>
+template <class Hasher, class Codec, class File,
+    std::size_t KeySize, class Observer>
 detail::bucket
-store<Hasher, Codec, File>::load (
+store<Hasher, Codec, File, KeySize, Observer>::load (
     std::size_t n, detail::cache& c1,
-        detail::cache& c0, void* buf)
+        detail::cache& c0, void* buf,
+            detail::bulk_writer<File>& lw)
 {
     using namespace detail;
     auto iter = c1.find(n);
@@ -706,49 +2651,377 @@ store<Hasher, Codec, File>::load (
     if (iter != c0.end())
         return c1.insert (n,
             iter->second)->second;
-    bucket tmp (s_->kh.block_size, buf);
-    tmp.read (s_->kf, (n + 1) *
-        s_->kh.block_size);
+    bucket tmp (s_->kh.block_size,
+        buf, s_->kh.inline_bytes);
+    if (s_->ki.enabled())
+        tmp = bucket (s_->kh.block_size,
+            s_->ki.at(n), s_->kh.inline_bytes);
+    else
+        tmp.read (s_->kf, (n + 1) *
+            s_->kh.block_size);
     c0.insert (n, tmp);
+    // Log Record
+    auto os = lw.prepare(
+        field<std::uint64_t>::size +    // Index
+        tmp.compact_size());            // Bucket
+    // Log Record
+    write<std::uint64_t>(os, n);        // Index
+    tmp.write(os);                      // Bucket
     return c1.insert (n, tmp)->second;
 }
 
+//  Adds the hash of every key in the first buckets of
+//  the key file, including those in spill records, to bf.
+//
+template <class Hasher, class Codec, class File,
+    std::size_t KeySize, class Observer>
+void
+store<Hasher, Codec, File, KeySize, Observer>::fill_filter (
+    state& s, detail::bloom_filter& bf, std::size_t buckets)
+{
+    using namespace detail;
+    auto const block_size = s.kh.block_size;
+    buffer buf (2 * block_size);
+    bucket tmp (block_size, buf.get() +
+        block_size, s.kh.inline_bytes);
+    bulk_reader<File> r (s.kf, block_size,
+        (buckets + 1) * block_size,
+            recover_read_size);
+    while (! r.eof())
+    {
+        // Bucket Record
+        auto is = r.prepare(block_size);
+        std::memcpy(buf.get(),
+            is.data(block_size), block_size);
+        bucket b (block_size, buf.get(), s.kh.inline_bytes);
+        if (b.size() > s.kh.capacity)
+            throw store_corrupt_error(
+                "bad bucket size");
+        for(;;)
+        {
+            for (std::size_t i = 0; i < b.size(); ++i)
+                bf.insert(b[i].hash);
+            if (! b.spill())
+                break;
+            tmp.read(s.df, b.spill());
+            b = tmp;
+        }
+    }
+}
+
+//  Called by commit once the keys outgrow the filter, to
+//  replace it with one sized for twice the keys of the
+//  buckets. The commit thread is the only writer of the
+//  key file and of the filter, so the new filter holds
+//  every committed key when it is moved in. Readers query
+//  the filter under a shared lock, and keep the old one
+//  until then.
+//
+template <class Hasher, class Codec, class File,
+    std::size_t KeySize, class Observer>
+void
+store<Hasher, Codec, File, KeySize, Observer>::grow_filter (
+    std::size_t buckets)
+{
+    detail::bloom_filter bf (2 * buckets * s_->kh.capacity *
+        s_->kh.load_factor / 65536, s_->bf.bits_per_key());
+    fill_filter(*s_, bf, buckets);
+    unique_lock_type m (m_);
+    s_->bf = std::move(bf);
+}
+
+//  Runs on its own thread after open. Buckets are read in
+//  large sequential chunks. When filling the read cache,
+//  each chunk is read under a genlock like a fetch, and
+//  buckets being committed are skipped, so that a copy
+//  older than the one written by a commit is never cached.
+//
+template <class Hasher, class Codec, class File,
+    std::size_t KeySize, class Observer>
+void
+store<Hasher, Codec, File, KeySize, Observer>::warm (
+    bool prefetch, bool lock, bool fill)
+{
+    using namespace detail;
+    try
+    {
+        auto const block_size = s_->kh.block_size;
+        auto const buckets = warm_total_ / block_size;
+        auto const offset = block_size;
+        if (prefetch)
+            file_prefetch(s_->kf, offset, warm_total_);
+        if (lock)
+            warm_locked_.store(file_lock(
+                s_->kf, offset, warm_total_));
+        // A mapped key file is its own cache
+        fill = fill && s_->rc.capacity() > 0 &&
+            ! is_mapped_file<File>::value;
+        if (lock && ! prefetch && ! fill)
+            warm_amount_.store(warm_total_);
+        auto const chunk = std::max<std::size_t>(1,
+            recover_read_size / block_size);
+        buffer buf (chunk * block_size);
+        std::vector<bool> skip;
+        for (std::size_t n = 0; n < buckets &&
+            (prefetch || fill) && ! warm_stop_.load();
+                n += chunk)
+        {
+            auto const count =
+                std::min(chunk, buckets - n);
+            if (! fill)
+            {
+                s_->kf.read((n + 1) * block_size,
+                    buf.get(), count * block_size);
+                warm_amount_ += count * block_size;
+                continue;
+            }
+            genlock <epoch> g;
+            {
+                shared_lock_type m (m_);
+                skip.assign(count, false);
+                for (std::size_t j = 0; j < count; ++j)
+                    skip[j] = s_->c1.find(n + j) !=
+                        s_->c1.end();
+                g = genlock<epoch>(m_);
+            }
+            s_->kf.read((n + 1) * block_size,
+                buf.get(), count * block_size);
+            {
+                std::lock_guard<std::mutex> l (cm_);
+                for (std::size_t j = 0; j < count; ++j)
+                {
+                    if (s_->rc.size() >= s_->rc.capacity())
+                    {
+                        fill = false;
+                        break;
+                    }
+                    if (! skip[j])
+                        s_->rc.insert(n + j, bucket(block_size,
+                            buf.get() + j * block_size,
+                                s_->kh.inline_bytes));
+                }
+            }
+            warm_amount_ += count * block_size;
+        }
+    }
+    catch (...)
+    {
+        // The warm-up is only a hint
+    }
+    warm_done_.store(true);
+}
+
+//  Returns the commit ends after from, the last being
+//  the end of the data file as of the last commit.
+//  A from of zero is made the first record.
+//
+template <class Hasher, class Codec, class File,
+    std::size_t KeySize, class Observer>
+std::vector<std::uint64_t>
+store<Hasher, Codec, File, KeySize, Observer>::tail_range (
+    std::uint64_t& from)
+{
+    using namespace detail;
+    if (from == 0)
+        from = dat_file_header::size;
+    std::lock_guard<std::mutex> l (tm_);
+    auto const& v = s_->boundaries;
+    if (from < dat_file_header::size || from > v.back())
+        throw std::logic_error(
+            "nudb: tail offset out of range");
+    return std::vector<std::uint64_t>(
+        std::upper_bound(v.begin(), v.end(), from), v.end());
+}
+
+// Takes up to a batch of queued async fetches, and looks
+// them up together. The handlers of keys not found, and
+// all those left when a lookup throws, are called last.
+template <class Hasher, class Codec, class File,
+    std::size_t KeySize, class Observer>
+void
+store<Hasher, Codec, File, KeySize, Observer>::async_drain()
+{
+    std::vector<async_fetch_op> ops;
+    {
+        std::lock_guard<std::mutex> l (s_->am);
+        auto const n = std::min<std::size_t>(
+            s_->aq.size(), async_batch);
+        ops.reserve(n);
+        for (std::size_t i = 0; i < n; ++i)
+        {
+            ops.emplace_back(std::move(s_->aq.front()));
+            s_->aq.pop_front();
+        }
+    }
+    if (ops.empty())
+        return;
+    std::vector<bool> done (ops.size(), false);
+    auto const found =
+        [&](std::size_t i, void const* data, std::size_t size)
+        {
+            done[i] = true;
+            ops[i].handler(nullptr, data, size);
+        };
+    std::exception_ptr ep;
+    try
+    {
+        // Alone, it can be served by the value cache
+        if (ops.size() == 1)
+        {
+            fetch(ops[0].key.data(),
+                [&](void const* data, std::size_t size)
+                {
+                    found(0, data, size);
+                });
+        }
+        else
+        {
+            std::vector<void const*> keys;
+            keys.reserve(ops.size());
+            for (auto const& op : ops)
+                keys.push_back(op.key.data());
+            fetch_batch(keys.data(), keys.size(), found);
+        }
+    }
+    catch(...)
+    {
+        ep = std::current_exception();
+    }
+    for (std::size_t i = 0; i < ops.size(); ++i)
+        if (! done[i])
+            ops[i].handler(ep, nullptr, 0);
+}
+
+//  Returns `true` if a pool of this size should be
+//  committed without waiting for the timeout.
+//
+template <class Hasher, class Codec, class File,
+    std::size_t KeySize, class Observer>
+bool
+store<Hasher, Codec, File, KeySize, Observer>::commit_due (
+    std::size_t pool) const
+{
+    if (pool >= s_->pool_thresh)
+        return true;
+    if (s_->fc.limit() > 0 && pool >= s_->fc.limit())
+        return true;
+    // The memory budget asked for it
+    if (s_->bm.flush_requested())
+        return true;
+    // Start committing before inserts are throttled
+    auto const budget = s_->fc.budget();
+    return budget > 0 && pool >= budget;
+}
+
+//  Report the memory held to the budget.
+//
+//  Requires m_ held.
+//
+template <class Hasher, class Codec, class File,
+    std::size_t KeySize, class Observer>
+void
+store<Hasher, Codec, File, KeySize, Observer>::charge()
+{
+    if (! s_->bm.joined())
+        return;
+    auto n = s_->p1.memory() + s_->commit_memory;
+    for (auto const& p : s_->pq)
+        n += p.memory();
+    s_->bm.charge(n);
+}
+
+//  Report cache hits to the budget, and resize the
+//  read cache to the share the budget grants.
+//
+template <class Hasher, class Codec, class File,
+    std::size_t KeySize, class Observer>
+void
+store<Hasher, Codec, File, KeySize, Observer>::share_budget()
+{
+    if (! s_->bm.joined())
+        return;
+    s_->bm.hits(s_->sc.cache_hits.load());
+    s_->bm.rebalance();
+    auto const bytes = s_->bm.cache_size();
+    if (bytes / s_->kh.block_size != s_->rc.capacity())
+    {
+        std::lock_guard<std::mutex> l (cm_);
+        s_->rc.resize(bytes);
+    }
+}
+
 //  Commit the memory pool to disk, then sync.
 //
 //  Preconditions:
 //
 //  Effects:
 //
-template <class Hasher, class Codec, class File>
+//  Also splits the given number of buckets ahead of
+//  the load factor, even if the pool is empty.
+//
+template <class Hasher, class Codec, class File,
+    std::size_t KeySize, class Observer>
 void
-store<Hasher, Codec, File>::commit()
+store<Hasher, Codec, File, KeySize, Observer>::commit (
+    std::size_t splits)
 {
     using namespace detail;
     buffer buf1 (s_->kh.block_size);
     buffer buf2 (s_->kh.block_size);
-    bucket tmp (s_->kh.block_size, buf1.get());
+    bucket tmp (s_->kh.block_size,
+        buf1.get(), s_->kh.inline_bytes);
     // Empty cache put in place temporarily
     // so we can reuse the memory from s_->c1
     cache c1;
+    bool flush;
     {
         unique_lock_type m (m_);
-        if (s_->p1.empty())
-            return;
-        if (s_->p1.data_size() >= commit_limit_)
+        // Asked by the budget to give back memory
+        flush = s_->bm.flushed();
+        if (! s_->pq.empty())
+        {
+            // Sealed pools go first, in order
+            swap (s_->p0, s_->pq.front());
+            swap (s_->h0, s_->hq.front());
+            s_->pq.pop_front();
+            s_->hq.pop_front();
             cond_limit_.notify_all();
+        }
+        else if (s_->p1.empty() && splits == 0)
+        {
+            if (flush)
+            {
+                s_->p1.shrink_to_fit();
+                charge();
+            }
+            return;
+        }
+        else
+        {
+            if (s_->fc.limit() > 0 &&
+                    s_->p1.data_size() >= s_->fc.limit())
+                cond_limit_.notify_all();
+            swap (s_->p0, s_->p1);
+            swap (s_->h0, s_->h1);
+        }
         swap (s_->c1, c1);
-        swap (s_->p0, s_->p1);
         s_->pool_thresh = std::max(
             s_->pool_thresh, s_->p0.data_size());
+        s_->commit_memory = s_->p0.memory() +
+            s_->c0.memory() + c1.memory();
+        charge();
         m.unlock();
     }
+    // Measures the commit rate for the flow control
+    auto const start = std::chrono::steady_clock::now();
+    auto const pool = s_->p0.data_size();
     // Prepare rollback information
     // Log File Header
     log_file_header lh;
-    lh.version = currentVersion;    // Version
+    lh.version = creditVersion;     // Version
     lh.uid = s_->kh.uid;            // UID
     lh.appnum = s_->kh.appnum;      // Appnum
-    lh.key_size = s_->kh.key_size;  // Key Size
+    lh.key_size = key_size();       // Key Size
     lh.salt = s_->kh.salt;          // Salt
     lh.pepper = pepper<Hasher>(
         lh.salt);                   // Pepper
@@ -758,62 +3031,109 @@ store<Hasher, Codec, File>::commit()
         s_->kf.actual_size();       // Key File Size
     lh.dat_file_size =
         s_->df.actual_size();       // Data File Size
-    write (s_->lf, lh);
-    s_->lf.sync();
-    // Append data and spills to data file
+    lh.split_credit = credit_;      // Split Credit
+    {
+        observe<Observer> o (obs_, phase::log_header);
+        write (s_->lf, lh);
+        file_sync(s_->lf, s_->dl);
+    }
+    auto const log_start = s_->lf.actual_size();
+    // Syncs which later writes depend on flush the
+    // device cache even at range.
+    auto const barrier = s_->dl == durability::range ?
+        durability::data : s_->dl;
+    // The stages below overlap: full buffers of data
+    // records, spills and log records are written by
+    // the I/O worker while this thread keeps doing
+    // inserts and splits.
     auto modulus = modulus_;
     auto buckets = buckets_;
+    // Log records of clean buckets are written as
+    // the buckets are first loaded from the key file.
+    // VFALCO Should the bulk_writer buffer size be tunable?
+    bulk_writer<File> lw (s_->lf,
+        s_->lf.actual_size(), bulk_write_size, s_->lio);
+    // Append data and spills to data file
+    std::uint64_t dat_end;
     {
         // Bulk write to avoid write amplification
         bulk_writer<File> w (s_->df,
-            s_->df.actual_size(), bulk_write_size);
+            s_->df.actual_size(), bulk_write_size, s_->io);
         // Write inserted data to the data file
-        for (auto& e : s_->p0)
-        {
-            // VFALCO This could be UB since other
-            // threads are reading other data members
-            // of this object in memory
-            e.second = w.offset();
-            auto os = w.prepare (value_size(
-                e.first.size, s_->kh.key_size));
-            // Data Record
-            write <uint48_t> (os,
-                e.first.size);          // Size
-            write (os, e.first.key,
-                s_->kh.key_size);       // Key
-            write (os, e.first.data,
-                e.first.size);          // Data
+        {
+            observe<Observer> o (obs_, phase::data_append);
+            for (auto& e : s_->p0)
+            {
+                // VFALCO This could be UB since other
+                // threads are reading other data members
+                // of this object in memory
+                e.second = w.offset();
+                auto os = w.prepare (value_size(
+                    e.first.size, key_size()));
+                // Data Record
+                write <uint48_t> (os,
+                    e.first.size);          // Size
+                write (os, e.first.key,
+                    key_size());            // Key
+                write (os, e.first.data,
+                    e.first.size);          // Data
+            }
         }
         // Do inserts, splits, and build view
         // of original and modified buckets
-        for (auto const e : s_->p0)
-        {
-            // VFALCO Should this be >= or > ?
-            if ((frac_ += 65536) >= thresh_)
+        observe<Observer> o (obs_, phase::split_insert);
+        auto const split_next =
+            [&]
             {
-                // split
-                frac_ -= thresh_;
                 if (buckets == modulus)
                     modulus *= 2;
                 auto const n1 = buckets - (modulus / 2);
                 auto const n2 = buckets++;
-                auto b1 = load (n1, c1, s_->c0, buf2.get());
+                auto b1 = load (n1, c1, s_->c0, buf2.get(), lw);
                 auto b2 = c1.create (n2);
                 // If split spills, the writer is
                 // flushed which can amplify writes.
                 split (b1, b2, tmp, n1, n2,
                     buckets, modulus, w);
+            };
+        for (auto const e : s_->p0)
+        {
+            // VFALCO Should this be >= or > ?
+            if ((frac_ += 65536) >= thresh_)
+            {
+                frac_ -= thresh_;
+                // A bucket split early stands in
+                if (ahead_ > 0)
+                    --ahead_;
+                else
+                    split_next();
             }
             // insert
             auto const n = bucket_index(
                 e.first.hash, buckets, modulus);
-            auto b = load (n, c1, s_->c0, buf2.get());
+            auto b = load (n, c1, s_->c0, buf2.get(), lw);
             // This can amplify writes if it spills.
             maybe_spill(b, w);
-            b.insert (e.second,
+            auto const i = b.insert (e.second,
                 e.first.size, e.first.hash);
+            if (inline_record(b, i, e.first.size))
+            {
+                // Inline Record
+                std::memcpy(b.inline_data(i),
+                    e.first.key, key_size());
+                std::memcpy(b.inline_data(i) +
+                    key_size(), e.first.data,
+                        e.first.size);
+            }
+            // Must happen before readers lose sight of p0
+            s_->bf.insert(e.first.hash);
         }
+        for (std::size_t i = 0; i < splits; ++i)
+            split_next();
+        ahead_ += splits;
         w.flush();
+        dat_end = w.offset();
+        s_->sc.data_bytes.add(dat_end - lh.dat_file_size);
     }
     // Give readers a view of the new buckets.
     // This might be slightly better than the old
@@ -822,62 +3142,159 @@ store<Hasher, Codec, File>::commit()
         unique_lock_type m (m_);
         swap(c1, s_->c1);
         s_->p0.clear();
+        if (flush)
+            s_->p0.shrink_to_fit();
+        s_->commit_memory = s_->p0.memory() +
+            s_->c0.memory() + s_->c1.memory();
+        charge();
         buckets_ = buckets;
         modulus_ = modulus;
-        g_.start();
+        m_.start();
     }
-    // Write clean buckets to log file
-    // VFALCO Should the bulk_writer buffer size be tunable?
+    // Finish the log file. The data file is synced by
+    // the I/O worker while the log is synced, readers
+    // of the old view drain, and new buckets are written.
+    {
+        observe<Observer> o (obs_, phase::log_write);
+        lw.flush();
+        s_->sc.log_bytes.add(lw.offset() - log_start);
+        s_->c0.clear();
+        s_->io.post(
+            [this]
+            {
+                observe<Observer> o (obs_, phase::data_sync);
+                file_sync(s_->df, s_->dl);
+            });
+        // The log must be durable before any bucket
+        // is overwritten, which range does not ensure.
+        file_sync(s_->lf, barrier);
+    }
+    {
+        observe<Observer> o (obs_, phase::reader_drain);
+        auto const t0 = clock_type::now();
+        m_.finish();
+        s_->sc.gentex_waits.add();
+        s_->sc.gentex_time.add(
+            stat_nanoseconds(clock_type::now() - t0));
+    }
+    // Write new buckets to key file. The cache is
+    // visited in bucket order, so offsets ascend and
+    // runs of adjacent buckets go out as one write.
     {
-        bulk_writer<File> w(s_->lf,
-            s_->lf.actual_size(), bulk_write_size);
-        for (auto const e : s_->c0)
+        observe<Observer> o (obs_, phase::key_write);
+        std::vector<file_request> requests;
+        requests.reserve(s_->c1.size() + 1);
+        // The header goes first, holding the split
+        // credit. Recovery puts back the one logged.
+        buffer header;
+        if (ahead_ != credit_)
         {
-            // Log Record
-            auto os = w.prepare(
-                field<std::uint64_t>::size +    // Index
-                e.second.compact_size());       // Bucket
-            // Log Record
-            write<std::uint64_t>(os, e.first);  // Index
-            e.second.write(os);                 // Bucket
+            auto kh = s_->kh;
+            kh.split_credit = ahead_;
+            header.reserve(kh.block_size);
+            std::fill(header.get(),
+                header.get() + header.size(), 0);
+            ostream os (header.get(), header.size());
+            write(os, kh);
+            requests.push_back({0,
+                header.get(), kh.block_size});
+            credit_ = ahead_;
         }
-        s_->c0.clear();
-        w.flush();
-        s_->lf.sync();
+        for (auto e : s_->c1)
+        {
+            e.second.pad();
+            requests.push_back({
+                (e.first + 1) * s_->kh.block_size,
+                const_cast<void*>(e.second.block()),
+                    s_->kh.block_size});
+        }
+        write_batch(s_->kf,
+            requests.data(), requests.size());
+        s_->sc.key_bytes.add(
+            requests.size() * s_->kh.block_size);
     }
-    g_.finish();
-    // Write new buckets to key file
-    for (auto const e : s_->c1)
-        e.second.write (s_->kf,
-            (e.first + 1) * s_->kh.block_size);
     // Finalize the commit
-    s_->df.sync();
-    s_->kf.sync();
-    s_->lf.trunc(0);
-    s_->lf.sync();
-    // Cache is no longer needed, all fetches will go straight
-    // to disk again. Do this after the sync, otherwise readers
-    // might get blocked longer due to the extra I/O.
+    {
+        observe<Observer> o (obs_, phase::final_sync);
+        s_->io.wait();
+        // The buckets, and the data records written back
+        // by the data sync, must be durable before the
+        // log is emptied.
+        file_sync(s_->kf, barrier);
+        s_->lf.trunc(0);
+        file_sync(s_->lf, s_->dl);
+    }
+    {
+        std::lock_guard<std::mutex> l (tm_);
+        s_->boundaries.push_back(dat_end);
+        if (s_->boundaries.size() > tail_boundaries)
+            s_->boundaries.pop_front();
+    }
+    auto const elapsed =
+        std::chrono::steady_clock::now() - start;
+    // Splits alone say nothing of the insert rate
+    if (pool > 0)
+        s_->fc.on_commit(pool, elapsed);
+    if (splits > 0)
+    {
+        s_->sc.early_splits.add(splits);
+        s_->sc.split_commits.add();
+    }
+    s_->sc.commits.add();
+    s_->sc.commit_time.add(stat_nanoseconds(elapsed));
+    s_->sc.commit_max.raise(stat_nanoseconds(elapsed));
+    // The filter was sized at open
+    if (s_->bf.enabled() && buckets * s_->kh.capacity *
+            s_->kh.load_factor / 65536 > s_->bf.keys())
+        grow_filter(buckets);
+    // The values in p0 are durable now
+    complete(s_->h0, nullptr);
+    // Bring the read cache up to date before c1 goes
+    // away. Readers holding a genlock from before the
+    // new view finished above, so nothing stale can be
+    // inserted after this point.
+    if (s_->rc.capacity() > 0)
+    {
+        std::lock_guard<std::mutex> l (cm_);
+        for (auto const e : s_->c1)
+            s_->rc.update(e.first, e.second);
+    }
+    // The same holds for the index, whose buckets in c1
+    // are not read until c1 is cleared below.
+    if (s_->ki.enabled())
+        for (auto const e : s_->c1)
+            s_->ki.update(e.first, e.second.block());
+    // Cache is no longer needed, fetches will go to the
+    // read cache or disk again. Do this after the sync,
+    // otherwise readers might get blocked longer due to
+    // the extra I/O.
     // VFALCO is this correct?
     {
         unique_lock_type m (m_);
         s_->c1.clear();
+        if (flush)
+        {
+            s_->c1.shrink_to_fit();
+            s_->c0.shrink_to_fit();
+        }
+        s_->commit_memory = s_->p0.memory() +
+            s_->c0.memory() + s_->c1.memory();
+        charge();
     }
 }
 
-template <class Hasher, class Codec, class File>
+template <class Hasher, class Codec, class File,
+    std::size_t KeySize, class Observer>
 void
-store<Hasher, Codec, File>::run()
+store<Hasher, Codec, File, KeySize, Observer>::run()
 {
     auto const pred =
         [this]()
         {
             return
                 ! open_ ||
-                s_->p1.data_size() >=
-                    s_->pool_thresh ||
-                s_->p1.data_size() >=
-                    commit_limit_;
+                ! s_->pq.empty() ||
+                commit_due(s_->p1.data_size());
         };
     try
     {
@@ -894,6 +3311,20 @@ store<Hasher, Codec, File>::run()
                     break;
                 m.unlock();
                 commit();
+                share_budget();
+                // Split ahead while nothing is due,
+                // a batch at a time so that a commit
+                // which comes due waits for one only.
+                while (timeout && ahead_ < s_->split_ahead)
+                {
+                    m.lock();
+                    bool const due = pred();
+                    m.unlock();
+                    if (due)
+                        break;
+                    commit(std::min<std::size_t>(split_batch,
+                        s_->split_ahead - ahead_));
+                }
                 // Reclaim some memory if
                 // we get a spare moment.
                 if (timeout)
@@ -906,17 +3337,102 @@ store<Hasher, Codec, File>::run()
                     s_->p0.shrink_to_fit();
                     s_->c1.shrink_to_fit();
                     s_->c0.shrink_to_fit();
+                    s_->commit_memory = s_->p0.memory() +
+                        s_->c0.memory() + s_->c1.memory();
+                    charge();
                     m.unlock();
                 }
             }
         }
+        // Commit everything, sealed pools first
+        while (! s_->pq.empty())
+            commit();
         commit();
     }
     catch(...)
     {
         ep_ = std::current_exception(); // must come first
         epb_.store(true);
+        complete(s_->h0, ep_);
+    }
+}
+
+template <class Hasher, class Codec, class File,
+    std::size_t KeySize, class Observer>
+auto
+store<Hasher, Codec, File, KeySize, Observer>::find_pooled (
+    std::size_t h, void const* key, bool fetching) ->
+        typename pool_type::element*
+{
+    auto iter = s_->p1.find(h, key);
+    if (iter != s_->p1.end())
+    {
+        if (fetching)
+            s_->sc.fetch_p1.add();
+        return &*iter;
+    }
+    for (auto& p : s_->pq)
+    {
+        iter = p.find(h, key);
+        if (iter != p.end())
+        {
+            if (fetching)
+                s_->sc.fetch_queue.add();
+            return &*iter;
+        }
+    }
+    iter = s_->p0.find(h, key);
+    if (iter != s_->p0.end())
+    {
+        if (fetching)
+            s_->sc.fetch_p0.add();
+        return &*iter;
+    }
+    return nullptr;
+}
+
+template <class Hasher, class Codec, class File,
+    std::size_t KeySize, class Observer>
+void
+store<Hasher, Codec, File, KeySize, Observer>::limit_pool (
+    unique_lock_type& m)
+{
+    // Start a new commit
+    cond_.notify_all();
+    // Wait for the pool to shrink, or for
+    // room to seal it behind the commit
+    auto const pred =
+        [this]() { return
+            s_->p1.data_size() < s_->fc.limit() ||
+                s_->pq.size() < s_->queue_size; };
+    if (! pred())
+    {
+        auto const t0 = clock_type::now();
+        cond_limit_.wait(m, pred);
+        s_->sc.limit_waits.add();
+        s_->sc.limit_time.add(detail::stat_nanoseconds(
+            clock_type::now() - t0));
     }
+    if (s_->p1.data_size() < s_->fc.limit())
+        return;
+    s_->pq.emplace_back(key_size(), s_->alloc_size,
+        s_->high_water, s_->huge_pages);
+    swap (s_->pq.back(), s_->p1);
+    s_->hq.emplace_back();
+    swap (s_->hq.back(), s_->h1);
+    cond_.notify_all();
+}
+
+template <class Hasher, class Codec, class File,
+    std::size_t KeySize, class Observer>
+void
+store<Hasher, Codec, File, KeySize, Observer>::complete (
+    std::vector<commit_handler>& handlers,
+        std::exception_ptr ep)
+{
+    for (auto& h : handlers)
+        h(ep);
+    handlers.clear();
 }
 
 } // nudb
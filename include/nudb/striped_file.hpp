@@ -0,0 +1,428 @@
+//
+// Copyright (c) 2015-2016 Vinnie Falco (vinnie dot falco at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef NUDB_STRIPED_FILE_HPP
+#define NUDB_STRIPED_FILE_HPP
+
+#include <nudb/common.hpp>
+#include <nudb/file.hpp>
+#include <nudb/detail/file_traits.hpp>
+#include <nudb/detail/thread_group.hpp>
+#include <algorithm>
+#include <cstddef>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace nudb {
+
+/** Options for striped_file. */
+struct striped_file_options
+{
+    // Directories holding the second and later stripes of
+    // each file created, usually on other devices. With
+    // none, files are created whole.
+    std::vector<path_type> dirs;
+
+    // Bytes of each stripe unit. A multiple of the block
+    // size keeps every bucket on one device.
+    std::size_t stripe_size = 1024 * 1024;
+};
+
+/** A file striped across several devices.
+
+    The bytes of the file are dealt out in units of the
+    stripe size to a set of segment files, in turn, as
+    a RAID 0 array would. The first segment is at the path
+    of the file, and the others have the same name in each
+    of the directories of the options. Offsets seen by the
+    store are those of the whole file, so the formats do
+    not change.
+
+    A transfer which spans several segments, such as the
+    bulk writes of a commit, runs on all of them at once,
+    one thread per segment, and so does a sync.
+
+    The stripe size and directories are kept in a file
+    next to the first segment, named as the file with
+    ".stripes" appended, so that a striped file can be
+    opened, recovered or erased without the options.
+    Files without one are opened as a single segment.
+
+    Only the File concept of the store is provided. visit,
+    verify and other functions which read the data file
+    through native_file need its segments joined first.
+
+    @tparam File The type of each segment file.
+*/
+template <class File = native_file>
+class striped_file
+{
+private:
+    std::vector<path_type> dirs_;   // used by create
+    std::size_t unit_ = 1024 * 1024;
+    std::vector<File> f_;
+
+public:
+    striped_file() = default;
+    striped_file (striped_file const&) = delete;
+    striped_file& operator= (striped_file const&) = delete;
+
+    striped_file (striped_file&&) = default;
+    striped_file& operator= (striped_file&&) = default;
+
+    explicit
+    striped_file (striped_file_options const& opt)
+        : dirs_ (opt.dirs)
+        , unit_ (std::max<std::size_t>(1, opt.stripe_size))
+    {
+    }
+
+    bool
+    is_open() const
+    {
+        return ! f_.empty();
+    }
+
+    // Returns the number of segments
+    std::size_t
+    segments() const
+    {
+        return f_.size();
+    }
+
+    void
+    close();
+
+    bool
+    create (file_mode mode, path_type const& path);
+
+    bool
+    open (file_mode mode, path_type const& path);
+
+    static
+    bool
+    erase (path_type const& path);
+
+    std::size_t
+    actual_size() const;
+
+    void
+    read (std::size_t offset,
+        void* buffer, std::size_t bytes)
+    {
+        transfer(false, offset, buffer, bytes);
+    }
+
+    void
+    write (std::size_t offset,
+        void const* buffer, std::size_t bytes)
+    {
+        transfer(true, offset,
+            const_cast<void*>(buffer), bytes);
+    }
+
+    void
+    sync()
+    {
+        sync(durability::full);
+    }
+
+    // Sync to the given level, see durability
+    void
+    sync (durability level);
+
+    void
+    trunc (std::size_t length);
+
+private:
+    static
+    path_type
+    manifest (path_type const& path)
+    {
+        return path + ".stripes";
+    }
+
+    static
+    bool
+    read_manifest (path_type const& path,
+        std::size_t& unit, std::vector<path_type>& dirs);
+
+    static
+    std::vector<path_type>
+    segment_paths (path_type const& path,
+        std::vector<path_type> const& dirs);
+
+    bool
+    open_segments (file_mode mode, path_type const& path,
+        std::vector<path_type> const& dirs, bool create);
+
+    void
+    transfer (bool write, std::size_t offset,
+        void* buffer, std::size_t bytes);
+
+    // Calls f(i) for each segment i, at once
+    template <class Function>
+    void
+    each (Function&& f);
+};
+
+//------------------------------------------------------------------------------
+
+template <class File>
+void
+striped_file<File>::close()
+{
+    for (auto& f : f_)
+        f.close();
+    f_.clear();
+}
+
+template <class File>
+bool
+striped_file<File>::create (
+    file_mode mode, path_type const& path)
+{
+    if (is_open())
+        throw std::logic_error("nudb: already open");
+    return open_segments(mode, path, dirs_, true);
+}
+
+template <class File>
+bool
+striped_file<File>::open (
+    file_mode mode, path_type const& path)
+{
+    if (is_open())
+        throw std::logic_error("nudb: already open");
+    std::vector<path_type> dirs;
+    if (! read_manifest(path, unit_, dirs))
+        dirs.clear();
+    return open_segments(mode, path, dirs, false);
+}
+
+template <class File>
+bool
+striped_file<File>::erase (path_type const& path)
+{
+    std::size_t unit;
+    std::vector<path_type> dirs;
+    if (read_manifest(path, unit, dirs))
+    {
+        auto const paths = segment_paths(path, dirs);
+        for (std::size_t i = 1; i < paths.size(); ++i)
+            File::erase(paths[i]);
+        File::erase(manifest(path));
+    }
+    return File::erase(path);
+}
+
+// The size is that of the whole file up to
+// the last byte held by any segment.
+template <class File>
+std::size_t
+striped_file<File>::actual_size() const
+{
+    auto const n = f_.size();
+    std::size_t result = 0;
+    for (std::size_t i = 0; i < n; ++i)
+    {
+        auto const size = f_[i].actual_size();
+        if (size == 0)
+            continue;
+        auto const last = size - 1;
+        result = std::max(result,
+            ((last / unit_) * n + i) * unit_ +
+                last % unit_ + 1);
+    }
+    return result;
+}
+
+template <class File>
+void
+striped_file<File>::sync (durability level)
+{
+    each(
+        [&](std::size_t i)
+        {
+            detail::file_sync(f_[i], level);
+        });
+}
+
+template <class File>
+void
+striped_file<File>::trunc (std::size_t length)
+{
+    auto const n = f_.size();
+    auto const units = length / unit_;
+    each(
+        [&](std::size_t i)
+        {
+            auto size = (units / n) * unit_;
+            if (i < units % n)
+                size += unit_;
+            else if (i == units % n)
+                size += length % unit_;
+            f_[i].trunc(size);
+        });
+}
+
+template <class File>
+bool
+striped_file<File>::read_manifest (path_type const& path,
+    std::size_t& unit, std::vector<path_type>& dirs)
+{
+    std::ifstream is (manifest(path));
+    if (! is)
+        return false;
+    std::string line;
+    if (! std::getline(is, line))
+        throw file_error("nudb: bad stripes file");
+    unit = std::max<std::size_t>(1, std::stoull(line));
+    dirs.clear();
+    while (std::getline(is, line))
+        if (! line.empty())
+            dirs.push_back(line);
+    return true;
+}
+
+template <class File>
+std::vector<path_type>
+striped_file<File>::segment_paths (path_type const& path,
+    std::vector<path_type> const& dirs)
+{
+    auto const pos = path.find_last_of("/\\");
+    auto const name = pos == path_type::npos ?
+        path : path.substr(pos + 1);
+    std::vector<path_type> result;
+    result.push_back(path);
+    for (auto const& dir : dirs)
+        result.push_back(dir + "/" + name);
+    return result;
+}
+
+template <class File>
+bool
+striped_file<File>::open_segments (file_mode mode,
+    path_type const& path, std::vector<path_type> const& dirs,
+        bool create)
+{
+    auto const paths = segment_paths(path, dirs);
+    f_.resize(paths.size());
+    if (! (create ? f_[0].create(mode, path) :
+        f_[0].open(mode, path)))
+    {
+        f_.clear();
+        return false;
+    }
+    if (create && ! dirs.empty())
+    {
+        std::ofstream os (manifest(path));
+        os << unit_ << "\n";
+        for (auto const& dir : dirs)
+            os << dir << "\n";
+        os.close();
+        if (! os)
+        {
+            close();
+            File::erase(path);
+            throw file_error("nudb: write stripes file");
+        }
+    }
+    for (std::size_t i = 1; i < paths.size(); ++i)
+    {
+        if (create ? f_[i].create(mode, paths[i]) :
+            f_[i].open(mode, paths[i]))
+            continue;
+        close();
+        if (! create)
+            throw file_error(
+                "nudb: missing stripe " + paths[i]);
+        // Already there, leave it alone
+        for (std::size_t j = 1; j < i; ++j)
+            File::erase(paths[j]);
+        File::erase(manifest(path));
+        File::erase(path);
+        return false;
+    }
+    return true;
+}
+
+template <class File>
+void
+striped_file<File>::transfer (bool write,
+    std::size_t offset, void* buffer, std::size_t bytes)
+{
+    auto const n = f_.size();
+    // Within one unit, as most reads are
+    if (n == 1 || offset % unit_ + bytes <= unit_)
+    {
+        auto const u = offset / unit_;
+        auto& f = f_[u % n];
+        auto const at = (u / n) * unit_ + offset % unit_;
+        if (write)
+            f.write(at, buffer, bytes);
+        else
+            f.read(at, buffer, bytes);
+        return;
+    }
+    // Units of one segment follow each other in it, so
+    // a native file merges them into one vectored call.
+    std::vector<std::vector<file_request>> r (n);
+    auto p = reinterpret_cast<char*>(buffer);
+    while (bytes > 0)
+    {
+        auto const u = offset / unit_;
+        auto const amount = std::min(
+            bytes, unit_ - offset % unit_);
+        r[u % n].push_back({(u / n) * unit_ +
+            offset % unit_, p, amount});
+        offset += amount;
+        p += amount;
+        bytes -= amount;
+    }
+    each(
+        [&](std::size_t i)
+        {
+            if (r[i].empty())
+                return;
+            if (write)
+                detail::write_batch(
+                    f_[i], r[i].data(), r[i].size());
+            else
+                detail::read_batch(
+                    f_[i], r[i].data(), r[i].size());
+        });
+}
+
+template <class File>
+template <class Function>
+void
+striped_file<File>::each (Function&& f)
+{
+    if (f_.size() == 1)
+        return f(0);
+    detail::thread_group g;
+    for (std::size_t i = 1; i < f_.size(); ++i)
+        g.spawn(
+            [&f, i]
+            {
+                f(i);
+            });
+    g.run(
+        [&f]
+        {
+            f(0);
+        });
+    g.join();
+}
+
+} // nudb
+
+#endif
@@ -0,0 +1,474 @@
+//
+// Copyright (c) 2015-2016 Vinnie Falco (vinnie dot falco at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef NUDB_URING_FILE_HPP
+#define NUDB_URING_FILE_HPP
+
+#include <nudb/common.hpp>
+#include <nudb/posix_file.hpp>
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <utility>
+#include <vector>
+
+#ifndef NUDB_URING_FILE
+# if NUDB_POSIX_FILE && defined(__linux__) && defined(__has_include)
+#  if __has_include(<linux/io_uring.h>)
+#   define NUDB_URING_FILE 1
+#  else
+#   define NUDB_URING_FILE 0
+#  endif
+# else
+#  define NUDB_URING_FILE 0
+# endif
+#endif
+
+#if NUDB_URING_FILE
+# include <linux/io_uring.h>
+# include <sys/mman.h>
+# include <sys/syscall.h>
+# include <sys/uio.h>
+# include <unistd.h>
+#endif
+
+namespace nudb {
+
+#if NUDB_URING_FILE
+
+namespace detail {
+
+/*  A submission and completion queue pair.
+
+    Requests are queued with a single io_uring_enter
+    and their completions are reaped together. If the
+    kernel refuses to create the ring, for example when
+    io_uring is disabled, the ring is not valid and the
+    caller falls back to ordinary blocking calls.
+*/
+template <class = void>
+class uring_t
+{
+private:
+    int fd_ = -1;
+    unsigned entries_ = 0;
+
+    void* sq_ptr_ = MAP_FAILED;
+    std::size_t sq_size_ = 0;
+    void* cq_ptr_ = MAP_FAILED;
+    std::size_t cq_size_ = 0;
+    io_uring_sqe* sqes_ = nullptr;
+    std::size_t sqes_size_ = 0;
+
+    unsigned* sq_tail_;
+    unsigned* sq_mask_;
+    unsigned* sq_array_;
+    unsigned* cq_head_;
+    unsigned* cq_tail_;
+    unsigned* cq_mask_;
+    io_uring_cqe* cqes_;
+
+    std::vector<iovec> iov_;
+
+public:
+    uring_t (uring_t const&) = delete;
+    uring_t& operator= (uring_t const&) = delete;
+
+    explicit
+    uring_t (unsigned entries);
+
+    ~uring_t();
+
+    bool
+    valid() const
+    {
+        return fd_ != -1;
+    }
+
+    // Maximum number of requests per submission
+    std::size_t
+    depth() const
+    {
+        return entries_;
+    }
+
+    // Perform up to depth() transfers on fd, storing
+    // in done[i] the bytes transferred or -errno.
+    void
+    submit (int fd, bool write, file_request const* r,
+        std::size_t n, long* done);
+
+private:
+    int
+    enter (unsigned to_submit, unsigned min_complete);
+
+    void
+    destroy();
+};
+
+template <class _>
+uring_t<_>::uring_t (unsigned entries)
+{
+    io_uring_params p;
+    std::memset(&p, 0, sizeof(p));
+    fd_ = static_cast<int>(::syscall(
+        __NR_io_uring_setup, entries, &p));
+    if (fd_ == -1)
+        return;
+    entries_ = p.sq_entries;
+    sq_size_ = p.sq_off.array +
+        p.sq_entries * sizeof(unsigned);
+    cq_size_ = p.cq_off.cqes +
+        p.cq_entries * sizeof(io_uring_cqe);
+    bool const single =
+        (p.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single)
+        sq_size_ = cq_size_ =
+            std::max(sq_size_, cq_size_);
+    sq_ptr_ = ::mmap(nullptr, sq_size_,
+        PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+            fd_, IORING_OFF_SQ_RING);
+    if (sq_ptr_ == MAP_FAILED)
+    {
+        destroy();
+        return;
+    }
+    if (single)
+    {
+        cq_ptr_ = sq_ptr_;
+    }
+    else
+    {
+        cq_ptr_ = ::mmap(nullptr, cq_size_,
+            PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                fd_, IORING_OFF_CQ_RING);
+        if (cq_ptr_ == MAP_FAILED)
+        {
+            destroy();
+            return;
+        }
+    }
+    sqes_size_ = p.sq_entries * sizeof(io_uring_sqe);
+    auto const sqes = ::mmap(nullptr, sqes_size_,
+        PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+            fd_, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED)
+    {
+        destroy();
+        return;
+    }
+    sqes_ = reinterpret_cast<io_uring_sqe*>(sqes);
+    auto const sq = reinterpret_cast<char*>(sq_ptr_);
+    auto const cq = reinterpret_cast<char*>(cq_ptr_);
+    sq_tail_ = reinterpret_cast<unsigned*>(sq + p.sq_off.tail);
+    sq_mask_ = reinterpret_cast<unsigned*>(sq + p.sq_off.ring_mask);
+    sq_array_ = reinterpret_cast<unsigned*>(sq + p.sq_off.array);
+    cq_head_ = reinterpret_cast<unsigned*>(cq + p.cq_off.head);
+    cq_tail_ = reinterpret_cast<unsigned*>(cq + p.cq_off.tail);
+    cq_mask_ = reinterpret_cast<unsigned*>(cq + p.cq_off.ring_mask);
+    cqes_ = reinterpret_cast<io_uring_cqe*>(cq + p.cq_off.cqes);
+    iov_.resize(entries_);
+}
+
+template <class _>
+uring_t<_>::~uring_t()
+{
+    destroy();
+}
+
+template <class _>
+void
+uring_t<_>::submit (int fd, bool write,
+    file_request const* r, std::size_t n, long* done)
+{
+    // Submission Queue Entries
+    auto tail = *sq_tail_;
+    auto const mask = *sq_mask_;
+    for (std::size_t i = 0; i < n; ++i)
+    {
+        auto const index = tail & mask;
+        iov_[i].iov_base = r[i].data;
+        iov_[i].iov_len = r[i].bytes;
+        auto& e = sqes_[index];
+        std::memset(&e, 0, sizeof(e));
+        e.opcode = write ? IORING_OP_WRITEV : IORING_OP_READV;
+        e.fd = fd;
+        e.off = r[i].offset;
+        e.addr = reinterpret_cast<std::uintptr_t>(&iov_[i]);
+        e.len = 1;
+        e.user_data = i;
+        sq_array_[index] = index;
+        ++tail;
+    }
+    // Publish the entries before the tail
+    __atomic_store_n(sq_tail_, tail, __ATOMIC_RELEASE);
+    // Every request is reaped before returning, even after
+    // an error, since the kernel still owns the buffers.
+    auto submitted = 0u;
+    auto reaped = 0u;
+    while (reaped < n)
+    {
+        auto const result = enter(
+            static_cast<unsigned>(n - submitted),
+                static_cast<unsigned>(n - reaped));
+        if (result < 0)
+        {
+            if (errno == EINTR || errno == EAGAIN ||
+                    errno == EBUSY)
+                continue;
+            throw file_posix_error("io_uring_enter");
+        }
+        submitted += result;
+        // Completion Queue Entries
+        auto head = *cq_head_;
+        auto const ctail = __atomic_load_n(
+            cq_tail_, __ATOMIC_ACQUIRE);
+        while (head != ctail)
+        {
+            auto const& e = cqes_[head & *cq_mask_];
+            done[e.user_data] = e.res;
+            ++head;
+            ++reaped;
+        }
+        __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+    }
+}
+
+template <class _>
+int
+uring_t<_>::enter (
+    unsigned to_submit, unsigned min_complete)
+{
+    return static_cast<int>(::syscall(__NR_io_uring_enter,
+        fd_, to_submit, min_complete,
+            IORING_ENTER_GETEVENTS, nullptr, 0));
+}
+
+template <class _>
+void
+uring_t<_>::destroy()
+{
+    if (sqes_)
+        ::munmap(sqes_, sqes_size_);
+    if (cq_ptr_ != MAP_FAILED && cq_ptr_ != sq_ptr_)
+        ::munmap(cq_ptr_, cq_size_);
+    if (sq_ptr_ != MAP_FAILED)
+        ::munmap(sq_ptr_, sq_size_);
+    sqes_ = nullptr;
+    cq_ptr_ = MAP_FAILED;
+    sq_ptr_ = MAP_FAILED;
+    if (fd_ != -1)
+        ::close(fd_);
+    fd_ = -1;
+}
+
+using uring = uring_t<>;
+
+//------------------------------------------------------------------------------
+
+/*  File which performs batches of transfers using io_uring.
+
+    Single reads and writes go through posix_file. A batch
+    is queued with one system call per ring's worth of
+    requests and the completions are reaped together, so
+    that the device sees many requests in flight from a
+    single thread.
+
+    Each thread uses its own ring, created on the first
+    batch. If io_uring is not available, batches are
+    performed by posix_file.
+*/
+template <class = void>
+class uring_file
+{
+private:
+    enum
+    {
+        // Entries in each ring
+        ring_entries = 64
+    };
+
+    posix_file<> f_;
+
+public:
+    uring_file() = default;
+    uring_file (uring_file const&) = delete;
+    uring_file& operator= (uring_file const&) = delete;
+
+    uring_file (uring_file&&) = default;
+    uring_file& operator= (uring_file&&) = default;
+
+    bool
+    is_open() const
+    {
+        return f_.is_open();
+    }
+
+    void
+    close()
+    {
+        f_.close();
+    }
+
+    bool
+    create (file_mode mode, path_type const& path)
+    {
+        return f_.create(mode, path);
+    }
+
+    bool
+    open (file_mode mode, path_type const& path)
+    {
+        return f_.open(mode, path);
+    }
+
+    static
+    bool
+    erase (path_type const& path)
+    {
+        return posix_file<>::erase(path);
+    }
+
+    std::size_t
+    actual_size() const
+    {
+        return f_.actual_size();
+    }
+
+    void
+    read (std::size_t offset,
+        void* buffer, std::size_t bytes)
+    {
+        f_.read(offset, buffer, bytes);
+    }
+
+    void
+    write (std::size_t offset,
+        void const* buffer, std::size_t bytes)
+    {
+        f_.write(offset, buffer, bytes);
+    }
+
+    void
+    read_batch (file_request const* r, std::size_t n)
+    {
+        transfer(false, r, n);
+    }
+
+    void
+    write_batch (file_request const* r, std::size_t n)
+    {
+        transfer(true, r, n);
+    }
+
+    void
+    sync()
+    {
+        f_.sync();
+    }
+
+    void
+    sync (durability level)
+    {
+        f_.sync(level);
+    }
+
+    void
+    trunc (std::size_t length)
+    {
+        f_.trunc(length);
+    }
+
+    void
+    prefetch (std::size_t offset, std::size_t bytes)
+    {
+        f_.prefetch(offset, bytes);
+    }
+
+    bool
+    lock (std::size_t offset, std::size_t bytes)
+    {
+        return f_.lock(offset, bytes);
+    }
+
+    void
+    copy_to (int fd, std::size_t offset, std::size_t bytes)
+    {
+        f_.copy_to(fd, offset, bytes);
+    }
+
+private:
+    static
+    uring&
+    ring()
+    {
+        static thread_local uring r (ring_entries);
+        return r;
+    }
+
+    void
+    transfer (bool write,
+        file_request const* r, std::size_t n);
+};
+
+template <class _>
+void
+uring_file<_>::transfer (bool write,
+    file_request const* r, std::size_t n)
+{
+    auto& u = ring();
+    if (! u.valid())
+    {
+        if (write)
+            f_.write_batch(r, n);
+        else
+            f_.read_batch(r, n);
+        return;
+    }
+    long done[ring_entries];
+    while (n > 0)
+    {
+        auto const count = std::min<std::size_t>(
+            n, std::min<std::size_t>(u.depth(), ring_entries));
+        u.submit(f_.native_handle(), write, r, count, done);
+        for (std::size_t i = 0; i < count; ++i)
+        {
+            if (done[i] < 0)
+                throw file_posix_error(write ?
+                    "io_uring write" : "io_uring read",
+                        static_cast<int>(-done[i]));
+            auto const used =
+                static_cast<std::size_t>(done[i]);
+            if (used == r[i].bytes)
+                continue;
+            // Finish a short transfer, which
+            // throws at the end of the file.
+            auto const p =
+                reinterpret_cast<char*>(r[i].data) + used;
+            if (write)
+                f_.write(r[i].offset + used,
+                    p, r[i].bytes - used);
+            else
+                f_.read(r[i].offset + used,
+                    p, r[i].bytes - used);
+        }
+        r += count;
+        n -= count;
+    }
+}
+
+} // detail
+
+using uring_file = detail::uring_file<>;
+
+#endif
+
+} // nudb
+
+#endif
@@ -13,9 +13,13 @@
 #include <nudb/detail/bucket.hpp>
 #include <nudb/detail/bulkio.hpp>
 #include <nudb/detail/format.hpp>
+#include <nudb/detail/thread_group.hpp>
 #include <algorithm>
+#include <atomic>
 #include <cstddef>
+#include <functional>
 #include <string>
+#include <vector>
 
 namespace nudb {
 
@@ -63,19 +67,91 @@ struct verify_info
     }
 };
 
+namespace detail {
+
+// Returns the configured and calculated fields
+template <class = void>
+verify_info
+make_verify_info (dat_file_header const& dh,
+    key_file_header const& kh, std::size_t key_file_size,
+        std::size_t dat_file_size)
+{
+    verify_info info;
+    info.version = dh.version;
+    info.uid = dh.uid;
+    info.appnum = dh.appnum;
+    info.key_size = dh.key_size;
+    info.salt = kh.salt;
+    info.pepper = kh.pepper;
+    info.block_size = kh.block_size;
+    info.load_factor = kh.load_factor / 65536.f;
+    info.capacity = kh.capacity;
+    info.buckets = kh.buckets;
+    info.bucket_size = kh.bucket_size;
+    info.key_file_size = key_file_size;
+    info.dat_file_size = dat_file_size;
+    return info;
+}
+
+// Adds the measured fields of other to info
+template <class = void>
+void
+merge (verify_info& info, verify_info const& other)
+{
+    info.key_count += other.key_count;
+    info.value_count += other.value_count;
+    info.value_bytes += other.value_bytes;
+    info.spill_count += other.spill_count;
+    info.spill_count_tot += other.spill_count_tot;
+    info.spill_bytes += other.spill_bytes;
+    info.spill_bytes_tot += other.spill_bytes_tot;
+    for (std::size_t i = 0; i < info.hist.size(); ++i)
+        info.hist[i] += other.hist[i];
+}
+
+// Calculates the performance fields from the measured ones
+template <class = void>
+void
+update_performance (verify_info& info,
+    std::size_t fetches)
+{
+    info.avg_fetch = float(fetches) / info.value_count;
+    info.waste = (info.spill_bytes_tot - info.spill_bytes) /
+        float(info.dat_file_size);
+    info.overhead =
+        float(info.key_file_size + info.dat_file_size) /
+        (
+            info.value_bytes +
+            info.key_count *
+                (info.key_size +
+                // Data Record
+                 field<uint48_t>::size) // Size
+                    ) - 1;
+    info.actual_load = info.key_count / float(
+        info.capacity * info.buckets);
+}
+
+} // detail
+
 /** Verify consistency of the key and data files.
     Effects:
         Opens the key and data files in read-only mode.
         Throws file_error if a file can't be opened.
         Iterates the key and data files, throws store_corrupt_error
             on broken invariants.
+
+    Progress is called as
+        `(void)()(std::uint64_t amount, std::uint64_t total)`
+
+    with the bytes of the data and key files checked so far.
 */
-template <class Hasher>
+template <class Hasher, class Progress>
 verify_info
 verify (
     path_type const& dat_path,
     path_type const& key_path,
-    std::size_t read_size)
+    std::size_t read_size,
+    Progress&& progress)
 {
     using namespace detail;
     using File = native_file;
@@ -94,20 +170,8 @@ verify (
     verify(dh);
     verify<Hasher>(dh, kh);
 
-    verify_info info;
-    info.version = dh.version;
-    info.uid = dh.uid;
-    info.appnum = dh.appnum;
-    info.key_size = dh.key_size;
-    info.salt = kh.salt;
-    info.pepper = kh.pepper;
-    info.block_size = kh.block_size;
-    info.load_factor = kh.load_factor / 65536.f;
-    info.capacity = kh.capacity;
-    info.buckets = kh.buckets;
-    info.bucket_size = kh.bucket_size;
-    info.key_file_size = kf.actual_size();
-    info.dat_file_size = df.actual_size();
+    auto info = make_verify_info(dh, kh,
+        kf.actual_size(), df.actual_size());
 
     // Data Record
     auto const dh_len =
@@ -115,10 +179,12 @@ verify (
         kh.key_size;            // Key
 
     std::size_t fetches = 0;
+    auto const work =
+        info.dat_file_size + info.key_file_size;
 
     // Iterate Data File
     buffer buf (kh.block_size + dh_len);
-    bucket b (kh.block_size, buf.get());
+    bucket b (kh.block_size, buf.get(), kh.inline_bytes);
     std::uint8_t* pd = buf.get() + kh.block_size;
     {
         bulk_reader<File> r(df,
@@ -127,6 +193,7 @@ verify (
         while (! r.eof())
         {
             auto const offset = r.offset();
+            progress(offset, work);
             // Data Record or Spill Record
             auto is = r.prepare(
                 field<uint48_t>::size); // Size
@@ -196,15 +263,26 @@ verify (
                 is = r.prepare(
                     field<std::uint16_t>::size);
                 read<std::uint16_t>(is, size);  // Size
-                if (size != kh.bucket_size)
-                    throw store_corrupt_error(
-                        "bad spill size");
-                b.read(r);                      // Bucket
+                if (size == kh.bucket_size)
+                {
+                    b.read(r);                  // Bucket
+                    size = b.compact_size();
+                }
+                else
+                {
+                    // Written for a key file with another block
+                    // size, which the data file has outlived.
+                    if (size < field<std::uint16_t>::size +
+                            field<uint48_t>::size)
+                        throw store_corrupt_error(
+                            "bad spill size");
+                    r.prepare(size); // skip bucket
+                }
                 ++info.spill_count_tot;
                 info.spill_bytes_tot +=
                     field<uint48_t>::size +     // Zero
                     field<uint16_t>::size +     // Size
-                    b.compact_size();           // Bucket
+                    size;                       // Bucket
             }
         }
     }
@@ -213,6 +291,8 @@ verify (
     {
         for (std::size_t n = 0; n < kh.buckets; ++n)
         {
+            progress(info.dat_file_size +
+                (n + 1) * kh.block_size, work);
             std::size_t nspill = 0;
             b.read (kf, (n + 1) * kh.block_size);
             for(;;)
@@ -269,27 +349,31 @@ verify (
         }
     }
 
-    float sum = 0;
-    for (int i = 0; i < info.hist.size(); ++i)
-        sum += info.hist[i] * (i + 1);
-    //info.avg_fetch = sum / info.buckets;
-    info.avg_fetch = float(fetches) / info.value_count;
-    info.waste = (info.spill_bytes_tot - info.spill_bytes) /
-        float(info.dat_file_size);
-    info.overhead =
-        float(info.key_file_size + info.dat_file_size) /
-        (
-            info.value_bytes +
-            info.key_count *
-                (info.key_size +
-                // Data Record
-                 field<uint48_t>::size) // Size
-                    ) - 1;
-    info.actual_load = info.key_count / float(
-        info.capacity * info.buckets);
+    update_performance(info, fetches);
+    progress(work, work);
     return info;
 }
 
+/** Verify consistency of the key and data files.
+    Effects:
+        Opens the key and data files in read-only mode.
+        Throws file_error if a file can't be opened.
+        Iterates the key and data files, throws store_corrupt_error
+            on broken invariants.
+*/
+template <class Hasher>
+verify_info
+verify (
+    path_type const& dat_path,
+    path_type const& key_path,
+    std::size_t read_size)
+{
+    return verify<Hasher>(dat_path, key_path, read_size,
+        [](std::uint64_t, std::uint64_t)
+        {
+        });
+}
+
 /** Verify consistency of the key and data files.
     Effects:
         Opens the key and data files in read-only mode.
@@ -324,20 +408,8 @@ verify_fast (
     verify(dh);
     verify<Hasher>(dh, kh);
 
-    verify_info info;
-    info.version = dh.version;
-    info.uid = dh.uid;
-    info.appnum = dh.appnum;
-    info.key_size = dh.key_size;
-    info.salt = kh.salt;
-    info.pepper = kh.pepper;
-    info.block_size = kh.block_size;
-    info.load_factor = kh.load_factor / 65536.f;
-    info.capacity = kh.capacity;
-    info.buckets = kh.buckets;
-    info.bucket_size = kh.bucket_size;
-    info.key_file_size = kf.actual_size();
-    info.dat_file_size = df.actual_size();
+    auto info = make_verify_info(dh, kh,
+        kf.actual_size(), df.actual_size());
 
     std::size_t fetches = 0;
 
@@ -352,7 +424,7 @@ verify_fast (
         buffer_size / kh.block_size);
     buffer buf((buckets + 1) * kh.block_size);
     bucket tmp(kh.block_size, buf.get() +
-        buckets * kh.block_size);
+        buckets * kh.block_size, kh.inline_bytes);
     std::size_t const passes =
         (kh.buckets + buckets - 1) / buckets;
     auto const df_size = df.actual_size();
@@ -371,7 +443,7 @@ verify_fast (
         for (std::size_t i = b0 ; i < b1; ++i)
         {
             bucket b(kh.block_size, buf.get() +
-                (i - b0) * kh.block_size);
+                (i - b0) * kh.block_size, kh.inline_bytes);
             nkeys[i] = b.size();
             std::size_t nspill = 0;
             auto spill = b.spill();
@@ -424,7 +496,7 @@ verify_fast (
                     continue;
                 // Check bucket and spills
                 bucket b (kh.block_size, buf.get() +
-                    (n - b0) * kh.block_size);
+                    (n - b0) * kh.block_size, kh.inline_bytes);
                 ++fetches;
                 for (;;)
                 {
@@ -468,17 +540,28 @@ verify_fast (
                 is = r.prepare(
                     field<std::uint16_t>::size);
                 read<std::uint16_t>(is, size);      // Size
-                if (size != kh.bucket_size)
-                    throw store_corrupt_error(
-                        "bad spill size");
-                tmp.read(r);                        // Bucket
+                if (size == kh.bucket_size)
+                {
+                    tmp.read(r);                  // Bucket
+                    size = tmp.compact_size();
+                }
+                else
+                {
+                    // Written for a key file with another block
+                    // size, which the data file has outlived.
+                    if (size < field<std::uint16_t>::size +
+                            field<uint48_t>::size)
+                        throw store_corrupt_error(
+                            "bad spill size");
+                    r.prepare(size); // skip bucket
+                }
                 if (b0 == 0)
                 {
                     ++info.spill_count_tot;
                     info.spill_bytes_tot +=
                         field<uint48_t>::size +     // Zero
                         field<uint16_t>::size +     // Size
-                        tmp.compact_size();         // Bucket
+                        size;                       // Bucket
                 }
             }
         }
@@ -492,24 +575,304 @@ verify_fast (
             throw store_corrupt_error(
                 "orphan value");
 
-    float sum = 0;
-    for (int i = 0; i < info.hist.size(); ++i)
-        sum += info.hist[i] * (i + 1);
-    //info.avg_fetch = sum / info.buckets;
-    info.avg_fetch = float(fetches) / info.value_count;
-    info.waste = (info.spill_bytes_tot - info.spill_bytes) /
-        float(info.dat_file_size);
-    info.overhead =
-        float(info.key_file_size + info.dat_file_size) /
-        (
-            info.value_bytes +
-            info.key_count *
-                (info.key_size +
+    update_performance(info, fetches);
+    return info;
+}
+
+namespace detail {
+
+// Checks the buckets [b0, b1) and the spill records and
+// data records they refer to. buf holds the buckets.
+//
+template <class Hasher, class File>
+void
+verify_buckets (key_file_header const& kh,
+    File& df, File& kf, std::size_t b0, std::size_t b1,
+        buffer& buf, std::vector<std::size_t>& offsets,
+            verify_info& info, std::size_t& fetches)
+{
+    // Data Record
+    auto const dh_len =
+        field<uint48_t>::size + // Size
+        kh.key_size;            // Key
+    auto const bn = b1 - b0;
+    buf.reserve((bn + 1) * kh.block_size + dh_len);
+    kf.read((b0 + 1) * kh.block_size,
+        buf.get(), bn * kh.block_size);
+    bucket tmp (kh.block_size, buf.get() +
+        bn * kh.block_size, kh.inline_bytes);
+    std::uint8_t* pd = buf.get() + (bn + 1) * kh.block_size;
+    for (std::size_t n = b0; n < b1; ++n)
+    {
+        bucket b (kh.block_size, buf.get() +
+            (n - b0) * kh.block_size, kh.inline_bytes);
+        std::size_t nspill = 0;
+        offsets.clear();
+        for (;;)
+        {
+            info.key_count += b.size();
+            for (std::size_t i = 0; i < b.size(); ++i)
+            {
+                auto const e = b[i];
+                try
+                {
+                    df.read (e.offset, pd, dh_len);
+                }
+                catch (file_short_read_error const&)
+                {
+                    throw store_corrupt_error(
+                        "missing value");
+                }
                 // Data Record
-                 field<uint48_t>::size) // Size
-                    ) - 1;
-    info.actual_load = info.key_count / float(
-        info.capacity * info.buckets);
+                istream is(pd, dh_len);
+                std::size_t size;
+                read<uint48_t>(is, size);   // Size
+                void const* key =
+                    is.data(kh.key_size);   // Key
+                if (size != e.size)
+                    throw store_corrupt_error(
+                        "wrong size");
+                auto const h = hash<Hasher>(key,
+                    kh.key_size, kh.salt);
+                if (h != e.hash)
+                    throw store_corrupt_error(
+                        "wrong hash");
+                // A fetch reads the bucket and each spill
+                // before the one holding the entry.
+                fetches += 1 + nspill;
+                offsets.push_back(e.offset);
+            }
+            if (! b.spill())
+                break;
+            try
+            {
+                tmp.read (df, b.spill());
+                b = tmp;
+                ++nspill;
+                ++info.spill_count;
+                info.spill_bytes +=
+                    field<uint48_t>::size + // Zero
+                    field<uint16_t>::size + // Size
+                    b.compact_size();       // SpillBucket
+            }
+            catch (file_short_read_error const&)
+            {
+                throw store_corrupt_error(
+                    "missing spill");
+            }
+        }
+        // Entries with the same offset have the same
+        // hash, so they can only be in the same bucket.
+        std::sort(offsets.begin(), offsets.end());
+        if (std::adjacent_find(offsets.begin(),
+                offsets.end()) != offsets.end())
+            throw store_corrupt_error(
+                "duplicate value");
+        if (nspill >= info.hist.size())
+            nspill = info.hist.size() - 1;
+        ++info.hist[nspill];
+    }
+}
+
+// Counts the data records and spill records of
+// the data file. Progress is called with the offset.
+//
+template <class File, class Progress>
+void
+verify_values (key_file_header const& kh,
+    File& df, std::size_t df_size, std::size_t read_size,
+        verify_info& info, Progress&& progress)
+{
+    buffer buf (kh.block_size);
+    bucket b (kh.block_size, buf.get(), kh.inline_bytes);
+    bulk_reader<File> r(df,
+        dat_file_header::size, df_size, read_size);
+    while (! r.eof())
+    {
+        progress(r.offset());
+        // Data Record or Spill Record
+        auto is = r.prepare(
+            field<uint48_t>::size); // Size
+        std::size_t size;
+        read<uint48_t>(is, size);
+        if (size > 0)
+        {
+            // Data Record
+            r.prepare(
+                kh.key_size +           // Key
+                size);                  // Data
+            ++info.value_count;
+            info.value_bytes += size;
+        }
+        else
+        {
+            // Spill Record
+            is = r.prepare(
+                field<std::uint16_t>::size);
+            read<std::uint16_t>(is, size);  // Size
+            if (size == kh.bucket_size)
+            {
+                b.read(r);                  // Bucket
+                size = b.compact_size();
+            }
+            else
+            {
+                // Written for a key file with another block
+                // size, which the data file has outlived.
+                if (size < field<std::uint16_t>::size +
+                        field<uint48_t>::size)
+                    throw store_corrupt_error(
+                        "bad spill size");
+                r.prepare(size); // skip bucket
+            }
+            ++info.spill_count_tot;
+            info.spill_bytes_tot +=
+                field<uint48_t>::size +     // Zero
+                field<uint16_t>::size +     // Size
+                size;                       // Bucket
+        }
+    }
+}
+
+} // detail
+
+/** Verify consistency of the key and data files using threads.
+
+    The buckets are divided into ranges handed out to the
+    threads, each of which checks the spill records and
+    data records of its buckets independently. The calling
+    thread counts the records of the data file in one pass
+    before taking ranges itself. The partial results are
+    merged at the end.
+
+    Rather than locating every data record in its bucket,
+    this checks that every bucket entry refers to a data
+    record with the same hash and size, that no two entries
+    refer to the same record, and that the number of entries
+    equals the number of data records. The results are the
+    same as for verify, except that avg_fetch ignores the
+    rare entries with equal hashes.
+
+    Effects:
+        Opens the key and data files in read-only mode,
+            once for each thread.
+        Throws store_corrupt_error on broken invariants.
+
+    Progress is called on the calling thread as
+        `(void)()(std::uint64_t amount, std::uint64_t total)`
+
+    with the bytes of the data and key files checked so far.
+
+    @param threads The number of threads, including the
+        calling thread. If zero, the number of hardware
+        threads is used.
+*/
+template <class Hasher, class Progress>
+verify_info
+verify_parallel (
+    path_type const& dat_path,
+    path_type const& key_path,
+    std::size_t read_size,
+    std::size_t threads,
+    Progress&& progress)
+{
+    using namespace detail;
+    using File = native_file;
+    File df;
+    File kf;
+    if (! df.open (file_mode::scan, dat_path))
+        throw store_corrupt_error(
+            "no data file");
+    if (! kf.open (file_mode::read, key_path))
+        throw store_corrupt_error(
+            "no key file");
+    key_file_header kh;
+    dat_file_header dh;
+    read (df, dh);
+    read (kf, kh);
+    verify(dh);
+    verify<Hasher>(dh, kh);
+
+    auto info = make_verify_info(dh, kh,
+        kf.actual_size(), df.actual_size());
+    auto const work =
+        info.dat_file_size + info.key_file_size;
+    threads = thread_group::size(threads);
+    // Ranges are small enough to balance the threads
+    auto const chunk = std::max<std::size_t>(1,
+        std::min<std::size_t>(read_size / kh.block_size,
+            kh.buckets / (8 * threads)));
+
+    std::atomic<std::size_t> next (0);   // first unclaimed bucket
+    std::atomic<std::size_t> done (0);   // key file bytes checked
+    std::vector<verify_info> parts (threads);
+    std::vector<std::size_t> fetches (threads, 0);
+    thread_group g;
+    auto const run =
+        [&](std::size_t t, File& df, File& kf,
+            std::function<void()> const& report)
+        {
+            buffer buf;
+            std::vector<std::size_t> offsets;
+            while (! g.stopped())
+            {
+                auto const b0 = next.fetch_add(chunk);
+                if (b0 >= kh.buckets)
+                    break;
+                auto const b1 = std::min(
+                    b0 + chunk, kh.buckets);
+                verify_buckets<Hasher>(kh, df, kf, b0, b1,
+                    buf, offsets, parts[t], fetches[t]);
+                done += (b1 - b0) * kh.block_size;
+                report();
+            }
+        };
+    for (std::size_t t = 1; t < threads; ++t)
+        g.spawn(
+            [&, t]
+            {
+                File df;
+                File kf;
+                if (! df.open (file_mode::read, dat_path))
+                    throw store_corrupt_error(
+                        "no data file");
+                if (! kf.open (file_mode::read, key_path))
+                    throw store_corrupt_error(
+                        "no key file");
+                run(t, df, kf, []{});
+            });
+    g.run(
+        [&]
+        {
+            verify_values(kh, df, info.dat_file_size,
+                read_size, parts[0],
+                [&](std::size_t offset)
+                {
+                    if (g.stopped())
+                        throw store_corrupt_error(
+                            "stopped");
+                    progress(offset + done.load(), work);
+                });
+            run(0, df, kf,
+                [&]
+                {
+                    progress(info.dat_file_size +
+                        done.load(), work);
+                });
+        });
+    g.join();
+
+    std::size_t total = 0;
+    for (std::size_t t = 0; t < threads; ++t)
+    {
+        merge(info, parts[t]);
+        total += fetches[t];
+    }
+    if (info.key_count != info.value_count)
+        throw store_corrupt_error(
+            "orphaned value");
+    update_performance(info, total);
+    progress(work, work);
     return info;
 }
 
@@ -11,11 +11,21 @@
 #include <nudb/common.hpp>
 #include <nudb/file.hpp>
 #include <nudb/detail/buffer.hpp>
+#include <nudb/detail/bucket.hpp>
 #include <nudb/detail/bulkio.hpp>
 #include <nudb/detail/format.hpp>
+#include <nudb/detail/thread_group.hpp>
 #include <algorithm>
+#include <atomic>
+#include <condition_variable>
 #include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <utility>
+#include <vector>
 
 namespace nudb {
 
@@ -92,6 +102,328 @@ visit(
     return true;
 }
 
+/** Visit each key/data pair in a database file using threads.
+
+    The data file is read sequentially on the calling thread,
+    and batches of records are handed to worker threads which
+    decompress the values and call Function. Function is called
+    concurrently, and not in file order.
+
+    Function will be called with this signature:
+        bool(void const* key, std::size_t key_size,
+             void const* data, std::size_t size)
+
+    If Function returns false, the visit is terminated once
+    the calls in progress return.
+
+    @param threads The number of worker threads. If zero,
+        the number of hardware threads is used.
+    @return `true` if the visit completed
+    This only requires the data file.
+*/
+template <class Codec, class Function>
+bool
+visit_parallel(
+    path_type const& path,
+    std::size_t read_size,
+    std::size_t threads,
+    Function&& f)
+{
+    using namespace detail;
+    using File = native_file;
+    File df;
+    df.open (file_mode::scan, path);
+    dat_file_header dh;
+    read (df, dh);
+    verify (dh);
+    threads = thread_group::size(threads);
+
+    // Records copied from the data file
+    struct batch
+    {
+        std::vector<std::uint8_t> data; // keys and values
+        std::vector<std::size_t> size;  // value sizes
+    };
+
+    auto const batch_size = std::max<std::size_t>(
+        64 * 1024, read_size / (4 * threads));
+    std::mutex m;
+    std::condition_variable cond;
+    std::deque<std::unique_ptr<batch>> full;
+    std::vector<std::unique_ptr<batch>> spare;
+    bool done = false;
+    std::atomic<bool> quit (false);
+    thread_group g;
+    // Stop the group and wake every waiting thread
+    auto const stop =
+        [&]
+        {
+            g.stop();
+            std::lock_guard<std::mutex> lock (m);
+            cond.notify_all();
+        };
+    for (std::size_t t = 0; t < threads; ++t)
+        g.spawn(
+            [&]
+            {
+                try
+                {
+                    Codec codec;
+                    buffer buf;
+                    for (;;)
+                    {
+                        std::unique_ptr<batch> b;
+                        {
+                            std::unique_lock<std::mutex> lock (m);
+                            cond.wait(lock,
+                                [&]
+                                {
+                                    return ! full.empty() ||
+                                        done || g.stopped();
+                                });
+                            if (full.empty() || g.stopped())
+                                break;
+                            b = std::move(full.front());
+                            full.pop_front();
+                            cond.notify_all();
+                        }
+                        auto p = b->data.data();
+                        for (auto const size : b->size)
+                        {
+                            if (g.stopped())
+                                break;
+                            auto const result = codec.decompress(
+                                p + dh.key_size, size, buf);
+                            if (! f(p, dh.key_size,
+                                result.first, result.second))
+                            {
+                                quit = true;
+                                stop();
+                                break;
+                            }
+                            p += dh.key_size + size;
+                        }
+                        b->data.clear();
+                        b->size.clear();
+                        std::lock_guard<std::mutex> lock (m);
+                        spare.push_back(std::move(b));
+                    }
+                }
+                catch (...)
+                {
+                    stop();
+                    throw;
+                }
+            });
+    g.run(
+        [&]
+        {
+            // Iterate Data File
+            bulk_reader<File> r(
+                df, dat_file_header::size,
+                    df.actual_size(), read_size);
+            std::unique_ptr<batch> b (new batch);
+            // Hand the batch to the workers
+            auto const post =
+                [&]
+                {
+                    std::unique_lock<std::mutex> lock (m);
+                    cond.wait(lock,
+                        [&]
+                        {
+                            return full.size() < 2 * threads ||
+                                g.stopped();
+                        });
+                    if (g.stopped())
+                        return false;
+                    full.push_back(std::move(b));
+                    cond.notify_all();
+                    if (spare.empty())
+                    {
+                        b.reset(new batch);
+                    }
+                    else
+                    {
+                        b = std::move(spare.back());
+                        spare.pop_back();
+                    }
+                    return true;
+                };
+            try
+            {
+                while (! r.eof())
+                {
+                    // Data Record or Spill Record
+                    std::size_t size;
+                    auto is = r.prepare(
+                        field<uint48_t>::size); // Size
+                    read<uint48_t>(is, size);
+                    if (size > 0)
+                    {
+                        // Data Record
+                        is = r.prepare(
+                            dh.key_size +           // Key
+                            size);                  // Data
+                        auto const p = is.data(
+                            dh.key_size + size);
+                        b->data.insert(b->data.end(),
+                            p, p + dh.key_size + size);
+                        b->size.push_back(size);
+                        if (b->data.size() >= batch_size &&
+                                ! post())
+                            return;
+                    }
+                    else
+                    {
+                        // Spill Record
+                        is = r.prepare(
+                            field<std::uint16_t>::size);
+                        read<std::uint16_t>(is, size);  // Size
+                        r.prepare(size); // skip bucket
+                    }
+                }
+            }
+            catch (file_short_read_error const&)
+            {
+                throw store_corrupt_error(
+                    "nudb: data short read");
+            }
+            if (! b->size.empty())
+                post();
+        });
+    {
+        std::lock_guard<std::mutex> lock (m);
+        done = true;
+        cond.notify_all();
+    }
+    g.join();
+    return ! quit;
+}
+
+/** Visit each key/data pair in a database using the key file.
+
+    The buckets of the key file are divided into ranges handed
+    out to threads. Each thread follows the spill records of
+    its buckets and reads each value from the data file by its
+    offset. Function is called concurrently, in no particular
+    order. Values which no bucket refers to are skipped.
+
+    Function will be called with this signature:
+        bool(void const* key, std::size_t key_size,
+             void const* data, std::size_t size)
+
+    If Function returns false, the visit is terminated once
+    the calls in progress return.
+
+    @param threads The number of threads, including the
+        calling thread. If zero, the number of hardware
+        threads is used.
+    @return `true` if the visit completed
+*/
+template <class Hasher, class Codec, class Function>
+bool
+visit_buckets(
+    path_type const& dat_path,
+    path_type const& key_path,
+    std::size_t read_size,
+    std::size_t threads,
+    Function&& f)
+{
+    using namespace detail;
+    using File = native_file;
+    dat_file_header dh;
+    key_file_header kh;
+    {
+        File df;
+        File kf;
+        if (! df.open (file_mode::read, dat_path))
+            throw store_corrupt_error(
+                "no data file");
+        if (! kf.open (file_mode::read, key_path))
+            throw store_corrupt_error(
+                "no key file");
+        read (df, dh);
+        read (kf, kh);
+        verify (dh);
+        verify<Hasher>(dh, kh);
+    }
+    threads = thread_group::size(threads);
+    auto const chunk = std::max<std::size_t>(1,
+        std::min<std::size_t>(read_size / kh.block_size,
+            kh.buckets / (8 * threads)));
+    std::atomic<std::size_t> next (0);   // first unclaimed bucket
+    std::atomic<bool> quit (false);
+    thread_group g;
+    auto const run =
+        [&]
+        {
+            File df;
+            File kf;
+            if (! df.open (file_mode::read, dat_path))
+                throw store_corrupt_error(
+                    "no data file");
+            if (! kf.open (file_mode::read, key_path))
+                throw store_corrupt_error(
+                    "no key file");
+            Codec codec;
+            buffer buf;
+            buffer ds;
+            buffer vb;
+            for (;;)
+            {
+                auto const b0 = next.fetch_add(chunk);
+                if (b0 >= kh.buckets)
+                    break;
+                auto const b1 = std::min(
+                    b0 + chunk, kh.buckets);
+                auto const bn = b1 - b0;
+                buf.reserve((bn + 1) * kh.block_size);
+                kf.read((b0 + 1) * kh.block_size,
+                    buf.get(), bn * kh.block_size);
+                bucket tmp (kh.block_size, buf.get() +
+                    bn * kh.block_size, kh.inline_bytes);
+                for (std::size_t n = 0; n < bn; ++n)
+                {
+                    bucket b (kh.block_size, buf.get() +
+                        n * kh.block_size, kh.inline_bytes);
+                    for (;;)
+                    {
+                        for (std::size_t i = 0; i < b.size(); ++i)
+                        {
+                            if (g.stopped())
+                                return;
+                            auto const e = b[i];
+                            // Data Record
+                            ds.reserve(value_size(
+                                e.size, kh.key_size));
+                            df.read(e.offset, ds.get(), ds.size());
+                            auto const key = ds.get() +
+                                field<uint48_t>::size;
+                            auto const result = codec.decompress(
+                                key + kh.key_size, e.size, vb);
+                            if (! f(key, kh.key_size,
+                                result.first, result.second))
+                            {
+                                quit = true;
+                                g.stop();
+                                return;
+                            }
+                        }
+                        if (! b.spill())
+                            break;
+                        tmp.read(df, b.spill());
+                        b = tmp;
+                    }
+                }
+            }
+        };
+    for (std::size_t t = 1; t < threads; ++t)
+        g.spawn(run);
+    g.run(run);
+    g.join();
+    return ! quit;
+}
+
 } // nudb
 
 #endif
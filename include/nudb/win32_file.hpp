@@ -9,9 +9,18 @@
 #define NUDB_DETAIL_WIN32_FILE_HPP
 
 #include <nudb/common.hpp>
+#include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <climits>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <utility>
 
 #ifndef NUDB_WIN32_FILE
 # ifdef _MSC_VER
@@ -47,6 +56,34 @@ namespace nudb {
 
 #if NUDB_WIN32_FILE
 
+/** Options for opening a win32_file.
+
+    These are passed to the constructor, for example
+    through the extra arguments of store::open.
+*/
+struct win32_file_options
+{
+    /** Open files for overlapped I/O.
+
+        The reads and writes of a batch are all issued
+        before any of them is waited for, and completions
+        are collected from an I/O completion port, so that
+        the device sees many requests in flight from one
+        thread.
+    */
+    bool overlapped = false;
+
+    /** Write files opened in append mode without buffering.
+
+        Appends bypass the system cache, through a second
+        handle opened with FILE_FLAG_NO_BUFFERING. Each write
+        is staged in a sector aligned buffer, reading back
+        the partial sectors at either end first. Reads still
+        go through the cache.
+    */
+    bool unbuffered = false;
+};
+
 namespace detail {
 
 // Win32 error code
@@ -111,13 +148,78 @@ template <class = void>
 class win32_file
 {
 private:
+    enum
+    {
+        // Requests in flight per batch
+        max_ops = 64,
+
+        // Alignment of unbuffered transfers, a multiple
+        // of the sector size of common devices
+        sector_size = 4096,
+
+        // Largest unbuffered transfer, sector aligned
+        max_direct = 1 << 30
+    };
+
+    // A request of a batch in flight
+    struct op
+    {
+        OVERLAPPED ov;                  // must be first
+        std::atomic<std::size_t>* left; // unfinished in its batch
+        DWORD bytes;
+        DWORD error;
+    };
+
+    // Completions of the batches of every thread arrive on
+    // one port. One thread at a time collects them on behalf
+    // of all, while the others wait for their own.
+    struct port_t
+    {
+        HANDLE h = NULL;
+        std::mutex m;
+        std::condition_variable cv;
+        bool busy = false;
+
+        ~port_t()
+        {
+            if (h != NULL)
+                ::CloseHandle(h);
+        }
+    };
+
+    // The unbuffered handle and its staging buffer
+    struct direct_t
+    {
+        HANDLE h = INVALID_HANDLE_VALUE;
+        std::mutex m;
+        void* buf = nullptr;
+        std::size_t size = 0;
+
+        ~direct_t()
+        {
+            if (buf)
+                ::VirtualFree(buf, 0, MEM_RELEASE);
+            if (h != INVALID_HANDLE_VALUE)
+                ::CloseHandle(h);
+        }
+    };
+
     HANDLE hf_ = INVALID_HANDLE_VALUE;
+    win32_file_options opt_;
+    std::unique_ptr<port_t> port_;
+    std::unique_ptr<direct_t> direct_;
 
 public:
     win32_file() = default;
     win32_file (win32_file const&) = delete;
     win32_file& operator= (win32_file const&) = delete;
 
+    explicit
+    win32_file (win32_file_options const& opt)
+        : opt_ (opt)
+    {
+    }
+
     ~win32_file();
 
     win32_file (win32_file&&);
@@ -178,16 +280,57 @@ public:
     write (std::size_t offset,
         void const* buffer, std::size_t bytes);
 
+    // Perform a batch of transfers. With overlapped I/O
+    // up to max_ops requests are in flight at once.
+    void
+    read_batch (file_request const* r, std::size_t n);
+
+    void
+    write_batch (file_request const* r, std::size_t n);
+
     void
     sync();
 
+    // Sync to the given level, see durability. The system
+    // offers no cheaper flush, so each level but none
+    // flushes the file buffers.
+    void
+    sync (durability level);
+
     void
     trunc (std::size_t length);
 
 private:
+    void
+    attach (file_mode mode, std::string const& path);
+
+    DWORD
+    transfer (HANDLE h, bool write, std::size_t offset,
+        void* buffer, DWORD amount);
+
+    void
+    batch (bool write, file_request const* r, std::size_t n);
+
+    void
+    wait (std::atomic<std::size_t>& left);
+
+    void
+    write_direct (std::size_t offset,
+        void const* buffer, std::size_t bytes);
+
+    void
+    read_sector (std::size_t offset,
+        std::uint8_t* p, std::size_t file_size);
+
     static
+    HANDLE
+    event();
+
     std::pair<DWORD, DWORD>
-    flags (file_mode mode);
+    flags (file_mode mode) const;
+
+    DWORD
+    share (file_mode mode) const;
 };
 
 template <class _>
@@ -199,6 +342,9 @@ win32_file<_>::~win32_file()
 template <class _>
 win32_file<_>::win32_file (win32_file&& other)
     : hf_ (other.hf_)
+    , opt_ (other.opt_)
+    , port_ (std::move(other.port_))
+    , direct_ (std::move(other.direct_))
 {
     other.hf_ = INVALID_HANDLE_VALUE;
 }
@@ -211,6 +357,9 @@ win32_file<_>::operator= (win32_file&& other)
         return *this;
     close();
     hf_ = other.hf_;
+    opt_ = other.opt_;
+    port_ = std::move(other.port_);
+    direct_ = std::move(other.direct_);
     other.hf_ = INVALID_HANDLE_VALUE;
     return *this;
 }
@@ -219,11 +368,13 @@ template <class _>
 void
 win32_file<_>::close()
 {
+    direct_.reset();
     if (hf_ != INVALID_HANDLE_VALUE)
     {
         ::CloseHandle(hf_);
         hf_ = INVALID_HANDLE_VALUE;
     }
+    port_.reset();
 }
 
 template <class _>
@@ -235,7 +386,7 @@ win32_file<_>::create (file_mode mode,
     auto const f = flags(mode);
     hf_ = ::CreateFileA (path.c_str(),
         f.first,
-        0,
+        share(mode),
         NULL,
         CREATE_NEW,
         f.second,
@@ -248,6 +399,7 @@ win32_file<_>::create (file_mode mode,
                 "create file", dwError);
         return false;
     }
+    attach(mode, path);
     return true;
 }
 
@@ -260,7 +412,7 @@ win32_file<_>::open (file_mode mode,
     auto const f = flags(mode);
     hf_ = ::CreateFileA (path.c_str(),
         f.first,
-        0,
+        share(mode),
         NULL,
         OPEN_EXISTING,
         f.second,
@@ -274,6 +426,7 @@ win32_file<_>::open (file_mode mode,
                 "open file", dwError);
         return false;
     }
+    attach(mode, path);
     return true;
 }
 
@@ -315,28 +468,13 @@ win32_file<_>::read (std::size_t offset,
 {
     while(bytes > 0)
     {
-        DWORD bytesRead;
-        LARGE_INTEGER li;
-        li.QuadPart = static_cast<LONGLONG>(offset);
-        OVERLAPPED ov;
-        ov.Offset = li.LowPart;
-        ov.OffsetHigh = li.HighPart;
-        ov.hEvent = NULL;
         DWORD amount;
         if(bytes > std::numeric_limits<DWORD>::max())
             amount = std::numeric_limits<DWORD>::max();
         else
             amount = static_cast<DWORD>(bytes);
-        BOOL const bSuccess = ::ReadFile(
-            hf_, buffer, amount, &bytesRead, &ov);
-        if (! bSuccess)
-        {
-            DWORD const dwError = ::GetLastError();
-            if (dwError != ERROR_HANDLE_EOF)
-                throw file_win32_error(
-                    "read file", dwError);
-            throw file_short_read_error();
-        }
+        auto const bytesRead = transfer(
+            hf_, false, offset, buffer, amount);
         if (bytesRead == 0)
             throw file_short_read_error();
         offset += bytesRead;
@@ -351,25 +489,17 @@ void
 win32_file<_>::write (std::size_t offset,
     void const* buffer, std::size_t bytes)
 {
+    if (direct_)
+        return write_direct(offset, buffer, bytes);
     while(bytes > 0)
     {
-        LARGE_INTEGER li;
-        li.QuadPart = static_cast<LONGLONG>(offset);
-        OVERLAPPED ov;
-        ov.Offset = li.LowPart;
-        ov.OffsetHigh = li.HighPart;
-        ov.hEvent = NULL;
         DWORD amount;
         if(bytes > std::numeric_limits<DWORD>::max())
             amount = std::numeric_limits<DWORD>::max();
         else
             amount = static_cast<DWORD>(bytes);
-        DWORD bytesWritten;
-        BOOL const bSuccess = ::WriteFile(
-            hf_, buffer, amount, &bytesWritten, &ov);
-        if (! bSuccess)
-            throw file_win32_error(
-                "write file");
+        auto const bytesWritten = transfer(hf_, true,
+            offset, const_cast<void*>(buffer), amount);
         if (bytesWritten == 0)
             throw file_short_write_error();
         offset += bytesWritten;
@@ -380,6 +510,29 @@ win32_file<_>::write (std::size_t offset,
     }
 }
 
+template <class _>
+void
+win32_file<_>::read_batch (
+    file_request const* r, std::size_t n)
+{
+    if (port_)
+        return batch(false, r, n);
+    for (std::size_t i = 0; i < n; ++i)
+        read(r[i].offset, r[i].data, r[i].bytes);
+}
+
+template <class _>
+void
+win32_file<_>::write_batch (
+    file_request const* r, std::size_t n)
+{
+    // Unbuffered writes are staged one at a time
+    if (port_ && ! direct_)
+        return batch(true, r, n);
+    for (std::size_t i = 0; i < n; ++i)
+        write(r[i].offset, r[i].data, r[i].bytes);
+}
+
 template <class _>
 void
 win32_file<_>::sync()
@@ -391,6 +544,14 @@ win32_file<_>::sync()
             "sync file");
 }
 
+template <class _>
+void
+win32_file<_>::sync (durability level)
+{
+    if (level != durability::none)
+        sync();
+}
+
 template <class _>
 void
 win32_file<_>::trunc (std::size_t length)
@@ -407,9 +568,310 @@ win32_file<_>::trunc (std::size_t length)
             "trunc file");
 }
 
+template <class _>
+void
+win32_file<_>::attach (file_mode mode,
+    std::string const& path)
+{
+    if (opt_.overlapped)
+    {
+        std::unique_ptr<port_t> p (new port_t);
+        p->h = ::CreateIoCompletionPort(hf_, NULL, 0, 0);
+        if (p->h == NULL)
+        {
+            DWORD const dwError = ::GetLastError();
+            close();
+            throw file_win32_error(
+                "create port", dwError);
+        }
+        port_ = std::move(p);
+    }
+    if (opt_.unbuffered && mode == file_mode::append)
+    {
+        std::unique_ptr<direct_t> d (new direct_t);
+        d->h = ::CreateFileA (path.c_str(),
+            GENERIC_READ | GENERIC_WRITE,
+            share(mode),
+            NULL,
+            OPEN_EXISTING,
+            FILE_FLAG_NO_BUFFERING,
+            NULL);
+        if (d->h == INVALID_HANDLE_VALUE)
+        {
+            DWORD const dwError = ::GetLastError();
+            close();
+            throw file_win32_error(
+                "open unbuffered file", dwError);
+        }
+        direct_ = std::move(d);
+    }
+}
+
+// Returns the bytes transferred, or 0 at the end of file
+template <class _>
+DWORD
+win32_file<_>::transfer (HANDLE h, bool write,
+    std::size_t offset, void* buffer, DWORD amount)
+{
+    LARGE_INTEGER li;
+    li.QuadPart = static_cast<LONGLONG>(offset);
+    OVERLAPPED ov;
+    std::memset(&ov, 0, sizeof(ov));
+    ov.Offset = li.LowPart;
+    ov.OffsetHigh = li.HighPart;
+    bool const async = port_ && h == hf_;
+    HANDLE e = NULL;
+    if (async)
+    {
+        // The low bit keeps the completion off the port
+        e = event();
+        ov.hEvent = reinterpret_cast<HANDLE>(
+            reinterpret_cast<ULONG_PTR>(e) | 1);
+    }
+    DWORD n = 0;
+    BOOL bSuccess = write ?
+        ::WriteFile(h, buffer, amount, &n, &ov) :
+        ::ReadFile(h, buffer, amount, &n, &ov);
+    if (async && (bSuccess ||
+        ::GetLastError() == ERROR_IO_PENDING))
+    {
+        ::WaitForSingleObject(e, INFINITE);
+        bSuccess = ::GetOverlappedResult(
+            h, &ov, &n, FALSE);
+    }
+    if (! bSuccess)
+    {
+        DWORD const dwError = ::GetLastError();
+        if (! write && dwError == ERROR_HANDLE_EOF)
+            return 0;
+        throw file_win32_error(write ?
+            "write file" : "read file", dwError);
+    }
+    return n;
+}
+
+template <class _>
+void
+win32_file<_>::batch (bool write,
+    file_request const* r, std::size_t n)
+{
+    op ops[max_ops];
+    while (n > 0)
+    {
+        auto const count = std::min<std::size_t>(
+            n, max_ops);
+        std::atomic<std::size_t> left (0);
+        for (std::size_t i = 0; i < count; ++i)
+        {
+            auto& o = ops[i];
+            std::memset(&o.ov, 0, sizeof(o.ov));
+            LARGE_INTEGER li;
+            li.QuadPart = static_cast<LONGLONG>(r[i].offset);
+            o.ov.Offset = li.LowPart;
+            o.ov.OffsetHigh = li.HighPart;
+            o.left = &left;
+            o.bytes = 0;
+            o.error = ERROR_SUCCESS;
+            auto const amount = static_cast<DWORD>(
+                std::min<std::size_t>(r[i].bytes,
+                    std::numeric_limits<DWORD>::max()));
+            // Counted first, since any waiting
+            // thread may collect the completion.
+            left.fetch_add(1, std::memory_order_relaxed);
+            BOOL const bSuccess = write ?
+                ::WriteFile(hf_, r[i].data, amount, NULL, &o.ov) :
+                ::ReadFile(hf_, r[i].data, amount, NULL, &o.ov);
+            if (! bSuccess)
+            {
+                DWORD const dwError = ::GetLastError();
+                if (dwError != ERROR_IO_PENDING)
+                {
+                    // Nothing is queued for a failed request
+                    left.fetch_sub(1, std::memory_order_relaxed);
+                    o.error = dwError;
+                }
+            }
+        }
+        wait(left);
+        // Finish a short transfer one request at
+        // a time, which throws at the end of file.
+        for (std::size_t i = 0; i < count; ++i)
+        {
+            auto const& o = ops[i];
+            if (o.error != ERROR_SUCCESS &&
+                    o.error != ERROR_HANDLE_EOF)
+                throw file_win32_error(write ?
+                    "write file" : "read file", o.error);
+            if (o.bytes == r[i].bytes)
+                continue;
+            auto const p =
+                reinterpret_cast<char*>(r[i].data) + o.bytes;
+            if (write)
+                this->write(r[i].offset + o.bytes,
+                    p, r[i].bytes - o.bytes);
+            else
+                read(r[i].offset + o.bytes,
+                    p, r[i].bytes - o.bytes);
+        }
+        r += count;
+        n -= count;
+    }
+}
+
+// Returns when every request counted by left is complete
+template <class _>
+void
+win32_file<_>::wait (std::atomic<std::size_t>& left)
+{
+    auto& p = *port_;
+    std::unique_lock<std::mutex> lock (p.m);
+    while (left.load(std::memory_order_acquire) > 0)
+    {
+        if (p.busy)
+        {
+            p.cv.wait(lock);
+            continue;
+        }
+        // Requests of this thread are still queued,
+        // so the wait below ends.
+        p.busy = true;
+        lock.unlock();
+        OVERLAPPED_ENTRY e[max_ops];
+        ULONG got = 0;
+        BOOL const bSuccess =
+            ::GetQueuedCompletionStatusEx(
+                p.h, e, max_ops, &got, INFINITE, FALSE);
+        DWORD const dwError =
+            bSuccess ? ERROR_SUCCESS : ::GetLastError();
+        for (ULONG i = 0; bSuccess && i < got; ++i)
+        {
+            auto const o = reinterpret_cast<
+                op*>(e[i].lpOverlapped);
+            DWORD bytes = 0;
+            o->error = ::GetOverlappedResult(
+                hf_, &o->ov, &bytes, FALSE) ?
+                    ERROR_SUCCESS : ::GetLastError();
+            o->bytes = bytes;
+            // The request may not be touched after this
+            o->left->fetch_sub(1, std::memory_order_release);
+        }
+        lock.lock();
+        p.busy = false;
+        p.cv.notify_all();
+        if (! bSuccess)
+            throw file_win32_error(
+                "wait port", dwError);
+    }
+}
+
+template <class _>
+void
+win32_file<_>::write_direct (std::size_t offset,
+    void const* buffer, std::size_t bytes)
+{
+    if (bytes == 0)
+        return;
+    auto& d = *direct_;
+    std::lock_guard<std::mutex> lock (d.m);
+    auto const end = offset + bytes;
+    auto const first = offset - offset % sector_size;
+    auto const last = (end + sector_size - 1) /
+        sector_size * sector_size;
+    auto const size = last - first;
+    if (d.size < size)
+    {
+        if (d.buf)
+            ::VirtualFree(d.buf, 0, MEM_RELEASE);
+        d.size = 0;
+        // Pages are aligned to more than a sector
+        d.buf = ::VirtualAlloc(NULL, size,
+            MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+        if (! d.buf)
+            throw file_win32_error(
+                "alloc buffer");
+        d.size = size;
+    }
+    auto const p = static_cast<std::uint8_t*>(d.buf);
+    LARGE_INTEGER li;
+    if (! ::GetFileSizeEx(d.h, &li))
+        throw file_win32_error(
+            "size file");
+    auto const file_size =
+        static_cast<std::size_t>(li.QuadPart);
+    // Keep the bytes of the partial sectors at either end
+    if (first < offset)
+        read_sector(first, p, file_size);
+    if (end < last && (first == offset ||
+            last - sector_size != first))
+        read_sector(last - sector_size,
+            p + size - sector_size, file_size);
+    std::memcpy(p + (offset - first), buffer, bytes);
+    for (std::size_t pos = 0; pos < size;)
+    {
+        auto const amount = static_cast<DWORD>(
+            std::min<std::size_t>(size - pos, max_direct));
+        auto const bytesWritten = transfer(
+            d.h, true, first + pos, p + pos, amount);
+        if (bytesWritten == 0)
+            throw file_short_write_error();
+        pos += bytesWritten;
+    }
+    // Remove the padding past the end of the file
+    if (last > file_size)
+    {
+        FILE_END_OF_FILE_INFO info;
+        info.EndOfFile.QuadPart = static_cast<LONGLONG>(
+            std::max(end, file_size));
+        if (! ::SetFileInformationByHandle(d.h,
+                FileEndOfFileInfo, &info, sizeof(info)))
+            throw file_win32_error(
+                "trunc file");
+    }
+}
+
+// Reads the aligned sector at offset, as zeroes past
+// the end of the file.
+template <class _>
+void
+win32_file<_>::read_sector (std::size_t offset,
+    std::uint8_t* p, std::size_t file_size)
+{
+    std::memset(p, 0, sector_size);
+    if (offset < file_size)
+        transfer(direct_->h, false, offset, p, sector_size);
+}
+
+// An event per thread, for single transfers
+// on an overlapped handle.
+template <class _>
+HANDLE
+win32_file<_>::event()
+{
+    struct holder
+    {
+        HANDLE h;
+
+        holder()
+            : h (::CreateEventW(NULL, TRUE, FALSE, NULL))
+        {
+        }
+
+        ~holder()
+        {
+            if (h != NULL)
+                ::CloseHandle(h);
+        }
+    };
+    static thread_local holder e;
+    if (e.h == NULL)
+        throw file_win32_error(
+            "create event");
+    return e.h;
+}
+
 template <class _>
 std::pair<DWORD, DWORD>
-win32_file<_>::flags (file_mode mode)
+win32_file<_>::flags (file_mode mode) const
 {
     std::pair<DWORD, DWORD> result(0, 0);
     switch (mode)
@@ -429,13 +891,11 @@ win32_file<_>::flags (file_mode mode)
         break;
 
     case file_mode::append:
+        // Unbuffered writes use a second handle
         result.first =
             GENERIC_READ | GENERIC_WRITE;
         result.second =
-            FILE_FLAG_RANDOM_ACCESS
-            //| FILE_FLAG_NO_BUFFERING
-            //| FILE_FLAG_WRITE_THROUGH
-            ;
+            FILE_FLAG_RANDOM_ACCESS;
         break;
 
     case file_mode::write:
@@ -445,9 +905,21 @@ win32_file<_>::flags (file_mode mode)
             FILE_FLAG_RANDOM_ACCESS;
         break;
     }
+    if (opt_.overlapped)
+        result.second |= FILE_FLAG_OVERLAPPED;
     return result;
 }
 
+// The unbuffered handle is opened alongside the first
+template <class _>
+DWORD
+win32_file<_>::share (file_mode mode) const
+{
+    if (opt_.unbuffered && mode == file_mode::append)
+        return FILE_SHARE_READ | FILE_SHARE_WRITE;
+    return 0;
+}
+
 } // detail
 
 using win32_file = detail::win32_file<>;
@@ -0,0 +1,95 @@
+//
+// Copyright (c) 2015-2016 Vinnie Falco (vinnie dot falco at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef NUDB_XXH3_HASHER_HPP
+#define NUDB_XXH3_HASHER_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+
+#ifndef NUDB_XXH3_HASHER
+# if defined(__has_include)
+#  if __has_include(<xxhash.h>)
+#   include <xxhash.h>
+#   if defined(XXH_VERSION_NUMBER) && XXH_VERSION_NUMBER >= 800
+#    define NUDB_XXH3_HASHER 1
+#   else
+#    define NUDB_XXH3_HASHER 0
+#   endif
+#  else
+#   define NUDB_XXH3_HASHER 0
+#  endif
+# else
+#  define NUDB_XXH3_HASHER 0
+# endif
+#elif NUDB_XXH3_HASHER
+# include <xxhash.h>
+#endif
+
+namespace nudb {
+
+#if NUDB_XXH3_HASHER
+
+/** Hasher using the 64-bit XXH3 function of xxHash.
+
+    Each key is hashed in one call, which lets XXH3 use its
+    paths for short inputs; keys of 16 and 32 bytes take only
+    a few multiplies. If the function operator is called more
+    than once, each call is seeded with the result so far.
+
+    This requires xxHash 0.8 or later. Linking requires the
+    xxhash library, unless XXH_INLINE_ALL is defined.
+*/
+class xxh3_hasher
+{
+private:
+    std::uint64_t h_;
+
+public:
+    using result_type = std::uint64_t;
+
+    xxh3_hasher() noexcept
+        : h_ (1)
+    {
+    }
+
+    template<class Seed,
+        std::enable_if_t<
+            std::is_unsigned<Seed>::value>* = nullptr>
+    explicit
+    xxh3_hasher(Seed seed) noexcept
+        : h_ (static_cast<std::uint64_t>(seed))
+    {
+    }
+
+    template<class Seed,
+        std::enable_if_t<
+            std::is_unsigned<Seed>::value>* = nullptr>
+    xxh3_hasher(Seed seed, Seed) noexcept
+        : xxh3_hasher(seed)
+    {
+    }
+
+    void
+    operator()(void const* key, std::size_t len) noexcept
+    {
+        h_ = XXH3_64bits_withSeed(key, len, h_);
+    }
+
+    explicit
+    operator std::uint64_t() noexcept
+    {
+        return h_;
+    }
+};
+
+#endif
+
+} // nudb
+
+#endif
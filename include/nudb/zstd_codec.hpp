@@ -0,0 +1,297 @@
+//
+// Copyright (c) 2015-2016 Vinnie Falco (vinnie dot falco at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef NUDB_ZSTD_CODEC_HPP
+#define NUDB_ZSTD_CODEC_HPP
+
+#include <nudb/common.hpp>
+#include <nudb/file.hpp>
+#include <nudb/detail/buffer.hpp>
+#include <nudb/detail/field.hpp>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <utility>
+
+#ifndef NUDB_ZSTD_CODEC
+# if defined(__has_include)
+#  if __has_include(<zstd.h>) && __has_include(<zdict.h>)
+#   define NUDB_ZSTD_CODEC 1
+#  else
+#   define NUDB_ZSTD_CODEC 0
+#  endif
+# else
+#  define NUDB_ZSTD_CODEC 0
+# endif
+#endif
+
+#if NUDB_ZSTD_CODEC
+# include <zstd.h>
+# include <zdict.h>
+#endif
+
+namespace nudb {
+
+#if NUDB_ZSTD_CODEC
+
+/** Codec which compresses values with Zstandard.
+
+    Each value is stored as a zstd frame holding its size.
+    Compression and decompression contexts are kept per
+    thread and reused.
+
+    Small values which look alike compress much better
+    with a dictionary trained on samples of them, see
+    train. The dictionary is kept in its own file next to
+    the database and loaded when the codec is constructed,
+    which store does when store_options::codec_dictionary
+    is set. Values written with a dictionary can only be
+    read with the same dictionary.
+
+    Linking requires the zstd library.
+*/
+class zstd_codec
+{
+private:
+    struct dictionary
+    {
+        ZSTD_CDict* cd = nullptr;
+        ZSTD_DDict* dd = nullptr;
+
+        dictionary (void const* data,
+            std::size_t size, int level)
+            : cd (ZSTD_createCDict(data, size, level))
+            , dd (ZSTD_createDDict(data, size))
+        {
+            if (! cd || ! dd)
+            {
+                free();
+                throw codec_error(
+                    "nudb: zstd bad dictionary");
+            }
+        }
+
+        ~dictionary()
+        {
+            free();
+        }
+
+        void
+        free()
+        {
+            ZSTD_freeCDict(cd);
+            ZSTD_freeDDict(dd);
+        }
+    };
+
+    std::shared_ptr<dictionary const> dict_;
+    int level_;
+
+public:
+    enum
+    {
+        default_level = 3
+    };
+
+    // Tells store to construct the codec from
+    // store_options::codec_dictionary.
+    struct dictionary_file
+    {
+    };
+
+    /** Create a codec without a dictionary. */
+    explicit
+    zstd_codec (int level = default_level)
+        : level_ (level)
+    {
+    }
+
+    /** Create a codec with a dictionary held in memory. */
+    zstd_codec (void const* data, std::size_t size,
+            int level = default_level)
+        : dict_ (std::make_shared<dictionary>(
+            data, size, level))
+        , level_ (level)
+    {
+    }
+
+    /** Create a codec with the dictionary in a file.
+
+        Throws:
+            file_error if the file cannot be read
+            codec_error if the dictionary is not valid
+    */
+    explicit
+    zstd_codec (path_type const& dictionary_path,
+            int level = default_level)
+        : level_ (level)
+    {
+        native_file f;
+        if (! f.open(file_mode::scan, dictionary_path))
+            throw file_error(
+                "nudb: no zstd dictionary");
+        auto const size = f.actual_size();
+        detail::buffer buf (size);
+        f.read(0, buf.get(), size);
+        dict_ = std::make_shared<dictionary>(
+            buf.get(), size, level);
+    }
+
+    char const*
+    name() const
+    {
+        return "zstd";
+    }
+
+    /** Train a dictionary and write it to a new file.
+
+        The samples are stored back to back in one buffer,
+        with the size of each in sizes. A few thousand
+        samples typical of the values work well.
+
+        @return `false` if the file already exists.
+
+        Throws:
+            codec_error if training fails
+    */
+    static
+    bool
+    train (path_type const& dictionary_path,
+        void const* samples, std::size_t const* sizes,
+            std::size_t count,
+                std::size_t capacity = 64 * 1024);
+
+    template <class BufferFactory>
+    std::pair<void const*, std::size_t>
+    compress (void const* in,
+        std::size_t in_size, BufferFactory&& bf) const
+    {
+        auto const bound = ZSTD_compressBound(in_size);
+        auto const out = bf(bound);
+        auto const cctx = context<ZSTD_CCtx>();
+        auto const used = dict_ ?
+            ZSTD_compress_usingCDict(cctx, out, bound,
+                in, in_size, dict_->cd) :
+            ZSTD_compressCCtx(cctx, out, bound,
+                in, in_size, level_);
+        if (ZSTD_isError(used))
+            throw codec_error(std::string(
+                "nudb: zstd compress, ") +
+                    ZSTD_getErrorName(used));
+        return std::make_pair(out, used);
+    }
+
+    template <class BufferFactory>
+    std::pair<void const*, std::size_t>
+    decompress (void const* in,
+        std::size_t in_size, BufferFactory&& bf) const
+    {
+        auto const size =
+            ZSTD_getFrameContentSize(in, in_size);
+        if (size == ZSTD_CONTENTSIZE_UNKNOWN ||
+                size == ZSTD_CONTENTSIZE_ERROR)
+            throw codec_error(
+                "nudb: zstd bad frame");
+        // The size is read from the file, so bound it
+        // before allocating.
+        if (size > detail::field<detail::uint48_t>::max)
+            throw codec_error(
+                "nudb: zstd bad size");
+        auto const out = bf(static_cast<std::size_t>(size));
+        auto const dctx = context<ZSTD_DCtx>();
+        auto const used = dict_ ?
+            ZSTD_decompress_usingDDict(dctx, out, size,
+                in, in_size, dict_->dd) :
+            ZSTD_decompressDCtx(dctx, out, size,
+                in, in_size);
+        if (ZSTD_isError(used) || used != size)
+            throw codec_error(
+                "nudb: zstd decompress");
+        return std::make_pair(out, used);
+    }
+
+private:
+    static
+    void
+    free_context (ZSTD_CCtx* p)
+    {
+        ZSTD_freeCCtx(p);
+    }
+
+    static
+    void
+    free_context (ZSTD_DCtx* p)
+    {
+        ZSTD_freeDCtx(p);
+    }
+
+    static
+    ZSTD_CCtx*
+    create_context (ZSTD_CCtx*)
+    {
+        return ZSTD_createCCtx();
+    }
+
+    static
+    ZSTD_DCtx*
+    create_context (ZSTD_DCtx*)
+    {
+        return ZSTD_createDCtx();
+    }
+
+    // Returns the context of this thread
+    template <class Context>
+    static
+    Context*
+    context()
+    {
+        struct deleter
+        {
+            void
+            operator() (Context* p) const
+            {
+                free_context(p);
+            }
+        };
+        static thread_local std::unique_ptr<
+            Context, deleter> p (create_context(
+                static_cast<Context*>(nullptr)));
+        if (! p)
+            throw codec_error(
+                "nudb: zstd context");
+        return p.get();
+    }
+};
+
+inline
+bool
+zstd_codec::train (path_type const& dictionary_path,
+    void const* samples, std::size_t const* sizes,
+        std::size_t count, std::size_t capacity)
+{
+    detail::buffer buf (capacity);
+    auto const size = ZDICT_trainFromBuffer(
+        buf.get(), capacity, samples, sizes,
+            static_cast<unsigned>(count));
+    if (ZDICT_isError(size))
+        throw codec_error(std::string(
+            "nudb: zstd train, ") +
+                ZDICT_getErrorName(size));
+    native_file f;
+    if (! f.create(file_mode::append, dictionary_path))
+        return false;
+    f.write(0, buf.get(), size);
+    f.sync();
+    return true;
+}
+
+#endif
+
+} // nudb
+
+#endif
@@ -0,0 +1,134 @@
+//
+// Copyright (c) 2015-2016 Vinnie Falco (vinnie dot falco at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#include "test_util.hpp"
+#include "suite.hpp"
+#include <cmath>
+
+namespace nudb {
+namespace test {
+
+// Compares the predictions of advise with what verify
+// measures of a database built with the same settings.
+//
+class advise_test : public suite
+{
+public:
+    void
+    do_test (std::size_t N, std::size_t block_size,
+        float load_factor)
+    {
+        temp_dir td;
+
+        auto const dp = td.file ("nudb.dat");
+        auto const kp = td.file ("nudb.key");
+        auto const lp = td.file ("nudb.log");
+        Sequence seq;
+        try
+        {
+            expect(test_api::create(dp, kp, lp, appnum, salt,
+                sizeof(key_type), block_size, load_factor),
+                    "create");
+            tuning_workload w;
+            w.key_count = N;
+            w.key_size = sizeof(key_type);
+            {
+                store_options options;
+                options.arena_alloc_size = arena_alloc_size;
+                test_api::store db;
+                if(! expect(db.open(dp, kp, lp, options), "open"))
+                    return;
+                for(std::size_t i = 0; i < N; ++i)
+                {
+                    auto const v = seq[i];
+                    expect(db.insert(&v.key, v.data, v.size),
+                        "insert");
+                    w.value_sizes.push_back(v.size);
+                }
+                db.close();
+            }
+            auto const info = verify<test_api::hash_type>(
+                dp, kp, 1 * 1024 * 1024);
+            w.block_sizes = {block_size};
+            w.load_factors = {load_factor};
+            auto const a = advise(w);
+            if(! expect(a.size() == 1, "advice"))
+                return;
+            log() << "block_size " << block_size <<
+                ", load_factor " << load_factor <<
+                ": avg_fetch " << a[0].avg_fetch <<
+                " predicted, " << info.avg_fetch <<
+                " measured" << std::endl;
+            expect(std::abs(a[0].avg_fetch -
+                info.avg_fetch) < 0.05f, "avg_fetch");
+            expect(std::abs(a[0].actual_load -
+                info.actual_load) < 0.02f, "actual_load");
+            expect(a[0].key_file_size == info.key_file_size,
+                "key file size");
+            expect(std::abs(float(a[0].dat_file_size) /
+                info.dat_file_size - 1) < 0.02f, "dat file size");
+            // Sampled from the database itself
+            auto const m = advise(make_workload(info));
+            expect(! m.empty(), "no advice");
+            for(std::size_t i = 1; i < m.size(); ++i)
+                expect(m[i - 1].cost <= m[i].cost, "order");
+        }
+        catch (std::exception const& e)
+        {
+            fail (e.what());
+        }
+        test_api::file_type::erase(dp);
+        test_api::file_type::erase(kp);
+        test_api::file_type::erase(lp);
+    }
+
+    // A large database is simulated at a smaller scale
+    void
+    test_scale()
+    {
+        tuning_workload w;
+        w.key_count = 100000000;
+        w.key_size = 32;
+        w.value_sizes = {100, 200};
+        w.block_sizes = {4096};
+        w.load_factors = {0.5f};
+        auto const a = advise(w);
+        if(! expect(a.size() == 1, "advice"))
+            return;
+        auto const buckets =
+            a[0].key_file_size / 4096 - 1;
+        auto const expected = w.key_count /
+            (0.5 * nudb::detail::bucket_capacity(4096));
+        expect(std::abs(buckets / expected - 1) < 0.01,
+            "buckets");
+        expect(a[0].avg_fetch >= 1 &&
+            a[0].avg_fetch < 1.1f, "avg_fetch");
+    }
+
+    void
+    run() override
+    {
+        enum
+        {
+            N =             20000
+        };
+
+        do_test(N, 256, 0.95f);
+        do_test(N, 1024, 0.5f);
+        test_scale();
+    }
+};
+
+} // test
+} // nudb
+
+int main()
+{
+    std::cout << "advise_test:" << std::endl;
+    nudb::test::advise_test t;
+    return t(std::cerr) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,316 @@
+//
+// Copyright (c) 2015-2016 Vinnie Falco (vinnie dot falco at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#include "suite.hpp"
+#include "test_util.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <iomanip>
+#include <new>
+
+namespace {
+
+// Heap allocations made by the calling thread
+thread_local std::size_t allocations = 0;
+
+void*
+allocate (std::size_t n) noexcept
+{
+    ++allocations;
+    return std::malloc(n ? n : 1);
+}
+
+// Kept out of line, or GCC sees free called on memory from
+// a new-expression and warns with -Wmismatched-new-delete.
+#if defined(__GNUC__)
+__attribute__((noinline))
+#endif
+void
+deallocate (void* p) noexcept
+{
+    std::free(p);
+}
+
+#if __cpp_aligned_new
+
+void*
+allocate (std::size_t n, std::align_val_t a) noexcept
+{
+    ++allocations;
+    auto const align = static_cast<std::size_t>(a);
+    // The size must be a multiple of the alignment
+    return std::aligned_alloc(align,
+        (std::max<std::size_t>(n, 1) + align - 1) & ~(align - 1));
+}
+
+#endif
+
+} // (anon)
+
+// Every form is replaced, so that each allocation is
+// counted and all of them are made with malloc and free.
+
+void*
+operator new (std::size_t n)
+{
+    if (auto const p = allocate(n))
+        return p;
+    throw std::bad_alloc();
+}
+
+void*
+operator new[] (std::size_t n)
+{
+    if (auto const p = allocate(n))
+        return p;
+    throw std::bad_alloc();
+}
+
+void*
+operator new (std::size_t n, std::nothrow_t const&) noexcept
+{
+    return allocate(n);
+}
+
+void*
+operator new[] (std::size_t n, std::nothrow_t const&) noexcept
+{
+    return allocate(n);
+}
+
+void
+operator delete (void* p) noexcept
+{
+    deallocate(p);
+}
+
+void
+operator delete[] (void* p) noexcept
+{
+    deallocate(p);
+}
+
+void
+operator delete (void* p, std::size_t) noexcept
+{
+    deallocate(p);
+}
+
+void
+operator delete[] (void* p, std::size_t) noexcept
+{
+    deallocate(p);
+}
+
+void
+operator delete (void* p, std::nothrow_t const&) noexcept
+{
+    deallocate(p);
+}
+
+void
+operator delete[] (void* p, std::nothrow_t const&) noexcept
+{
+    deallocate(p);
+}
+
+#if __cpp_aligned_new
+
+void*
+operator new (std::size_t n, std::align_val_t a)
+{
+    if (auto const p = allocate(n, a))
+        return p;
+    throw std::bad_alloc();
+}
+
+void*
+operator new[] (std::size_t n, std::align_val_t a)
+{
+    if (auto const p = allocate(n, a))
+        return p;
+    throw std::bad_alloc();
+}
+
+void*
+operator new (std::size_t n, std::align_val_t a,
+    std::nothrow_t const&) noexcept
+{
+    return allocate(n, a);
+}
+
+void*
+operator new[] (std::size_t n, std::align_val_t a,
+    std::nothrow_t const&) noexcept
+{
+    return allocate(n, a);
+}
+
+void
+operator delete (void* p, std::align_val_t) noexcept
+{
+    deallocate(p);
+}
+
+void
+operator delete[] (void* p, std::align_val_t) noexcept
+{
+    deallocate(p);
+}
+
+void
+operator delete (void* p, std::size_t, std::align_val_t) noexcept
+{
+    deallocate(p);
+}
+
+void
+operator delete[] (void* p, std::size_t, std::align_val_t) noexcept
+{
+    deallocate(p);
+}
+
+void
+operator delete (void* p, std::align_val_t,
+    std::nothrow_t const&) noexcept
+{
+    deallocate(p);
+}
+
+void
+operator delete[] (void* p, std::align_val_t,
+    std::nothrow_t const&) noexcept
+{
+    deallocate(p);
+}
+
+#endif
+
+namespace nudb {
+namespace test {
+
+// Measures heap allocations and time per operation
+// on the fetch and insert paths in steady state.
+//
+class alloc_bench : public suite
+{
+public:
+    template <class Function>
+    void
+    measure (char const* what, std::size_t count,
+        Function&& f, double& per_op)
+    {
+        using namespace std::chrono;
+        auto const a0 = allocations;
+        auto const t0 = steady_clock::now();
+        for (std::size_t i = 0; i < count; ++i)
+            f(i);
+        auto const elapsed = steady_clock::now() - t0;
+        per_op = double(allocations - a0) / count;
+        log() <<
+            std::setw(16) << std::left << what <<
+            std::setw(10) << std::right << std::fixed <<
+                std::setprecision(3) << per_op <<
+                " allocs/op " <<
+            std::setw(10) << std::setprecision(0) <<
+                duration_cast<duration<double, std::nano>>(
+                    elapsed).count() / count <<
+                " ns/op" << std::endl;
+    }
+
+    void
+    do_test (std::size_t count, path_type const& path)
+    {
+        auto const dp = path + ".dat";
+        auto const kp = path + ".key";
+        auto const lp = path + ".log";
+        test_api::create(dp, kp, lp, appnum, salt,
+            sizeof(key_type), 4096, 0.5f);
+        store_options options;
+        options.arena_alloc_size = arena_alloc_size;
+        Sequence seq;
+        double per_op;
+        {
+            test_api::store db;
+            if (! expect(db.open(dp, kp, lp,
+                    options), "open"))
+                return;
+            measure("insert", count,
+                [&](std::size_t i)
+                {
+                    auto const v = seq[i];
+                    expect(db.insert(&v.key, v.data, v.size),
+                        "insert");
+                }, per_op);
+            db.close();
+        }
+        test_api::store db;
+        if (! expect(db.open(dp, kp, lp,
+                options), "reopen"))
+            return;
+        std::size_t bytes = 0;
+        auto const fetch =
+            [&](std::size_t i)
+            {
+                auto const k = seq.key(i);
+                db.fetch(&k,
+                    [&](void const*, std::size_t size)
+                    {
+                        bytes += size;
+                    });
+            };
+        // Warm up the buffers of this thread
+        for (std::size_t i = 0; i < count; ++i)
+            fetch(i);
+        measure("fetch", count, fetch, per_op);
+        expect(per_op == 0, "fetch allocates");
+        measure("fetch missing", count,
+            [&](std::size_t i)
+            {
+                fetch(count + i);
+            }, per_op);
+        expect(per_op == 0, "fetch missing allocates");
+        fetch_context ctx;
+        measure("fetch context", count,
+            [&](std::size_t i)
+            {
+                auto const k = seq.key(i);
+                db.fetch(&k, ctx,
+                    [&](void const*, std::size_t size)
+                    {
+                        bytes += size;
+                    });
+            }, per_op);
+        expect(per_op < 0.01, "fetch context allocates");
+        expect(bytes > 0, "no values");
+        db.close();
+        test_api::file_type::erase(dp);
+        test_api::file_type::erase(kp);
+        test_api::file_type::erase(lp);
+    }
+
+    void
+    run() override
+    {
+        static std::size_t constexpr N = 20000;
+
+        temp_dir td;
+        do_test(N, td.path());
+    }
+};
+
+} // test
+} // nudb
+
+int main()
+{
+    std::cout << "alloc_bench:" << std::endl;
+    nudb::test::alloc_bench t;
+    return t(std::cerr) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,598 @@
+//
+// Copyright (c) 2015-2016 Vinnie Falco (vinnie dot falco at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+// Benchmarks a store under configurable workloads.
+//
+// Each workload prints one line per kind of operation, with the
+// throughput and latency percentiles, as JSON or CSV so that runs
+// of different versions can be compared by a script. Run with
+// --help for the options.
+//
+// Keys and values are computed from an index rather than kept in
+// memory, so the store may be made larger than RAM with --count
+// and --value-max, in a directory given with --dir.
+
+#include "test_util.hpp"
+#include <nudb/observer.hpp>
+#include <boost/program_options.hpp>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace nudb {
+namespace test {
+
+struct bench_config
+{
+    std::string dir;
+    std::string label;
+    std::string workloads = "insert,read,mixed,readers";
+    std::string distribution = "uniform";
+    std::string format = "json";
+    std::size_t count = 1000000;
+    std::size_t ops = 1000000;
+    std::size_t threads = 1;
+    std::size_t key_size = 32;
+    std::size_t value_min = 100;
+    std::size_t value_max = 1000;
+    std::size_t block_size = 4096;
+    std::size_t cache_size = 0;
+    std::size_t filter_bits = 0;
+    double load_factor = 0.5;
+    double write_ratio = 0.1;
+    double zipf_theta = 0.99;
+    bool reuse = false;
+};
+
+//------------------------------------------------------------------------------
+
+// Draws ranks in [0, n) where rank i has weight 1 / (i + 1)^theta,
+// using the method of Gray et al., "Quickly Generating Billion-Record
+// Synthetic Databases". Ranks are scattered over the keys so that the
+// popular keys do not share buckets.
+//
+class zipf_distribution
+{
+private:
+    std::uint64_t n_;
+    double theta_;
+    double alpha_;
+    double zetan_;
+    double eta_;
+
+    // Sum of 1 / i^theta for i in [1, n]. Past a million terms
+    // the tail is approximated by its integral.
+    static
+    double
+    zeta (std::uint64_t n, double theta)
+    {
+        std::uint64_t const exact = std::min<std::uint64_t>(n, 1000000);
+        double sum = 0;
+        for (std::uint64_t i = 1; i <= exact; ++i)
+            sum += 1 / std::pow(static_cast<double>(i), theta);
+        if (n > exact)
+            sum += (std::pow(static_cast<double>(n), 1 - theta) -
+                std::pow(static_cast<double>(exact), 1 - theta)) /
+                    (1 - theta);
+        return sum;
+    }
+
+public:
+    zipf_distribution (std::uint64_t n, double theta)
+        : n_ (n)
+        , theta_ (theta)
+        , alpha_ (1 / (1 - theta))
+        , zetan_ (zeta(n, theta))
+        , eta_ ((1 - std::pow(2.0 / n, 1 - theta)) /
+            (1 - zeta(2, theta) / zetan_))
+    {
+    }
+
+    template <class Generator>
+    std::uint64_t
+    operator() (Generator& g)
+    {
+        // Uniform in [0, 1) from the top 53 bits
+        auto const u = static_cast<double>(g() >> 11) /
+            9007199254740992.0;
+        auto const uz = u * zetan_;
+        std::uint64_t rank;
+        if (uz < 1)
+            rank = 0;
+        else if (uz < 1 + std::pow(0.5, theta_))
+            rank = 1;
+        else
+            rank = static_cast<std::uint64_t>(n_ *
+                std::pow(eta_ * u - eta_ + 1, alpha_));
+        rank = std::min(rank, n_ - 1);
+        return (rank * 0x9e3779b97f4a7c15ULL) % n_;
+    }
+};
+
+// Produces the keys and values of a benchmark from an index
+class bench_data
+{
+private:
+    bench_config const& c_;
+    std::vector<std::uint8_t> pattern_;
+
+public:
+    explicit
+    bench_data (bench_config const& c)
+        : c_ (c)
+        , pattern_ (c.value_max + 64)
+    {
+        xor_shift_engine g (1);
+        rngcpy(pattern_.data(), pattern_.size(), g);
+    }
+
+    void
+    key (std::uint64_t i, std::uint8_t* out) const
+    {
+        xor_shift_engine g (i + 1);
+        rngcpy(out, c_.key_size, g);
+    }
+
+    // Returns the value of index i
+    std::pair<void const*, std::size_t>
+    value (std::uint64_t i) const
+    {
+        xor_shift_engine g (i + 1);
+        auto const size = c_.value_min + g() %
+            (c_.value_max - c_.value_min + 1);
+        return {pattern_.data() + i % 64, size};
+    }
+};
+
+// Picks the keys which workloads fetch
+class key_chooser
+{
+private:
+    std::uint64_t n_;
+    bool zipf_;
+    zipf_distribution z_;
+
+public:
+    key_chooser (bench_config const& c)
+        : n_ (c.count)
+        , zipf_ (c.distribution == "zipf")
+        , z_ (std::max<std::uint64_t>(c.count, 2), c.zipf_theta)
+    {
+    }
+
+    template <class Generator>
+    std::uint64_t
+    operator() (Generator& g)
+    {
+        if (zipf_)
+            return z_(g);
+        return g() % n_;
+    }
+};
+
+//------------------------------------------------------------------------------
+
+// Results of one kind of operation in a workload
+struct bench_result
+{
+    std::string workload;
+    std::string op;
+    std::size_t threads;
+    double seconds;
+    std::unique_ptr<latency_histogram> h;
+};
+
+class bench
+{
+private:
+    using clock_type = std::chrono::steady_clock;
+    using store_type = test_api::store;
+
+    bench_config const& c_;
+    bench_data data_;
+    store_type db_;
+    std::atomic<std::uint64_t> next_ {0};   // next key to insert
+    bool header_ = false;
+
+public:
+    explicit
+    bench (bench_config const& c)
+        : c_ (c)
+        , data_ (c)
+    {
+    }
+
+    void
+    run()
+    {
+        auto const dp = c_.dir + "/nudb.dat";
+        auto const kp = c_.dir + "/nudb.key";
+        auto const lp = c_.dir + "/nudb.log";
+        bool const fresh = ! (c_.reuse &&
+            boost::filesystem::exists(dp));
+        if (fresh)
+        {
+            native_file::erase(dp);
+            native_file::erase(kp);
+            native_file::erase(lp);
+            test_api::create(dp, kp, lp, appnum, salt,
+                c_.key_size, c_.block_size, c_.load_factor);
+        }
+        store_options options;
+        options.cache_size = c_.cache_size;
+        options.filter_bits = c_.filter_bits;
+        db_.open(dp, kp, lp, options);
+        next_ = c_.count;
+        std::istringstream is (c_.workloads);
+        std::string w;
+        std::vector<std::string> workloads;
+        while (std::getline(is, w, ','))
+            workloads.push_back(w);
+        // The store is filled first, reported only if asked for
+        if (fresh)
+        {
+            auto r = insert();
+            if (std::find(workloads.begin(), workloads.end(),
+                    "insert") != workloads.end())
+                report(r);
+        }
+        for (auto const& name : workloads)
+        {
+            if (name == "insert")
+                continue;
+            else if (name == "read")
+                report(read());
+            else if (name == "mixed")
+                mixed();
+            else if (name == "readers")
+                readers();
+            else
+                throw std::invalid_argument(
+                    "unknown workload " + name);
+        }
+        db_.close();
+    }
+
+private:
+    static
+    std::unique_ptr<latency_histogram>
+    histogram()
+    {
+        return std::unique_ptr<latency_histogram>(
+            new latency_histogram);
+    }
+
+    template <class Function>
+    static
+    void
+    timed (latency_histogram& h, Function&& f)
+    {
+        auto const t0 = clock_type::now();
+        f();
+        h.record(std::chrono::duration_cast<
+            std::chrono::nanoseconds>(clock_type::now() - t0));
+    }
+
+    // Runs f(thread, histograms) on each of n threads,
+    // returning the elapsed time and merged histograms.
+    template <class Function>
+    double
+    parallel (std::size_t n, std::size_t kinds,
+        std::vector<std::unique_ptr<latency_histogram>>& merged,
+            Function&& f)
+    {
+        std::vector<std::vector<std::unique_ptr<
+            latency_histogram>>> hs(n);
+        for (auto& v : hs)
+            for (std::size_t k = 0; k < kinds; ++k)
+                v.push_back(histogram());
+        std::vector<std::thread> threads;
+        auto const t0 = clock_type::now();
+        for (std::size_t t = 0; t < n; ++t)
+            threads.emplace_back(
+                [&, t]()
+                {
+                    f(t, hs[t]);
+                });
+        for (auto& t : threads)
+            t.join();
+        auto const elapsed = std::chrono::duration<double>(
+            clock_type::now() - t0).count();
+        merged.clear();
+        for (std::size_t k = 0; k < kinds; ++k)
+        {
+            merged.push_back(histogram());
+            for (auto const& v : hs)
+                merged.back()->merge(*v[k]);
+        }
+        return elapsed;
+    }
+
+    bool
+    do_insert (std::uint64_t i, std::uint8_t* key)
+    {
+        data_.key(i, key);
+        auto const v = data_.value(i);
+        return db_.insert(key, v.first, v.second);
+    }
+
+    bool
+    do_fetch (std::uint64_t i, std::uint8_t* key)
+    {
+        data_.key(i, key);
+        return db_.fetch(key,
+            [](void const*, std::size_t)
+            {
+            });
+    }
+
+    bench_result
+    insert()
+    {
+        std::vector<std::unique_ptr<latency_histogram>> h;
+        std::atomic<std::uint64_t> next {0};
+        auto const elapsed = parallel(c_.threads, 1, h,
+            [&](std::size_t, std::vector<std::unique_ptr<
+                latency_histogram>>& hs)
+            {
+                std::vector<std::uint8_t> key (c_.key_size);
+                for (;;)
+                {
+                    auto const i = next++;
+                    if (i >= c_.count)
+                        break;
+                    timed(*hs[0], [&]{ do_insert(i, key.data()); });
+                }
+            });
+        return {"insert", "insert", c_.threads,
+            elapsed, std::move(h[0])};
+    }
+
+    bench_result
+    read()
+    {
+        std::vector<std::unique_ptr<latency_histogram>> h;
+        auto const elapsed = parallel(c_.threads, 1, h,
+            [&](std::size_t t, std::vector<std::unique_ptr<
+                latency_histogram>>& hs)
+            {
+                xor_shift_engine g (t + 1);
+                key_chooser choose (c_);
+                std::vector<std::uint8_t> key (c_.key_size);
+                for (std::size_t n = t; n < c_.ops; n += c_.threads)
+                {
+                    auto const i = choose(g);
+                    timed(*hs[0], [&]{ do_fetch(i, key.data()); });
+                }
+            });
+        return {"read", "fetch", c_.threads,
+            elapsed, std::move(h[0])};
+    }
+
+    // Each thread fetches, or inserts a new key
+    // with probability write_ratio.
+    void
+    mixed()
+    {
+        std::vector<std::unique_ptr<latency_histogram>> h;
+        auto const elapsed = parallel(c_.threads, 2, h,
+            [&](std::size_t t, std::vector<std::unique_ptr<
+                latency_histogram>>& hs)
+            {
+                xor_shift_engine g (t + 1);
+                key_chooser choose (c_);
+                auto const threshold = static_cast<std::uint64_t>(
+                    c_.write_ratio * 1000000);
+                std::vector<std::uint8_t> key (c_.key_size);
+                for (std::size_t n = t; n < c_.ops; n += c_.threads)
+                {
+                    if (g() % 1000000 < threshold)
+                    {
+                        auto const i = next_++;
+                        timed(*hs[1], [&]{ do_insert(i, key.data()); });
+                    }
+                    else
+                    {
+                        auto const i = choose(g);
+                        timed(*hs[0], [&]{ do_fetch(i, key.data()); });
+                    }
+                }
+            });
+        report({"mixed", "fetch", c_.threads,
+            elapsed, std::move(h[0])});
+        report({"mixed", "insert", c_.threads,
+            elapsed, std::move(h[1])});
+    }
+
+    // Reader threads fetch while one more thread inserts
+    // new keys until the readers are done.
+    void
+    readers()
+    {
+        std::vector<std::unique_ptr<latency_histogram>> h;
+        std::atomic<bool> done {false};
+        std::atomic<std::size_t> finished {0};
+        auto const n = c_.threads + 1;
+        auto const elapsed = parallel(n, 2, h,
+            [&](std::size_t t, std::vector<std::unique_ptr<
+                latency_histogram>>& hs)
+            {
+                std::vector<std::uint8_t> key (c_.key_size);
+                if (t == c_.threads)
+                {
+                    while (! done.load())
+                    {
+                        auto const i = next_++;
+                        timed(*hs[1], [&]{ do_insert(i, key.data()); });
+                    }
+                    return;
+                }
+                xor_shift_engine g (t + 1);
+                key_chooser choose (c_);
+                for (std::size_t j = t; j < c_.ops; j += c_.threads)
+                {
+                    auto const i = choose(g);
+                    timed(*hs[0], [&]{ do_fetch(i, key.data()); });
+                }
+                // The last reader to finish stops the writer
+                if (++finished == c_.threads)
+                    done.store(true);
+            });
+        report({"readers", "fetch", c_.threads,
+            elapsed, std::move(h[0])});
+        report({"readers", "insert", 1,
+            elapsed, std::move(h[1])});
+    }
+
+    void
+    report (bench_result const& r)
+    {
+        using std::chrono::nanoseconds;
+        auto const& h = *r.h;
+        auto const ops = h.count();
+        auto const rate = r.seconds > 0 ? ops / r.seconds : 0;
+        auto const ns = [](nanoseconds d) { return d.count(); };
+        if (c_.format == "csv")
+        {
+            if (! header_)
+                std::cout <<
+                    "label,workload,op,threads,distribution,count,"
+                    "key_size,value_min,value_max,block_size,"
+                    "ops,seconds,ops_per_sec,"
+                    "p50_ns,p99_ns,p999_ns,max_ns\n";
+            header_ = true;
+            std::cout <<
+                c_.label << ',' <<
+                r.workload << ',' <<
+                r.op << ',' <<
+                r.threads << ',' <<
+                c_.distribution << ',' <<
+                c_.count << ',' <<
+                c_.key_size << ',' <<
+                c_.value_min << ',' <<
+                c_.value_max << ',' <<
+                c_.block_size << ',' <<
+                ops << ',' <<
+                r.seconds << ',' <<
+                rate << ',' <<
+                ns(h.percentile(0.5)) << ',' <<
+                ns(h.percentile(0.99)) << ',' <<
+                ns(h.percentile(0.999)) << ',' <<
+                ns(h.max()) << std::endl;
+            return;
+        }
+        std::cout <<
+            "{\"label\":\"" << c_.label << "\"," <<
+            "\"workload\":\"" << r.workload << "\"," <<
+            "\"op\":\"" << r.op << "\"," <<
+            "\"threads\":" << r.threads << ',' <<
+            "\"distribution\":\"" << c_.distribution << "\"," <<
+            "\"count\":" << c_.count << ',' <<
+            "\"key_size\":" << c_.key_size << ',' <<
+            "\"value_min\":" << c_.value_min << ',' <<
+            "\"value_max\":" << c_.value_max << ',' <<
+            "\"block_size\":" << c_.block_size << ',' <<
+            "\"ops\":" << ops << ',' <<
+            "\"seconds\":" << r.seconds << ',' <<
+            "\"ops_per_sec\":" << rate << ',' <<
+            "\"p50_ns\":" << ns(h.percentile(0.5)) << ',' <<
+            "\"p99_ns\":" << ns(h.percentile(0.99)) << ',' <<
+            "\"p999_ns\":" << ns(h.percentile(0.999)) << ',' <<
+            "\"max_ns\":" << ns(h.max()) << '}' << std::endl;
+    }
+};
+
+} // test
+} // nudb
+
+int main(int argc, char** argv)
+{
+    namespace po = boost::program_options;
+    using namespace nudb::test;
+    bench_config c;
+    po::options_description desc("Options");
+    desc.add_options()
+        ("help", "show this message")
+        ("dir", po::value<std::string>(&c.dir),
+            "directory for the database, or a temporary one")
+        ("reuse", po::bool_switch(&c.reuse),
+            "use a database left in --dir by an earlier run")
+        ("label", po::value<std::string>(&c.label),
+            "text copied to each result, such as a version")
+        ("workloads", po::value<std::string>(&c.workloads)->
+            default_value(c.workloads),
+            "comma separated: insert, read, mixed, readers")
+        ("distribution", po::value<std::string>(&c.distribution)->
+            default_value(c.distribution),
+            "keys fetched: uniform or zipf")
+        ("zipf-theta", po::value<double>(&c.zipf_theta)->
+            default_value(c.zipf_theta), "skew of zipf, below 1")
+        ("format", po::value<std::string>(&c.format)->
+            default_value(c.format), "json or csv")
+        ("count", po::value<std::size_t>(&c.count)->
+            default_value(c.count), "keys inserted before the workloads")
+        ("ops", po::value<std::size_t>(&c.ops)->
+            default_value(c.ops), "operations per workload")
+        ("threads", po::value<std::size_t>(&c.threads)->
+            default_value(c.threads), "threads per workload")
+        ("write-ratio", po::value<double>(&c.write_ratio)->
+            default_value(c.write_ratio), "inserts in mixed, 0 to 1")
+        ("key-size", po::value<std::size_t>(&c.key_size)->
+            default_value(c.key_size), "bytes per key")
+        ("value-min", po::value<std::size_t>(&c.value_min)->
+            default_value(c.value_min), "smallest value")
+        ("value-max", po::value<std::size_t>(&c.value_max)->
+            default_value(c.value_max), "largest value")
+        ("block-size", po::value<std::size_t>(&c.block_size)->
+            default_value(c.block_size), "key file block size")
+        ("load-factor", po::value<double>(&c.load_factor)->
+            default_value(c.load_factor), "key file load factor")
+        ("cache-size", po::value<std::size_t>(&c.cache_size)->
+            default_value(c.cache_size), "read cache bytes")
+        ("filter-bits", po::value<std::size_t>(&c.filter_bits)->
+            default_value(c.filter_bits), "filter bits per key")
+        ;
+    try
+    {
+        po::variables_map vm;
+        po::store(po::parse_command_line(argc, argv, desc), vm);
+        po::notify(vm);
+        if (vm.count("help"))
+        {
+            std::cout << desc << std::endl;
+            return EXIT_SUCCESS;
+        }
+        if (c.threads == 0 || c.count == 0 || c.value_min == 0 ||
+                c.value_max < c.value_min ||
+                c.zipf_theta <= 0 || c.zipf_theta >= 1)
+            throw std::invalid_argument("bad option");
+        std::unique_ptr<temp_dir> td;
+        if (c.dir.empty())
+        {
+            td.reset(new temp_dir);
+            c.dir = td->path();
+        }
+        bench b (c);
+        b.run();
+    }
+    catch (std::exception const& e)
+    {
+        std::cerr << "bench: " << e.what() << std::endl;
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
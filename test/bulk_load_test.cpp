@@ -0,0 +1,363 @@
+//
+// Copyright (c) 2015-2016 Vinnie Falco (vinnie dot falco at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#include "test_util.hpp"
+#include "suite.hpp"
+#include <cmath>
+#include <cstring>
+#include <functional>
+
+namespace nudb {
+namespace test {
+
+// Builds databases with bulk_load and build_key_file,
+// then opens them as ordinary stores.
+//
+class bulk_load_test : public suite
+{
+public:
+    // Returns the number of buckets expected for count keys
+    static
+    std::size_t
+    expected_buckets (std::size_t count,
+        std::size_t block_size, float load_factor)
+    {
+        auto const capacity =
+            nudb::detail::bucket_capacity(block_size);
+        return static_cast<std::size_t>(std::ceil(
+            static_cast<double>(count) /
+                (capacity * load_factor)));
+    }
+
+    // Fetches keys [first, last) and checks the values
+    void
+    check (test_api::store& db, Sequence& seq,
+        std::size_t first, std::size_t last)
+    {
+        Storage s;
+        for(std::size_t i = first; i < last; ++i)
+        {
+            auto const v = seq[i];
+            if(! expect(db.fetch(&v.key, s), "missing"))
+                break;
+            if(! expect(s.size() == v.size &&
+                    std::memcmp(s.get(), v.data,
+                        v.size) == 0, "wrong data"))
+                break;
+        }
+    }
+
+    void
+    test_bulk_load (std::size_t N, std::size_t block_size,
+        float load_factor, std::size_t buffer_size)
+    {
+        temp_dir td;
+
+        auto const dp = td.file ("nudb.dat");
+        auto const kp = td.file ("nudb.key");
+        auto const lp = td.file ("nudb.log");
+        Sequence seq;
+        try
+        {
+            std::size_t progress = 0;
+            expect(bulk_load<test_api::hash_type,
+                test_api::codec_type, test_api::file_type>(
+                    dp, kp, appnum, salt, sizeof(key_type),
+                    block_size, load_factor, N, buffer_size,
+                [&](std::function<void(void const*,
+                    void const*, std::size_t)> insert)
+                {
+                    for(std::size_t i = 0; i < N; ++i)
+                    {
+                        auto const v = seq[i];
+                        insert(&v.key, v.data, v.size);
+                    }
+                },
+                [&](std::uint64_t amount, std::uint64_t total)
+                {
+                    expect(amount <= total, "progress");
+                    progress = amount;
+                }), "bulk_load");
+            expect(progress > 0, "no progress");
+            auto info = test_api::verify(dp, kp);
+            expect(info.key_count == N, "key count");
+            expect(info.buckets == expected_buckets(
+                N, block_size, load_factor), "buckets");
+            store_options options;
+            options.arena_alloc_size = arena_alloc_size;
+            test_api::store db;
+            if(! expect(db.open(dp, kp, lp, options), "open"))
+                return;
+            check(db, seq, 0, N);
+            for(std::size_t i = N; i < 2 * N; ++i)
+            {
+                auto const v = seq[i];
+                expect(db.insert(&v.key, v.data, v.size),
+                    "insert");
+                auto const k = seq.key(i - N);
+                expect(! db.insert(&k, v.data, v.size),
+                    "insert duplicate");
+            }
+            db.close();
+            expect(db.open(dp, kp, lp, options), "reopen");
+            check(db, seq, 0, 2 * N);
+            db.close();
+            info = test_api::verify(dp, kp);
+            expect(info.key_count == 2 * N, "verify");
+        }
+        catch (std::exception const& e)
+        {
+            fail (e.what());
+        }
+        expect(test_api::file_type::erase(dp));
+        expect(test_api::file_type::erase(kp));
+        expect(! test_api::file_type::erase(kp + ".sort"));
+        test_api::file_type::erase(lp);
+    }
+
+    // Loads N keys into a key file sized for 4N, then
+    // inserts up to 3N over two opens without a split.
+    void
+    test_presized (std::size_t N, std::size_t block_size,
+        float load_factor)
+    {
+        temp_dir td;
+
+        auto const dp = td.file ("nudb.dat");
+        auto const kp = td.file ("nudb.key");
+        auto const lp = td.file ("nudb.log");
+        Sequence seq;
+        try
+        {
+            expect(bulk_load<test_api::hash_type,
+                test_api::codec_type, test_api::file_type>(
+                    dp, kp, appnum, salt, sizeof(key_type),
+                    block_size, load_factor, 4 * N,
+                        test_api::buffer_size,
+                [&](std::function<void(void const*,
+                    void const*, std::size_t)> insert)
+                {
+                    for(std::size_t i = 0; i < N; ++i)
+                    {
+                        auto const v = seq[i];
+                        insert(&v.key, v.data, v.size);
+                    }
+                },
+                [](std::uint64_t, std::uint64_t)
+                {
+                }), "bulk_load");
+            auto const buckets = expected_buckets(
+                4 * N, block_size, load_factor);
+            auto info = test_api::verify(dp, kp);
+            expect(info.buckets == buckets, "buckets");
+            store_options options;
+            options.arena_alloc_size = arena_alloc_size;
+            test_api::store db;
+            for(std::size_t n = 1; n <= 2; ++n)
+            {
+                if(! expect(db.open(dp, kp, lp, options), "open"))
+                    return;
+                for(std::size_t i = n * N; i < (n + 1) * N; ++i)
+                {
+                    auto const v = seq[i];
+                    expect(db.insert(&v.key, v.data, v.size),
+                        "insert");
+                }
+                db.close();
+                info = test_api::verify(dp, kp);
+                expect(info.key_count == (n + 1) * N, "verify");
+                expect(info.buckets == buckets, "split");
+            }
+        }
+        catch (std::exception const& e)
+        {
+            fail (e.what());
+        }
+        test_api::file_type::erase(dp);
+        test_api::file_type::erase(kp);
+        test_api::file_type::erase(lp);
+    }
+
+    // Replaces the key file of a populated database
+    void
+    test_rebuild (std::size_t N, std::size_t block_size,
+        float load_factor)
+    {
+        temp_dir td;
+
+        auto const dp = td.file ("nudb.dat");
+        auto const kp = td.file ("nudb.key");
+        auto const lp = td.file ("nudb.log");
+        Sequence seq;
+        try
+        {
+            expect(test_api::create(dp, kp, lp, appnum, salt,
+                sizeof(key_type), block_size, load_factor),
+                    "create");
+            store_options options;
+            options.arena_alloc_size = arena_alloc_size;
+            test_api::store db;
+            if(! expect(db.open(dp, kp, lp, options), "open"))
+                return;
+            for(std::size_t i = 0; i < N; ++i)
+            {
+                auto const v = seq[i];
+                expect(db.insert(&v.key, v.data, v.size),
+                    "insert");
+            }
+            db.close();
+            expect(test_api::file_type::erase(kp), "erase");
+            expect(build_key_file<test_api::hash_type,
+                test_api::file_type>(dp, kp, salt + 1,
+                    block_size, load_factor, 2 * N,
+                        test_api::buffer_size,
+                [](std::uint64_t, std::uint64_t)
+                {
+                }), "build_key_file");
+            auto const info = test_api::verify(dp, kp);
+            expect(info.key_count == N, "key count");
+            expect(info.buckets == expected_buckets(
+                2 * N, block_size, load_factor), "buckets");
+            if(! expect(db.open(dp, kp, lp, options), "reopen"))
+                return;
+            check(db, seq, 0, N);
+            db.close();
+        }
+        catch (std::exception const& e)
+        {
+            fail (e.what());
+        }
+        test_api::file_type::erase(dp);
+        test_api::file_type::erase(kp);
+        test_api::file_type::erase(lp);
+    }
+
+    // Retunes a database grown with small buckets
+    void
+    test_rekey (std::size_t N)
+    {
+        temp_dir td;
+
+        auto const dp = td.file ("nudb.dat");
+        auto const kp = td.file ("nudb.key");
+        auto const lp = td.file ("nudb.log");
+        auto const nkp = td.file ("new.key");
+        Sequence seq;
+        try
+        {
+            expect(test_api::create(dp, kp, lp, appnum, salt,
+                sizeof(key_type), 256, 0.95f), "create");
+            store_options options;
+            options.arena_alloc_size = arena_alloc_size;
+            test_api::store db;
+            if(! expect(db.open(dp, kp, lp, options), "open"))
+                return;
+            for(std::size_t i = 0; i < N; ++i)
+            {
+                auto const v = seq[i];
+                expect(db.insert(&v.key, v.data, v.size),
+                    "insert");
+            }
+            db.close();
+            expect(rekey<test_api::hash_type,
+                test_api::file_type>(dp, kp, nkp, 1024, 0.5f, 0,
+                    test_api::buffer_size,
+                [](std::uint64_t, std::uint64_t)
+                {
+                }), "rekey");
+            auto const info = test_api::verify(dp, nkp);
+            expect(info.key_count == N, "key count");
+            expect(info.block_size == 1024, "block size");
+            expect(info.buckets == expected_buckets(
+                N, 1024, 0.5f), "buckets");
+            // The old key file still works
+            expect(test_api::verify(dp, kp).key_count == N,
+                "old key file");
+            if(! expect(db.open(dp, nkp, lp, options), "reopen"))
+                return;
+            check(db, seq, 0, N);
+            db.close();
+        }
+        catch (std::exception const& e)
+        {
+            fail (e.what());
+        }
+        test_api::file_type::erase(dp);
+        test_api::file_type::erase(kp);
+        test_api::file_type::erase(nkp);
+        test_api::file_type::erase(lp);
+    }
+
+    // A repeated key fails the build and erases the files
+    void
+    test_duplicate (std::size_t N, std::size_t block_size)
+    {
+        temp_dir td;
+
+        auto const dp = td.file ("nudb.dat");
+        auto const kp = td.file ("nudb.key");
+        Sequence seq;
+        try
+        {
+            bulk_load<test_api::hash_type,
+                test_api::codec_type, test_api::file_type>(
+                    dp, kp, appnum, salt, sizeof(key_type),
+                    block_size, 0.5f, N, 64 * 1024,
+                [&](std::function<void(void const*,
+                    void const*, std::size_t)> insert)
+                {
+                    for(std::size_t i = 0; i < N; ++i)
+                    {
+                        auto const v = seq[i % (N - 1)];
+                        insert(&v.key, v.data, v.size);
+                    }
+                },
+                [](std::uint64_t, std::uint64_t)
+                {
+                });
+            fail("duplicate key");
+        }
+        catch (store_corrupt_error const&)
+        {
+            pass();
+        }
+        expect(! test_api::file_type::erase(dp), "dat erased");
+        expect(! test_api::file_type::erase(kp), "key erased");
+        expect(! test_api::file_type::erase(kp + ".sort"),
+            "sort erased");
+    }
+
+    void
+    run() override
+    {
+        enum
+        {
+            N =             20000,
+            block_size =    256
+        };
+
+        // Many runs merged from the sort file
+        test_bulk_load(N, block_size, 0.5f, 64 * 1024);
+        // A single run sorted in memory
+        test_bulk_load(N, block_size, 0.95f,
+            test_api::buffer_size);
+        test_presized(N, block_size, 0.5f);
+        test_rebuild(N, block_size, 0.5f);
+        test_rekey(N);
+        test_duplicate(1000, block_size);
+    }
+};
+
+} // test
+} // nudb
+
+int main()
+{
+    std::cout << "bulk_load_test:" << std::endl;
+    nudb::test::bulk_load_test t;
+    return t(std::cerr) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -27,7 +27,8 @@ public:
     // with keys not present.
     //
     void
-    testCallgrind(std::size_t count, path_type const& path)
+    testCallgrind(std::size_t count, path_type const& path,
+        std::size_t filter_bits)
     {
         auto const dp = path + ".dat";
         auto const kp = path + ".key";
@@ -39,8 +40,11 @@ public:
             nudb::block_size(path),
             0.50);
         test_api::store db;
+        store_options options;
+        options.arena_alloc_size = arena_alloc_size;
+        options.filter_bits = filter_bits;
         if(! expect (db.open(dp, kp, lp,
-                arena_alloc_size), "open"))
+                options), "open"))
             return;
         expect (db.appnum() == appnum, "appnum");
         Sequence seq;
@@ -80,7 +84,9 @@ public:
         static std::size_t constexpr N = 100000;
 
         temp_dir td;
-        testCallgrind(N, td.path());
+        testCallgrind(N, td.path(), 0);
+        // Misses are answered by the membership filter
+        testCallgrind(N, td.path(), 10);
     }
 };
 
@@ -0,0 +1,171 @@
+//
+// Copyright (c) 2015-2016 Vinnie Falco (vinnie dot falco at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#include "test_util.hpp"
+#include "suite.hpp"
+#include <nudb/lz4_codec.hpp>
+#include <nudb/zstd_codec.hpp>
+#include <cstring>
+#include <string>
+#include <vector>
+
+namespace nudb {
+namespace test {
+
+// Round trips values through each codec whose library
+// is installed. With none, there is nothing to test.
+//
+class codec_test : public suite
+{
+public:
+    template <class Codec>
+    void
+    round_trip (Codec const& c,
+        void const* data, std::size_t size)
+    {
+        nudb::detail::buffer b0;
+        nudb::detail::buffer b1;
+        auto const in = c.compress(data, size, b0);
+        auto const out = c.decompress(
+            in.first, in.second, b1);
+        expect(out.second == size, "wrong size");
+        expect(size == 0 || std::memcmp(
+            out.first, data, size) == 0, "wrong data");
+    }
+
+    template <class Codec>
+    void
+    do_test (Codec const& c, std::size_t N)
+    {
+        Sequence seq;
+        for(std::size_t i = 0; i < N; ++i)
+        {
+            auto const v = seq[i];
+            round_trip(c, v.data, v.size);
+        }
+        // Empty
+        std::uint8_t const none = 0;
+        round_trip(c, &none, 0);
+        // Large, part random and part repeated
+        std::vector<std::uint8_t> large (1024 * 1024);
+        xor_shift_engine gen;
+        rngcpy(large.data(), large.size() / 2, gen);
+        round_trip(c, large.data(), large.size());
+        log() << c.name() << ": " << N + 2 <<
+            " values" << std::endl;
+    }
+
+#if NUDB_ZSTD_CODEC
+    // Returns a value which looks like the others
+    static
+    std::string
+    document (std::size_t n)
+    {
+        return "{\"id\":" + std::to_string(n) +
+            ",\"name\":\"user" + std::to_string(n % 97) +
+            "\",\"active\":" + ((n % 3) ? "true" : "false") +
+            ",\"score\":" + std::to_string(n * 7919 % 1000) +
+            "}";
+    }
+
+    void
+    test_dictionary (std::size_t N)
+    {
+        temp_dir td;
+
+        auto const dp = td.file ("nudb.dict");
+        try
+        {
+            std::string samples;
+            std::vector<std::size_t> sizes;
+            for(std::size_t i = 0; i < N; ++i)
+            {
+                auto const s = document(i);
+                samples += s;
+                sizes.push_back(s.size());
+            }
+            expect(zstd_codec::train(dp, samples.data(),
+                sizes.data(), sizes.size()), "train");
+            expect(! zstd_codec::train(dp, samples.data(),
+                sizes.data(), sizes.size()), "train exists");
+            zstd_codec c (dp);
+            for(std::size_t i = 0; i < N; ++i)
+            {
+                auto const s = document(N + i);
+                round_trip(c, s.data(), s.size());
+            }
+            // The dictionary makes small values smaller
+            auto const s = document(2 * N);
+            nudb::detail::buffer b0;
+            nudb::detail::buffer b1;
+            expect(c.compress(s.data(), s.size(), b0).second <
+                zstd_codec{}.compress(s.data(), s.size(),
+                    b1).second, "dictionary size");
+            do_test(c, N);
+        }
+        catch (std::exception const& e)
+        {
+            fail (e.what());
+        }
+        native_file::erase(dp);
+    }
+
+    // A frame claiming more than a value can hold is
+    // refused before anything is allocated.
+    void
+    test_bad_size()
+    {
+        std::uint8_t frame[14] = {
+            0x28, 0xb5, 0x2f, 0xfd, // magic
+            0xc0, 0x00 };           // 8 byte content size
+        auto const size = std::uint64_t(1) << 60;
+        for(std::size_t i = 0; i < 8; ++i)
+            frame[6 + i] = static_cast<
+                std::uint8_t>(size >> (8 * i));
+        nudb::detail::buffer b;
+        try
+        {
+            zstd_codec{}.decompress(frame, sizeof(frame), b);
+            fail("no codec_error");
+        }
+        catch (codec_error const&)
+        {
+            pass();
+        }
+    }
+#endif
+
+    void
+    run() override
+    {
+        enum
+        {
+            N =             2000
+        };
+
+#if NUDB_LZ4_CODEC
+        do_test(lz4_codec{}, N);
+#endif
+#if NUDB_ZSTD_CODEC
+        do_test(zstd_codec{}, N);
+        do_test(zstd_codec{1}, N);
+        test_dictionary(N);
+        test_bad_size();
+#endif
+        pass();
+    }
+};
+
+} // test
+} // nudb
+
+int main()
+{
+    std::cout << "codec_test:" << std::endl;
+    nudb::test::codec_test t;
+    return t(std::cerr) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,137 @@
+//
+// Copyright (c) 2015-2016 Vinnie Falco (vinnie dot falco at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#include "test_util.hpp"
+#include "suite.hpp"
+#include <cstring>
+
+namespace nudb {
+namespace test {
+
+// Compacts a database grown by inserts, which leaves
+// unused spill records, and opens the copy.
+//
+class compact_test : public suite
+{
+public:
+    void
+    do_test (std::size_t N, std::size_t block_size,
+        float load_factor, bool bucket_order)
+    {
+        temp_dir td;
+
+        auto const dp = td.file ("nudb.dat");
+        auto const kp = td.file ("nudb.key");
+        auto const lp = td.file ("nudb.log");
+        auto const ndp = td.file ("new.dat");
+        auto const nkp = td.file ("new.key");
+        auto const nlp = td.file ("new.log");
+        Sequence seq;
+        try
+        {
+            expect(test_api::create(dp, kp, lp, appnum, salt,
+                sizeof(key_type), block_size, load_factor),
+                    "create");
+            store_options options;
+            options.arena_alloc_size = arena_alloc_size;
+            {
+                test_api::store db;
+                if(! expect(db.open(dp, kp, lp, options), "open"))
+                    return;
+                for(std::size_t i = 0; i < N; ++i)
+                {
+                    auto const v = seq[i];
+                    expect(db.insert(&v.key, v.data, v.size),
+                        "insert");
+                }
+                db.close();
+            }
+            auto const before = test_api::verify(dp, kp);
+            expect(before.spill_bytes_tot > before.spill_bytes,
+                "no waste");
+            std::uint64_t last = 1;
+            expect(compact<test_api::hash_type,
+                test_api::file_type>(dp, kp, ndp, nkp,
+                    64 * 1024, bucket_order,
+                [&](std::uint64_t amount, std::uint64_t total)
+                {
+                    expect(amount <= total, "progress");
+                    last = total - amount;
+                }), "compact");
+            expect(last == 0, "progress incomplete");
+            expect(! compact<test_api::hash_type,
+                test_api::file_type>(dp, kp, ndp, nkp,
+                    64 * 1024, bucket_order,
+                [](std::uint64_t, std::uint64_t)
+                {
+                }), "compact existing");
+            auto const after = test_api::verify(ndp, nkp);
+            expect(after.key_count == N, "key count");
+            expect(after.buckets == before.buckets, "buckets");
+            expect(after.value_bytes == before.value_bytes,
+                "value bytes");
+            expect(after.spill_bytes_tot == after.spill_bytes,
+                "waste");
+            expect(after.dat_file_size < before.dat_file_size,
+                "not smaller");
+            test_api::store db;
+            if(! expect(db.open(ndp, nkp, nlp, options), "open"))
+                return;
+            Storage s;
+            for(std::size_t i = 0; i < N; ++i)
+            {
+                auto const v = seq[i];
+                if(! expect(db.fetch(&v.key, s), "missing"))
+                    break;
+                expect(s.size() == v.size && std::memcmp(
+                    s.get(), v.data, v.size) == 0, "wrong data");
+            }
+            for(std::size_t i = N; i < N + N / 10; ++i)
+            {
+                auto const v = seq[i];
+                expect(db.insert(&v.key, v.data, v.size),
+                    "insert after compact");
+            }
+            db.close();
+            expect(test_api::verify(ndp, nkp).key_count ==
+                N + N / 10, "verify");
+        }
+        catch (std::exception const& e)
+        {
+            fail (e.what());
+        }
+        test_api::file_type::erase(dp);
+        test_api::file_type::erase(kp);
+        test_api::file_type::erase(lp);
+        test_api::file_type::erase(ndp);
+        test_api::file_type::erase(nkp);
+        test_api::file_type::erase(nlp);
+    }
+
+    void
+    run() override
+    {
+        enum
+        {
+            N =             20000,
+            block_size =    256
+        };
+
+        do_test(N, block_size, 0.95f, false);
+        do_test(N, block_size, 0.95f, true);
+    }
+};
+
+} // test
+} // nudb
+
+int main()
+{
+    std::cout << "compact_test:" << std::endl;
+    nudb::test::compact_test t;
+    return t(std::cerr) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
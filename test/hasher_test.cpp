@@ -0,0 +1,156 @@
+//
+// Copyright (c) 2015-2016 Vinnie Falco (vinnie dot falco at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#include "test_util.hpp"
+#include "suite.hpp"
+#include <nudb/crc32c_hasher.hpp>
+#include <nudb/xxh3_hasher.hpp>
+#include <algorithm>
+#include <cstring>
+#include <string>
+#include <vector>
+
+namespace nudb {
+namespace test {
+
+class hasher_test : public suite
+{
+public:
+    void
+    test_crc32c()
+    {
+        // Check value of CRC32C
+        std::string const s = "123456789";
+        auto const& t = nudb::detail::crc32c_table_t<>::get().t;
+        std::uint32_t c = 0xffffffff;
+        for (auto const ch : s)
+            c = t[(c ^ static_cast<std::uint8_t>(ch)) & 0xff] ^ (c >> 8);
+        expect(~c == 0xe3069283, "crc32c check");
+        // The instructions give the same lanes as the table
+        std::vector<std::uint8_t> buf(100);
+        for (std::size_t i = 0; i < buf.size(); ++i)
+            buf[i] = static_cast<std::uint8_t>(i * 7 + 1);
+        for (std::size_t n = 0; n <= buf.size(); ++n)
+        {
+            nudb::detail::crc32c_lanes hw{1, 2};
+            nudb::detail::crc32c_lanes sw{1, 2};
+            nudb::detail::crc32c_update_hw(hw, buf.data(), n);
+            nudb::detail::crc32c_update_sw(sw, buf.data(), n);
+            expect(hw.a == sw.a && hw.b == sw.b, "crc32c lanes");
+        }
+        log() << "crc32c instructions: " <<
+            (nudb::detail::crc32c_has_hw() ? "yes" : "no") <<
+                std::endl;
+    }
+
+    // Hashes counters, which share most of their bytes,
+    // and checks the spread over buckets and that no two
+    // keys have the same stored hash.
+    template <class Hasher>
+    void
+    test_spread (std::size_t key_size)
+    {
+        enum
+        {
+            N = 200000,
+            buckets = 1021
+        };
+
+        std::vector<std::size_t> counts(buckets, 0);
+        std::vector<std::size_t> hashes;
+        hashes.reserve(N);
+        std::vector<std::uint8_t> key(key_size, 0);
+        for (std::size_t i = 0; i < N; ++i)
+        {
+            std::memcpy(key.data(), &i, sizeof(i));
+            auto const h = nudb::detail::hash<Hasher>(
+                key.data(), key.size(), salt);
+            ++counts[h % buckets];
+            hashes.push_back(h);
+        }
+        auto const mean = N / buckets;
+        for (auto const n : counts)
+            if (! expect(n > mean * 6 / 10 && n < mean * 14 / 10,
+                    "spread"))
+                break;
+        std::sort(hashes.begin(), hashes.end());
+        expect(std::adjacent_find(hashes.begin(),
+            hashes.end()) == hashes.end(), "collision");
+        expect(nudb::detail::hash<Hasher>(key.data(), key.size(),
+            salt) != nudb::detail::hash<Hasher>(key.data(),
+                key.size(), salt + 1), "salt");
+    }
+
+    // Inserts and fetches through a store using Hasher
+    template <class Hasher>
+    void
+    test_store (std::size_t N)
+    {
+        using api = nudb::api<Hasher, identity, native_file>;
+        temp_dir td;
+
+        auto const dp = td.file ("nudb.dat");
+        auto const kp = td.file ("nudb.key");
+        auto const lp = td.file ("nudb.log");
+        Sequence seq;
+        try
+        {
+            expect(api::create(dp, kp, lp, appnum, salt,
+                sizeof(key_type), 4096, 0.5f), "create");
+            typename api::store db;
+            if(! expect(db.open(dp, kp, lp,
+                    arena_alloc_size), "open"))
+                return;
+            for(std::size_t i = 0; i < N; ++i)
+            {
+                auto const v = seq[i];
+                expect(db.insert(&v.key, v.data, v.size),
+                    "insert");
+            }
+            Storage s;
+            for(std::size_t i = 0; i < N; ++i)
+            {
+                auto const v = seq[i];
+                if(! expect(db.fetch(&v.key, s), "missing"))
+                    break;
+            }
+            db.close();
+            expect(api::verify(dp, kp).key_count == N, "verify");
+        }
+        catch (std::exception const& e)
+        {
+            fail (e.what());
+        }
+        api::file_type::erase(dp);
+        api::file_type::erase(kp);
+        api::file_type::erase(lp);
+    }
+
+    void
+    run() override
+    {
+        test_crc32c();
+        for (auto const n : {8, 16, 32, 33})
+            test_spread<crc32c_hasher>(n);
+        test_store<crc32c_hasher>(10000);
+#if NUDB_XXH3_HASHER
+        for (auto const n : {8, 16, 32, 33})
+            test_spread<xxh3_hasher>(n);
+        test_store<xxh3_hasher>(10000);
+#endif
+    }
+};
+
+} // test
+} // nudb
+
+int main()
+{
+    std::cout << "hasher_test:" << std::endl;
+    nudb::test::hasher_test t;
+    return t(std::cerr) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,426 @@
+//
+// Copyright (c) 2015-2016 Vinnie Falco (vinnie dot falco at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#include "suite.hpp"
+#include "test_util.hpp"
+
+#include <nudb/detail/arena.hpp>
+#include <nudb/detail/bucket.hpp>
+#include <nudb/detail/bulkio.hpp>
+#include <nudb/detail/cache.hpp>
+#include <nudb/detail/pool.hpp>
+#include <nudb/detail/varint.hpp>
+#include <chrono>
+#include <cstring>
+#include <iomanip>
+#include <vector>
+
+namespace nudb {
+namespace test {
+
+// Times the in-memory structures used by the store,
+// at the sizes which a key file block size implies.
+//
+class micro_bench : public suite
+{
+public:
+    // Keeps results alive so loops are not optimized away
+    std::size_t sink_ = 0;
+
+    template <class Function>
+    void
+    measure (std::string const& what, std::size_t count,
+        Function&& f)
+    {
+        using namespace std::chrono;
+        auto const t0 = steady_clock::now();
+        f();
+        auto const elapsed = steady_clock::now() - t0;
+        log() <<
+            std::setw(28) << std::left << what <<
+            std::setw(10) << std::right << std::fixed <<
+                std::setprecision(1) <<
+                duration_cast<duration<double, std::nano>>(
+                    elapsed).count() / count <<
+                " ns/op" << std::endl;
+    }
+
+    template <class Function>
+    void
+    measure_bytes (std::string const& what, std::size_t bytes,
+        Function&& f)
+    {
+        using namespace std::chrono;
+        auto const t0 = steady_clock::now();
+        f();
+        auto const elapsed = duration_cast<
+            duration<double>>(steady_clock::now() - t0).count();
+        log() <<
+            std::setw(28) << std::left << what <<
+            std::setw(10) << std::right << std::fixed <<
+                std::setprecision(1) <<
+                (elapsed > 0 ? bytes / elapsed / 1e6 : 0.0) <<
+                " MB/s" << std::endl;
+    }
+
+    void
+    test_bucket (std::size_t block_size, std::size_t rounds)
+    {
+        using nudb::detail::bucket;
+        auto const cap =
+            nudb::detail::bucket_capacity(block_size);
+        nudb::detail::buffer buf (block_size);
+        bucket b (block_size, buf.get(), nudb::detail::empty);
+        xor_shift_engine gen;
+        std::vector<std::size_t> hashes(cap);
+        auto const prefix = "bucket " +
+            std::to_string(block_size) + " ";
+
+        measure(prefix + "insert", rounds * cap,
+            [&]
+            {
+                for (std::size_t r = 0; r < rounds; ++r)
+                {
+                    b.clear();
+                    for (std::size_t i = 0; i < cap; ++i)
+                        b.insert(i, i, gen() & 0xffffffffffff);
+                }
+            });
+        expect(b.full(), "full");
+
+        for (auto& h : hashes)
+            h = gen() & 0xffffffffffff;
+        measure(prefix + "lower_bound", rounds * cap,
+            [&]
+            {
+                for (std::size_t r = 0; r < rounds; ++r)
+                    for (auto const h : hashes)
+                        sink_ += b.lower_bound(h);
+            });
+
+        measure(prefix + "erase", rounds * cap,
+            [&]
+            {
+                for (std::size_t r = 0; r < rounds; ++r)
+                {
+                    b.clear();
+                    for (std::size_t i = 0; i < cap; ++i)
+                        b.insert(i, i, hashes[i]);
+                    while (! b.empty())
+                        b.erase(b.size() / 2);
+                }
+            });
+        expect(b.empty(), "empty");
+    }
+
+    // A pool holds the inserts of one commit, which
+    // touch about one bucket per key in turn.
+    void
+    test_pool (std::size_t block_size, std::size_t buckets)
+    {
+        auto const cap =
+            nudb::detail::bucket_capacity(block_size);
+        auto const n = cap * buckets / 2;
+        nudb::detail::pool_t<> p (
+            sizeof(key_type), arena_alloc_size);
+        std::vector<std::size_t> hashes(n);
+        for (std::size_t i = 0; i < n; ++i)
+            hashes[i] = nudb::detail::hash<xxhasher>(
+                &i, sizeof(i), salt);
+        std::uint8_t const data[64] = {};
+        auto const prefix = "pool " +
+            std::to_string(block_size) + " ";
+
+        measure(prefix + "insert", n,
+            [&]
+            {
+                for (std::size_t i = 0; i < n; ++i)
+                    p.insert(hashes[i], &i, data,
+                        1 + i % sizeof(data));
+            });
+        expect(p.size() == n, "pool size");
+
+        measure(prefix + "find", n,
+            [&]
+            {
+                for (std::size_t i = 0; i < n; ++i)
+                    if (p.find(hashes[i], &i) != p.end())
+                        ++sink_;
+            });
+        measure(prefix + "find missing", n,
+            [&]
+            {
+                for (std::size_t i = n; i < 2 * n; ++i)
+                    if (p.find(hashes[i - n] + 1, &i) != p.end())
+                        ++sink_;
+            });
+    }
+
+    void
+    test_cache (std::size_t block_size, std::size_t buckets)
+    {
+        using nudb::detail::bucket;
+        nudb::detail::cache_t<> c (sizeof(key_type), block_size);
+        nudb::detail::buffer buf (block_size);
+        bucket b (block_size, buf.get(), nudb::detail::empty);
+        auto const cap =
+            nudb::detail::bucket_capacity(block_size);
+        for (std::size_t i = 0; i < cap / 2; ++i)
+            b.insert(i, i, i);
+        xor_shift_engine gen;
+        std::vector<std::size_t> order(buckets);
+        for (std::size_t i = 0; i < buckets; ++i)
+            order[i] = gen() % buckets;
+        auto const prefix = "cache " +
+            std::to_string(block_size) + " ";
+
+        measure(prefix + "insert", buckets,
+            [&]
+            {
+                for (auto const n : order)
+                    c.insert(n, b);
+            });
+
+        measure(prefix + "find", buckets,
+            [&]
+            {
+                for (auto const n : order)
+                    if (c.find(n) != c.end())
+                        ++sink_;
+            });
+        measure(prefix + "find missing", buckets,
+            [&]
+            {
+                for (auto const n : order)
+                    if (c.find(n + buckets) != c.end())
+                        ++sink_;
+            });
+        // Cleared, the pages are kept for the next use
+        auto const memory = c.memory();
+        c.clear();
+        expect(c.empty() && c.begin() == c.end(), "clear");
+        measure(prefix + "insert reused", buckets,
+            [&]
+            {
+                for (auto const n : order)
+                    c.insert(n, b);
+            });
+        expect(c.memory() == memory, "pages reused");
+        std::size_t prev = 0;
+        std::size_t count = 0;
+        for (auto const e : c)
+        {
+            expect(count == 0 || e.first > prev, "order");
+            prev = e.first;
+            ++count;
+        }
+        expect(count == c.size(), "iterate");
+        c.clear();
+        c.shrink_to_fit();
+        expect(c.memory() < memory, "pages freed");
+    }
+
+    // The cache allocates one block per bucket
+    void
+    test_arena (std::size_t block_size, std::size_t buckets)
+    {
+        nudb::detail::arena a (block_size * 64);
+        auto const n = buckets;
+        auto const prefix = "arena " +
+            std::to_string(block_size) + " ";
+
+        measure(prefix + "alloc cold", n,
+            [&]
+            {
+                for (std::size_t i = 0; i < n; ++i)
+                    sink_ += reinterpret_cast<std::uintptr_t>(
+                        a.alloc(block_size)) & 1;
+            });
+        a.clear();
+        measure(prefix + "alloc reused", n,
+            [&]
+            {
+                for (std::size_t i = 0; i < n; ++i)
+                    sink_ += reinterpret_cast<std::uintptr_t>(
+                        a.alloc(block_size)) & 1;
+            });
+        nudb::detail::arena h (block_size * 64, 0, true);
+        measure(prefix + "alloc huge", n,
+            [&]
+            {
+                for (std::size_t i = 0; i < n; ++i)
+                    sink_ += reinterpret_cast<std::uintptr_t>(
+                        h.alloc(block_size)) & 1;
+            });
+    }
+
+    // Varints hold the sizes of values and spill records
+    void
+    test_varint (std::size_t block_size, std::size_t count)
+    {
+        xor_shift_engine gen;
+        std::vector<std::size_t> v(count);
+        for (auto& e : v)
+            e = gen() % block_size;
+        std::vector<std::uint8_t> buf(count *
+            nudb::detail::varint_traits<std::size_t>::max);
+        auto const prefix = "varint " +
+            std::to_string(block_size) + " ";
+        std::size_t used = 0;
+
+        measure(prefix + "encode", count,
+            [&]
+            {
+                used = 0;
+                for (auto const e : v)
+                    used += nudb::detail::write_varint(
+                        buf.data() + used, e);
+            });
+
+        std::size_t sum = 0;
+        measure(prefix + "decode", count,
+            [&]
+            {
+                std::size_t pos = 0;
+                std::size_t t;
+                while (pos < used)
+                {
+                    pos += nudb::detail::read_varint(buf.data() + pos,
+                        used - pos, t);
+                    sum += t;
+                }
+            });
+        std::size_t total = 0;
+        for (auto const e : v)
+            total += e;
+        expect(sum == total, "varint round trip");
+    }
+
+    // Streams records of one block each, as bulk_load and
+    // the key file scans do.
+    void
+    test_bulkio (std::size_t block_size, std::size_t bytes,
+        path_type const& path)
+    {
+        auto const records = bytes / block_size;
+        std::vector<std::uint8_t> record(block_size, 0x5a);
+        auto const prefix = "bulkio " +
+            std::to_string(block_size) + " ";
+        native_file f;
+        f.create(file_mode::append, path);
+
+        measure_bytes(prefix + "write", bytes,
+            [&]
+            {
+                nudb::detail::bulk_writer<native_file> w (
+                    f, 0, 64 * block_size);
+                for (std::size_t i = 0; i < records; ++i)
+                    std::memcpy(w.prepare(block_size).data(
+                        block_size), record.data(), block_size);
+                w.flush();
+            });
+
+        {
+            nudb::detail::io_worker worker;
+            measure_bytes(prefix + "write async", bytes,
+                [&]
+                {
+                    nudb::detail::bulk_writer<native_file> w (
+                        f, 0, 64 * block_size, worker);
+                    for (std::size_t i = 0; i < records; ++i)
+                        std::memcpy(w.prepare(block_size).data(
+                            block_size), record.data(),
+                                block_size);
+                    w.flush();
+                });
+        }
+
+        // Writers sharing a worker see only their own errors
+        {
+            nudb::detail::io_worker worker;
+            fail_counter c (1);
+            fail_file<native_file> ff (c);
+            ff.create(file_mode::append, path + ".fail");
+            nudb::detail::bulk_writer<fail_file<native_file>> bad (
+                ff, 0, block_size, worker);
+            nudb::detail::bulk_writer<native_file> good (
+                f, 0, block_size, worker);
+            bad.prepare(block_size);
+            bad.prepare(block_size);
+            std::memcpy(good.prepare(block_size).data(
+                block_size), record.data(), block_size);
+            try
+            {
+                good.flush();
+                pass();
+            }
+            catch (fail_error const&)
+            {
+                fail("error of another writer");
+            }
+            try
+            {
+                bad.flush();
+                fail("no fail_error");
+            }
+            catch (fail_error const&)
+            {
+                pass();
+            }
+            ff.close();
+            native_file::erase(path + ".fail");
+        }
+
+        std::size_t n = 0;
+        measure_bytes(prefix + "read", bytes,
+            [&]
+            {
+                nudb::detail::bulk_reader<native_file> r (f, 0,
+                    records * block_size, 64 * block_size);
+                while (! r.eof())
+                {
+                    auto is = r.prepare(block_size);
+                    n += *is.data(block_size) == 0x5a;
+                }
+            });
+        expect(n == records, "bulk read");
+        f.close();
+        native_file::erase(path);
+    }
+
+    void
+    run() override
+    {
+        temp_dir td;
+        for (std::size_t const block_size :
+            {1024, 4096, 16384, 65536})
+        {
+            // Buckets of a key file of about 16MB
+            auto const buckets = (16 << 20) / block_size;
+            auto const cap =
+            nudb::detail::bucket_capacity(block_size);
+            test_bucket(block_size, 200000 / cap + 1);
+            test_pool(block_size, buckets);
+            test_cache(block_size, buckets);
+            test_arena(block_size, buckets);
+            test_varint(block_size, 1000000);
+            test_bulkio(block_size, 32 << 20,
+                td.file("micro_bench.dat"));
+        }
+        log() << "sink " << (sink_ & 1) << std::endl;
+    }
+};
+
+} // test
+} // nudb
+
+int main()
+{
+    std::cout << "micro_bench:" << std::endl;
+    nudb::test::micro_bench t;
+    return t(std::cerr) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -7,11 +7,13 @@
 
 #include "suite.hpp"
 #include "test_util.hpp"
+#include <algorithm>
 #include <cmath>
 #include <cstring>
 #include <memory>
 #include <random>
 #include <utility>
+#include <vector>
 
 namespace nudb {
 namespace test {
@@ -97,6 +99,174 @@ public:
         test_api::file_type::erase (lp);
     }
 
+    // Writes a log holding every bucket in a scrambled
+    // order, clears the buckets in the key file, then
+    // recovers in small batches and checks that the key
+    // file is restored and the log is gone.
+    void
+    test_rollback(std::size_t count)
+    {
+        temp_dir td;
+
+        auto const dp = td.file ("nudb.dat");
+        auto const kp = td.file ("nudb.key");
+        auto const lp = td.file ("nudb.log");
+        try
+        {
+            expect(test_api::create(dp, kp, lp, appnum, salt,
+                sizeof(key_type), 256, 0.5f), "create");
+            {
+                test_api::store db;
+                store_options options;
+                options.arena_alloc_size = arena_alloc_size;
+                if(! expect(db.open(dp, kp, lp, options), "open"))
+                    return;
+                Sequence seq;
+                for(std::size_t i = 0; i < count; ++i)
+                {
+                    auto const v = seq[i];
+                    expect(db.insert(&v.key, v.data, v.size),
+                        "insert");
+                }
+            }
+            test_api::file_type kf;
+            test_api::file_type df;
+            test_api::file_type lf;
+            nudb::detail::key_file_header kh;
+            expect(kf.open(file_mode::write, kp), "open key");
+            expect(df.open(file_mode::read, dp), "open dat");
+            nudb::detail::read(kf, kh);
+            auto const kf_size = kf.actual_size();
+            nudb::detail::buffer before(kf_size);
+            kf.read(0, before.get(), kf_size);
+            expect(lf.create(file_mode::append, lp), "create log");
+            nudb::detail::log_file_header lh;
+            lh.version = nudb::detail::currentVersion;
+            lh.uid = kh.uid;
+            lh.appnum = kh.appnum;
+            lh.key_size = kh.key_size;
+            lh.salt = kh.salt;
+            lh.pepper = nudb::detail::pepper<
+                test_api::hash_type>(kh.salt);
+            lh.block_size = kh.block_size;
+            lh.key_file_size = kf_size;
+            lh.dat_file_size = df.actual_size();
+            nudb::detail::write(lf, lh);
+            std::vector<std::size_t> order;
+            for(std::size_t n = 0; n < kh.buckets; ++n)
+                order.push_back(n);
+            std::shuffle(order.begin(), order.end(),
+                std::mt19937{});
+            nudb::detail::buffer buf(kh.block_size);
+            nudb::detail::buffer rec(
+                8 + kh.block_size);
+            for(auto const n : order)
+            {
+                nudb::detail::bucket b(kh.block_size,
+                    buf.get(), kh.inline_bytes);
+                b.read(kf, (n + 1) * kh.block_size);
+                nudb::detail::ostream os(
+                    rec.get(), 8 + b.compact_size());
+                nudb::detail::write<std::uint64_t>(os, n);
+                b.write(os);
+                lf.write(lf.actual_size(), rec.get(),
+                    8 + b.compact_size());
+                nudb::detail::bucket e(kh.block_size,
+                    buf.get(), nudb::detail::empty,
+                        kh.inline_bytes);
+                e.write(kf, (n + 1) * kh.block_size);
+            }
+            lf.close();
+            kf.close();
+            df.close();
+            // Batches of 16 buckets are each read, then
+            // written back, and the files synced once.
+            latency_observer obs;
+            expect(nudb::detail::recover<test_api::hash_type,
+                test_api::file_type>(obs, dp, kp, lp,
+                    16 * kh.block_size), "recover");
+            auto const batches =
+                obs[phase::recover_rollback].count();
+            expect(batches > 1, "rollback batches");
+            expect(obs[phase::recover_read].count() == batches,
+                "read batches");
+            expect(obs[phase::recover_sync].count() == 2, "syncs");
+            expect(kf.open(file_mode::read, kp), "reopen key");
+            nudb::detail::buffer after(kf_size);
+            expect(kf.actual_size() == kf_size, "key file size");
+            kf.read(0, after.get(), kf_size);
+            expect(std::memcmp(before.get(), after.get(),
+                kf_size) == 0, "key file restored");
+            kf.close();
+            expect(! test_api::file_type::erase(lp), "log erased");
+            expect(test_api::verify(dp, kp).key_count == count,
+                "verify");
+        }
+        catch (std::exception const& e)
+        {
+            fail (e.what());
+        }
+        test_api::file_type::erase(dp);
+        test_api::file_type::erase(kp);
+        test_api::file_type::erase(lp);
+    }
+
+    // The split credit written by an unfinished commit is
+    // put back to the one in the log.
+    void
+    test_credit()
+    {
+        temp_dir td;
+
+        auto const dp = td.file ("nudb.dat");
+        auto const kp = td.file ("nudb.key");
+        auto const lp = td.file ("nudb.log");
+        try
+        {
+            expect(test_api::create(dp, kp, lp, appnum, salt,
+                sizeof(key_type), 256, 0.5f), "create");
+            test_api::file_type kf;
+            test_api::file_type df;
+            test_api::file_type lf;
+            nudb::detail::key_file_header kh;
+            expect(kf.open(file_mode::write, kp), "open key");
+            expect(df.open(file_mode::read, dp), "open dat");
+            nudb::detail::read(kf, kh);
+            kh.split_credit = 7;
+            nudb::detail::write(kf, kh);
+            expect(lf.open(file_mode::append, lp), "open log");
+            nudb::detail::log_file_header lh;
+            lh.version = nudb::detail::creditVersion;
+            lh.uid = kh.uid;
+            lh.appnum = kh.appnum;
+            lh.key_size = kh.key_size;
+            lh.salt = kh.salt;
+            lh.pepper = nudb::detail::pepper<
+                test_api::hash_type>(kh.salt);
+            lh.block_size = kh.block_size;
+            lh.key_file_size = kf.actual_size();
+            lh.dat_file_size = df.actual_size();
+            lh.split_credit = 3;
+            nudb::detail::write(lf, lh);
+            lf.close();
+            kf.close();
+            df.close();
+            expect(test_api::recover(dp, kp, lp), "recover");
+            expect(kf.open(file_mode::read, kp), "reopen key");
+            nudb::detail::read(kf, kh);
+            expect(kh.split_credit == 3, "split credit");
+            kf.close();
+            expect(! test_api::file_type::erase(lp), "log erased");
+        }
+        catch (std::exception const& e)
+        {
+            fail (e.what());
+        }
+        test_api::file_type::erase(dp);
+        test_api::file_type::erase(kp);
+        test_api::file_type::erase(lp);
+    }
+
     void
     test_recover(float load_factor, std::size_t count)
     {
@@ -143,6 +313,8 @@ public:
         test_recover(lf, 10);
         test_recover(lf, 100);
         test_recover(lf, 1000);
+        test_rollback(10000);
+        test_credit();
     }
 };
 
@@ -0,0 +1,245 @@
+//
+// Copyright (c) 2015-2016 Vinnie Falco (vinnie dot falco at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#include "test_util.hpp"
+#include "suite.hpp"
+#include <cstring>
+#include <vector>
+
+namespace nudb {
+namespace test {
+
+// Inserts and fetches through a sharded store, then
+// reopens it and verifies each shard on its own.
+//
+class sharded_store_test : public suite
+{
+public:
+    enum
+    {
+        shards = 4,
+        batch = 100
+    };
+
+    using store_type = test_api::sharded_store<shards>;
+
+    void
+    do_test (std::size_t N, std::size_t block_size,
+        float load_factor)
+    {
+        temp_dir td;
+
+        auto const dp = td.file ("nudb.dat");
+        auto const kp = td.file ("nudb.key");
+        auto const lp = td.file ("nudb.log");
+        Sequence seq;
+        store_type db;
+        try
+        {
+            expect(store_type::create(dp, kp, lp, appnum,
+                salt, sizeof(key_type), block_size,
+                    load_factor), "create");
+            expect(! store_type::create(dp, kp, lp, appnum,
+                salt, sizeof(key_type), block_size,
+                    load_factor), "create existing");
+            store_options options;
+            options.arena_alloc_size = arena_alloc_size;
+            expect(db.open(dp, kp, lp, options), "open");
+            Storage s;
+            std::vector<std::size_t> counts(shards, 0);
+            for(std::size_t i = 0; i < N; ++i)
+            {
+                auto const v = seq[i];
+                expect(db.insert(
+                    &v.key, v.data, v.size), "insert");
+                ++counts[db.shard_index(&v.key)];
+            }
+            for(auto const n : counts)
+                expect(n > N / (2 * shards), "unbalanced");
+            // insert_batch, half of the keys duplicates
+            for(std::size_t i = 0; i < N; i += batch)
+            {
+                std::vector<key_type> keys;
+                std::vector<std::vector<std::uint8_t>> values;
+                std::vector<insert_item> items;
+                for(std::size_t j = i; j < i + batch; ++j)
+                {
+                    auto const v = seq[(j % 2) ? (N + j) : j];
+                    keys.push_back(v.key);
+                    values.emplace_back(v.data, v.data + v.size);
+                }
+                for(std::size_t j = 0; j < keys.size(); ++j)
+                    items.push_back({&keys[j],
+                        values[j].data(), values[j].size()});
+                auto const inserted =
+                    db.insert_batch(items.data(), items.size());
+                for(std::size_t j = 0; j < batch; ++j)
+                    expect(inserted[j] == ((j % 2) != 0),
+                        "insert_batch result");
+            }
+            db.close();
+            expect(db.open(dp, kp, lp, options), "reopen");
+            for(std::size_t i = 0; i < N; ++i)
+            {
+                auto const v = seq[(i % 2) ? (N + i) : i];
+                expect(db.fetch(&v.key, s), "missing");
+                expect(s.size() == v.size &&
+                    std::memcmp(s.get(), v.data,
+                        v.size) == 0, "wrong data");
+            }
+            // fetch_batch, half of the keys missing
+            for(std::size_t i = 0; i < N; i += batch)
+            {
+                std::vector<key_type> keys;
+                for(std::size_t j = i; j < i + batch; ++j)
+                    keys.push_back(seq.key(
+                        (j % 2) ? (3 * N + j) : j));
+                std::vector<void const*> pk;
+                for(auto const& k : keys)
+                    pk.push_back(&k);
+                auto const found = db.fetch_batch(
+                    pk.data(), pk.size(),
+                    [&](std::size_t j,
+                        void const* data, std::size_t size)
+                    {
+                        auto const v = seq[i + j];
+                        expect(keys[j] == v.key &&
+                            size == v.size &&
+                            std::memcmp(data, v.data,
+                                size) == 0, "fetch_batch");
+                    });
+                expect(found == batch / 2, "fetch_batch count");
+            }
+            db.close();
+            std::size_t keys = 0;
+            for(std::size_t i = 0; i < shards; ++i)
+            {
+                auto const stats = verify<test_api::hash_type>(
+                    store_type::shard_path(dp, i),
+                    store_type::shard_path(kp, i),
+                        1024 * 1024);
+                expect(stats.key_count >= counts[i],
+                    "verify count");
+                keys += stats.key_count;
+            }
+            expect(keys == N + N / 2, "verify keys");
+        }
+        catch (std::exception const& e)
+        {
+            fail (e.what());
+        }
+        for(std::size_t i = 0; i < shards; ++i)
+        {
+            expect(test_api::file_type::erase(
+                store_type::shard_path(dp, i)));
+            expect(test_api::file_type::erase(
+                store_type::shard_path(kp, i)));
+            expect(! test_api::file_type::erase(
+                store_type::shard_path(lp, i)));
+        }
+    }
+
+    // Shards created for another database are refused
+    void
+    test_mismatch (std::size_t block_size)
+    {
+        temp_dir td;
+
+        auto const dp = td.file ("nudb.dat");
+        auto const kp = td.file ("nudb.key");
+        auto const lp = td.file ("nudb.log");
+        expect(store_type::create(dp, kp, lp, appnum,
+            salt, sizeof(key_type), block_size, 0.5f), "create");
+        // Replace the last shard with a foreign one
+        auto const last = shards - 1;
+        test_api::file_type::erase(store_type::shard_path(dp, last));
+        test_api::file_type::erase(store_type::shard_path(kp, last));
+        test_api::file_type::erase(store_type::shard_path(lp, last));
+        expect(test_api::create(
+            store_type::shard_path(dp, last),
+            store_type::shard_path(kp, last),
+            store_type::shard_path(lp, last),
+            appnum + 1, salt, sizeof(key_type),
+                block_size, 0.5f), "create foreign");
+        store_type db;
+        store_options options;
+        options.arena_alloc_size = arena_alloc_size;
+        try
+        {
+            db.open(dp, kp, lp, options);
+            fail("open mismatch");
+        }
+        catch (store_corrupt_error const&)
+        {
+            pass();
+        }
+        expect(! db.is_open(), "closed after mismatch");
+        for(std::size_t i = 0; i < shards; ++i)
+        {
+            test_api::file_type::erase(store_type::shard_path(dp, i));
+            test_api::file_type::erase(store_type::shard_path(kp, i));
+            test_api::file_type::erase(store_type::shard_path(lp, i));
+        }
+    }
+
+    // A database of more shards is not opened as fewer
+    void
+    test_shard_count (std::size_t block_size)
+    {
+        temp_dir td;
+
+        auto const dp = td.file ("nudb.dat");
+        auto const kp = td.file ("nudb.key");
+        auto const lp = td.file ("nudb.log");
+        using larger_type = test_api::sharded_store<2 * shards>;
+        expect(larger_type::create(dp, kp, lp, appnum,
+            salt, sizeof(key_type), block_size, 0.5f), "create");
+        store_type db;
+        store_options options;
+        options.arena_alloc_size = arena_alloc_size;
+        try
+        {
+            db.open(dp, kp, lp, options);
+            fail("open fewer shards");
+        }
+        catch (store_error const&)
+        {
+            pass();
+        }
+        expect(! db.is_open(), "closed after shard count");
+        for(std::size_t i = 0; i < 2 * shards; ++i)
+        {
+            test_api::file_type::erase(store_type::shard_path(dp, i));
+            test_api::file_type::erase(store_type::shard_path(kp, i));
+            test_api::file_type::erase(store_type::shard_path(lp, i));
+        }
+    }
+
+    void
+    run() override
+    {
+        enum
+        {
+            N =             20000,
+            block_size =    256
+        };
+
+        do_test(N, block_size, 0.95f);
+        test_mismatch(block_size);
+        test_shard_count(block_size);
+    }
+};
+
+} // test
+} // nudb
+
+int main()
+{
+    std::cout << "sharded_store_test:" << std::endl;
+    nudb::test::sharded_store_test t;
+    return t(std::cerr) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
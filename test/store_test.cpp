@@ -7,11 +7,17 @@
 
 #include "test_util.hpp"
 #include "suite.hpp"
+#include <array>
+#include <atomic>
+#include <chrono>
 #include <cmath>
+#include <functional>
 #include <iomanip>
 #include <memory>
 #include <random>
+#include <thread>
 #include <utility>
+#include <vector>
 
 namespace nudb {
 namespace test {
@@ -24,9 +30,17 @@ namespace test {
 class store_test : public suite
 {
 public:
+    enum
+    {
+        batch = 100
+    };
+
+    template <class Store>
     void
-    do_test (std::size_t N,
-        std::size_t block_size, float load_factor)
+    do_test (std::size_t N, std::size_t block_size,
+        float load_factor, std::size_t cache_size,
+            std::size_t filter_bits = 0,
+                std::size_t inline_size = 0)
     {
         temp_dir td;
 
@@ -34,14 +48,19 @@ public:
         auto const kp = td.file ("nudb.key");
         auto const lp = td.file ("nudb.log");
         Sequence seq;
-        test_api::store db;
+        Store db;
         try
         {
+            create_options co;
+            co.inline_size = inline_size;
             expect(test_api::create (dp, kp, lp, appnum,
                 salt, sizeof(key_type), block_size,
-                    load_factor), "create");
-            expect(db.open(dp, kp, lp,
-                arena_alloc_size), "open");
+                    load_factor, co), "create");
+            store_options options;
+            options.arena_alloc_size = arena_alloc_size;
+            options.cache_size = cache_size;
+            options.filter_bits = filter_bits;
+            expect(db.open(dp, kp, lp, options), "open");
             Storage s;
             // insert
             for(std::size_t i = 0; i < N; ++i)
@@ -80,12 +99,129 @@ public:
                 expect(db.insert(&v.key, v.data, v.size),
                     "insert 2");
             }
+            // fetch_batch, half of the keys missing
+            for(std::size_t i = 0; i < 2 * N; i += batch)
+            {
+                std::vector<key_type> keys;
+                for(std::size_t j = i; j < i + batch; ++j)
+                    keys.push_back(seq.key(
+                        (j % 2) ? (2 * N + j) : j));
+                std::vector<void const*> pk;
+                for(auto const& k : keys)
+                    pk.push_back(&k);
+                std::vector<bool> seen(keys.size(), false);
+                auto const found = db.fetch_batch(
+                    pk.data(), pk.size(),
+                    [&](std::size_t j,
+                        void const* data, std::size_t size)
+                    {
+                        auto const v = seq[i + j];
+                        expect(! seen[j], "fetch_batch twice");
+                        seen[j] = true;
+                        expect(seq.key(i + j) == keys[j],
+                            "fetch_batch missing key");
+                        expect(size == v.size,
+                            "fetch_batch wrong size");
+                        expect(std::memcmp(data,
+                            v.data, v.size) == 0,
+                                "fetch_batch wrong data");
+                    });
+                expect(found == batch / 2, "fetch_batch count");
+            }
+            // insert_batch, half of the keys duplicates
+            for(std::size_t i = 0; i < 2 * N; i += batch)
+            {
+                std::vector<key_type> keys;
+                std::vector<std::vector<std::uint8_t>> values;
+                std::vector<insert_item> items;
+                for(std::size_t j = i; j < i + batch; ++j)
+                {
+                    auto const v = seq[(j % 2) ? (2 * N + j) : j];
+                    keys.push_back(v.key);
+                    values.emplace_back(v.data, v.data + v.size);
+                }
+                // Repeated key within the batch
+                keys.push_back(keys[1]);
+                values.push_back(values[1]);
+                for(std::size_t j = 0; j < keys.size(); ++j)
+                    items.push_back({&keys[j],
+                        values[j].data(), values[j].size()});
+                auto const inserted =
+                    db.insert_batch(items.data(), items.size());
+                expect(inserted.size() == items.size(),
+                    "insert_batch size");
+                for(std::size_t j = 0; j < batch; ++j)
+                    expect(inserted[j] == ((j % 2) != 0),
+                        "insert_batch result");
+                expect(! inserted[batch], "insert_batch repeat");
+                for(std::size_t j = 1; j < batch; j += 2)
+                {
+                    expect(db.fetch(&keys[j], s),
+                        "insert_batch missing");
+                    expect(s.size() == values[j].size() &&
+                        std::memcmp(s.get(), values[j].data(),
+                            s.size()) == 0, "insert_batch data");
+                }
+            }
             db.close();
+            if (filter_bits > 0)
+            {
+                // The filter is rebuilt from the key file
+                expect(db.open(dp, kp, lp, options), "reopen");
+                for(std::size_t i = 0; i < 2 * N; ++i)
+                {
+                    auto const v = seq[i];
+                    expect(db.fetch(&v.key, s), "filter missing");
+                    auto const k = seq.key(5 * N + i);
+                    expect(! db.fetch(&k, s), "filter found");
+                }
+                db.close();
+            }
             //auto const stats = test_api::verify(dp, kp);
             auto const stats = verify<test_api::hash_type>(
                 dp, kp, 1 * 1024 * 1024);
             expect(stats.hist[1] > 0, "no splits");
             print(log(), stats);
+            std::uint64_t last = 0;
+            auto const pstats = verify_parallel<test_api::hash_type>(
+                dp, kp, 1 * 1024 * 1024, 4,
+                [&](std::uint64_t amount, std::uint64_t total)
+                {
+                    expect(amount <= total, "progress");
+                    last = total - amount;
+                });
+            expect(last == 0, "progress incomplete");
+            expect(pstats.key_count == stats.key_count &&
+                pstats.value_count == stats.value_count &&
+                pstats.value_bytes == stats.value_bytes &&
+                pstats.spill_count == stats.spill_count &&
+                pstats.spill_count_tot == stats.spill_count_tot &&
+                pstats.spill_bytes == stats.spill_bytes &&
+                pstats.spill_bytes_tot == stats.spill_bytes_tot &&
+                pstats.hist == stats.hist, "verify_parallel");
+            {
+                // Append a value which no bucket refers to
+                test_api::file_type df;
+                expect(df.open(file_mode::append, dp), "append");
+                std::array<std::uint8_t, 6 + sizeof(key_type) + 1> rec;
+                rec.fill(0);
+                nudb::detail::ostream os(rec.data(), rec.size());
+                nudb::detail::write<nudb::detail::uint48_t>(os, 1);
+                df.write(df.actual_size(), rec.data(), rec.size());
+            }
+            try
+            {
+                verify_parallel<test_api::hash_type>(
+                    dp, kp, 1 * 1024 * 1024, 4,
+                    [](std::uint64_t, std::uint64_t)
+                    {
+                    });
+                fail("orphaned value");
+            }
+            catch (store_corrupt_error const&)
+            {
+                pass();
+            }
         }
         catch (nudb::store_error const& e)
         {
@@ -100,6 +236,1438 @@ public:
         expect(! test_api::file_type::erase(lp));
     }
 
+    // Threads insert overlapping ranges of keys, so that
+    // they race on the same keys and on different ones.
+    // Each key must be inserted by exactly one thread.
+    void
+    test_concurrent_insert (std::size_t N,
+        std::size_t block_size, float load_factor)
+    {
+        enum
+        {
+            threads = 4
+        };
+
+        temp_dir td;
+
+        auto const dp = td.file ("nudb.dat");
+        auto const kp = td.file ("nudb.key");
+        auto const lp = td.file ("nudb.log");
+        try
+        {
+            expect(test_api::create (dp, kp, lp, appnum,
+                salt, sizeof(key_type), block_size,
+                    load_factor), "create");
+            test_api::store db;
+            store_options options;
+            options.arena_alloc_size = arena_alloc_size;
+            expect(db.open(dp, kp, lp, options), "open");
+            // Values are made up front, Sequence
+            // is not safe to share between threads.
+            Sequence seq;
+            std::vector<key_type> keys;
+            std::vector<std::vector<std::uint8_t>> values;
+            for(std::size_t i = 0; i < 2 * N; ++i)
+            {
+                auto const v = seq[i];
+                keys.push_back(v.key);
+                values.emplace_back(v.data, v.data + v.size);
+            }
+            std::vector<std::size_t> inserted(threads, 0);
+            std::vector<std::thread> pool;
+            for(std::size_t t = 0; t < threads; ++t)
+                pool.emplace_back(
+                    [&, t]
+                    {
+                        // Each thread covers half of the keys
+                        for(std::size_t j = 0; j < N; ++j)
+                        {
+                            auto const i =
+                                (t * N / 2 + j) % (2 * N);
+                            if (db.insert(&keys[i],
+                                    values[i].data(),
+                                        values[i].size()))
+                                ++inserted[t];
+                        }
+                    });
+            for(auto& t : pool)
+                t.join();
+            std::size_t total = 0;
+            for(auto const n : inserted)
+                total += n;
+            expect(total == 2 * N, "concurrent inserts");
+            db.close();
+            auto const stats = verify<test_api::hash_type>(
+                dp, kp, 1 * 1024 * 1024);
+            expect(stats.key_count == 2 * N, "key count");
+        }
+        catch (std::exception const& e)
+        {
+            fail (e.what());
+        }
+        expect(test_api::file_type::erase(dp));
+        expect(test_api::file_type::erase(kp));
+        expect(! test_api::file_type::erase(lp));
+    }
+
+    // Inserts throttled on several threads share one
+    // schedule, so together they keep to the rate.
+    void
+    test_flow_control()
+    {
+        using namespace std::chrono;
+        nudb::detail::flow_control fc (
+            0, milliseconds(1000), 1.f);
+        // One megabyte per second, and a pool of
+        // twice the budget charges the full delay.
+        fc.on_commit(1000000, seconds(1));
+        auto const start = steady_clock::now();
+        std::vector<std::thread> threads;
+        for(int t = 0; t < 4; ++t)
+            threads.emplace_back(
+                [&]
+                {
+                    for(int i = 0; i < 10; ++i)
+                        fc.throttle(5000, 2000000);
+                });
+        for(auto& t : threads)
+            t.join();
+        // 200000 bytes take 200 milliseconds
+        expect(steady_clock::now() - start >=
+            milliseconds(190), "not paced");
+    }
+
+    // Inserts with a small commit limit, so that full
+    // pools are sealed and wait behind the commit, and
+    // fetches each key right after inserting it.
+    void
+    test_commit_queue (std::size_t N,
+        std::size_t block_size, float load_factor)
+    {
+        temp_dir td;
+
+        auto const dp = td.file ("nudb.dat");
+        auto const kp = td.file ("nudb.key");
+        auto const lp = td.file ("nudb.log");
+        Sequence seq;
+        try
+        {
+            expect(test_api::create (dp, kp, lp, appnum,
+                salt, sizeof(key_type), block_size,
+                    load_factor), "create");
+            test_api::store db;
+            store_options options;
+            options.arena_alloc_size = arena_alloc_size;
+            options.commit_limit = 16 * 1024;
+            options.commit_target =
+                std::chrono::milliseconds(0);
+            options.commit_queue = 4;
+            expect(db.open(dp, kp, lp, options), "open");
+            Storage s;
+            for(std::size_t i = 0; i < N; ++i)
+            {
+                auto const v = seq[i];
+                expect(db.insert(&v.key, v.data, v.size),
+                    "insert");
+                auto const k = seq.key(i / 2);
+                expect(! db.insert(&k, v.data, v.size) ||
+                    i / 2 == i, "insert duplicate");
+                auto const w = seq[i / 2];
+                if(! expect(db.fetch(&w.key, s), "missing"))
+                    break;
+                if(! expect(s.size() == w.size &&
+                        std::memcmp(s.get(), w.data,
+                            w.size) == 0, "wrong data"))
+                    break;
+            }
+            db.close();
+            auto const stats = verify<test_api::hash_type>(
+                dp, kp, 1 * 1024 * 1024);
+            expect(stats.key_count == N, "key count");
+        }
+        catch (std::exception const& e)
+        {
+            fail (e.what());
+        }
+        expect(test_api::file_type::erase(dp));
+        expect(test_api::file_type::erase(kp));
+        expect(! test_api::file_type::erase(lp));
+    }
+
+    // Inserts and reopens at a sync level
+    void
+    test_durability (std::size_t N, std::size_t block_size,
+        float load_factor, durability level)
+    {
+        temp_dir td;
+
+        auto const dp = td.file ("nudb.dat");
+        auto const kp = td.file ("nudb.key");
+        auto const lp = td.file ("nudb.log");
+        Sequence seq;
+        try
+        {
+            expect(test_api::create (dp, kp, lp, appnum,
+                salt, sizeof(key_type), block_size,
+                    load_factor), "create");
+            test_api::store db;
+            store_options options;
+            options.arena_alloc_size = arena_alloc_size;
+            options.sync_level = level;
+            expect(db.open(dp, kp, lp, options), "open");
+            for(std::size_t i = 0; i < N; ++i)
+            {
+                auto const v = seq[i];
+                expect(db.insert(&v.key, v.data, v.size),
+                    "insert");
+            }
+            db.close();
+            expect(db.open(dp, kp, lp, options), "reopen");
+            Storage s;
+            for(std::size_t i = 0; i < N; ++i)
+            {
+                auto const v = seq[i];
+                if(! expect(db.fetch(&v.key, s), "missing"))
+                    break;
+            }
+            db.close();
+            auto const stats = verify<test_api::hash_type>(
+                dp, kp, 1 * 1024 * 1024);
+            expect(stats.key_count == N, "key count");
+        }
+        catch (std::exception const& e)
+        {
+            fail (e.what());
+        }
+        expect(test_api::file_type::erase(dp));
+        expect(test_api::file_type::erase(kp));
+        expect(! test_api::file_type::erase(lp));
+    }
+
+    // Arenas with huge pages which keep their free blocks
+    void
+    test_arena (std::size_t N,
+        std::size_t block_size, float load_factor)
+    {
+        {
+            nudb::detail::arena a (4096, 2 * 4096, true);
+            auto const p = a.alloc(100);
+            a.clear();
+            a.shrink_to_fit();
+            expect(a.alloc(100) == p, "kept block");
+        }
+        temp_dir td;
+
+        auto const dp = td.file ("nudb.dat");
+        auto const kp = td.file ("nudb.key");
+        auto const lp = td.file ("nudb.log");
+        Sequence seq;
+        try
+        {
+            expect(test_api::create (dp, kp, lp, appnum,
+                salt, sizeof(key_type), block_size,
+                    load_factor), "create");
+            test_api::store db;
+            store_options options;
+            options.arena_alloc_size = arena_alloc_size;
+            options.arena_high_water = 4 * arena_alloc_size;
+            options.arena_huge_pages = true;
+            options.commit_queue = 2;
+            expect(db.open(dp, kp, lp, options), "open");
+            Storage s;
+            for(std::size_t i = 0; i < N; ++i)
+            {
+                auto const v = seq[i];
+                expect(db.insert(&v.key, v.data, v.size),
+                    "insert");
+            }
+            for(std::size_t i = 0; i < N; ++i)
+            {
+                auto const v = seq[i];
+                if(! expect(db.fetch(&v.key, s), "missing"))
+                    break;
+                expect(s.size() == v.size &&
+                    std::memcmp(s.get(), v.data,
+                        v.size) == 0, "wrong value");
+            }
+            db.close();
+            auto const stats = verify<test_api::hash_type>(
+                dp, kp, 1 * 1024 * 1024);
+            expect(stats.key_count == N, "key count");
+        }
+        catch (std::exception const& e)
+        {
+            fail (e.what());
+        }
+        expect(test_api::file_type::erase(dp));
+        expect(test_api::file_type::erase(kp));
+        expect(! test_api::file_type::erase(lp));
+    }
+
+    // Stores sharing a memory budget
+    void
+    test_budget (std::size_t N,
+        std::size_t block_size, float load_factor)
+    {
+        {
+            memory_budget b (100, 1000);
+            memory_budget::member m1;
+            memory_budget::member m2;
+            int w1 = 0;
+            int w2 = 0;
+            m1.join(b, [&]{ ++w1; });
+            m2.join(b, [&]{ ++w2; });
+            expect(m1.cache_size() == m2.cache_size() &&
+                m1.cache_size() + m2.cache_size() <= 1000,
+                    "even shares");
+            m1.charge(30);
+            m2.charge(60);
+            expect(w1 == 0 && w2 == 0, "under limit");
+            m1.charge(50);
+            expect(w1 == 0 && w2 == 1, "largest flushes");
+            expect(m2.flush_requested() &&
+                ! m1.flush_requested(), "flush requested");
+            m1.charge(55);
+            expect(w1 == 0, "one flush at a time");
+            expect(m2.flushed(), "flushed");
+            m2.charge(0);
+            m1.charge(120);
+            expect(w1 == 1, "next flush");
+            m1.leave();
+            expect(b.used() == 0, "used");
+        }
+        temp_dir td;
+        // Small enough to force early commits
+        memory_budget b (arena_alloc_size, 1024 * 1024);
+        std::vector<path_type> paths;
+        try
+        {
+            test_api::store db1;
+            test_api::store db2;
+            for (auto const db : {&db1, &db2})
+            {
+                auto const i = std::to_string(paths.size());
+                paths.push_back(td.file("nudb.dat." + i));
+                paths.push_back(td.file("nudb.key." + i));
+                paths.push_back(td.file("nudb.log." + i));
+                auto const p = paths.data() + paths.size() - 3;
+                expect(test_api::create (p[0], p[1], p[2],
+                    appnum, salt, sizeof(key_type), block_size,
+                        load_factor), "create");
+                store_options options;
+                options.arena_alloc_size = arena_alloc_size;
+                options.budget = &b;
+                expect(db->open(p[0], p[1], p[2], options),
+                    "open");
+            }
+            Sequence seq;
+            Storage s;
+            for(std::size_t i = 0; i < N; ++i)
+            {
+                auto const v = seq[i];
+                auto& db = i % 2 ? db2 : db1;
+                expect(db.insert(&v.key, v.data, v.size),
+                    "insert");
+            }
+            for(std::size_t i = 0; i < N; ++i)
+            {
+                auto const v = seq[i];
+                auto& db = i % 2 ? db2 : db1;
+                if(! expect(db.fetch(&v.key, s), "missing"))
+                    break;
+            }
+            db1.close();
+            db2.close();
+            expect(b.used() == 0, "released");
+        }
+        catch (std::exception const& e)
+        {
+            fail (e.what());
+        }
+        for (std::size_t i = 0; i < paths.size(); i += 3)
+        {
+            expect(test_api::file_type::erase(paths[i]));
+            expect(test_api::file_type::erase(paths[i + 1]));
+            expect(! test_api::file_type::erase(paths[i + 2]));
+        }
+    }
+
+    // Fetches a hot set of keys repeatedly through the
+    // value cache, checking the values it returns.
+    void
+    test_value_cache (std::size_t N,
+        std::size_t block_size, float load_factor)
+    {
+        temp_dir td;
+
+        auto const dp = td.file ("nudb.dat");
+        auto const kp = td.file ("nudb.key");
+        auto const lp = td.file ("nudb.log");
+        Sequence seq;
+        try
+        {
+            expect(test_api::create (dp, kp, lp, appnum,
+                salt, sizeof(key_type), block_size,
+                    load_factor), "create");
+            test_api::store db;
+            store_options options;
+            options.arena_alloc_size = arena_alloc_size;
+            options.value_cache_size = 1024 * 1024;
+            expect(db.open(dp, kp, lp, options), "open");
+            for(std::size_t i = 0; i < N; ++i)
+            {
+                auto const v = seq[i];
+                expect(db.insert(&v.key, v.data, v.size),
+                    "insert");
+            }
+            db.close();
+            expect(db.open(dp, kp, lp, options), "reopen");
+            Storage s;
+            auto const hot = N / 10 + 1;
+            for(std::size_t pass = 0; pass < 4; ++pass)
+            {
+                for(std::size_t i = 0;
+                    i < (pass == 0 ? N : hot); ++i)
+                {
+                    auto const v = seq[i];
+                    if(! expect(db.fetch(&v.key, s), "missing"))
+                        break;
+                    expect(s.size() == v.size, "wrong size");
+                    expect(std::memcmp(s.get(),
+                        v.data, v.size) == 0, "wrong data");
+                }
+            }
+            auto const v = seq[N];
+            expect(! db.fetch(&v.key, s), "found");
+            auto const st = db.stats();
+            expect(st.fetch_value >= hot, "value cache hits");
+            expect(st.fetch_value + st.fetch_disk ==
+                N + 3 * hot + 1, "fetches");
+            db.close();
+        }
+        catch (std::exception const& e)
+        {
+            fail (e.what());
+        }
+        expect(test_api::file_type::erase(dp));
+        expect(test_api::file_type::erase(kp));
+        expect(! test_api::file_type::erase(lp));
+    }
+
+    // Checks the counters against a known sequence of
+    // inserts and fetches.
+    void
+    test_stats (std::size_t N, std::size_t block_size,
+        float load_factor)
+    {
+        temp_dir td;
+
+        auto const dp = td.file ("nudb.dat");
+        auto const kp = td.file ("nudb.key");
+        auto const lp = td.file ("nudb.log");
+        Sequence seq;
+        try
+        {
+            expect(test_api::create (dp, kp, lp, appnum,
+                salt, sizeof(key_type), block_size,
+                    load_factor), "create");
+            test_api::store db;
+            store_options options;
+            options.arena_alloc_size = arena_alloc_size;
+            options.cache_size = 1024 * 1024;
+            expect(db.open(dp, kp, lp, options), "open");
+            for(std::size_t i = 0; i < N; ++i)
+            {
+                auto const v = seq[i];
+                expect(db.insert(&v.key, v.data, v.size),
+                    "insert");
+            }
+            Storage s;
+            for(std::size_t i = 0; i < N; ++i)
+            {
+                auto const v = seq[i];
+                expect(db.fetch(&v.key, s), "missing");
+            }
+            for(int i = 0; db.stats().commits == 0 && i < 1000; ++i)
+                std::this_thread::sleep_for(
+                    std::chrono::milliseconds(10));
+            auto st = db.stats();
+            expect(st.fetch_p1 + st.fetch_queue + st.fetch_p0 +
+                st.fetch_c1 + st.fetch_disk == N, "fetches");
+            expect(st.commits > 0, "commits");
+            expect(st.data_bytes > 0, "data bytes");
+            expect(st.key_bytes > 0, "key bytes");
+            expect(st.log_bytes > 0, "log bytes");
+            expect(st.commit_max <= st.commit_time, "commit time");
+            expect(st.gentex_waits == st.commits, "gentex waits");
+            db.close();
+
+            // Every bucket now comes from the key file
+            expect(db.open(dp, kp, lp, options), "reopen");
+            st = db.stats();
+            expect(st.commits == 0, "reset");
+            for(std::size_t i = 0; i < N; ++i)
+            {
+                auto const v = seq[i];
+                expect(db.fetch(&v.key, s), "missing");
+            }
+            auto const v = seq[N];
+            expect(! db.fetch(&v.key, s), "found");
+            st = db.stats();
+            expect(st.fetch_disk == N + 1, "disk fetches");
+            expect(st.key_reads + st.cache_hits == N + 1,
+                "bucket reads");
+            expect(st.cache_hits > 0, "cache hits");
+            expect(st.data_reads >= N, "data reads");
+            std::uint64_t lookups = 0;
+            for (auto const n : st.spill_depth)
+                lookups += n;
+            expect(lookups == N + 1, "spill depth");
+            auto const w = seq[0];
+            expect(! db.insert(&w.key, w.data, w.size),
+                "duplicate");
+            st = db.stats();
+            expect(st.insert_reads == 1, "insert reads");
+            expect(st.p1_size == 0, "pool size");
+            db.close();
+        }
+        catch (std::exception const& e)
+        {
+            fail (e.what());
+        }
+        expect(test_api::file_type::erase(dp));
+        expect(test_api::file_type::erase(kp));
+        expect(! test_api::file_type::erase(lp));
+    }
+
+    // Checks that commits and reads report their phases
+    void
+    test_observer (std::size_t N, std::size_t block_size,
+        float load_factor)
+    {
+        using namespace std::chrono;
+        using store_type = nudb::store<test_api::hash_type,
+            test_api::codec_type, test_api::file_type,
+                0, latency_observer>;
+
+        latency_histogram h;
+        for (int i = 1; i <= 1000; ++i)
+            h.record(microseconds(i));
+        expect(h.count() == 1000, "count");
+        expect(h.max() == microseconds(1000), "max");
+        auto const p50 = h.percentile(0.5);
+        expect(p50 >= microseconds(500) &&
+            p50 <= microseconds(500) * 9 / 8, "p50");
+        auto const p99 = h.percentile(0.99);
+        expect(p99 >= microseconds(990) &&
+            p99 <= microseconds(1000), "p99");
+        expect(h.percentile(1) == h.max(), "p100");
+
+        temp_dir td;
+
+        auto const dp = td.file ("nudb.dat");
+        auto const kp = td.file ("nudb.key");
+        auto const lp = td.file ("nudb.log");
+        Sequence seq;
+        try
+        {
+            expect(test_api::create (dp, kp, lp, appnum,
+                salt, sizeof(key_type), block_size,
+                    load_factor), "create");
+            store_type db;
+            expect(db.open(dp, kp, lp, arena_alloc_size), "open");
+            for(std::size_t i = 0; i < N; ++i)
+            {
+                auto const v = seq[i];
+                expect(db.insert(&v.key, v.data, v.size),
+                    "insert");
+            }
+            db.close();
+            auto const& obs = db.observer();
+            auto const commits = obs[phase::log_header].count();
+            expect(commits > 0, "commits");
+            for (auto const p : {phase::data_append,
+                    phase::split_insert, phase::log_write,
+                        phase::reader_drain, phase::key_write,
+                            phase::data_sync, phase::final_sync})
+                expect(obs[p].count() == commits, to_string(p));
+            expect(obs[phase::recover_read].count() == 0,
+                "recover");
+            db.observer().clear();
+            expect(db.open(dp, kp, lp, arena_alloc_size), "reopen");
+            Storage s;
+            for(std::size_t i = 0; i < N; ++i)
+            {
+                auto const v = seq[i];
+                expect(db.fetch(&v.key, s), "missing");
+            }
+            expect(obs[phase::key_read].count() == N, "key reads");
+            expect(obs[phase::data_read].count() >= N,
+                "data reads");
+            db.close();
+        }
+        catch (std::exception const& e)
+        {
+            fail (e.what());
+        }
+        expect(test_api::file_type::erase(dp));
+        expect(test_api::file_type::erase(kp));
+        expect(! test_api::file_type::erase(lp));
+    }
+
+    // A store with a fixed key size refuses a key file
+    // with keys of another size.
+    void
+    test_key_size_mismatch (std::size_t block_size,
+        float load_factor)
+    {
+        temp_dir td;
+
+        auto const dp = td.file ("nudb.dat");
+        auto const kp = td.file ("nudb.key");
+        auto const lp = td.file ("nudb.log");
+        try
+        {
+            expect(test_api::create (dp, kp, lp, appnum,
+                salt, sizeof(key_type), block_size,
+                    load_factor), "create");
+            nudb::store<test_api::hash_type,
+                test_api::codec_type, test_api::file_type,
+                    2 * sizeof(key_type)> db;
+            try
+            {
+                db.open(dp, kp, lp, arena_alloc_size);
+                fail("no store_error");
+            }
+            catch (store_error const&)
+            {
+                pass();
+            }
+            expect(! db.is_open(), "open");
+        }
+        catch (std::exception const& e)
+        {
+            fail (e.what());
+        }
+        expect(test_api::file_type::erase(dp));
+        expect(test_api::file_type::erase(kp));
+        test_api::file_type::erase(lp);
+    }
+
+    // A dictionary given to a codec which takes none is
+    // refused rather than ignored.
+    void
+    test_codec_dictionary (std::size_t block_size,
+        float load_factor)
+    {
+        temp_dir td;
+
+        auto const dp = td.file ("nudb.dat");
+        auto const kp = td.file ("nudb.key");
+        auto const lp = td.file ("nudb.log");
+        try
+        {
+            expect(test_api::create (dp, kp, lp, appnum,
+                salt, sizeof(key_type), block_size,
+                    load_factor), "create");
+            store_options options;
+            options.arena_alloc_size = arena_alloc_size;
+            options.codec_dictionary = td.file ("nudb.dict");
+            test_api::store db;
+            try
+            {
+                db.open(dp, kp, lp, options);
+                fail("no logic_error");
+            }
+            catch (std::logic_error const&)
+            {
+                pass();
+            }
+            expect(! db.is_open(), "open");
+        }
+        catch (std::exception const& e)
+        {
+            fail (e.what());
+        }
+        expect(test_api::file_type::erase(dp));
+        expect(test_api::file_type::erase(kp));
+        test_api::file_type::erase(lp);
+    }
+
+    // The filter of a store opened empty grows with it,
+    // and keeps ruling out absent keys.
+    void
+    test_filter_growth (std::size_t N,
+        std::size_t block_size, float load_factor)
+    {
+        temp_dir td;
+
+        auto const dp = td.file ("nudb.dat");
+        auto const kp = td.file ("nudb.key");
+        auto const lp = td.file ("nudb.log");
+        Sequence seq;
+        try
+        {
+            expect(test_api::create (dp, kp, lp, appnum,
+                salt, sizeof(key_type), block_size,
+                    load_factor), "create");
+            test_api::store db;
+            store_options options;
+            options.arena_alloc_size = arena_alloc_size;
+            options.filter_bits = 10;
+            expect(db.open(dp, kp, lp, options), "open");
+            std::atomic<bool> done (false);
+            for(std::size_t i = 0; i < N; ++i)
+            {
+                auto const v = seq[i];
+                if (i + 1 < N)
+                    expect(db.insert(&v.key, v.data, v.size),
+                        "insert");
+                else
+                    expect(db.insert(&v.key, v.data, v.size,
+                        [&](std::exception_ptr)
+                        {
+                            done = true;
+                        }), "insert");
+            }
+            for(int i = 0; ! done && i < 1000; ++i)
+                std::this_thread::sleep_for(
+                    std::chrono::milliseconds(10));
+            expect(done, "commit");
+            Storage s;
+            for(std::size_t i = 0; i < N; ++i)
+            {
+                auto const v = seq[i];
+                expect(db.fetch(&v.key, s), "missing");
+                auto const k = seq.key(2 * N + i);
+                expect(! db.fetch(&k, s), "found");
+            }
+            expect(db.stats().fetch_filter > N * 9 / 10,
+                "filter saturated");
+            db.close();
+        }
+        catch (std::exception const& e)
+        {
+            fail (e.what());
+        }
+        expect(test_api::file_type::erase(dp));
+        expect(test_api::file_type::erase(kp));
+        expect(! test_api::file_type::erase(lp));
+    }
+
+    // Counts the commit handlers of inserts, which must
+    // all be called once their commit has finished.
+    void
+    test_commit_handler (std::size_t N,
+        std::size_t block_size, float load_factor)
+    {
+        temp_dir td;
+
+        auto const dp = td.file ("nudb.dat");
+        auto const kp = td.file ("nudb.key");
+        auto const lp = td.file ("nudb.log");
+        Sequence seq;
+        try
+        {
+            expect(test_api::create (dp, kp, lp, appnum,
+                salt, sizeof(key_type), block_size,
+                    load_factor), "create");
+            test_api::store db;
+            store_options options;
+            options.arena_alloc_size = arena_alloc_size;
+            expect(db.open(dp, kp, lp, options), "open");
+            std::atomic<std::size_t> done(0);
+            std::atomic<std::size_t> errors(0);
+            auto const handler =
+                [&](std::exception_ptr ep)
+                {
+                    if (ep)
+                        ++errors;
+                    ++done;
+                };
+            for(std::size_t i = 0; i < N; ++i)
+            {
+                auto const v = seq[i];
+                expect(db.insert(&v.key, v.data, v.size,
+                    handler), "insert");
+            }
+            // Duplicates are not reported
+            auto const v = seq[0];
+            expect(! db.insert(&v.key, v.data, v.size,
+                handler), "insert duplicate");
+            std::vector<key_type> keys;
+            std::vector<std::vector<std::uint8_t>> values;
+            std::vector<insert_item> items;
+            for(std::size_t i = N - batch / 2;
+                    i < N + batch / 2; ++i)
+            {
+                auto const v = seq[i];
+                keys.push_back(v.key);
+                values.emplace_back(v.data, v.data + v.size);
+            }
+            for(std::size_t j = 0; j < keys.size(); ++j)
+                items.push_back({&keys[j],
+                    values[j].data(), values[j].size()});
+            db.insert_batch(items.data(), items.size(), handler);
+            db.insert_batch(items.data(), items.size(), handler);
+            for(int i = 0; done.load() < N + 1 && i < 1000; ++i)
+                std::this_thread::sleep_for(
+                    std::chrono::milliseconds(10));
+            expect(done.load() == N + 1, "handlers");
+            db.close();
+            expect(done.load() == N + 1, "handlers after close");
+            expect(errors.load() == 0, "errors");
+            auto const stats = verify<test_api::hash_type>(
+                dp, kp, 1 * 1024 * 1024);
+            expect(stats.key_count == N + batch / 2, "key count");
+        }
+        catch (std::exception const& e)
+        {
+            fail (e.what());
+        }
+        expect(test_api::file_type::erase(dp));
+        expect(test_api::file_type::erase(kp));
+        expect(! test_api::file_type::erase(lp));
+    }
+
+    // Serves buckets from memory while commits split
+    // them and grow the index.
+    void
+    test_index (std::size_t N,
+        std::size_t block_size, float load_factor)
+    {
+        temp_dir td;
+
+        auto const dp = td.file ("nudb.dat");
+        auto const kp = td.file ("nudb.key");
+        auto const lp = td.file ("nudb.log");
+        Sequence seq;
+        try
+        {
+            expect(test_api::create (dp, kp, lp, appnum,
+                salt, sizeof(key_type), block_size,
+                    load_factor), "create");
+            test_api::store db;
+            store_options options;
+            options.arena_alloc_size = arena_alloc_size;
+            options.index_in_memory = true;
+            Storage s;
+            for(std::size_t round = 0; round < 2; ++round)
+            {
+                expect(db.open(dp, kp, lp, options), "open");
+                for(std::size_t i = round * N;
+                        i < (round + 1) * N; ++i)
+                {
+                    auto const v = seq[i];
+                    expect(db.insert(&v.key, v.data, v.size),
+                        "insert");
+                    // Fetch earlier keys as commits run
+                    auto const w = seq[i / 2];
+                    if(! expect(db.fetch(&w.key, s), "missing"))
+                        break;
+                    expect(s.size() == w.size &&
+                        std::memcmp(s.get(), w.data,
+                            w.size) == 0, "wrong data");
+                }
+                db.close();
+            }
+            expect(db.open(dp, kp, lp, options), "reopen");
+            for(std::size_t i = 0; i < 2 * N; ++i)
+            {
+                auto const v = seq[i];
+                if(! expect(db.fetch(&v.key, s), "missing"))
+                    break;
+                expect(s.size() == v.size &&
+                    std::memcmp(s.get(), v.data,
+                        v.size) == 0, "wrong data");
+            }
+            std::vector<key_type> keys;
+            for(std::size_t i = 0; i < batch; ++i)
+                keys.push_back(seq.key(i));
+            std::vector<void const*> pk;
+            for(auto const& k : keys)
+                pk.push_back(&k);
+            expect(db.fetch_batch(pk.data(), pk.size(),
+                [](std::size_t, void const*, std::size_t)
+                {
+                }) == batch, "fetch_batch");
+            expect(db.stats().key_reads == 0, "key reads");
+            db.close();
+            auto const stats = verify<test_api::hash_type>(
+                dp, kp, 1 * 1024 * 1024);
+            expect(stats.key_count == 2 * N, "key count");
+        }
+        catch (std::exception const& e)
+        {
+            fail (e.what());
+        }
+        expect(test_api::file_type::erase(dp));
+        expect(test_api::file_type::erase(kp));
+        expect(! test_api::file_type::erase(lp));
+    }
+
+    // Splits buckets while the store is idle, then
+    // lets later commits use them up.
+    void
+    test_split_ahead (std::size_t N,
+        std::size_t block_size, float load_factor)
+    {
+        temp_dir td;
+
+        auto const dp = td.file ("nudb.dat");
+        auto const kp = td.file ("nudb.key");
+        auto const lp = td.file ("nudb.log");
+        Sequence seq;
+        try
+        {
+            expect(test_api::create (dp, kp, lp, appnum,
+                salt, sizeof(key_type), block_size,
+                    load_factor), "create");
+            test_api::store db;
+            store_options options;
+            options.arena_alloc_size = arena_alloc_size;
+            options.split_ahead = 300;
+            expect(db.open(dp, kp, lp, options), "open");
+            for(std::size_t i = 0; i < N; ++i)
+            {
+                auto const v = seq[i];
+                expect(db.insert(&v.key, v.data, v.size),
+                    "insert");
+            }
+            // Commits of the idle thread come a second apart
+            for(int i = 0; db.stats().early_splits <
+                    options.split_ahead && i < 1000; ++i)
+                std::this_thread::sleep_for(
+                    std::chrono::milliseconds(10));
+            auto const stats = db.stats();
+            expect(stats.early_splits ==
+                options.split_ahead, "early splits");
+            expect(stats.split_commits >= 2, "split commits");
+            // The credit is kept, so opening again while
+            // it is unused splits nothing more
+            db.close();
+            auto const before = verify<test_api::hash_type>(
+                dp, kp, 1 * 1024 * 1024);
+            expect(db.open(dp, kp, lp, options), "reopen");
+            std::this_thread::sleep_for(
+                std::chrono::milliseconds(2500));
+            expect(db.stats().early_splits == 0, "split again");
+            db.close();
+            auto const after = verify<test_api::hash_type>(
+                dp, kp, 1 * 1024 * 1024);
+            expect(after.buckets == before.buckets, "buckets");
+            expect(db.open(dp, kp, lp, options), "reopen");
+            Storage s;
+            for(std::size_t i = N; i < 2 * N; ++i)
+            {
+                auto const v = seq[i];
+                expect(db.insert(&v.key, v.data, v.size),
+                    "insert");
+            }
+            for(std::size_t i = 0; i < 2 * N; ++i)
+            {
+                auto const v = seq[i];
+                if(! expect(db.fetch(&v.key, s), "missing"))
+                    break;
+                expect(s.size() == v.size &&
+                    std::memcmp(s.get(), v.data,
+                        v.size) == 0, "wrong data");
+            }
+            db.close();
+            auto const info = verify<test_api::hash_type>(
+                dp, kp, 1 * 1024 * 1024);
+            expect(info.key_count == 2 * N, "key count");
+        }
+        catch (std::exception const& e)
+        {
+            fail (e.what());
+        }
+        expect(test_api::file_type::erase(dp));
+        expect(test_api::file_type::erase(kp));
+        expect(! test_api::file_type::erase(lp));
+    }
+
+    // Inserts and fetches from the async threads, waiting
+    // for the handlers.
+    void
+    test_async (std::size_t N,
+        std::size_t block_size, float load_factor)
+    {
+        temp_dir td;
+
+        auto const dp = td.file ("nudb.dat");
+        auto const kp = td.file ("nudb.key");
+        auto const lp = td.file ("nudb.log");
+        Sequence seq;
+        try
+        {
+            expect(test_api::create (dp, kp, lp, appnum,
+                salt, sizeof(key_type), block_size,
+                    load_factor), "create");
+            test_api::store db;
+            store_options options;
+            options.arena_alloc_size = arena_alloc_size;
+            options.async_threads = 3;
+            expect(db.open(dp, kp, lp, options), "open");
+            std::atomic<std::size_t> done (0);
+            std::atomic<std::size_t> inserted (0);
+            std::atomic<std::size_t> errors (0);
+            auto const insert_handler =
+                [&](std::exception_ptr ep, bool ok)
+                {
+                    if (ep)
+                        ++errors;
+                    if (ok)
+                        ++inserted;
+                    ++done;
+                };
+            for(std::size_t i = 0; i < N; ++i)
+            {
+                auto const v = seq[i];
+                db.async_insert(&v.key, v.data, v.size,
+                    insert_handler);
+            }
+            auto const v0 = seq[0];
+            db.async_insert(&v0.key, v0.data, v0.size,
+                insert_handler);
+            for(int i = 0; done.load() < N + 1 && i < 1000; ++i)
+                std::this_thread::sleep_for(
+                    std::chrono::milliseconds(10));
+            expect(done.load() == N + 1, "insert handlers");
+            expect(inserted.load() == N, "inserted");
+            // Handlers run on other threads, so they
+            // check against copies of the values.
+            std::vector<std::vector<std::uint8_t>> values;
+            for(std::size_t i = 0; i < N; ++i)
+            {
+                auto const v = seq[i];
+                values.emplace_back(v.data, v.data + v.size);
+            }
+            std::atomic<std::size_t> found (0);
+            std::atomic<std::size_t> wrong (0);
+            done = 0;
+            for(std::size_t i = 0; i < N + batch; ++i)
+            {
+                auto const key = seq.key(i);
+                db.async_fetch(&key,
+                    [&, i](std::exception_ptr ep,
+                        void const* data, std::size_t size)
+                    {
+                        if (ep)
+                            ++errors;
+                        if (size > 0)
+                        {
+                            if (i >= N || size != values[i].size() ||
+                                    std::memcmp(data, values[i].data(),
+                                        size) != 0)
+                                ++wrong;
+                            ++found;
+                        }
+                        ++done;
+                    });
+            }
+            for(int i = 0; done.load() < N + batch &&
+                    i < 1000; ++i)
+                std::this_thread::sleep_for(
+                    std::chrono::milliseconds(10));
+            expect(done.load() == N + batch, "fetch handlers");
+            expect(found.load() == N, "found");
+            expect(wrong.load() == 0, "wrong data");
+            expect(errors.load() == 0, "errors");
+            db.close();
+            auto const stats = verify<test_api::hash_type>(
+                dp, kp, 1 * 1024 * 1024);
+            expect(stats.key_count == N, "key count");
+        }
+        catch (std::exception const& e)
+        {
+            fail (e.what());
+        }
+        expect(test_api::file_type::erase(dp));
+        expect(test_api::file_type::erase(kp));
+        expect(! test_api::file_type::erase(lp));
+    }
+
+    // The guessed block size is one create accepts
+    void
+    test_block_size()
+    {
+        temp_dir td;
+        auto const n = block_size(td.file ("nudb.key"));
+        expect(n >= 512 && n <= 32768 &&
+            (n & (n - 1)) == 0, "block size");
+        expect(block_size("nudb.key") > 0, "relative path");
+    }
+
+    // Stripes the files of a store across three
+    // directories, then opens it without the options.
+    void
+    test_striped (std::size_t N,
+        std::size_t block_size, float load_factor)
+    {
+        using file_type = striped_file<>;
+        temp_dir td;
+        temp_dir t1;
+        temp_dir t2;
+
+        auto const dp = td.file ("nudb.dat");
+        auto const kp = td.file ("nudb.key");
+        auto const lp = td.file ("nudb.log");
+        striped_file_options so;
+        so.dirs = {t1.path(), t2.path()};
+        so.stripe_size = 16 * block_size;
+        Sequence seq;
+        try
+        {
+            expect(nudb::create<test_api::hash_type,
+                test_api::codec_type, file_type>(dp, kp, lp,
+                    appnum, salt, sizeof(key_type), block_size,
+                        load_factor, so), "create");
+            expect(! nudb::create<test_api::hash_type,
+                test_api::codec_type, file_type>(dp, kp, lp,
+                    appnum, salt, sizeof(key_type), block_size,
+                        load_factor, so), "create again");
+            test_api::striped_store db;
+            store_options options;
+            options.arena_alloc_size = arena_alloc_size;
+            expect(db.open(dp, kp, lp, options, so), "open");
+            for(std::size_t i = 0; i < N; ++i)
+            {
+                auto const v = seq[i];
+                expect(db.insert(&v.key, v.data, v.size),
+                    "insert");
+            }
+            db.close();
+            for (auto const t : {&t1, &t2})
+            {
+                native_file f;
+                expect(f.open(file_mode::read,
+                    t->file("nudb.dat")) &&
+                        f.actual_size() > 0, "stripe");
+            }
+            // The layout is read from the stripes file
+            expect(db.open(dp, kp, lp, options), "reopen");
+            Storage s;
+            for(std::size_t i = 0; i < N; ++i)
+            {
+                auto const v = seq[i];
+                if(! expect(db.fetch(&v.key, s), "missing"))
+                    break;
+                expect(s.size() == v.size, "wrong size");
+                expect(std::memcmp(s.get(),
+                    v.data, v.size) == 0, "wrong data");
+            }
+            db.close();
+        }
+        catch (std::exception const& e)
+        {
+            fail (e.what());
+        }
+        expect(file_type::erase(dp));
+        expect(file_type::erase(kp));
+        expect(! file_type::erase(lp));
+        expect(! native_file::erase(t1.file("nudb.dat")),
+            "stripe erased");
+    }
+
+    // Streams the records of each commit from the open
+    // data file, resuming where the last stream ended.
+    void
+    test_tail (std::size_t N,
+        std::size_t block_size, float load_factor)
+    {
+        temp_dir td;
+
+        auto const dp = td.file ("nudb.dat");
+        auto const kp = td.file ("nudb.key");
+        auto const lp = td.file ("nudb.log");
+        auto const cp = td.file ("nudb.copy");
+        Sequence seq;
+        try
+        {
+            expect(test_api::create (dp, kp, lp, appnum,
+                salt, sizeof(key_type), block_size,
+                    load_factor), "create");
+            test_api::store db;
+            store_options options;
+            options.arena_alloc_size = arena_alloc_size;
+            expect(db.open(dp, kp, lp, options), "open");
+            std::atomic<std::size_t> done(0);
+            auto const handler =
+                [&](std::exception_ptr)
+                {
+                    ++done;
+                };
+            std::uint64_t from = 0;
+            Storage s;
+            for(std::size_t round = 0; round < 2; ++round)
+            {
+                for(std::size_t i = round * N;
+                        i < (round + 1) * N; ++i)
+                {
+                    auto const v = seq[i];
+                    expect(db.insert(&v.key, v.data, v.size,
+                        handler), "insert");
+                }
+                for(int i = 0; done.load() < (round + 1) * N &&
+                        i < 1000; ++i)
+                    std::this_thread::sleep_for(
+                        std::chrono::milliseconds(10));
+                std::size_t records = 0;
+                std::uint64_t last = 0;
+                auto const end = db.tail(from,
+                    [&](std::uint64_t offset, void const* key,
+                        std::size_t key_size, void const* data,
+                            std::size_t size)
+                    {
+                        expect(offset >= last, "record order");
+                        expect(key_size == sizeof(key_type),
+                            "key size");
+                        expect(db.fetch(key, s) &&
+                            s.size() == size && std::memcmp(
+                                s.get(), data, size) == 0,
+                                    "record data");
+                        ++records;
+                        return true;
+                    },
+                    [&](std::uint64_t offset)
+                    {
+                        expect(offset > last, "commit order");
+                        last = offset;
+                        return true;
+                    });
+                expect(records == N, "records");
+                expect(end == last, "last commit");
+                from = end;
+            }
+            expect(db.tail(from,
+                [](std::uint64_t, void const*, std::size_t,
+                    void const*, std::size_t)
+                {
+                    return true;
+                },
+                [](std::uint64_t)
+                {
+                    return true;
+                }) == from, "nothing new");
+            try
+            {
+                db.tail_copy(from + 1, -1);
+                fail("out of range");
+            }
+            catch (std::logic_error const&)
+            {
+                pass();
+            }
+#if NUDB_POSIX_FILE
+            {
+                native_file f;
+                f.create(file_mode::write, cp);
+                expect(db.tail_copy(0, f.native_handle()) ==
+                    from, "copy end");
+                expect(f.actual_size() == from -
+                    nudb::detail::dat_file_header::size, "copy size");
+                f.close();
+                native_file::erase(cp);
+            }
+#endif
+            db.close();
+        }
+        catch (std::exception const& e)
+        {
+            fail (e.what());
+        }
+        expect(test_api::file_type::erase(dp));
+        expect(test_api::file_type::erase(kp));
+        expect(! test_api::file_type::erase(lp));
+    }
+
+    // Warms the key file of a populated database while
+    // other threads fetch and insert.
+    void
+    test_warmup (std::size_t N,
+        std::size_t block_size, float load_factor)
+    {
+        temp_dir td;
+
+        auto const dp = td.file ("nudb.dat");
+        auto const kp = td.file ("nudb.key");
+        auto const lp = td.file ("nudb.log");
+        Sequence seq;
+        try
+        {
+            expect(test_api::create (dp, kp, lp, appnum,
+                salt, sizeof(key_type), block_size,
+                    load_factor), "create");
+            test_api::store db;
+            store_options options;
+            options.arena_alloc_size = arena_alloc_size;
+            expect(! db.warmup().amount, "closed");
+            expect(db.open(dp, kp, lp, options), "open");
+            expect(db.warmup().done, "no warm-up");
+            for(std::size_t i = 0; i < N; ++i)
+            {
+                auto const v = seq[i];
+                expect(db.insert(&v.key, v.data, v.size),
+                    "insert");
+            }
+            db.close();
+            options.cache_size = 64 * 1024 * 1024;
+            options.prefetch_key_file = true;
+            options.lock_key_file = true;
+            options.warm_cache = true;
+            expect(db.open(dp, kp, lp, options), "reopen");
+            std::thread t(
+                [&]
+                {
+                    for(std::size_t i = N; i < 2 * N; ++i)
+                    {
+                        auto const v = seq[i];
+                        db.insert(&v.key, v.data, v.size);
+                    }
+                });
+            for(int i = 0; ! db.warmup().done && i < 1000; ++i)
+                std::this_thread::sleep_for(
+                    std::chrono::milliseconds(10));
+            t.join();
+            auto const p = db.warmup();
+            expect(p.done, "done");
+            expect(p.total > 0 && p.amount == p.total, "amount");
+            Storage s;
+            for(std::size_t i = 0; i < 2 * N; ++i)
+            {
+                auto const v = seq[i];
+                if(! expect(db.fetch(&v.key, s), "missing"))
+                    break;
+                if(! expect(s.size() == v.size &&
+                        std::memcmp(s.get(), v.data,
+                            v.size) == 0, "wrong data"))
+                    break;
+            }
+            db.close();
+        }
+        catch (std::exception const& e)
+        {
+            fail (e.what());
+        }
+        expect(test_api::file_type::erase(dp));
+        expect(test_api::file_type::erase(kp));
+        expect(! test_api::file_type::erase(lp));
+    }
+
+    // Opens a store read-only twice at once, as separate
+    // processes would, and fetches from both.
+    void
+    test_read_only (std::size_t N,
+        std::size_t block_size, float load_factor)
+    {
+        temp_dir td;
+
+        auto const dp = td.file ("nudb.dat");
+        auto const kp = td.file ("nudb.key");
+        auto const lp = td.file ("nudb.log");
+        Sequence seq;
+        try
+        {
+            expect(test_api::create (dp, kp, lp, appnum,
+                salt, sizeof(key_type), block_size,
+                    load_factor), "create");
+            store_options options;
+            options.arena_alloc_size = arena_alloc_size;
+            {
+                test_api::store db;
+                expect(db.open(dp, kp, lp, options), "open");
+                for(std::size_t i = 0; i < N; ++i)
+                {
+                    auto const v = seq[i];
+                    expect(db.insert(&v.key, v.data, v.size),
+                        "insert");
+                }
+                db.close();
+            }
+            options.read_only = true;
+            options.cache_size = 1024 * 1024;
+            options.filter_bits = 10;
+            test_api::store db1;
+            test_api::store db2;
+            expect(db1.open(dp, kp, lp, options), "open 1");
+            expect(db2.open(dp, kp, lp, options), "open 2");
+            expect(db1.read_only() && db2.read_only(),
+                "read_only");
+            expect(! test_api::file_type::erase(lp), "log");
+            std::atomic<std::size_t> missing {0};
+            auto const reader =
+                [&](test_api::store& db)
+                {
+                    Sequence seq;
+                    Storage s;
+                    for(std::size_t i = 0; i < 2 * N; ++i)
+                    {
+                        auto const v = seq[i];
+                        if(db.fetch(&v.key, s) != (i < N) ||
+                            (i < N && (s.size() != v.size ||
+                                std::memcmp(s.get(), v.data,
+                                    v.size) != 0)))
+                            ++missing;
+                    }
+                };
+            std::thread t1(reader, std::ref(db1));
+            std::thread t2(reader, std::ref(db2));
+            t1.join();
+            t2.join();
+            expect(missing == 0, "wrong fetch");
+            std::vector<key_type> keys;
+            std::vector<void const*> pk;
+            for(std::size_t i = 0; i < 2 * N; i += 7)
+                keys.push_back(seq.key(i));
+            for(auto const& k : keys)
+                pk.push_back(&k);
+            std::size_t found = 0;
+            expect(db1.fetch_batch(pk.data(), pk.size(),
+                [&](std::size_t i, void const*, std::size_t)
+                {
+                    if(i * 7 < N)
+                        ++found;
+                }) == found, "fetch_batch");
+            expect(found == (N + 6) / 7, "fetch_batch found");
+            auto const v = seq[2 * N];
+            try
+            {
+                db1.insert(&v.key, v.data, v.size);
+                fail("no logic_error");
+            }
+            catch (std::logic_error const&)
+            {
+                pass();
+            }
+            db1.close();
+            db2.close();
+            // A log left by a commit needs a writer to recover
+            {
+                test_api::file_type lf;
+                lf.create(file_mode::append, lp);
+                lf.write(0, "x", 1);
+            }
+            try
+            {
+                db1.open(dp, kp, lp, options);
+                fail("no store_error");
+            }
+            catch (store_error const&)
+            {
+                pass();
+            }
+            expect(! db1.is_open(), "open 3");
+        }
+        catch (std::exception const& e)
+        {
+            fail (e.what());
+        }
+        expect(test_api::file_type::erase(dp));
+        expect(test_api::file_type::erase(kp));
+        expect(test_api::file_type::erase(lp));
+    }
+
     void
     run() override
     {
@@ -111,7 +1679,55 @@ public:
 
         float const load_factor = 0.95f;
 
-        do_test (N, block_size, load_factor);
+        do_test<test_api::store>(
+            N, block_size, load_factor, 0);
+        // Read cache smaller than the key file
+        do_test<test_api::store>(
+            N, block_size, load_factor, 1024 * 1024);
+        // Membership filter
+        do_test<test_api::store>(
+            N, block_size, load_factor, 0, 10);
+        // Values up to 300 bytes in the key file
+        do_test<test_api::store>(
+            N, 2048, load_factor, 1024 * 1024, 0, 300);
+        // Keys of a size fixed at compile time
+        do_test<test_api::fixed_store>(
+            N, block_size, load_factor, 1024 * 1024);
+        test_key_size_mismatch(block_size, load_factor);
+        test_codec_dictionary(block_size, load_factor);
+        test_filter_growth(N / 5, block_size, load_factor);
+        test_flow_control();
+        test_block_size();
+        test_stats(N / 10, block_size, load_factor);
+        test_observer(N / 10, block_size, load_factor);
+        // Striped insert locks
+        test_concurrent_insert(N / 5, block_size, load_factor);
+        test_warmup(N / 5, block_size, load_factor);
+        test_read_only(N / 5, block_size, load_factor);
+        test_arena(N / 5, block_size, load_factor);
+        test_budget(N / 5, block_size, load_factor);
+        test_value_cache(N / 5, block_size, load_factor);
+        test_tail(N / 5, block_size, load_factor);
+        test_striped(N / 5, block_size, load_factor);
+        test_index(N / 5, block_size, load_factor);
+        test_split_ahead(N / 5, block_size, load_factor);
+        test_async(N / 5, block_size, load_factor);
+        test_commit_handler(N / 5, block_size, load_factor);
+        test_commit_queue(N / 5, block_size, load_factor);
+        for(auto const level : {durability::data,
+                durability::range, durability::none})
+            test_durability(N / 10, block_size,
+                load_factor, level);
+#if NUDB_POSIX_FILE
+        // Reads through memory mappings
+        do_test<test_api::mmap_store>(
+            N, block_size, load_factor, 0);
+#endif
+#if NUDB_URING_FILE
+        // Batches through io_uring
+        do_test<test_api::uring_store>(
+            N, block_size, load_factor, 1024 * 1024);
+#endif
     }
 };
 
@@ -34,6 +34,37 @@ struct test_api : test_api_base
         typename test_api_base::hash_type,
             typename test_api_base::codec_type,
                 fail_file<typename test_api_base::file_type>>;
+
+    using fixed_store = nudb::store<
+        typename test_api_base::hash_type,
+            typename test_api_base::codec_type,
+                typename test_api_base::file_type,
+                    sizeof(key_type)>;
+
+    template <std::size_t N>
+    using sharded_store = nudb::sharded_store<
+        typename test_api_base::hash_type,
+            typename test_api_base::codec_type,
+                typename test_api_base::file_type, N>;
+
+    using striped_store = nudb::store<
+        typename test_api_base::hash_type,
+            typename test_api_base::codec_type,
+                striped_file<>>;
+
+#if NUDB_POSIX_FILE
+    using mmap_store = nudb::store<
+        typename test_api_base::hash_type,
+            typename test_api_base::codec_type,
+                mmap_file>;
+#endif
+
+#if NUDB_URING_FILE
+    using uring_store = nudb::store<
+        typename test_api_base::hash_type,
+            typename test_api_base::codec_type,
+                uring_file>;
+#endif
 };
 
 static std::size_t constexpr arena_alloc_size = 16 * 1024 * 1024;
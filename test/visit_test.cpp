@@ -0,0 +1,169 @@
+//
+// Copyright (c) 2015-2016 Vinnie Falco (vinnie dot falco at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#include "test_util.hpp"
+#include "suite.hpp"
+#include <atomic>
+#include <cstring>
+#include <map>
+#include <mutex>
+
+namespace nudb {
+namespace test {
+
+// Visits a database serially, in parallel and through
+// the key file, checking that each value is seen once.
+//
+class visit_test : public suite
+{
+public:
+    enum
+    {
+        threads = 3
+    };
+
+    // Checks the values seen by a visit
+    class checker
+    {
+    private:
+        suite& s_;
+        std::mutex m_;
+        Sequence seq_;
+        std::map<key_type, std::size_t> index_;
+        std::map<key_type, std::size_t> seen_;
+
+    public:
+        checker (suite& s, std::size_t N)
+            : s_ (s)
+        {
+            for(std::size_t i = 0; i < N; ++i)
+                index_[seq_.key(i)] = i;
+        }
+
+        bool
+        operator()(void const* key, std::size_t key_size,
+            void const* data, std::size_t size)
+        {
+            std::lock_guard<std::mutex> lock (m_);
+            key_type k;
+            s_.expect(key_size == sizeof(k), "key size");
+            std::memcpy(&k, key, sizeof(k));
+            auto const iter = index_.find(k);
+            if (! s_.expect(iter != index_.end(), "unknown key"))
+                return true;
+            auto const v = seq_[iter->second];
+            s_.expect(size == v.size && std::memcmp(
+                data, v.data, size) == 0, "wrong data");
+            ++seen_[k];
+            return true;
+        }
+
+        void
+        check()
+        {
+            s_.expect(seen_.size() == index_.size(), "missing keys");
+            for(auto const& e : seen_)
+                s_.expect(e.second == 1, "visited twice");
+        }
+    };
+
+    void
+    do_test (std::size_t N, std::size_t block_size,
+        float load_factor)
+    {
+        temp_dir td;
+
+        auto const dp = td.file ("nudb.dat");
+        auto const kp = td.file ("nudb.key");
+        auto const lp = td.file ("nudb.log");
+        Sequence seq;
+        try
+        {
+            expect(test_api::create(dp, kp, lp, appnum, salt,
+                sizeof(key_type), block_size, load_factor),
+                    "create");
+            {
+                store_options options;
+                options.arena_alloc_size = arena_alloc_size;
+                test_api::store db;
+                if(! expect(db.open(dp, kp, lp, options), "open"))
+                    return;
+                for(std::size_t i = 0; i < N; ++i)
+                {
+                    auto const v = seq[i];
+                    expect(db.insert(&v.key, v.data, v.size),
+                        "insert");
+                }
+                db.close();
+            }
+            {
+                checker c (*this, N);
+                expect(test_api::visit(dp, c), "visit");
+                c.check();
+            }
+            {
+                checker c (*this, N);
+                expect(visit_parallel<test_api::codec_type>(dp,
+                    64 * 1024, threads, std::ref(c)),
+                        "visit_parallel");
+                c.check();
+            }
+            {
+                checker c (*this, N);
+                expect(visit_buckets<test_api::hash_type,
+                    test_api::codec_type>(dp, kp, 64 * 1024,
+                        threads, std::ref(c)), "visit_buckets");
+                c.check();
+            }
+            // Returning false ends the visits early
+            std::atomic<std::size_t> calls (0);
+            auto const stop =
+                [&](void const*, std::size_t,
+                    void const*, std::size_t)
+                {
+                    return ++calls < 100;
+                };
+            expect(! visit_parallel<test_api::codec_type>(
+                dp, 64 * 1024, threads, stop), "stop parallel");
+            expect(calls < N, "parallel not stopped");
+            calls = 0;
+            expect(! visit_buckets<test_api::hash_type,
+                test_api::codec_type>(dp, kp, 64 * 1024,
+                    threads, stop), "stop buckets");
+            expect(calls < N, "buckets not stopped");
+        }
+        catch (std::exception const& e)
+        {
+            fail (e.what());
+        }
+        test_api::file_type::erase(dp);
+        test_api::file_type::erase(kp);
+        test_api::file_type::erase(lp);
+    }
+
+    void
+    run() override
+    {
+        enum
+        {
+            N =             20000,
+            block_size =    256
+        };
+
+        do_test(N, block_size, 0.95f);
+    }
+};
+
+} // test
+} // nudb
+
+int main()
+{
+    std::cout << "visit_test:" << std::endl;
+    nudb::test::visit_test t;
+    return t(std::cerr) ? EXIT_SUCCESS : EXIT_FAILURE;
+}